@@ -9,6 +9,8 @@
 #include "esp_mac.h"
 #include "driver/gpio.h"
 #include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #if CONFIG_ETH_USE_SPI_ETHERNET
 #include "driver/spi_master.h"
 #endif // CONFIG_ETH_USE_SPI_ETHERNET
@@ -27,6 +29,35 @@ static const char *TAG = "bridge_eth_init";
 #define INTERNAL_ETHERNETS_NUM      0
 #endif
 
+#if CONFIG_EXAMPLE_ETH_PERF_THROUGHPUT
+#define ETH_PERF_PROFILE_NAME       "throughput"
+#elif CONFIG_EXAMPLE_ETH_PERF_LOW_LATENCY
+#define ETH_PERF_PROFILE_NAME       "low-latency"
+#elif CONFIG_EXAMPLE_ETH_PERF_CUSTOM
+#define ETH_PERF_PROFILE_NAME       "custom"
+#else
+#define ETH_PERF_PROFILE_NAME       "balanced"
+#endif
+
+// The driver pins its RX task to the core the MAC instance is created on
+#if CONFIG_EXAMPLE_ETH_RX_TASK_CORE >= 0 && !CONFIG_FREERTOS_UNICORE
+#define ETH_RX_TASK_PINNED          1
+#define ETH_RX_TASK_CORE            CONFIG_EXAMPLE_ETH_RX_TASK_CORE
+#else
+#define ETH_RX_TASK_PINNED          0
+#define ETH_RX_TASK_CORE            -1
+#endif
+
+#if CONFIG_EXAMPLE_ETH_PERF_THROUGHPUT && CONFIG_ETH_USE_ESP32_EMAC && CONFIG_ETH_DMA_RX_BUFFER_NUM < 20
+#warning "Throughput profile expects CONFIG_ETH_DMA_RX_BUFFER_NUM of 20 or more"
+#endif
+
+#if CONFIG_EXAMPLE_ETH_SPI_POLLING1_MS
+#define SPI_POLLING1_MS             CONFIG_EXAMPLE_ETH_SPI_POLLING1_MS
+#else
+#define SPI_POLLING1_MS             0
+#endif
+
 #define INIT_SPI_ETH_MODULE_CONFIG(eth_module_config, num)                                      \
     do {                                                                                        \
         eth_module_config[num].spi_cs_gpio = CONFIG_EXAMPLE_ETH_SPI_CS ##num## _GPIO;           \
@@ -45,6 +76,20 @@ typedef struct {
     uint8_t *mac_addr;
 }spi_eth_module_config_t;
 
+/**
+ * @brief Update MAC config with RX task settings of the selected profile
+ *
+ * @param[in,out] mac_config common MAC config
+ */
+static void __attribute__((unused)) eth_mac_apply_perf_profile(eth_mac_config_t *mac_config)
+{
+    mac_config->rx_task_stack_size = CONFIG_EXAMPLE_ETH_RX_TASK_STACK;
+    mac_config->rx_task_prio = CONFIG_EXAMPLE_ETH_RX_TASK_PRIO;
+#if ETH_RX_TASK_PINNED
+    mac_config->flags |= ETH_MAC_FLAG_PIN_TO_CORE;
+#endif
+}
+
 #if CONFIG_EXAMPLE_USE_INTERNAL_ETHERNET
 /**
  * @brief Internal ESP32 Ethernet initialization
@@ -62,6 +107,7 @@ static esp_eth_handle_t eth_init_internal(esp_eth_mac_t **mac_out, esp_eth_phy_t
     // Init common MAC and PHY configs to default
     eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
     eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
+    eth_mac_apply_perf_profile(&mac_config);
 
     // Update PHY config based on board specific configuration
     phy_config.phy_addr = CONFIG_EXAMPLE_ETH_PHY_ADDR;
@@ -93,6 +139,7 @@ static esp_eth_handle_t eth_init_internal(esp_eth_mac_t **mac_out, esp_eth_phy_t
     // Init Ethernet driver to default and install it
     esp_eth_handle_t eth_handle = NULL;
     esp_eth_config_t config = ETH_DEFAULT_CONFIG(mac, phy);
+    config.check_link_period_ms = CONFIG_EXAMPLE_ETH_LINK_CHECK_MS;
     ESP_GOTO_ON_FALSE(esp_eth_driver_install(&config, &eth_handle) == ESP_OK, NULL,
                         err, TAG, "Ethernet driver install failed");
 
@@ -172,6 +219,7 @@ static esp_eth_handle_t eth_init_spi(spi_eth_module_config_t *spi_eth_module_con
     // Init common MAC and PHY configs to default
     eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
     eth_phy_config_t phy_config = ETH_PHY_DEFAULT_CONFIG();
+    eth_mac_apply_perf_profile(&mac_config);
 
     // Update PHY config based on board specific configuration
     phy_config.phy_addr = spi_eth_module_config->phy_addr;
@@ -208,6 +256,7 @@ static esp_eth_handle_t eth_init_spi(spi_eth_module_config_t *spi_eth_module_con
     // Init Ethernet driver to default and install it
     esp_eth_handle_t eth_handle = NULL;
     esp_eth_config_t eth_config_spi = ETH_DEFAULT_CONFIG(mac, phy);
+    eth_config_spi.check_link_period_ms = CONFIG_EXAMPLE_ETH_LINK_CHECK_MS;
     ESP_GOTO_ON_FALSE(esp_eth_driver_install(&eth_config_spi, &eth_handle) == ESP_OK, NULL, err, TAG, "SPI Ethernet driver install failed");
 
     // The SPI Ethernet module might not have a burned factory MAC address, we can set it manually.
@@ -237,7 +286,7 @@ err:
 }
 #endif // CONFIG_EXAMPLE_USE_SPI_ETHERNET
 
-esp_err_t example_eth_init(esp_eth_handle_t *eth_handles_out[], uint8_t *eth_cnt_out)
+static esp_err_t eth_init(esp_eth_handle_t *eth_handles_out[], uint8_t *eth_cnt_out)
 {
     esp_err_t ret = ESP_OK;
     esp_eth_handle_t *eth_handles = NULL;
@@ -302,3 +351,62 @@ err:
     return ret;
 #endif
 }
+
+#if ETH_RX_TASK_PINNED
+typedef struct {
+    esp_eth_handle_t **eth_handles_out;
+    uint8_t *eth_cnt_out;
+    TaskHandle_t caller;
+    esp_err_t ret;
+} eth_init_args_t;
+
+static void eth_init_task(void *arg)
+{
+    eth_init_args_t *args = (eth_init_args_t *)arg;
+    args->ret = eth_init(args->eth_handles_out, args->eth_cnt_out);
+    xTaskNotifyGive(args->caller);
+    vTaskDelete(NULL);
+}
+#endif // ETH_RX_TASK_PINNED
+
+esp_err_t example_eth_init(esp_eth_handle_t *eth_handles_out[], uint8_t *eth_cnt_out)
+{
+    eth_perf_profile_t profile;
+    example_eth_get_perf_profile(&profile);
+    ESP_LOGI(TAG, "data path profile %s: RX task prio %lu, core %d, DMA buffers %d RX / %d TX",
+             profile.name, (unsigned long)profile.rx_task_prio, profile.rx_task_core, profile.dma_rx_buffers, profile.dma_tx_buffers);
+#if ETH_RX_TASK_PINNED
+    if (xPortGetCoreID() != ETH_RX_TASK_CORE) {
+        // Create MAC instances on the target core so the driver pins its RX task there
+        eth_init_args_t args = {
+            .eth_handles_out = eth_handles_out,
+            .eth_cnt_out = eth_cnt_out,
+            .caller = xTaskGetCurrentTaskHandle(),
+        };
+        ESP_RETURN_ON_FALSE(xTaskCreatePinnedToCore(eth_init_task, "eth_init", 4096, &args,
+                                                    uxTaskPriorityGet(NULL), NULL, ETH_RX_TASK_CORE) == pdPASS,
+                            ESP_ERR_NO_MEM, TAG, "no memory");
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        return args.ret;
+    }
+#endif
+    return eth_init(eth_handles_out, eth_cnt_out);
+}
+
+void example_eth_get_perf_profile(eth_perf_profile_t *profile)
+{
+    *profile = (eth_perf_profile_t) {
+        .name = ETH_PERF_PROFILE_NAME,
+        .rx_task_stack = CONFIG_EXAMPLE_ETH_RX_TASK_STACK,
+        .rx_task_prio = CONFIG_EXAMPLE_ETH_RX_TASK_PRIO,
+        .rx_task_core = ETH_RX_TASK_CORE,
+#if CONFIG_EXAMPLE_USE_INTERNAL_ETHERNET
+        .dma_rx_buffers = CONFIG_ETH_DMA_RX_BUFFER_NUM,
+        .dma_tx_buffers = CONFIG_ETH_DMA_TX_BUFFER_NUM,
+        .dma_buffer_size = CONFIG_ETH_DMA_BUFFER_SIZE,
+#endif
+#if CONFIG_EXAMPLE_USE_SPI_ETHERNET
+        .spi_polling_ms = { CONFIG_EXAMPLE_ETH_SPI_POLLING0_MS, SPI_POLLING1_MS },
+#endif
+    };
+}
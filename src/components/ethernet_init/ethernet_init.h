@@ -24,6 +24,27 @@ extern "C" {
  */
 esp_err_t example_eth_init(esp_eth_handle_t *eth_handles_out[], uint8_t *eth_cnt_out);
 
+/**
+ * @brief Ethernet data path settings in effect
+ */
+typedef struct {
+    const char *name;           /*!< Profile name */
+    uint32_t rx_task_stack;     /*!< Driver RX task stack size */
+    uint32_t rx_task_prio;      /*!< Driver RX task priority */
+    int rx_task_core;           /*!< Core the RX task is pinned to, -1 if not pinned */
+    int dma_rx_buffers;         /*!< Internal EMAC DMA RX buffers, 0 if EMAC is not used */
+    int dma_tx_buffers;         /*!< Internal EMAC DMA TX buffers, 0 if EMAC is not used */
+    int dma_buffer_size;        /*!< Internal EMAC DMA buffer size */
+    uint32_t spi_polling_ms[2]; /*!< SPI module polling period, 0 if interrupt driven or not used */
+} eth_perf_profile_t;
+
+/**
+ * @brief Get Ethernet data path settings selected at build time
+ *
+ * @param[out] profile settings in effect
+ */
+void example_eth_get_perf_profile(eth_perf_profile_t *profile);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,146 @@
+/* Bridge port admission control
+
+   Every connection to the bridge port is checked before it may claim the UART.
+   Its source address has to be on the allow list (when there is one) or among
+   the trusted peers, and addresses other than trusted ones may only connect at
+   the configured rate: each address gets a token bucket refilled at the rate per
+   minute, so a scanner reconnecting in a loop is reset at once instead of taking
+   the session slot over and over. Trusted peers are always admitted and may take
+   the UART over from an untrusted session, see tcp_server.c.
+*/
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/inet.h"
+
+#include "admission.h"
+#include "token_bucket.h"
+
+static const char *TAG = "admission";
+
+// A connection costs a minute worth of the per minute rate, in tokens per second
+#define CONN_COST 60
+
+struct net {
+    uint32_t addr;      // host byte order, masked
+    uint32_t mask;
+};
+
+struct net_list {
+    struct net nets[ADMISSION_MAX_NETS];
+    int        cnt;
+    bool       active;  // has entries, an allow list of mistyped ones admits nobody
+};
+
+struct rate_slot {
+    uint32_t       ip;
+    int64_t        last_us;
+    token_bucket_t tb;
+};
+
+static struct {
+    struct net_list   allow;
+    struct net_list   trusted;
+    struct rate_slot  rate[ADMISSION_RATE_SLOTS];
+    admission_stats_t stats;
+} adm;
+
+/** Parse comma or space separated addresses and a.b.c.d/len networks */
+static void parse_list(const char *name, const char *text, struct net_list *list)
+{
+    char *buf = strdup(text);
+    if (!buf)
+        return;
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+        list->active = true;
+        int len = 32;
+        char *slash = strchr(tok, '/');
+        if (slash) {
+            *slash = '\0';
+            char *end;
+            len = strtol(slash + 1, &end, 10);
+            if (*end || end == slash + 1 || len < 0 || len > 32)
+                len = -1;
+        }
+        struct in_addr addr;
+        if (len < 0 || !inet_aton(tok, &addr)) {
+            ESP_LOGE(TAG, "Invalid %s entry %s", name, tok);
+            continue;
+        }
+        if (list->cnt == ADMISSION_MAX_NETS) {
+            ESP_LOGE(TAG, "Too many %s entries, %s ignored", name, tok);
+            continue;
+        }
+        uint32_t const mask = len ? UINT32_MAX << (32 - len) : 0;
+        list->nets[list->cnt++] = (struct net){ .addr = ntohl(addr.s_addr) & mask, .mask = mask };
+    }
+    free(buf);
+    ESP_LOGI(TAG, "%d %s network(s)", list->cnt, name);
+}
+
+static bool list_match(const struct net_list *list, uint32_t ip)
+{
+    uint32_t const host = ntohl(ip);
+    for (int i = 0; i < list->cnt; i++) {
+        if ((host & list->nets[i].mask) == list->nets[i].addr)
+            return true;
+    }
+    return false;
+}
+
+/** Take a connection from the bucket of the address, false if it is empty */
+static bool rate_take(uint32_t ip)
+{
+    int64_t const now = esp_timer_get_time();
+    struct rate_slot *slot = NULL;
+    struct rate_slot *oldest = &adm.rate[0];
+    for (int i = 0; i < ADMISSION_RATE_SLOTS; i++) {
+        if (adm.rate[i].last_us && adm.rate[i].ip == ip) {
+            slot = &adm.rate[i];
+            break;
+        }
+        if (adm.rate[i].last_us < oldest->last_us)
+            oldest = &adm.rate[i];
+    }
+    if (!slot) {
+        slot = oldest;
+        slot->ip = ip;
+        token_bucket_init(&slot->tb, CONFIG_ADMISSION_RATE_PER_MIN, CONFIG_ADMISSION_RATE_BURST * CONN_COST);
+    }
+    slot->last_us = now;
+    if (token_bucket_available(&slot->tb) < CONN_COST)
+        return false;
+    token_bucket_consume(&slot->tb, CONN_COST);
+    return true;
+}
+
+void admission_init(void)
+{
+    parse_list("allowed", CONFIG_ADMISSION_ALLOW, &adm.allow);
+    parse_list("trusted", CONFIG_ADMISSION_TRUSTED, &adm.trusted);
+}
+
+admission_t admission_check(uint32_t ip)
+{
+    // The UART self test connects from the bridge itself, a peer must not take the UART over meanwhile
+    if ((ntohl(ip) >> 24) == 127)
+        return ADMISSION_TRUSTED;
+    if (list_match(&adm.trusted, ip))
+        return ADMISSION_TRUSTED;
+    if (adm.allow.active && !list_match(&adm.allow, ip)) {
+        adm.stats.denied++;
+        return ADMISSION_DENIED;
+    }
+    if (CONFIG_ADMISSION_RATE_PER_MIN && !rate_take(ip)) {
+        adm.stats.rate_limited++;
+        return ADMISSION_RATE_LIMITED;
+    }
+    return ADMISSION_ACCEPT;
+}
+
+void admission_get_stats(admission_stats_t *stats)
+{
+    *stats = adm.stats;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Networks per list, more entries are ignored with an error
+#define ADMISSION_MAX_NETS  8
+// Source addresses the connection rate is tracked for, the least recently seen one is replaced
+#define ADMISSION_RATE_SLOTS 16
+
+typedef enum {
+    ADMISSION_ACCEPT,
+    ADMISSION_TRUSTED,      // accept, may take the UART over from an untrusted session
+    ADMISSION_DENIED,       // not on the allow list
+    ADMISSION_RATE_LIMITED, // too many connections from the address
+} admission_t;
+
+typedef struct {
+    uint32_t denied;
+    uint32_t rate_limited;
+} admission_stats_t;
+
+/** Parse the configured address lists */
+void admission_init(void);
+
+/** Verdict for a new connection from ip (network byte order), counts rejections and rate */
+admission_t admission_check(uint32_t ip);
+
+void admission_get_stats(admission_stats_t *stats);
+
+#endif // ADMISSION_H
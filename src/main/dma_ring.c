@@ -0,0 +1,148 @@
+/* Buffer ring shared with a DMA engine
+
+   Plain C without any driver dependency so the buffer handling can be exercised
+   on a host against a simulated DMA. The completion side functions may be called
+   from an interrupt handler while the CPU side runs in a task, one of each. They
+   and dma_ring_rx_arm(), which may be called from either, are placed in IRAM so
+   they keep working while flash writes disable the cache.
+*/
+#include <stddef.h>
+#include "dma_ring.h"
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#define LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static IRAM_ATTR dma_slot_t *slot(dma_ring_t *r, uint32_t n)
+{
+    return &r->slots[n % r->cnt];
+}
+
+void dma_ring_init(dma_ring_t *r, uint8_t *mem, uint32_t slot_size, uint32_t cnt)
+{
+    if (cnt > DMA_RING_MAX_SLOTS)
+        cnt = DMA_RING_MAX_SLOTS;
+    while (cnt & (cnt - 1))
+        cnt &= cnt - 1;
+    *r = (dma_ring_t){ .slot_size = slot_size, .cnt = cnt };
+    for (uint32_t i = 0; i < cnt; i++)
+        r->slots[i].buf = mem + i * slot_size;
+}
+
+uint32_t dma_ring_dma_slots(const dma_ring_t *r)
+{
+    return LOAD(&r->head) - LOAD(&r->done);
+}
+
+/** Free slots from head on, up to cnt, NULL if the ring is full */
+static IRAM_ATTR dma_slot_t *take_head(dma_ring_t *r, uint32_t *cnt)
+{
+    uint32_t const used = r->head - LOAD(&r->tail);
+    if (used == r->cnt) {
+        r->starved++;
+        return NULL;
+    }
+    if (*cnt > r->cnt - used)
+        *cnt = r->cnt - used;
+    return slot(r, r->head);
+}
+
+uint8_t IRAM_ATTR *dma_ring_rx_arm(dma_ring_t *r, uint32_t *cnt)
+{
+    // Not past the end of the memory, the transfer needs one piece
+    uint32_t const to_end = r->cnt - r->head % r->cnt;
+    if (*cnt > to_end)
+        *cnt = to_end;
+    dma_slot_t *s = take_head(r, cnt);
+    if (!s)
+        return NULL;
+    for (uint32_t i = 0; i < *cnt; i++) {
+        STORE(&s[i].len, 0);
+        s[i].off = 0;
+    }
+    STORE(&r->head, r->head + *cnt);
+    return s->buf;
+}
+
+void IRAM_ATTR dma_ring_rx_data(dma_ring_t *r, uint32_t len, bool eof)
+{
+    uint32_t done = r->done;
+    uint32_t const head = LOAD(&r->head);
+    while (len && done != head) {
+        dma_slot_t *s = slot(r, done);
+        uint32_t const room = r->slot_size - s->len;
+        uint32_t const n = len < room ? len : room;
+        STORE(&s->len, s->len + n);
+        len -= n;
+        if (s->len == r->slot_size)
+            STORE(&r->done, ++done);
+    }
+    if (eof && done != head) {
+        if (slot(r, done)->len)
+            STORE(&r->done, ++done);
+        STORE(&r->head, done);
+    }
+    // Slots holding data, those only waiting for it do not count
+    uint32_t const used = done - LOAD(&r->tail);
+    if (used > r->used_max)
+        r->used_max = used;
+}
+
+/** Free completed slots the CPU has consumed completely */
+static void rx_reclaim(dma_ring_t *r)
+{
+    while (r->tail != LOAD(&r->done)) {
+        dma_slot_t *s = slot(r, r->tail);
+        if (s->off < LOAD(&s->len))
+            break;
+        STORE(&r->tail, r->tail + 1);
+    }
+}
+
+uint32_t dma_ring_rx_peek(dma_ring_t *r, const uint8_t **data)
+{
+    rx_reclaim(r);
+    if (r->tail == LOAD(&r->head))
+        return 0;
+    dma_slot_t *s = slot(r, r->tail);
+    *data = s->buf + s->off;
+    return LOAD(&s->len) - s->off;
+}
+
+void dma_ring_rx_consume(dma_ring_t *r, uint32_t len)
+{
+    if (r->tail == LOAD(&r->head))
+        return;
+    slot(r, r->tail)->off += len;
+    rx_reclaim(r);
+}
+
+uint8_t *dma_ring_tx_acquire(dma_ring_t *r)
+{
+    r->tail = LOAD(&r->done);   // sent slots are free again
+    uint32_t cnt = 1;
+    dma_slot_t *s = take_head(r, &cnt);
+    if (!s)
+        return NULL;
+    if (r->head + 1 - r->tail > r->used_max)
+        r->used_max = r->head + 1 - r->tail;
+    return s->buf;
+}
+
+uint8_t *dma_ring_tx_commit(dma_ring_t *r, uint32_t len)
+{
+    dma_slot_t *s = slot(r, r->head);
+    s->len = len;
+    STORE(&r->head, r->head + 1);
+    return s->buf;
+}
+
+void IRAM_ATTR dma_ring_tx_done(dma_ring_t *r)
+{
+    if (r->done != LOAD(&r->head))
+        STORE(&r->done, r->done + 1);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#ifndef DMA_RING_H
+#define DMA_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DMA_RING_MAX_SLOTS 16
+
+/* Ring of equally sized buffers shared by the CPU and a DMA engine which completes
+   them in the order they were handed over. Free running counters mark the slots:
+   [tail, done) are completed and wait for the CPU, [done, head) are owned by DMA.
+   tail is only written by the CPU side, done and the length of the slot being
+   received only by the DMA completion (interrupt) side. head is written by the
+   side handing slots to DMA; on RX that may be either, serialized by the caller. */
+
+typedef struct {
+    uint8_t  *buf;
+    uint32_t  len;          // RX: bytes written by DMA so far, TX: bytes to send
+    uint32_t  off;          // RX: bytes already consumed by the CPU
+} dma_slot_t;
+
+typedef struct {
+    dma_slot_t slots[DMA_RING_MAX_SLOTS];
+    uint32_t   slot_size;
+    uint32_t   cnt;
+    uint32_t   head;
+    uint32_t   done;
+    uint32_t   tail;
+    uint32_t   used_max;    // most slots in use at once
+    uint32_t   starved;     // times a slot was wanted and none was free
+} dma_ring_t;
+
+/**
+ * Split mem (cnt * slot_size bytes) into slots. cnt is limited to DMA_RING_MAX_SLOTS
+ * and rounded down to a power of two, so slot numbers stay in order when the free
+ * running counters wrap.
+ */
+void dma_ring_init(dma_ring_t *r, uint8_t *mem, uint32_t slot_size, uint32_t cnt);
+
+/** Number of slots owned by DMA */
+uint32_t dma_ring_dma_slots(const dma_ring_t *r);
+
+/**
+ * RX: hand up to *cnt free slots following each other in memory to DMA for one
+ * transfer, returns the buffer of the first one and the number taken in *cnt, or
+ * NULL if none is free. Only while DMA owns no slot.
+ */
+uint8_t *dma_ring_rx_arm(dma_ring_t *r, uint32_t *cnt);
+
+/**
+ * RX, completion side: DMA wrote len more bytes after those received so far, full
+ * slots are completed. eof ends the transfer, the slot with data is completed and
+ * the slots DMA did not get to are taken back.
+ */
+void dma_ring_rx_data(dma_ring_t *r, uint32_t len, bool eof);
+
+/** RX: contiguous received bytes not consumed yet, data points into the slot buffer */
+uint32_t dma_ring_rx_peek(dma_ring_t *r, const uint8_t **data);
+
+/** RX: release len bytes returned by dma_ring_rx_peek(), finished slots become free */
+void dma_ring_rx_consume(dma_ring_t *r, uint32_t len);
+
+/** TX: buffer of the next free slot to fill, NULL if all are queued; it is not handed over yet */
+uint8_t *dma_ring_tx_acquire(dma_ring_t *r);
+
+/** TX: queue len bytes of the slot returned by dma_ring_tx_acquire() for DMA, returns its buffer */
+uint8_t *dma_ring_tx_commit(dma_ring_t *r, uint32_t len);
+
+/** TX, completion side: the oldest queued slot has been sent */
+void dma_ring_tx_done(dma_ring_t *r);
+
+#endif // DMA_RING_H
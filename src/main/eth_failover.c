@@ -0,0 +1,167 @@
+/* Ethernet link failover
+
+   Every port is watched for link and address changes. The default route stays on
+   the active port while it has link and address; when it goes down the route moves
+   to the usable port with the highest priority (the lowest index) at once, without
+   waiting for the address to time out. Bridge sessions bound to the address of a
+   port that lost its link are torn down immediately instead of waiting for TCP
+   keepalive, so clients may reconnect through the other port.
+*/
+#include <string.h>
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_timer.h"
+
+#include "eth_failover.h"
+#include "tcp_server.h"
+#if CONFIG_MDNS_RESPONDER_ENABLE
+#include "mdns_responder.h"
+#endif
+
+static const char *TAG = "eth_failover";
+
+struct eth_link {
+    esp_eth_handle_t eth;
+    esp_netif_t     *netif;
+    bool             link_up;
+    bool             has_ip;
+    esp_ip4_addr_t   ip;
+};
+
+static struct {
+    struct eth_link      links[ETH_FAILOVER_MAX_PORTS];
+    uint8_t              cnt;
+    eth_failover_stats_t stats;
+} fo = { .stats.active = -1 };
+
+/** Keep the active port while it is usable, otherwise take the first usable one */
+static int select_active(const struct eth_link *links, int cnt, int active)
+{
+    if (active >= 0 && links[active].link_up && links[active].has_ip)
+        return active;
+    for (int i = 0; i < cnt; i++) {
+        if (links[i].link_up && links[i].has_ip)
+            return i;
+    }
+    return -1;
+}
+
+static void update_active(int64_t event_time)
+{
+    int const active = select_active(fo.links, fo.cnt, fo.stats.active);
+    if (active == fo.stats.active)
+        return;
+
+    if (active >= 0) {
+        esp_netif_set_default_netif(fo.links[active].netif);
+#if CONFIG_MDNS_RESPONDER_ENABLE
+        mdns_responder_set_ip(&fo.links[active].ip);
+#endif
+    }
+    if (fo.stats.active >= 0) {
+        fo.stats.switches++;
+        fo.stats.last_switch_us = esp_timer_get_time() - event_time;
+    }
+    ESP_LOGW(TAG, "Active port %d -> %d", fo.stats.active, active);
+    fo.stats.active = active;
+}
+
+static int find_eth(esp_eth_handle_t eth)
+{
+    for (int i = 0; i < fo.cnt; i++) {
+        if (fo.links[i].eth == eth)
+            return i;
+    }
+    return -1;
+}
+
+static int find_netif(esp_netif_t *netif)
+{
+    for (int i = 0; i < fo.cnt; i++) {
+        if (fo.links[i].netif == netif)
+            return i;
+    }
+    return -1;
+}
+
+static void eth_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    int64_t const now = esp_timer_get_time();
+    int const port = find_eth(*(esp_eth_handle_t *)event_data);
+    if (port < 0)
+        return;
+    struct eth_link *link = &fo.links[port];
+
+    switch (event_id) {
+    case ETHERNET_EVENT_CONNECTED:
+        link->link_up = true;
+        break;
+    case ETHERNET_EVENT_DISCONNECTED:
+    case ETHERNET_EVENT_STOP:
+        if (!link->link_up)
+            return;
+        link->link_up = false;
+        fo.stats.link_downs++;
+        if (link->has_ip)
+            fo.stats.sessions_dropped += tcp_server_drop_sessions(link->ip.addr);
+        break;
+    default:
+        return;
+    }
+    update_active(now);
+}
+
+static void ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    int64_t const now = esp_timer_get_time();
+
+    if (event_id == IP_EVENT_ETH_GOT_IP) {
+        ip_event_got_ip_t const *event = (ip_event_got_ip_t *)event_data;
+        int const port = find_netif(event->esp_netif);
+        if (port < 0)
+            return;
+        struct eth_link *link = &fo.links[port];
+        if (link->has_ip && link->ip.addr != event->ip_info.ip.addr)
+            fo.stats.sessions_dropped += tcp_server_drop_sessions(link->ip.addr);
+        link->ip = event->ip_info.ip;
+        link->has_ip = true;
+        // Same port, new address
+        if (port == fo.stats.active) {
+#if CONFIG_MDNS_RESPONDER_ENABLE
+            mdns_responder_set_ip(&link->ip);
+#endif
+        }
+    } else if (event_id == IP_EVENT_ETH_LOST_IP) {
+        ip_event_got_ip_t const *event = (ip_event_got_ip_t *)event_data;
+        int const port = find_netif(event->esp_netif);
+        if (port < 0)
+            return;
+        fo.links[port].has_ip = false;
+    } else {
+        return;
+    }
+    update_active(now);
+}
+
+void eth_failover_start(esp_eth_handle_t *eth_handles, esp_netif_t **netifs, uint8_t cnt)
+{
+    if (cnt > ETH_FAILOVER_MAX_PORTS) {
+        ESP_LOGW(TAG, "Only %d ports are monitored", ETH_FAILOVER_MAX_PORTS);
+        cnt = ETH_FAILOVER_MAX_PORTS;
+    }
+    for (int i = 0; i < cnt; i++) {
+        fo.links[i].eth = eth_handles[i];
+        fo.links[i].netif = netifs[i];
+    }
+    fo.cnt = cnt;
+
+    ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &ip_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_LOST_IP, &ip_event_handler, NULL));
+    ESP_LOGI(TAG, "Monitoring %d port(s)", cnt);
+}
+
+void eth_failover_get_stats(eth_failover_stats_t *stats)
+{
+    *stats = fo.stats;
+}
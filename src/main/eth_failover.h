@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef ETH_FAILOVER_H
+#define ETH_FAILOVER_H
+
+#include <stdint.h>
+#include "esp_eth.h"
+#include "esp_netif.h"
+
+#define ETH_FAILOVER_MAX_PORTS 3
+
+typedef struct {
+    int      active;            // port carrying the default route, -1 if none is usable
+    uint32_t switches;          // default route moved to another port
+    uint32_t link_downs;        // link lost on any port
+    uint32_t sessions_dropped;  // bridge sessions torn down because their port went down
+    uint32_t last_switch_us;    // time from the link event to the new default route
+} eth_failover_stats_t;
+
+/** Monitor links of all ports, port 0 has the highest priority */
+void eth_failover_start(esp_eth_handle_t *eth_handles, esp_netif_t **netifs, uint8_t cnt);
+
+void eth_failover_get_stats(eth_failover_stats_t *stats);
+
+#endif // ETH_FAILOVER_H
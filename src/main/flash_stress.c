@@ -0,0 +1,66 @@
+/* Flash write stress test
+
+   Writes and commits an NVS blob over and over while the bridge runs. Every write
+   disables the flash cache for a while and NVS erases a sector whenever it has to
+   reclaim a page, so anything on the UART receive path that is not in IRAM stalls
+   long enough for the hardware FIFO to overrun. Stream data through the bridge at
+   the target baud rate meanwhile, the overrun counter in the uart section of
+   /stats has to stay at 0.
+*/
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "flash_stress.h"
+
+#define BLOB_SIZE   1024
+
+static const char *TAG = "flash_stress";
+
+static flash_stress_stats_t stats;
+
+static void flash_stress_task(void *pvParameters)
+{
+    static uint32_t blob[BLOB_SIZE / sizeof(uint32_t)];
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("flash_stress", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS: %s", esp_err_to_name(err));
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGW(TAG, "Writing %d byte blobs every %d ms", BLOB_SIZE, CONFIG_FLASH_STRESS_PERIOD_MS);
+    for (uint32_t seq = 0;; seq++) {
+        // NVS skips writing data equal to the stored one
+        for (size_t i = 0; i < BLOB_SIZE / sizeof(uint32_t); i++)
+            blob[i] = seq + i;
+        int64_t const start = esp_timer_get_time();
+        err = nvs_set_blob(nvs, "blob", blob, sizeof(blob));
+        if (err == ESP_OK)
+            err = nvs_commit(nvs);
+        uint32_t const took = esp_timer_get_time() - start;
+        if (err != ESP_OK) {
+            stats.errors++;
+            ESP_LOGE(TAG, "Write failed: %s", esp_err_to_name(err));
+        } else {
+            stats.writes++;
+            stats.write_us = took;
+            if (took > stats.write_max_us)
+                stats.write_max_us = took;
+        }
+        vTaskDelay(MAX(1, pdMS_TO_TICKS(CONFIG_FLASH_STRESS_PERIOD_MS)));
+    }
+}
+
+void flash_stress_start(void)
+{
+    xTaskCreate(flash_stress_task, "flash_stress", 3072, NULL, 1, NULL);
+}
+
+void flash_stress_get_stats(flash_stress_stats_t *out)
+{
+    *out = stats;
+}
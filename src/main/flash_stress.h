@@ -0,0 +1,20 @@
+#pragma once
+
+#ifndef FLASH_STRESS_H
+#define FLASH_STRESS_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t writes;            // blobs written and committed
+    uint32_t errors;
+    uint32_t write_us;          // duration of the last write and commit
+    uint32_t write_max_us;
+} flash_stress_stats_t;
+
+/** Start the task writing to flash continuously */
+void flash_stress_start(void);
+
+void flash_stress_get_stats(flash_stress_stats_t *stats);
+
+#endif // FLASH_STRESS_H
@@ -19,11 +19,41 @@
 #include "tcp_server.h"
 #include "nvs_flash.h"
 #include "settings.h"
+#include "mem_arena.h"
 #include "driver/gpio.h"
 #include "lwip/inet.h"
+#if CONFIG_MDNS_RESPONDER_ENABLE
+#include "mdns_responder.h"
+#endif
+#if CONFIG_OTA_ENABLE
+#include "ota_update.h"
+#endif
+#if CONFIG_ETH_FAILOVER_ENABLE
+#include "eth_failover.h"
+#endif
+#if CONFIG_PROFILER_ENABLE
+#include "profiler.h"
+#endif
+#if CONFIG_FLASH_STRESS_ENABLE
+#include "flash_stress.h"
+#endif
+#if CONFIG_MGMT_ENABLE
+#include "mgmt_server.h"
+#endif
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+#include "esp_sleep.h"
+#endif
 
 static const char *TAG = "bridge";
 
+// Internal EMAC and up to 2 SPI modules
+#define ETH_PORTS_MAX 3
+
+static esp_netif_t *eth_netifs[ETH_PORTS_MAX];
+
 /** Event handler for Ethernet events */
 static void eth_event_handler(void *arg, esp_event_base_t event_base,
                               int32_t event_id, void *event_data)
@@ -38,9 +68,15 @@ static void eth_event_handler(void *arg, esp_event_base_t event_base,
         ESP_LOGI(TAG, "Ethernet Link Up");
         ESP_LOGI(TAG, "Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x",
                  mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
+#if CONFIG_POWER_MGMT_ENABLE
+        power_mgmt_link(true);
+#endif
         break;
     case ETHERNET_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "Ethernet Link Down");
+#if CONFIG_POWER_MGMT_ENABLE
+        power_mgmt_link(false);
+#endif
         break;
     case ETHERNET_EVENT_START:
         ESP_LOGI(TAG, "Ethernet Started");
@@ -66,6 +102,27 @@ static void got_ip_event_handler(void *arg, esp_event_base_t event_base,
     ESP_LOGI(TAG, "ETHMASK:" IPSTR, IP2STR(&ip_info->netmask));
     ESP_LOGI(TAG, "ETHGW:" IPSTR, IP2STR(&ip_info->gw));
     ESP_LOGI(TAG, "~~~~~~~~~~~");
+#if CONFIG_MDNS_RESPONDER_ENABLE && !CONFIG_ETH_FAILOVER_ENABLE
+    // With failover the address of the active port is advertised
+    mdns_responder_set_ip(&ip_info->ip);
+#endif
+#if CONFIG_OTA_ENABLE
+    ota_update_confirm();
+#endif
+    // Confirmed, the bootloader no longer rolls back to firmware reading the separate keys
+    settings_release_legacy();
+}
+
+static TaskHandle_t config_mode_waiter;
+
+/** Config GPIO low, the level interrupt stays disabled from now on */
+static void IRAM_ATTR config_gpio_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+    gpio_intr_disable(DEFAULT_CONFIG_GPIO);
+    vTaskNotifyGiveFromISR(config_mode_waiter, &woken);
+    if (woken)
+        portYIELD_FROM_ISR();
 }
 
 static void config_mode_task(void *pvParameters)
@@ -73,25 +130,33 @@ static void config_mode_task(void *pvParameters)
     gpio_set_direction(DEFAULT_CONFIG_GPIO, GPIO_MODE_INPUT);
     gpio_set_pull_mode(DEFAULT_CONFIG_GPIO, GPIO_PULLUP_ONLY);
 
-    bool webserver_started = false;
-
-    while (1) {
-        if (gpio_get_level(DEFAULT_CONFIG_GPIO) == 0) {
-            if (!webserver_started) {
-                ESP_LOGI(TAG, "Configuration mode enabled, starting web server");
-                start_webserver();
-                webserver_started = true;
-            }
-        } 
-        // else {
-        //     if (webserver_started) {
-        //         ESP_LOGI(TAG, "Configuration mode disabled, stopping web server");
-        //         stop_webserver();
-        //         webserver_started = false;
-        //     }
-        // }
-        vTaskDelay(200 / portTICK_PERIOD_MS);
+    // Sleep until the pin is grounded instead of polling it, a pin held low at boot
+    // fires the level interrupt at once
+    config_mode_waiter = xTaskGetCurrentTaskHandle();
+    esp_err_t const err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "GPIO interrupt service failed: %s", esp_err_to_name(err));
+        vTaskDelete(NULL);
+        return;
     }
+    gpio_isr_handler_add(DEFAULT_CONFIG_GPIO, config_gpio_isr, NULL);
+    gpio_set_intr_type(DEFAULT_CONFIG_GPIO, GPIO_INTR_LOW_LEVEL);
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+    gpio_wakeup_enable(DEFAULT_CONFIG_GPIO, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+#endif
+    gpio_intr_enable(DEFAULT_CONFIG_GPIO);
+
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    ESP_LOGI(TAG, "Configuration mode enabled, starting web server");
+    start_webserver();
+
+    // The configuration pages stay up until the next reboot
+    gpio_isr_handler_remove(DEFAULT_CONFIG_GPIO);
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+    gpio_wakeup_disable(DEFAULT_CONFIG_GPIO);
+#endif
+    vTaskDelete(NULL);
 }
 
 void app_main(void)
@@ -103,10 +168,16 @@ void app_main(void)
       ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+#if CONFIG_OTA_ENABLE
+    ota_update_init();
+#endif
 
     settings_t settings;
     load_settings(&settings);
 
+    // Bridge buffers are placed before anything else, a configuration that does not fit stops here
+    ESP_ERROR_CHECK(mem_arena_init());
+
     // Initialize Ethernet driver
     uint8_t eth_port_cnt = 0;
     esp_eth_handle_t *eth_handles;
@@ -123,6 +194,7 @@ void app_main(void)
         // default esp-netif configuration parameters.
         esp_netif_config_t cfg = ESP_NETIF_DEFAULT_ETH();
         esp_netif_t *eth_netif = esp_netif_new(&cfg);
+        eth_netifs[0] = eth_netif;
         // Attach Ethernet driver to TCP/IP stack
         ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handles[0])));
 
@@ -176,6 +248,7 @@ void app_main(void)
             esp_netif_config.if_desc = if_desc_str;
             esp_netif_config.route_prio -= i*5;
             esp_netif_t *eth_netif = esp_netif_new(&cfg_spi);
+            eth_netifs[i] = eth_netif;
 
             // Attach Ethernet driver to TCP/IP stack
             ESP_ERROR_CHECK(esp_netif_attach(eth_netif, esp_eth_new_netif_glue(eth_handles[i])));
@@ -185,6 +258,9 @@ void app_main(void)
     // Register user defined event handers
     ESP_ERROR_CHECK(esp_event_handler_register(ETH_EVENT, ESP_EVENT_ANY_ID, &eth_event_handler, NULL));
     ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, &got_ip_event_handler, NULL));
+#if CONFIG_ETH_FAILOVER_ENABLE
+    eth_failover_start(eth_handles, eth_netifs, eth_port_cnt);
+#endif
 
     // Start Ethernet driver state machine
     for (int i = 0; i < eth_port_cnt; i++) {
@@ -194,4 +270,19 @@ void app_main(void)
     xTaskCreate(config_mode_task, "config_mode_task", 2048, NULL, 5, NULL);
 
     tcp_server_create(&settings);
+#if CONFIG_MDNS_RESPONDER_ENABLE
+    mdns_responder_start(&settings);
+#endif
+#if CONFIG_OTA_ENABLE || CONFIG_PROFILER_ENABLE || CONFIG_WS_BRIDGE_ENABLE
+    start_service_webserver();
+#endif
+#if CONFIG_MGMT_ENABLE
+    mgmt_server_start(&settings);
+#endif
+#if CONFIG_PROFILER_ENABLE
+    profiler_start();
+#endif
+#if CONFIG_FLASH_STRESS_ENABLE
+    flash_stress_start();
+#endif
 }
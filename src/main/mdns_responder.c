@@ -0,0 +1,431 @@
+/* Minimal mDNS / DNS-SD responder
+
+   Answers queries for the bridge host name (A record) and the _serial-bridge._tcp
+   service (PTR, SRV and TXT records), and announces the records when the address
+   is assigned or the TXT record content changes. All messages are built in
+   static buffers, nothing is allocated after start. The task only talks to the
+   rest of the firmware through the getters of the bridge state it puts into the
+   TXT record.
+*/
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_app_desc.h"
+
+#include "lwip/sockets.h"
+
+#include "mdns_responder.h"
+#include "tcp_server.h"
+
+#define MDNS_PORT          5353
+#define MDNS_GROUP         0xE00000FBu   // 224.0.0.251
+#define SERVICE_TYPE       "_serial-bridge._tcp.local"
+#define DNSSD_META         "_services._dns-sd._udp.local"
+
+#define TTL_HOST           120
+#define TTL_SERVICE        4500
+#define TTL_LEGACY         10
+
+#define DNS_TYPE_A         1
+#define DNS_TYPE_PTR       12
+#define DNS_TYPE_TXT       16
+#define DNS_TYPE_SRV       33
+#define DNS_TYPE_ANY       255
+#define DNS_CLASS_IN       1
+#define DNS_CACHE_FLUSH    0x8000
+#define DNS_QU             0x8000
+
+#define REC_A              (1 << 0)
+#define REC_PTR            (1 << 1)
+#define REC_SRV            (1 << 2)
+#define REC_TXT            (1 << 3)
+#define REC_META           (1 << 4)
+#define REC_ALL            (REC_A | REC_PTR | REC_SRV | REC_TXT)
+
+#define MAX_NAME           128
+#define POLL_INTERVAL_MS   1000
+
+static const char *TAG = "mdns";
+
+struct msg {
+    uint8_t *p;
+    uint8_t *end;
+    bool     overflow;
+};
+
+static struct {
+    int            sock;
+    uint32_t       ip;              // network byte order, 0 until assigned
+    volatile bool  ip_changed;
+    int            announce;        // announcements left to send
+    TickType_t     announced_at;
+    bool           session_busy;    // state published in the TXT record
+    int            baud_rate;       // running rate published in the TXT record
+    int            port;
+    char           host[MAX_NAME];      // serial-bridge-a1b2c3.local
+    char           instance[MAX_NAME];  // serial-bridge-a1b2c3._serial-bridge._tcp.local
+    char           mac[18];
+    uint8_t        rx[1500];
+    uint8_t        tx[768];
+} mdns = { .sock = -1 };
+
+static void put_u8(struct msg *m, uint8_t v)
+{
+    if (m->p < m->end)
+        *m->p++ = v;
+    else
+        m->overflow = true;
+}
+
+static void put_u16(struct msg *m, uint16_t v)
+{
+    put_u8(m, v >> 8);
+    put_u8(m, v & 0xFF);
+}
+
+static void put_u32(struct msg *m, uint32_t v)
+{
+    put_u16(m, v >> 16);
+    put_u16(m, v & 0xFFFF);
+}
+
+static void put_bytes(struct msg *m, const void *data, size_t len)
+{
+    if (m->end - m->p < (ptrdiff_t)len) {
+        m->overflow = true;
+        return;
+    }
+    memcpy(m->p, data, len);
+    m->p += len;
+}
+
+static void put_name(struct msg *m, const char *name)
+{
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t const len = dot ? (size_t)(dot - name) : strlen(name);
+        put_u8(m, len);
+        put_bytes(m, name, len);
+        name += len;
+        if (*name == '.')
+            name++;
+    }
+    put_u8(m, 0);
+}
+
+static void put_txt_item(struct msg *m, const char *item)
+{
+    size_t const len = strlen(item);
+    put_u8(m, len);
+    put_bytes(m, item, len);
+}
+
+/** Write the resource record header, returns the location of the data length field */
+static uint8_t *rr_begin(struct msg *m, const char *name, uint16_t type, bool unique, uint32_t ttl)
+{
+    put_name(m, name);
+    put_u16(m, type);
+    put_u16(m, DNS_CLASS_IN | (unique ? DNS_CACHE_FLUSH : 0));
+    put_u32(m, ttl);
+    uint8_t *rdlen = m->p;
+    put_u16(m, 0);
+    return rdlen;
+}
+
+static void rr_end(struct msg *m, uint8_t *rdlen)
+{
+    if (m->overflow)
+        return;
+    uint16_t const len = m->p - rdlen - 2;
+    rdlen[0] = len >> 8;
+    rdlen[1] = len & 0xFF;
+}
+
+static int put_records(struct msg *m, unsigned mask, uint32_t ttl_limit)
+{
+    int count = 0;
+    uint8_t *rd;
+    // Legacy unicast responses must not have the cache flush bit set
+    bool const unique = ttl_limit > TTL_LEGACY;
+#define TTL(t) ((t) < ttl_limit ? (t) : ttl_limit)
+    if (mask & REC_META) {
+        rd = rr_begin(m, DNSSD_META, DNS_TYPE_PTR, false, TTL(TTL_SERVICE));
+        put_name(m, SERVICE_TYPE);
+        rr_end(m, rd);
+        count++;
+    }
+    if (mask & REC_PTR) {
+        rd = rr_begin(m, SERVICE_TYPE, DNS_TYPE_PTR, false, TTL(TTL_SERVICE));
+        put_name(m, mdns.instance);
+        rr_end(m, rd);
+        count++;
+    }
+    if (mask & REC_SRV) {
+        rd = rr_begin(m, mdns.instance, DNS_TYPE_SRV, unique, TTL(TTL_HOST));
+        put_u16(m, 0);          // priority
+        put_u16(m, 0);          // weight
+        put_u16(m, mdns.port);
+        put_name(m, mdns.host);
+        rr_end(m, rd);
+        count++;
+    }
+    if (mask & REC_TXT) {
+        char item[48];
+        rd = rr_begin(m, mdns.instance, DNS_TYPE_TXT, unique, TTL(TTL_SERVICE));
+        snprintf(item, sizeof(item), "baud=%d", mdns.baud_rate);
+        put_txt_item(m, item);
+        snprintf(item, sizeof(item), "port=%d", mdns.port);
+        put_txt_item(m, item);
+        snprintf(item, sizeof(item), "fw=%s", esp_app_get_description()->version);
+        put_txt_item(m, item);
+        snprintf(item, sizeof(item), "mac=%s", mdns.mac);
+        put_txt_item(m, item);
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+        put_txt_item(m, "mode=modbus");
+#elif CONFIG_BRIDGE_MODE_MQTT
+        put_txt_item(m, "mode=mqtt");
+#else
+        put_txt_item(m, "mode=raw");
+        put_txt_item(m, mdns.session_busy ? "session=busy" : "session=free");
+#endif
+        rr_end(m, rd);
+        count++;
+    }
+    if (mask & REC_A) {
+        rd = rr_begin(m, mdns.host, DNS_TYPE_A, unique, TTL(TTL_HOST));
+        put_bytes(m, &mdns.ip, 4);
+        rr_end(m, rd);
+        count++;
+    }
+#undef TTL
+    return count;
+}
+
+/** Read the possibly compressed name at off, returns the offset past it or -1 */
+static int read_name(const uint8_t *msg, size_t len, size_t off, char *out, size_t out_len)
+{
+    size_t pos = 0;
+    int next = -1;
+    for (int jumps = 0; jumps < 16; ) {
+        if (off >= len)
+            return -1;
+        uint8_t const l = msg[off];
+        if ((l & 0xC0) == 0xC0) {
+            if (off + 1 >= len)
+                return -1;
+            if (next < 0)
+                next = off + 2;
+            off = (l & 0x3F) << 8 | msg[off + 1];
+            jumps++;
+            continue;
+        }
+        if (!l) {
+            out[pos ? pos - 1 : 0] = '\0';
+            return next < 0 ? (int)off + 1 : next;
+        }
+        if (off + 1 + l > len || pos + l + 1 >= out_len)
+            return -1;
+        memcpy(out + pos, msg + off + 1, l);
+        pos += l;
+        out[pos++] = '.';
+        off += 1 + l;
+    }
+    return -1;
+}
+
+static void send_msg(struct msg *m, const struct sockaddr_in *to)
+{
+    if (m->overflow) {
+        ESP_LOGW(TAG, "Response does not fit the buffer");
+        return;
+    }
+    struct sockaddr_in group = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MDNS_PORT),
+        .sin_addr.s_addr = htonl(MDNS_GROUP),
+    };
+    if (!to)
+        to = &group;
+    if (sendto(mdns.sock, mdns.tx, m->p - mdns.tx, 0, (const struct sockaddr *)to, sizeof(*to)) < 0)
+        ESP_LOGW(TAG, "Error occurred during sending: errno %d", errno);
+}
+
+static void send_response(uint16_t id, unsigned answers, unsigned additional,
+                          const char *question, uint16_t qtype, const struct sockaddr_in *to)
+{
+    struct msg m = { .p = mdns.tx, .end = mdns.tx + sizeof(mdns.tx) };
+    bool const legacy = to && ntohs(to->sin_port) != MDNS_PORT;
+    uint32_t const ttl_limit = legacy ? TTL_LEGACY : UINT32_MAX;
+
+    put_u16(&m, legacy ? id : 0);
+    put_u16(&m, 0x8400);                 // response, authoritative
+    put_u16(&m, legacy ? 1 : 0);
+    uint8_t *counts = m.p;
+    put_u32(&m, 0);
+    put_u16(&m, 0);
+    if (legacy) {
+        put_name(&m, question);
+        put_u16(&m, qtype);
+        put_u16(&m, DNS_CLASS_IN);
+    }
+    int const an = put_records(&m, answers, ttl_limit);
+    int const ar = put_records(&m, additional & ~answers, ttl_limit);
+    if (m.overflow)
+        return;
+    counts[0] = an >> 8;
+    counts[1] = an & 0xFF;
+    counts[4] = ar >> 8;
+    counts[5] = ar & 0xFF;
+    send_msg(&m, to);
+}
+
+static void handle_query(size_t len, const struct sockaddr_in *from)
+{
+    const uint8_t *q = mdns.rx;
+    if (len < 12 || (q[2] & 0x80) || !mdns.ip)
+        return;     // too short, a response or nothing to announce yet
+
+    uint16_t const id = q[0] << 8 | q[1];
+    uint16_t const qdcount = q[4] << 8 | q[5];
+    unsigned answers = 0, additional = 0;
+    bool unicast = ntohs(from->sin_port) != MDNS_PORT;
+    char name[MAX_NAME], first[MAX_NAME] = "";
+    uint16_t first_type = 0;
+    int off = 12;
+
+    for (int i = 0; i < qdcount; i++) {
+        off = read_name(q, len, off, name, sizeof(name));
+        if (off < 0 || off + 4 > (int)len)
+            return;
+        uint16_t const qtype = q[off] << 8 | q[off + 1];
+        uint16_t const qclass = q[off + 2] << 8 | q[off + 3];
+        off += 4;
+        bool const any = qtype == DNS_TYPE_ANY;
+
+        unsigned match = 0;
+        if (!strcasecmp(name, mdns.host) && (any || qtype == DNS_TYPE_A)) {
+            match = REC_A;
+        } else if (!strcasecmp(name, SERVICE_TYPE) && (any || qtype == DNS_TYPE_PTR)) {
+            match = REC_PTR;
+            additional |= REC_SRV | REC_TXT | REC_A;
+        } else if (!strcasecmp(name, mdns.instance)) {
+            if (any || qtype == DNS_TYPE_SRV)
+                match |= REC_SRV;
+            if (any || qtype == DNS_TYPE_TXT)
+                match |= REC_TXT;
+            additional |= REC_A;
+        } else if (!strcasecmp(name, DNSSD_META) && (any || qtype == DNS_TYPE_PTR)) {
+            match = REC_META;
+        }
+        if (match && !answers) {
+            strcpy(first, name);
+            first_type = qtype;
+        }
+        answers |= match;
+        if (match && (qclass & DNS_QU))
+            unicast = true;
+    }
+    if (answers)
+        send_response(id, answers, additional, first, first_type, unicast ? from : NULL);
+}
+
+static void join_group(void)
+{
+    struct ip_mreq mreq = {
+        .imr_multiaddr.s_addr = htonl(MDNS_GROUP),
+        .imr_interface.s_addr = mdns.ip,
+    };
+    // Fails with EADDRINUSE if already joined on this address, which is fine
+    setsockopt(mdns.sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    struct in_addr iface = { .s_addr = mdns.ip };
+    setsockopt(mdns.sock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface));
+}
+
+static void mdns_task(void *pvParameters)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(MDNS_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    mdns.sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (mdns.sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(mdns.sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    uint8_t ttl = 255;
+    setsockopt(mdns.sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    if (bind(mdns.sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(mdns.sock);
+        vTaskDelete(NULL);
+        return;
+    }
+
+    for (;;) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(mdns.sock, &rfds);
+        struct timeval tv = { .tv_sec = POLL_INTERVAL_MS / 1000 };
+        int const ready = select(mdns.sock + 1, &rfds, NULL, NULL, &tv);
+        if (ready > 0) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int const len = recvfrom(mdns.sock, mdns.rx, sizeof(mdns.rx), 0, (struct sockaddr *)&from, &from_len);
+            if (len > 0)
+                handle_query(len, &from);
+        }
+
+        if (mdns.ip_changed) {
+            mdns.ip_changed = false;
+            join_group();
+            // RFC 6762 8.3: at least two announcements one second apart
+            mdns.announce = 2;
+            ESP_LOGI(TAG, "Advertising %s as %s", mdns.instance, mdns.host);
+        }
+        // Sessions and live setting changes (management port, mux clients) move these
+        bool const busy = tcp_server_session_active();
+        int const baud_rate = tcp_server_baud_rate();
+        if (busy != mdns.session_busy || baud_rate != mdns.baud_rate) {
+            mdns.session_busy = busy;
+            mdns.baud_rate = baud_rate;
+            if (!mdns.announce)
+                mdns.announce = 1;
+        }
+        TickType_t const now = xTaskGetTickCount();
+        if (mdns.announce && mdns.ip && now - mdns.announced_at >= pdMS_TO_TICKS(POLL_INTERVAL_MS)) {
+            mdns.announce--;
+            mdns.announced_at = now;
+            send_response(0, REC_ALL, 0, NULL, 0, NULL);
+        }
+    }
+}
+
+void mdns_responder_set_ip(const esp_ip4_addr_t *ip)
+{
+    mdns.ip = ip->addr;
+    mdns.ip_changed = true;
+}
+
+void mdns_responder_start(const settings_t *settings)
+{
+    uint8_t mac[6] = {0};
+    esp_read_mac(mac, ESP_MAC_ETH);
+    snprintf(mdns.mac, sizeof(mdns.mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    snprintf(mdns.host, sizeof(mdns.host), "%s-%02x%02x%02x.local",
+             CONFIG_MDNS_HOSTNAME_PREFIX, mac[3], mac[4], mac[5]);
+    snprintf(mdns.instance, sizeof(mdns.instance), "%s-%02x%02x%02x." SERVICE_TYPE,
+             CONFIG_MDNS_HOSTNAME_PREFIX, mac[3], mac[4], mac[5]);
+    mdns.baud_rate = settings->uart_baud_rate;
+    mdns.port = settings->tcp_port;
+
+    xTaskCreate(mdns_task, "mdns", 3072, NULL, 2, NULL);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#ifndef MDNS_RESPONDER_H
+#define MDNS_RESPONDER_H
+
+#include "esp_netif_ip_addr.h"
+#include "settings.h"
+
+/** Start the responder task, it stays silent until the address is known */
+void mdns_responder_start(const settings_t *settings);
+
+/** Set the address advertised in A records and announce the bridge */
+void mdns_responder_set_ip(const esp_ip4_addr_t *ip);
+
+#endif // MDNS_RESPONDER_H
@@ -0,0 +1,326 @@
+/* Boot time memory arena
+
+   Every buffer the bridge needs for its whole life is listed in one budget table
+   with its size and the memory it has to live in. At boot the arena takes one
+   block per memory region from the heap and carves the buffers out of it, so the
+   memory used by the bridge is known up front and does not fragment the heap.
+   Buffers the drivers and lwIP allocate themselves are listed too and counted
+   against the budget.
+
+   A configuration whose table exceeds the budget does not build, one which does
+   not leave the configured headroom on the heap refuses to start instead of
+   failing later when a session opens.
+
+   Pools hand out fixed size blocks from a table buffer for data that comes and
+   goes on the data path.
+*/
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "mem_arena.h"
+#include "tcp_server.h"
+#include "mux_server.h"
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+#include "modbus_gw.h"
+#endif
+#if CONFIG_BRIDGE_MODE_MQTT
+#include "mqtt_bridge.h"
+#endif
+
+#define HEADROOM        (CONFIG_MEM_ARENA_HEADROOM_KB * 1024)
+#define ALIGN           8
+// UHCI moves data in bursts of this size
+#define DMA_ALIGN       32
+
+#define ALIGN_UP(x, a)  (((x) + (a) - 1) & ~((uint32_t)(a) - 1))
+
+static const char *TAG = "mem_arena";
+
+// Rarely touched data goes to PSRAM if the board has it
+#if CONFIG_SPIRAM
+#define MEM_REGION_COLD MEM_REGION_PSRAM
+#else
+#define MEM_REGION_COLD MEM_REGION_INTERNAL
+#endif
+
+/* Sizes of the table entries, 0 for features that are not built */
+
+#if CONFIG_BRIDGE_TRANSPORT_NETCONN
+// Sent without copy from the ring, received data is written from the pbufs
+#define SZ_BRIDGE_RX        BRIDGE_NETCONN_RING_SZ
+#define SZ_BRIDGE_TX        0
+#elif CONFIG_BRIDGE_MODE_RAW && !CONFIG_UART_DMA_ENABLE
+#define SZ_BRIDGE_RX        BRIDGE_BUFF_SZ
+#define SZ_BRIDGE_TX        BRIDGE_BUFF_SZ
+#else
+// Served straight from the DMA buffers, or no bridge port at all
+#define SZ_BRIDGE_RX        0
+#define SZ_BRIDGE_TX        0
+#endif
+
+#if CONFIG_UART_DMA_ENABLE
+#define SZ_UART_DMA         (CONFIG_UART_DMA_BUFF_COUNT * CONFIG_UART_DMA_BUFF_SIZE)
+#define SZ_UART_DRIVER      0
+#else
+#define SZ_UART_DMA         0
+#define SZ_UART_DRIVER      (1024 * (CONFIG_UART_RX_BUFF_SIZE + CONFIG_UART_TX_BUFF_SIZE))
+#endif
+
+#if CONFIG_WS_BRIDGE_ENABLE
+#define SZ_WS               CONFIG_WS_BRIDGE_FRAME_SIZE
+#else
+#define SZ_WS               0
+#endif
+
+#if CONFIG_MUX_ENABLE
+#define SZ_MUX              MUX_SERVER_BUF_SZ
+#if CONFIG_MUX_UART2_ENABLE
+#define SZ_MUX_CREDIT       (2 * CONFIG_MUX_CHANNEL_CREDIT)
+#define SZ_MUX_UART2        (2 * MUX_UART2_BUF_SZ)
+#else
+#define SZ_MUX_CREDIT       CONFIG_MUX_CHANNEL_CREDIT
+#define SZ_MUX_UART2        0
+#endif
+#else
+#define SZ_MUX              0
+#define SZ_MUX_CREDIT       0
+#define SZ_MUX_UART2        0
+#endif
+
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+// One more request than the queue holds, the one on the bus
+#define SZ_MODBUS_REQUESTS  ((MODBUS_GW_QUEUE_LEN + 1) * MODBUS_GW_REQUEST_SIZE)
+#define SZ_MODBUS_QUEUE     (MODBUS_GW_QUEUE_LEN * sizeof(void *))
+#define TCP_SESSIONS        CONFIG_MODBUS_GW_MAX_CLIENTS
+#else
+#define SZ_MODBUS_REQUESTS  0
+#define SZ_MODBUS_QUEUE     0
+#define TCP_SESSIONS        1
+#endif
+
+#if CONFIG_MODBUS_CACHE_ENABLE
+#define SZ_MODBUS_CACHE     (CONFIG_MODBUS_CACHE_SIZE_KB * 1024)
+#else
+#define SZ_MODBUS_CACHE     0
+#endif
+
+#if CONFIG_BRIDGE_MODE_MQTT
+#define SZ_MQTT_QUEUE       MQTT_BRIDGE_QUEUE_SZ
+#define SZ_MQTT_BATCH       MQTT_BRIDGE_BATCH_SZ
+#define SZ_MQTT_FRAME       CONFIG_MQTT_FRAME_MAX
+#else
+#define SZ_MQTT_QUEUE       0
+#define SZ_MQTT_BATCH       0
+#define SZ_MQTT_FRAME       0
+#endif
+
+#define SZ_TCP_WINDOWS      (TCP_SESSIONS * (CONFIG_LWIP_TCP_SND_BUF_DEFAULT + CONFIG_LWIP_TCP_WND_DEFAULT))
+
+#define SZ_TOTAL (SZ_BRIDGE_RX + SZ_BRIDGE_TX + 2 * SZ_UART_DMA + 2 * SZ_WS + 2 * SZ_MUX + SZ_MUX_CREDIT + \
+                  SZ_MODBUS_REQUESTS + SZ_MODBUS_QUEUE + SZ_MODBUS_CACHE + \
+                  SZ_MQTT_QUEUE + SZ_MQTT_BATCH + SZ_MQTT_FRAME + \
+                  SZ_UART_DRIVER + SZ_MUX_UART2 + SZ_TCP_WINDOWS)
+
+_Static_assert(SZ_TOTAL <= CONFIG_MEM_ARENA_BUDGET_KB * 1024,
+               "Bridge buffers exceed the memory budget, shrink them or raise MEM_ARENA_BUDGET_KB");
+
+static mem_arena_entry_t table[MEM_BUF_COUNT] = {
+    [MEM_BRIDGE_RX]       = { "bridge_rx",       SZ_BRIDGE_RX,       MEM_REGION_INTERNAL },
+    [MEM_BRIDGE_TX]       = { "bridge_tx",       SZ_BRIDGE_TX,       MEM_REGION_INTERNAL },
+    [MEM_UART_DMA_RX]     = { "uart_dma_rx",     SZ_UART_DMA,        MEM_REGION_DMA },
+    [MEM_UART_DMA_TX]     = { "uart_dma_tx",     SZ_UART_DMA,        MEM_REGION_DMA },
+    [MEM_WS_RX]           = { "ws_rx",           SZ_WS,              MEM_REGION_INTERNAL },
+    [MEM_WS_TX]           = { "ws_tx",           SZ_WS,              MEM_REGION_INTERNAL },
+    [MEM_MUX_RX]          = { "mux_rx",          SZ_MUX,             MEM_REGION_INTERNAL },
+    [MEM_MUX_TX]          = { "mux_tx",          SZ_MUX,             MEM_REGION_INTERNAL },
+    [MEM_MUX_CREDIT]      = { "mux_credit",      SZ_MUX_CREDIT,      MEM_REGION_INTERNAL },
+    [MEM_MODBUS_REQUESTS] = { "modbus_requests", SZ_MODBUS_REQUESTS, MEM_REGION_INTERNAL },
+    [MEM_MODBUS_QUEUE]    = { "modbus_queue",    SZ_MODBUS_QUEUE,    MEM_REGION_INTERNAL },
+    [MEM_MODBUS_CACHE]    = { "modbus_cache",    SZ_MODBUS_CACHE,    MEM_REGION_COLD },
+    [MEM_MQTT_QUEUE]      = { "mqtt_queue",      SZ_MQTT_QUEUE,      MEM_REGION_INTERNAL },
+    [MEM_MQTT_BATCH]      = { "mqtt_batch",      SZ_MQTT_BATCH,      MEM_REGION_INTERNAL },
+    [MEM_MQTT_FRAME]      = { "mqtt_frame",      SZ_MQTT_FRAME,      MEM_REGION_INTERNAL },
+    [MEM_UART_DRIVER]     = { "uart_driver",     SZ_UART_DRIVER + SZ_MUX_UART2, MEM_REGION_INTERNAL, true },
+    [MEM_TCP_WINDOWS]     = { "tcp_windows",     SZ_TCP_WINDOWS,     MEM_REGION_INTERNAL, true },
+};
+
+static const uint32_t region_caps[MEM_REGION_COUNT] = {
+    [MEM_REGION_INTERNAL] = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT,
+    [MEM_REGION_DMA]      = MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA,
+    [MEM_REGION_PSRAM]    = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT,
+};
+
+static const char *const region_names[MEM_REGION_COUNT] = { "internal", "dma", "psram" };
+
+static struct {
+    uint8_t    *block[MEM_REGION_COUNT];
+    uint32_t    reserved[MEM_REGION_COUNT];
+    uint32_t    external[MEM_REGION_COUNT];
+    mem_pool_t *pools[MEM_POOL_MAX];
+    int         pool_cnt;
+} arena;
+
+static uint32_t entry_align(const mem_arena_entry_t *e)
+{
+    return e->region == MEM_REGION_DMA ? DMA_ALIGN : ALIGN;
+}
+
+esp_err_t mem_arena_init(void)
+{
+    for (int i = 0; i < MEM_BUF_COUNT; i++) {
+        mem_arena_entry_t const *e = &table[i];
+        if (e->external)
+            arena.external[e->region] += e->size;
+        else if (e->size)
+            arena.reserved[e->region] = ALIGN_UP(arena.reserved[e->region], entry_align(e)) + e->size;
+    }
+
+    // Internal and DMA capable memory come from the same heap
+    uint32_t const internal = arena.reserved[MEM_REGION_INTERNAL] + arena.reserved[MEM_REGION_DMA] +
+                              arena.external[MEM_REGION_INTERNAL] + arena.external[MEM_REGION_DMA];
+    size_t const internal_free = heap_caps_get_free_size(region_caps[MEM_REGION_INTERNAL]);
+    if (internal + HEADROOM > internal_free) {
+        ESP_LOGE(TAG, "%lu bytes of internal memory needed and %d KB headroom, %u bytes free",
+                 (unsigned long)internal, CONFIG_MEM_ARENA_HEADROOM_KB, (unsigned)internal_free);
+        mem_arena_log();
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int r = 0; r < MEM_REGION_COUNT; r++) {
+        if (!arena.reserved[r])
+            continue;
+        arena.block[r] = heap_caps_malloc(arena.reserved[r], region_caps[r]);
+        if (!arena.block[r]) {
+            ESP_LOGE(TAG, "No %lu byte block of %s memory", (unsigned long)arena.reserved[r], region_names[r]);
+            mem_arena_log();
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    uint32_t off[MEM_REGION_COUNT] = { 0 };
+    for (int i = 0; i < MEM_BUF_COUNT; i++) {
+        mem_arena_entry_t *e = &table[i];
+        if (e->external || !e->size)
+            continue;
+        off[e->region] = ALIGN_UP(off[e->region], entry_align(e));
+        e->addr = arena.block[e->region] + off[e->region];
+        off[e->region] += e->size;
+    }
+    mem_arena_log();
+    return ESP_OK;
+}
+
+void *mem_arena_get(mem_buf_t buf)
+{
+    return table[buf].addr;
+}
+
+size_t mem_arena_size(mem_buf_t buf)
+{
+    return table[buf].size;
+}
+
+const mem_arena_entry_t *mem_arena_map(size_t *count)
+{
+    *count = MEM_BUF_COUNT;
+    return table;
+}
+
+const char *mem_arena_region_name(mem_region_t region)
+{
+    return region_names[region];
+}
+
+void mem_arena_get_region(mem_region_t region, mem_region_stats_t *stats)
+{
+    uint32_t const caps = region_caps[region];
+    stats->reserved = arena.reserved[region];
+    stats->external = arena.external[region];
+    stats->free = heap_caps_get_free_size(caps);
+    stats->min_free = heap_caps_get_minimum_free_size(caps);
+    stats->largest_block = heap_caps_get_largest_free_block(caps);
+}
+
+void mem_arena_log(void)
+{
+    for (int i = 0; i < MEM_BUF_COUNT; i++) {
+        mem_arena_entry_t const *e = &table[i];
+        if (e->size)
+            ESP_LOGI(TAG, "%-16s %-8s %6lu%s", e->name, region_names[e->region], (unsigned long)e->size,
+                     e->external ? " (external)" : "");
+    }
+    for (int r = 0; r < MEM_REGION_COUNT; r++) {
+        mem_region_stats_t st;
+        mem_arena_get_region(r, &st);
+        if (st.reserved || st.external || st.free)
+            ESP_LOGI(TAG, "%-8s arena %lu, external %lu, heap free %lu, largest block %lu", region_names[r],
+                     (unsigned long)st.reserved, (unsigned long)st.external, (unsigned long)st.free,
+                     (unsigned long)st.largest_block);
+    }
+}
+
+esp_err_t mem_pool_init(mem_pool_t *pool, mem_buf_t buf, size_t block_size)
+{
+    uint8_t *mem = table[buf].addr;
+    block_size = ALIGN_UP(block_size, sizeof(void *));
+    size_t const blocks = mem ? table[buf].size / block_size : 0;
+    if (!blocks || blocks > UINT16_MAX || block_size > UINT16_MAX || arena.pool_cnt == MEM_POOL_MAX)
+        return ESP_ERR_INVALID_SIZE;
+
+    *pool = (mem_pool_t) {
+        .name = table[buf].name,
+        .block_size = block_size,
+        .blocks = blocks,
+        .lock = portMUX_INITIALIZER_UNLOCKED,
+    };
+    // Thread the free list through the blocks, lowest address first
+    for (size_t i = blocks; i-- > 0;) {
+        void **block = (void **)(mem + i * block_size);
+        *block = pool->free;
+        pool->free = block;
+    }
+    arena.pools[arena.pool_cnt++] = pool;
+    return ESP_OK;
+}
+
+void *mem_pool_alloc(mem_pool_t *pool)
+{
+    portENTER_CRITICAL(&pool->lock);
+    void **block = pool->free;
+    if (block) {
+        pool->free = *block;
+        if (++pool->used > pool->used_max)
+            pool->used_max = pool->used;
+    } else {
+        pool->exhausted++;
+    }
+    portEXIT_CRITICAL(&pool->lock);
+    return block;
+}
+
+void mem_pool_free(mem_pool_t *pool, void *block)
+{
+    portENTER_CRITICAL(&pool->lock);
+    *(void **)block = pool->free;
+    pool->free = block;
+    pool->used--;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+int mem_pool_get_stats(mem_pool_stats_t *stats, int max)
+{
+    int n = 0;
+    for (; n < arena.pool_cnt && n < max; n++) {
+        mem_pool_t const *pool = arena.pools[n];
+        stats[n] = (mem_pool_stats_t) {
+            .name = pool->name,
+            .block_size = pool->block_size,
+            .blocks = pool->blocks,
+            .used = pool->used,
+            .used_max = pool->used_max,
+            .exhausted = pool->exhausted,
+        };
+    }
+    return n;
+}
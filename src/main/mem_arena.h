@@ -0,0 +1,116 @@
+#pragma once
+
+#ifndef MEM_ARENA_H
+#define MEM_ARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+typedef enum {
+    MEM_REGION_INTERNAL,        // internal DRAM, data touched on every transfer
+    MEM_REGION_DMA,             // DMA capable internal DRAM
+    MEM_REGION_PSRAM,           // external RAM, only used if the board has it
+    MEM_REGION_COUNT
+} mem_region_t;
+
+/** Entries of the budget table in mem_arena.c, buffers of disabled features have size 0 */
+typedef enum {
+    MEM_BRIDGE_RX,              // UART -> network buffer of the bridge port
+    MEM_BRIDGE_TX,              // network -> UART buffer of the bridge port
+    MEM_UART_DMA_RX,            // receive DMA buffers
+    MEM_UART_DMA_TX,            // transmit DMA buffers
+    MEM_WS_RX,                  // UART -> WebSocket frame
+    MEM_WS_TX,                  // WebSocket -> UART frame
+    MEM_MUX_RX,                 // mux frames received
+    MEM_MUX_TX,                 // mux frames to send
+    MEM_MUX_CREDIT,             // per channel data the client has credit for
+    MEM_MODBUS_REQUESTS,        // pool of queued Modbus requests
+    MEM_MODBUS_QUEUE,           // storage of the Modbus request queue
+    MEM_MODBUS_CACHE,           // Modbus response cache
+    MEM_MQTT_QUEUE,             // frames waiting to be published or acknowledged
+    MEM_MQTT_BATCH,             // payload of the publish being sent
+    MEM_MQTT_FRAME,             // frame being received from the UART
+    // Allocated by drivers and lwIP, only counted against the budget
+    MEM_UART_DRIVER,            // UART driver ring buffers
+    MEM_TCP_WINDOWS,            // send and receive windows of the bridge sessions
+    MEM_BUF_COUNT
+} mem_buf_t;
+
+typedef struct {
+    const char *name;
+    uint32_t    size;
+    uint8_t     region;
+    bool        external;       // allocated elsewhere, addr stays NULL
+    uint8_t    *addr;
+} mem_arena_entry_t;
+
+typedef struct {
+    uint32_t reserved;          // bytes placed by the arena
+    uint32_t external;          // bytes of the table allocated by drivers and lwIP
+    uint32_t free;              // heap free now
+    uint32_t min_free;          // lowest heap free since boot
+    uint32_t largest_block;
+} mem_region_stats_t;
+
+/* Pool of equally sized blocks carved from one buffer of the table. Allocation
+   and release take constant time and never touch the heap, so they are safe on
+   the data path. */
+typedef struct {
+    const char  *name;
+    void        *free;          // first free block, every free block links the next one
+    uint16_t     block_size;
+    uint16_t     blocks;
+    uint16_t     used;
+    uint16_t     used_max;
+    uint32_t     exhausted;     // allocations refused, no block free
+    portMUX_TYPE lock;
+} mem_pool_t;
+
+typedef struct {
+    const char *name;
+    uint16_t    block_size;
+    uint16_t    blocks;
+    uint16_t    used;
+    uint16_t    used_max;
+    uint32_t    exhausted;
+} mem_pool_stats_t;
+
+#define MEM_POOL_MAX 4
+
+/**
+ * Place every buffer of the budget table, call once at boot before any user.
+ * Returns ESP_ERR_NO_MEM and logs the map if the configuration does not fit
+ * the heap with the configured headroom left.
+ */
+esp_err_t mem_arena_init(void);
+
+/** Buffer placed for the entry, NULL if its size is 0 or it is external */
+void *mem_arena_get(mem_buf_t buf);
+
+size_t mem_arena_size(mem_buf_t buf);
+
+/** Budget table, count gets the number of entries */
+const mem_arena_entry_t *mem_arena_map(size_t *count);
+
+const char *mem_arena_region_name(mem_region_t region);
+
+void mem_arena_get_region(mem_region_t region, mem_region_stats_t *stats);
+
+/** Log the budget table and the heap left in every region */
+void mem_arena_log(void);
+
+/** Split the arena buffer of the entry into blocks of block_size bytes */
+esp_err_t mem_pool_init(mem_pool_t *pool, mem_buf_t buf, size_t block_size);
+
+/** NULL if all blocks are in use */
+void *mem_pool_alloc(mem_pool_t *pool);
+
+void mem_pool_free(mem_pool_t *pool, void *block);
+
+/** Stats of the pools in use, returns their number */
+int mem_pool_get_stats(mem_pool_stats_t *stats, int max);
+
+#endif // MEM_ARENA_H
@@ -0,0 +1,518 @@
+/*
+   Management port: read and change the settings, fetch the counters, apply or
+   reboot and run the UART self test over an authenticated binary protocol, so
+   fleets of bridges can be configured from a script without grounding the web
+   server GPIO of each one.
+   Message layout in mgmt_server.h, test/bridge_mgmt is the matching client.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "lwip/inet.h"
+#include "mbedtls/md.h"
+
+#include "mgmt_server.h"
+#include "settings.h"
+#include "tcp_server.h"
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+#include "modbus_gw.h"
+#endif
+#if CONFIG_BRIDGE_MODE_MQTT
+#include "mqtt_bridge.h"
+#endif
+#if !CONFIG_UART_DMA_ENABLE
+#include "uart_events.h"
+#endif
+#if CONFIG_ADMISSION_ENABLE
+#include "admission.h"
+#endif
+#if CONFIG_UART_SELFTEST_ENABLE
+#include "uart_selftest.h"
+#endif
+
+static const char *TAG = "mgmt";
+
+// Pause after a wrong answer, bounds the rate of key guesses
+#define AUTH_FAIL_DELAY_MS  1000
+
+#define MIN_BAUD_RATE       1200
+#define MAX_BAUD_RATE       5000000
+
+static struct {
+    settings_t          running;        // settings the bridge runs with
+    uint8_t             challenge[MGMT_CHALLENGE_LEN];
+    bool                authed;
+    uint8_t             rx[MGMT_MAX_LEN];
+    uint8_t             tx[MGMT_HDR_LEN + MGMT_MAX_LEN];
+    size_t              tx_len;
+    mgmt_server_stats_t stats;
+} mgmt;
+
+static void put_be(uint8_t *p, uint64_t v, size_t len)
+{
+    for (size_t i = len; i-- > 0; v >>= 8)
+        p[i] = v & 0xFF;
+}
+
+static uint32_t get_be(const uint8_t *p, size_t len)
+{
+    uint32_t v = 0;
+    for (size_t i = 0; i < len; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void msg_begin(uint8_t type)
+{
+    mgmt.tx[0] = type;
+    mgmt.tx_len = MGMT_HDR_LEN;
+}
+
+static void msg_add(const void *data, size_t len)
+{
+    assert(mgmt.tx_len + len <= sizeof(mgmt.tx));
+    memcpy(mgmt.tx + mgmt.tx_len, data, len);
+    mgmt.tx_len += len;
+}
+
+static void field_add(uint8_t tag, const void *data, size_t len)
+{
+    uint8_t const hdr[2] = { tag, len };
+    msg_add(hdr, sizeof(hdr));
+    msg_add(data, len);
+}
+
+static void field_add_num(uint8_t tag, uint64_t v, size_t len)
+{
+    uint8_t buf[8];
+    put_be(buf, v, len);
+    field_add(tag, buf, len);
+}
+
+static bool msg_send(int sock)
+{
+    put_be(mgmt.tx + 1, mgmt.tx_len - MGMT_HDR_LEN, 2);
+    for (size_t sent = 0; sent < mgmt.tx_len;) {
+        int const len = send(sock, mgmt.tx + sent, mgmt.tx_len - sent, 0);
+        if (len < 0) {
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        sent += len;
+    }
+    return true;
+}
+
+static void msg_status(uint8_t status)
+{
+    msg_begin(MGMT_STATUS);
+    msg_add(&status, 1);
+}
+
+static bool send_status(int sock, uint8_t status)
+{
+    msg_status(status);
+    return msg_send(sock);
+}
+
+static bool recv_all(int sock, uint8_t *buf, size_t len)
+{
+    for (size_t got = 0; got < len;) {
+        int const n = recv(sock, buf + got, len - got, 0);
+        if (n < 0) {
+            ESP_LOGW(TAG, "Error occurred during receiving: errno %d", errno);
+            return false;
+        }
+        if (n == 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+static bool check_auth(const uint8_t *mac, size_t len)
+{
+    uint8_t expected[MGMT_MAC_LEN];
+    const char *key = CONFIG_MGMT_KEY;
+    if (len != MGMT_MAC_LEN ||
+        mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const unsigned char *)key, strlen(key),
+                        mgmt.challenge, sizeof(mgmt.challenge), expected) != 0)
+        return false;
+    // Constant time, the comparison must not tell how many bytes matched
+    uint8_t diff = 0;
+    for (size_t i = 0; i < MGMT_MAC_LEN; i++)
+        diff |= mac[i] ^ expected[i];
+    return diff == 0;
+}
+
+static void get_settings(void)
+{
+    settings_t s;
+    load_settings(&s);
+    msg_begin(MGMT_GET_SETTINGS);
+    field_add_num(MGMT_SET_BAUD_RATE, s.uart_baud_rate, 4);
+    field_add_num(MGMT_SET_TCP_PORT, s.tcp_port, 2);
+    field_add_num(MGMT_SET_STATIC_IP, s.use_static_ip, 1);
+    field_add(MGMT_SET_IP_ADDR, s.ip_addr, strlen(s.ip_addr));
+    field_add(MGMT_SET_NETMASK, s.netmask, strlen(s.netmask));
+    field_add(MGMT_SET_GATEWAY, s.gateway, strlen(s.gateway));
+    field_add(MGMT_SET_DNS1, s.dns1, strlen(s.dns1));
+    field_add(MGMT_SET_DNS2, s.dns2, strlen(s.dns2));
+}
+
+static char *address_field(settings_t *s, uint8_t tag)
+{
+    switch (tag) {
+    case MGMT_SET_IP_ADDR: return s->ip_addr;
+    case MGMT_SET_NETMASK: return s->netmask;
+    case MGMT_SET_GATEWAY: return s->gateway;
+    case MGMT_SET_DNS1:    return s->dns1;
+    case MGMT_SET_DNS2:    return s->dns2;
+    default:               return NULL;
+    }
+}
+
+/** Apply the fields of the request to the stored settings, all or nothing, returns a status code */
+static uint8_t set_settings(const uint8_t *p, size_t len)
+{
+    settings_t s;
+    load_settings(&s);
+    while (len > 0) {
+        if (len < 2 || len - 2 < p[1])
+            return MGMT_ERR_FRAME;
+        uint8_t const tag = p[0], flen = p[1];
+        const uint8_t *v = p + 2;
+        p += 2 + flen;
+        len -= 2 + flen;
+
+        char *addr = address_field(&s, tag);
+        if (addr) {
+            struct in_addr in;
+            if (flen >= sizeof(s.ip_addr))
+                return MGMT_ERR_VALUE;
+            memcpy(addr, v, flen);
+            addr[flen] = '\0';
+            if (flen > 0 && !inet_aton(addr, &in))
+                return MGMT_ERR_VALUE;
+            continue;
+        }
+        switch (tag) {
+        case MGMT_SET_BAUD_RATE:
+            if (flen != 4)
+                return MGMT_ERR_FRAME;
+            s.uart_baud_rate = get_be(v, 4);
+            if (s.uart_baud_rate < MIN_BAUD_RATE || s.uart_baud_rate > MAX_BAUD_RATE)
+                return MGMT_ERR_VALUE;
+            break;
+        case MGMT_SET_TCP_PORT:
+            if (flen != 2)
+                return MGMT_ERR_FRAME;
+            s.tcp_port = get_be(v, 2);
+            if (s.tcp_port == 0)
+                return MGMT_ERR_VALUE;
+            break;
+        case MGMT_SET_STATIC_IP:
+            if (flen != 1)
+                return MGMT_ERR_FRAME;
+            if (v[0] > 1)
+                return MGMT_ERR_VALUE;
+            s.use_static_ip = v[0];
+            break;
+        default:
+            return MGMT_ERR_FRAME;
+        }
+    }
+    // The bridge would come up unreachable with a static address but none set
+    if (s.use_static_ip && (!s.ip_addr[0] || !s.netmask[0]))
+        return MGMT_ERR_VALUE;
+    if (save_settings(&s) != ESP_OK)
+        return MGMT_ERR_STORAGE;
+    mgmt.stats.settings_saved++;
+    ESP_LOGI(TAG, "Settings saved");
+    return MGMT_OK;
+}
+
+static void apply_settings(void)
+{
+    settings_t s;
+    load_settings(&s);
+    uint8_t reply[2] = { MGMT_OK, 0 };
+    if (s.uart_baud_rate == mgmt.running.uart_baud_rate ||
+        tcp_server_set_baud_rate(s.uart_baud_rate) == ESP_OK) {
+        mgmt.running.uart_baud_rate = s.uart_baud_rate;
+        reply[1] |= MGMT_APPLIED_LIVE;
+    }
+    // Everything else is only read at boot
+    const settings_t *r = &mgmt.running;
+    if (s.tcp_port != r->tcp_port || s.use_static_ip != r->use_static_ip || strcmp(s.ip_addr, r->ip_addr) ||
+        strcmp(s.netmask, r->netmask) || strcmp(s.gateway, r->gateway) || strcmp(s.dns1, r->dns1) ||
+        strcmp(s.dns2, r->dns2))
+        reply[1] |= MGMT_NEEDS_REBOOT;
+    msg_begin(MGMT_STATUS);
+    msg_add(reply, sizeof(reply));
+}
+
+static void get_stats(void)
+{
+    msg_begin(MGMT_GET_STATS);
+    field_add_num(MGMT_CNT_UPTIME_S, esp_timer_get_time() / 1000000, 8);
+    field_add_num(MGMT_CNT_FREE_HEAP, esp_get_free_heap_size(), 8);
+    field_add_num(MGMT_CNT_MIN_FREE_HEAP, esp_get_minimum_free_heap_size(), 8);
+#if CONFIG_BRIDGE_MODE_RAW
+    tcp_server_stats_t br;
+    tcp_server_get_stats(&br);
+    field_add_num(MGMT_CNT_SESSIONS, br.sessions, 8);
+    field_add_num(MGMT_CNT_UART_TO_ETH, br.uart_to_eth_bytes, 8);
+    field_add_num(MGMT_CNT_ETH_TO_UART, br.eth_to_uart_bytes, 8);
+    field_add_num(MGMT_CNT_TX_THROTTLED, br.tx_throttled, 8);
+    field_add_num(MGMT_CNT_REJECTED, br.rejected, 8);
+#if CONFIG_ADMISSION_ENABLE
+    admission_stats_t adm;
+    admission_get_stats(&adm);
+    field_add_num(MGMT_CNT_DENIED, adm.denied, 8);
+    field_add_num(MGMT_CNT_RATE_LIMITED, adm.rate_limited, 8);
+    field_add_num(MGMT_CNT_FIRST_BYTE_TIMEOUTS, br.first_byte_timeouts, 8);
+    field_add_num(MGMT_CNT_PREEMPTED, br.preempted, 8);
+#endif
+#endif
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+    modbus_gw_stats_t mb;
+    modbus_gw_get_stats(&mb);
+    field_add_num(MGMT_CNT_MB_REQUESTS, mb.requests, 8);
+    field_add_num(MGMT_CNT_MB_RESPONSES, mb.responses, 8);
+    field_add_num(MGMT_CNT_MB_TIMEOUTS, mb.timeouts, 8);
+    field_add_num(MGMT_CNT_MB_CRC_ERRORS, mb.crc_errors, 8);
+    field_add_num(MGMT_CNT_MB_BAD_FRAMES, mb.bad_frames, 8);
+#endif
+#if CONFIG_BRIDGE_MODE_MQTT
+    mqtt_bridge_stats_t mq;
+    mqtt_bridge_get_stats(&mq);
+    field_add_num(MGMT_CNT_MQTT_FRAMES, mq.frames, 8);
+    field_add_num(MGMT_CNT_MQTT_DROPPED, mq.dropped, 8);
+    field_add_num(MGMT_CNT_MQTT_PUBLISHES, mq.publishes, 8);
+    field_add_num(MGMT_CNT_MQTT_RESENT, mq.resent, 8);
+    field_add_num(MGMT_CNT_MQTT_CONNECTS, mq.connects, 8);
+    field_add_num(MGMT_CNT_MQTT_RX_MESSAGES, mq.rx_messages, 8);
+#endif
+#if !CONFIG_UART_DMA_ENABLE
+    uart_events_stats_t ue;
+    uart_events_get_stats(&ue);
+    field_add_num(MGMT_CNT_FIFO_OVERRUNS, ue.fifo_overruns, 8);
+    field_add_num(MGMT_CNT_BUFFER_FULL, ue.buffer_full, 8);
+    field_add_num(MGMT_CNT_FRAME_ERRORS, ue.frame_errors, 8);
+    field_add_num(MGMT_CNT_PARITY_ERRORS, ue.parity_errors, 8);
+#endif
+    field_add_num(MGMT_CNT_MGMT_SESSIONS, mgmt.stats.sessions, 8);
+    field_add_num(MGMT_CNT_MGMT_AUTH_FAILURES, mgmt.stats.auth_failures, 8);
+}
+
+#if CONFIG_UART_SELFTEST_ENABLE
+/** Start a UART self test with the fields of the request, returns a status code */
+static uint8_t start_selftest(const uint8_t *p, size_t len)
+{
+    int baud_rate = 0;
+    int seconds = UART_SELFTEST_DEFAULT_S;
+    while (len > 0) {
+        if (len < 2 || len - 2 < p[1])
+            return MGMT_ERR_FRAME;
+        uint8_t const tag = p[0], flen = p[1];
+        const uint8_t *v = p + 2;
+        p += 2 + flen;
+        len -= 2 + flen;
+        switch (tag) {
+        case MGMT_ST_BAUD_RATE:
+            if (flen != 4)
+                return MGMT_ERR_FRAME;
+            baud_rate = get_be(v, 4);
+            break;
+        case MGMT_ST_SECONDS:
+            if (flen != 1)
+                return MGMT_ERR_FRAME;
+            seconds = v[0];
+            break;
+        default:
+            return MGMT_ERR_FRAME;
+        }
+    }
+    switch (uart_selftest_start(baud_rate, seconds)) {
+    case ESP_OK:
+        ESP_LOGI(TAG, "UART self test started");
+        return MGMT_OK;
+    case ESP_ERR_INVALID_ARG:
+        return MGMT_ERR_VALUE;
+    default:
+        // Out of memory for the test task is worth another try as well
+        return MGMT_ERR_BUSY;
+    }
+}
+
+static void get_selftest(void)
+{
+    uart_selftest_result_t r;
+    uart_selftest_get_result(&r);
+    msg_begin(MGMT_SELFTEST);
+    field_add_num(MGMT_ST_STATE, r.state, 1);
+    field_add_num(MGMT_ST_ERROR, (uint32_t)r.error, 4);
+    field_add_num(MGMT_ST_BAUD_RATE, r.baud_rate, 4);
+    field_add_num(MGMT_ST_SENT, r.sent, 8);
+    field_add_num(MGMT_ST_RECEIVED, r.received, 8);
+    field_add_num(MGMT_ST_DURATION_MS, r.duration_ms, 4);
+    field_add_num(MGMT_ST_ERRORS, r.errors, 4);
+    field_add_num(MGMT_ST_BYTES_PER_S, r.bytes_per_s, 4);
+    field_add_num(MGMT_ST_LINE_PCT, r.line_pct, 4);
+    field_add_num(MGMT_ST_FIFO_OVERRUNS, r.fifo_overruns, 4);
+    field_add_num(MGMT_ST_BUFFER_FULL, r.buffer_full, 4);
+    field_add_num(MGMT_ST_RX_BUFFERED_MAX, r.rx_buffered_max, 4);
+    field_add_num(MGMT_ST_TX_BUFFERED_MAX, r.tx_buffered_max, 4);
+}
+#endif
+
+static void mgmt_session(int sock)
+{
+    uint8_t hello[1 + MGMT_CHALLENGE_LEN] = { MGMT_VERSION };
+    esp_fill_random(mgmt.challenge, sizeof(mgmt.challenge));
+    memcpy(hello + 1, mgmt.challenge, sizeof(mgmt.challenge));
+    mgmt.authed = false;
+    msg_begin(MGMT_HELLO);
+    msg_add(hello, sizeof(hello));
+    if (!msg_send(sock))
+        return;
+
+    for (;;) {
+        uint8_t hdr[MGMT_HDR_LEN];
+        if (!recv_all(sock, hdr, sizeof(hdr)))
+            return;
+        size_t const len = get_be(hdr + 1, 2);
+        if (len > MGMT_MAX_LEN) {
+            send_status(sock, MGMT_ERR_FRAME);
+            return;
+        }
+        if (!recv_all(sock, mgmt.rx, len))
+            return;
+
+        if (!mgmt.authed) {
+            if (hdr[0] != MGMT_AUTH) {
+                send_status(sock, MGMT_ERR_AUTH);
+                return;
+            }
+            if (!check_auth(mgmt.rx, len)) {
+                ESP_LOGW(TAG, "Authentication failed");
+                mgmt.stats.auth_failures++;
+                send_status(sock, MGMT_ERR_AUTH);
+                vTaskDelay(pdMS_TO_TICKS(AUTH_FAIL_DELAY_MS));
+                return;
+            }
+            mgmt.authed = true;
+            mgmt.stats.sessions++;
+            if (!send_status(sock, MGMT_OK))
+                return;
+            continue;
+        }
+
+        mgmt.stats.requests++;
+        switch (hdr[0]) {
+        case MGMT_GET_SETTINGS:
+            get_settings();
+            break;
+        case MGMT_SET_SETTINGS:
+            msg_status(set_settings(mgmt.rx, len));
+            break;
+        case MGMT_APPLY:
+            apply_settings();
+            break;
+        case MGMT_REBOOT:
+            ESP_LOGI(TAG, "Reboot requested");
+            send_status(sock, MGMT_OK);
+            shutdown(sock, SHUT_RDWR);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            esp_restart();
+            return;
+        case MGMT_GET_STATS:
+            get_stats();
+            break;
+#if CONFIG_UART_SELFTEST_ENABLE
+        case MGMT_SELFTEST:
+            if (len)
+                msg_status(start_selftest(mgmt.rx, len));
+            else
+                get_selftest();
+            break;
+#endif
+        default:
+            msg_status(MGMT_ERR_TYPE);
+            break;
+        }
+        if (!msg_send(sock))
+            return;
+    }
+}
+
+static void mgmt_server_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(CONFIG_MGMT_PORT),
+    };
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    // Batch tools connect to many bridges at once but rarely twice to one
+    if (listen(listen_sock, 4) != 0) {
+        ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    ESP_LOGI(TAG, "Management port %d", CONFIG_MGMT_PORT);
+
+    for (;;) {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            break;
+        }
+        // A client that stops talking must not lock the port
+        struct timeval timeout = { .tv_sec = CONFIG_MGMT_IDLE_TIMEOUT };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        mgmt_session(sock);
+        shutdown(sock, 0);
+        close(sock);
+    }
+
+CLEAN_UP:
+    close(listen_sock);
+    vTaskDelete(NULL);
+}
+
+void mgmt_server_start(const settings_t *settings)
+{
+    if (strlen(CONFIG_MGMT_KEY) == 0) {
+        ESP_LOGE(TAG, "No management key configured, management port disabled");
+        return;
+    }
+    mgmt.running = *settings;
+    // Off the data path, below the bridge tasks
+    xTaskCreate(mgmt_server_task, "mgmt_server", 4096, NULL, 2, NULL);
+}
+
+void mgmt_server_get_stats(mgmt_server_stats_t *stats)
+{
+    *stats = mgmt.stats;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef MGMT_SERVER_H
+#define MGMT_SERVER_H
+
+#include <stdint.h>
+#include "settings.h"
+
+/*
+   Management protocol, every message is [type][length, 16 bit big endian][value].
+
+   On connection the bridge sends MGMT_HELLO with the protocol version and a fresh
+   random challenge. The client proves it knows the management key by answering
+   MGMT_AUTH with HMAC-SHA256(key, challenge). Any other request before that, or a
+   wrong answer, gets MGMT_STATUS with an error and the connection is closed.
+
+   Every request gets one reply, either a message of the same type or MGMT_STATUS.
+   Settings and counters travel as a list of fields [tag][length][value] in the
+   message value, numbers big endian, strings without terminator.
+*/
+#define MGMT_VERSION        1
+#define MGMT_HDR_LEN        3
+#define MGMT_MAX_LEN        512
+#define MGMT_CHALLENGE_LEN  16
+#define MGMT_MAC_LEN        32
+
+// Message types
+#define MGMT_HELLO          0x01    // -> version, challenge
+#define MGMT_AUTH           0x02    // <- HMAC-SHA256(key, challenge) -> status
+#define MGMT_GET_SETTINGS   0x10    // <- empty -> stored settings fields
+#define MGMT_SET_SETTINGS   0x11    // <- fields to change -> status, stored only
+#define MGMT_APPLY          0x12    // <- empty -> status, apply flags
+#define MGMT_REBOOT         0x13    // <- empty -> status, then the bridge restarts
+#define MGMT_GET_STATS      0x20    // <- empty -> counter fields, 64 bit each
+#define MGMT_SELFTEST       0x21    // <- test fields -> status, the test starts; <- empty -> result fields
+#define MGMT_STATUS         0x7F    // -> status code[, apply flags]
+
+// Status codes
+#define MGMT_OK             0
+#define MGMT_ERR_FRAME      1       // malformed message or field
+#define MGMT_ERR_AUTH       2       // not authenticated or wrong answer
+#define MGMT_ERR_TYPE       3       // unknown message type
+#define MGMT_ERR_VALUE      4       // field value out of range, nothing was changed
+#define MGMT_ERR_STORAGE    5       // settings could not be written
+#define MGMT_ERR_BUSY       6       // a self test runs or a session holds the UART
+
+// MGMT_APPLY flags
+#define MGMT_APPLIED_LIVE   0x01    // the stored baud rate is now in use
+#define MGMT_NEEDS_REBOOT   0x02    // stored port or network settings differ from the running ones
+
+// Settings fields
+#define MGMT_SET_BAUD_RATE  0x01    // 32 bit
+#define MGMT_SET_TCP_PORT   0x02    // 16 bit
+#define MGMT_SET_STATIC_IP  0x03    // 8 bit, 0 DHCP, 1 static address
+#define MGMT_SET_IP_ADDR    0x04    // dotted quad, empty to clear
+#define MGMT_SET_NETMASK    0x05
+#define MGMT_SET_GATEWAY    0x06
+#define MGMT_SET_DNS1       0x07
+#define MGMT_SET_DNS2       0x08
+
+// Counter fields, only those of the built features are sent
+#define MGMT_CNT_UPTIME_S           0x01
+#define MGMT_CNT_FREE_HEAP          0x02
+#define MGMT_CNT_MIN_FREE_HEAP      0x03
+#define MGMT_CNT_SESSIONS           0x10
+#define MGMT_CNT_UART_TO_ETH        0x11
+#define MGMT_CNT_ETH_TO_UART        0x12
+#define MGMT_CNT_TX_THROTTLED       0x13
+#define MGMT_CNT_REJECTED           0x14
+#define MGMT_CNT_DENIED             0x15
+#define MGMT_CNT_RATE_LIMITED       0x16
+#define MGMT_CNT_FIRST_BYTE_TIMEOUTS 0x17
+#define MGMT_CNT_PREEMPTED          0x18
+#define MGMT_CNT_MB_REQUESTS        0x20
+#define MGMT_CNT_MB_RESPONSES       0x21
+#define MGMT_CNT_MB_TIMEOUTS        0x22
+#define MGMT_CNT_MB_CRC_ERRORS      0x23
+#define MGMT_CNT_MB_BAD_FRAMES      0x24
+#define MGMT_CNT_MQTT_FRAMES        0x28
+#define MGMT_CNT_MQTT_DROPPED       0x29
+#define MGMT_CNT_MQTT_PUBLISHES     0x2A
+#define MGMT_CNT_MQTT_RESENT        0x2B
+#define MGMT_CNT_MQTT_CONNECTS      0x2C
+#define MGMT_CNT_MQTT_RX_MESSAGES   0x2D
+#define MGMT_CNT_FIFO_OVERRUNS      0x30
+#define MGMT_CNT_BUFFER_FULL        0x31
+#define MGMT_CNT_FRAME_ERRORS       0x32
+#define MGMT_CNT_PARITY_ERRORS      0x33
+#define MGMT_CNT_MGMT_SESSIONS      0x40
+#define MGMT_CNT_MGMT_AUTH_FAILURES 0x41
+
+// UART self test fields, the request carries the first two
+#define MGMT_ST_BAUD_RATE       0x01    // 32 bit, 0 keeps the running rate
+#define MGMT_ST_SECONDS         0x02    // 8 bit
+#define MGMT_ST_STATE           0x10    // 8 bit, 0 idle, 1 running, 2 done, 3 failed
+#define MGMT_ST_ERROR           0x11    // 32 bit, esp_err_t of a failed test
+#define MGMT_ST_SENT            0x12    // 64 bit
+#define MGMT_ST_RECEIVED        0x13    // 64 bit
+#define MGMT_ST_DURATION_MS     0x14    // 32 bit from here on
+#define MGMT_ST_ERRORS          0x15
+#define MGMT_ST_BYTES_PER_S     0x16
+#define MGMT_ST_LINE_PCT        0x17
+#define MGMT_ST_FIFO_OVERRUNS   0x18
+#define MGMT_ST_BUFFER_FULL     0x19
+#define MGMT_ST_RX_BUFFERED_MAX 0x1A
+#define MGMT_ST_TX_BUFFERED_MAX 0x1B
+
+typedef struct {
+    uint32_t sessions;          // clients authenticated
+    uint32_t auth_failures;     // wrong answers to the challenge
+    uint32_t requests;
+    uint32_t settings_saved;
+} mgmt_server_stats_t;
+
+/** Start the management listener, settings are the ones the bridge runs with */
+void mgmt_server_start(const settings_t *settings);
+
+void mgmt_server_get_stats(mgmt_server_stats_t *stats);
+
+#endif // MGMT_SERVER_H
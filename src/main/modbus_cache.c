@@ -0,0 +1,323 @@
+/* Modbus gateway read response cache
+
+   Entries are kept in a fixed array sized from the memory budget and indexed by
+   a hash of (unit id, function code, address, count). When the array is full
+   the oldest entry is replaced. All entries share the same time to live.
+
+   A write request fences its range from being queued until the bus has
+   executed it: reads of the range neither hit nor store meanwhile, otherwise a
+   read executed ahead of the write would put the old data back in the cache.
+*/
+#include <assert.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "modbus_cache.h"
+#include "modbus_gw.h"
+#include "mem_arena.h"
+
+#define CACHE_TTL_US      (CONFIG_MODBUS_CACHE_TTL_MS * 1000LL)
+#define MB_PDU_MAX        253
+#define NIL               0xFFFF
+
+static const char *TAG = "modbus_cache";
+
+struct cache_entry {
+    uint16_t next;      // hash chain or free list link
+    uint8_t  unit;
+    uint8_t  fc;
+    uint16_t addr;
+    uint16_t count;
+    uint16_t len;       // response length, 0 if the entry is free
+    int64_t  expires;
+    uint8_t  pdu[MB_PDU_MAX];
+};
+
+// Range of a write request, end is one past the last address
+struct write_range {
+    uint8_t  unit;      // 0 - broadcast, every unit
+    bool     whole_unit;
+    uint16_t addr;
+    uint32_t end;
+};
+
+static struct {
+    SemaphoreHandle_t    lock;
+    struct cache_entry  *entries;
+    uint16_t            *buckets;
+    uint16_t             capacity;
+    uint8_t              bucket_bits;
+    uint16_t             free_head;
+    uint16_t             victim;    // next entry to replace when there are no free ones
+    // Writes queued, the one on the bus and the one being queued when the queue is full
+    struct write_range   fences[MODBUS_GW_QUEUE_LEN + 2];
+    uint16_t             fence_count;
+    modbus_cache_stats_t stats;
+} cache;
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t key_hash(uint8_t unit, uint8_t fc, uint16_t addr, uint16_t count)
+{
+    uint32_t const k = ((uint32_t)unit << 24 | (uint32_t)fc << 16 | addr) ^ ((uint32_t)count << 5);
+    return (k * 2654435761u) >> (32 - cache.bucket_bits);
+}
+
+/** Parse read request (function codes 1 to 4), returns false for any other request */
+static bool parse_read(const uint8_t *pdu, size_t pdu_len, uint16_t *addr, uint16_t *count)
+{
+    if (pdu_len != 5 || pdu[0] < 0x01 || pdu[0] > 0x04)
+        return false;
+    *addr = get_be16(pdu + 1);
+    *count = get_be16(pdu + 3);
+    return *count != 0;
+}
+
+static struct cache_entry *find(uint8_t unit, uint8_t fc, uint16_t addr, uint16_t count)
+{
+    for (uint16_t i = cache.buckets[key_hash(unit, fc, addr, count)]; i != NIL; i = cache.entries[i].next) {
+        struct cache_entry *e = &cache.entries[i];
+        if (e->unit == unit && e->fc == fc && e->addr == addr && e->count == count)
+            return e;
+    }
+    return NULL;
+}
+
+static void unlink_entry(uint16_t idx)
+{
+    struct cache_entry *e = &cache.entries[idx];
+    uint16_t *link = &cache.buckets[key_hash(e->unit, e->fc, e->addr, e->count)];
+    while (*link != idx)
+        link = &cache.entries[*link].next;
+    *link = e->next;
+    e->len = 0;
+    cache.stats.used--;
+}
+
+static void release_entry(uint16_t idx)
+{
+    unlink_entry(idx);
+    cache.entries[idx].next = cache.free_head;
+    cache.free_head = idx;
+}
+
+static uint16_t alloc_entry(int64_t now)
+{
+    uint16_t idx = cache.free_head;
+    if (idx != NIL) {
+        cache.free_head = cache.entries[idx].next;
+        return idx;
+    }
+    idx = cache.victim;
+    cache.victim = (idx + 1) % cache.capacity;
+    if (cache.entries[idx].expires > now)
+        cache.stats.evictions++;
+    unlink_entry(idx);
+    return idx;
+}
+
+/** Parse the range a write request may change, returns false for read requests */
+static bool parse_write(uint8_t unit, const uint8_t *pdu, size_t pdu_len, struct write_range *w)
+{
+    uint16_t count = 0;
+    w->unit = unit;
+    w->whole_unit = false;
+    w->addr = 0;
+
+    switch (pdu_len ? pdu[0] : 0) {
+    case 0x01: case 0x02: case 0x03: case 0x04:
+        return false;
+    case 0x05: case 0x06:
+        w->whole_unit = pdu_len < 5;
+        w->addr = w->whole_unit ? 0 : get_be16(pdu + 1);
+        count = 1;
+        break;
+    case 0x0F: case 0x10:
+        w->whole_unit = pdu_len < 5;
+        w->addr = w->whole_unit ? 0 : get_be16(pdu + 1);
+        count = w->whole_unit ? 0 : get_be16(pdu + 3);
+        break;
+    case 0x16:
+        w->whole_unit = pdu_len < 7;
+        w->addr = w->whole_unit ? 0 : get_be16(pdu + 1);
+        count = 1;
+        break;
+    case 0x17:
+        w->whole_unit = pdu_len < 9;
+        w->addr = w->whole_unit ? 0 : get_be16(pdu + 5);
+        count = w->whole_unit ? 0 : get_be16(pdu + 7);
+        break;
+    default:
+        // Unknown effect, assume anything of the unit may change
+        w->whole_unit = true;
+        break;
+    }
+    w->end = (uint32_t)w->addr + count;
+    return true;
+}
+
+static bool overlaps(const struct write_range *w, uint8_t unit, uint16_t addr, uint16_t count)
+{
+    // Broadcast writes go to every unit
+    if (w->unit && w->unit != unit)
+        return false;
+    return w->whole_unit || (addr < w->end && (uint32_t)addr + count > w->addr);
+}
+
+/** True if a queued write may change the range, called with the lock held */
+static bool fenced(uint8_t unit, uint16_t addr, uint16_t count)
+{
+    for (uint16_t i = 0; i < cache.fence_count; i++) {
+        if (overlaps(&cache.fences[i], unit, addr, count))
+            return true;
+    }
+    return false;
+}
+
+/** Drop the entries the write may change, called with the lock held */
+static void invalidate(const struct write_range *w)
+{
+    for (uint16_t i = 0; i < cache.capacity; i++) {
+        struct cache_entry *e = &cache.entries[i];
+        if (!e->len || !overlaps(w, e->unit, e->addr, e->count))
+            continue;
+        release_entry(i);
+        cache.stats.invalidations++;
+    }
+}
+
+esp_err_t modbus_cache_init(void)
+{
+    // Entries and hash buckets share the arena buffer, there are at most two buckets per entry
+    cache.entries = mem_arena_get(MEM_MODBUS_CACHE);
+    cache.capacity = mem_arena_size(MEM_MODBUS_CACHE) / (sizeof(struct cache_entry) + 2 * sizeof(uint16_t));
+    cache.bucket_bits = 1;
+    while ((1u << cache.bucket_bits) < cache.capacity)
+        cache.bucket_bits++;
+    cache.buckets = (uint16_t *)(cache.entries + cache.capacity);
+
+    cache.lock = xSemaphoreCreateMutex();
+    if (!cache.entries || !cache.capacity || !cache.lock) {
+        ESP_LOGE(TAG, "no memory");
+        return ESP_ERR_NO_MEM;
+    }
+    memset(cache.entries, 0, cache.capacity * sizeof(struct cache_entry));
+    memset(cache.buckets, 0xFF, (1u << cache.bucket_bits) * sizeof(uint16_t));
+    for (uint16_t i = 0; i < cache.capacity; i++)
+        cache.entries[i].next = i + 1 < cache.capacity ? i + 1 : NIL;
+    cache.free_head = 0;
+    cache.stats.capacity = cache.capacity;
+
+    ESP_LOGI(TAG, "%d entries, TTL %d ms", cache.capacity, CONFIG_MODBUS_CACHE_TTL_MS);
+    return ESP_OK;
+}
+
+size_t modbus_cache_lookup(uint8_t unit, const uint8_t *pdu, size_t pdu_len, uint8_t *resp)
+{
+    uint16_t addr, count;
+    if (!unit || !parse_read(pdu, pdu_len, &addr, &count))
+        return 0;
+
+    size_t len = 0;
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    if (fenced(unit, addr, count)) {
+        // The response has to come from the bus after the write
+        cache.stats.bypasses++;
+        xSemaphoreGive(cache.lock);
+        return 0;
+    }
+    struct cache_entry *e = find(unit, pdu[0], addr, count);
+    if (e && e->expires > esp_timer_get_time()) {
+        len = e->len;
+        memcpy(resp, e->pdu, len);
+        cache.stats.hits++;
+    } else {
+        if (e)
+            release_entry(e - cache.entries);
+        cache.stats.misses++;
+    }
+    xSemaphoreGive(cache.lock);
+    return len;
+}
+
+void modbus_cache_store(uint8_t unit, const uint8_t *pdu, size_t pdu_len, const uint8_t *resp, size_t resp_len)
+{
+    uint16_t addr, count;
+    if (!unit || !parse_read(pdu, pdu_len, &addr, &count))
+        return;
+    // Don't keep exception responses
+    if (resp_len < 2 || resp_len > MB_PDU_MAX || resp[0] != pdu[0])
+        return;
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    if (fenced(unit, addr, count)) {
+        // Read ahead of a write still queued, the data is about to change
+        xSemaphoreGive(cache.lock);
+        return;
+    }
+    int64_t const now = esp_timer_get_time();
+    struct cache_entry *e = find(unit, pdu[0], addr, count);
+    if (!e) {
+        uint16_t const idx = alloc_entry(now);
+        e = &cache.entries[idx];
+        e->unit = unit;
+        e->fc = pdu[0];
+        e->addr = addr;
+        e->count = count;
+        uint16_t *bucket = &cache.buckets[key_hash(unit, e->fc, addr, count)];
+        e->next = *bucket;
+        *bucket = idx;
+        cache.stats.used++;
+    }
+    e->len = resp_len;
+    e->expires = now + CACHE_TTL_US;
+    memcpy(e->pdu, resp, resp_len);
+    cache.stats.stores++;
+    xSemaphoreGive(cache.lock);
+}
+
+void modbus_cache_write_queued(uint8_t unit, const uint8_t *pdu, size_t pdu_len)
+{
+    struct write_range w;
+    if (!parse_write(unit, pdu, pdu_len, &w))
+        return;
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    invalidate(&w);
+    assert(cache.fence_count < sizeof(cache.fences) / sizeof(cache.fences[0]));
+    cache.fences[cache.fence_count++] = w;
+    xSemaphoreGive(cache.lock);
+}
+
+void modbus_cache_write_done(uint8_t unit, const uint8_t *pdu, size_t pdu_len)
+{
+    struct write_range w;
+    if (!parse_write(unit, pdu, pdu_len, &w))
+        return;
+
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    // Fences of the same range are interchangeable, any one of them goes
+    for (uint16_t i = 0; i < cache.fence_count; i++) {
+        struct write_range const *f = &cache.fences[i];
+        if (f->unit == w.unit && f->whole_unit == w.whole_unit && f->addr == w.addr && f->end == w.end) {
+            cache.fences[i] = cache.fences[--cache.fence_count];
+            break;
+        }
+    }
+    // Responses stored before the write reached the bus are stale now
+    invalidate(&w);
+    xSemaphoreGive(cache.lock);
+}
+
+void modbus_cache_get_stats(modbus_cache_stats_t *stats)
+{
+    xSemaphoreTake(cache.lock, portMAX_DELAY);
+    *stats = cache.stats;
+    xSemaphoreGive(cache.lock);
+}
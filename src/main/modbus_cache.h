@@ -0,0 +1,44 @@
+#pragma once
+
+#ifndef MODBUS_CACHE_H
+#define MODBUS_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t stores;
+    uint32_t evictions;       // valid entries replaced because the cache was full
+    uint32_t invalidations;   // entries dropped because of a write request
+    uint32_t bypasses;        // lookups sent to the bus because a write of the range is queued
+    uint16_t capacity;        // number of entries fitting the memory budget
+    uint16_t used;
+} modbus_cache_stats_t;
+
+esp_err_t modbus_cache_init(void);
+
+/**
+ * Look up the response to the read request, copies the response PDU to resp
+ * (room for 253 bytes) and returns its length or 0 if there is no valid entry.
+ */
+size_t modbus_cache_lookup(uint8_t unit, const uint8_t *pdu, size_t pdu_len, uint8_t *resp);
+
+/** Remember the successful response to the read request, other requests are ignored */
+void modbus_cache_store(uint8_t unit, const uint8_t *pdu, size_t pdu_len, const uint8_t *resp, size_t resp_len);
+
+/**
+ * The write request is queued for the bus: drop the entries it may change and
+ * keep reads of its range from hitting or storing until modbus_cache_write_done().
+ * Read requests are ignored.
+ */
+void modbus_cache_write_queued(uint8_t unit, const uint8_t *pdu, size_t pdu_len);
+
+/** The write request queued before has been executed or dropped, lift its fence */
+void modbus_cache_write_done(uint8_t unit, const uint8_t *pdu, size_t pdu_len);
+
+void modbus_cache_get_stats(modbus_cache_stats_t *stats);
+
+#endif // MODBUS_CACHE_H
@@ -0,0 +1,614 @@
+/* Modbus TCP <-> Modbus RTU gateway
+
+   Modbus TCP clients are served by the network task which splits the incoming
+   stream into MBAP frames and queues them. The bus task takes the requests one
+   by one, sends them to the serial line as RTU frames and sends the responses
+   back to the originating client. Several clients may have requests queued at
+   the same time so the next request is ready to go as soon as the bus becomes
+   idle.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+
+#include "lwip/sockets.h"
+
+#include "modbus_gw.h"
+#include "tcp_server.h"
+#include "mem_arena.h"
+#if CONFIG_MODBUS_CACHE_ENABLE
+#include "modbus_cache.h"
+#endif
+#if CONFIG_UART_LINE_RS485
+#include "rs485.h"
+#endif
+
+#define MAX_CLIENTS       CONFIG_MODBUS_GW_MAX_CLIENTS
+#define CLIENT_PIPELINE   CONFIG_MODBUS_GW_CLIENT_PIPELINE
+#define RESP_TIMEOUT_MS   CONFIG_MODBUS_GW_RESPONSE_TIMEOUT_MS
+#define BCAST_DELAY_MS    CONFIG_MODBUS_GW_BROADCAST_DELAY_MS
+
+#define MBAP_HDR_LEN      7
+#define MB_PDU_MAX        253
+#define RTU_FRAME_MAX     (1 + MB_PDU_MAX + 2)
+
+#define MB_EXC_GW_PATH_UNAVAILABLE  0x0A
+#define MB_EXC_GW_TARGET_FAILED     0x0B
+
+// Throttled clients are polled again after this time
+#define THROTTLE_POLL_MS  5
+#define DROP_POLL_MS      10     // how often the net task looks for clients to drop
+
+static const char *TAG = "modbus_gw";
+
+typedef struct {
+    uint8_t  client;
+    uint32_t gen;
+    uint16_t tid;
+    uint8_t  unit;
+    uint16_t pdu_len;
+    uint8_t  pdu[MB_PDU_MAX];
+} mb_request_t;
+
+_Static_assert(sizeof(mb_request_t) <= MODBUS_GW_REQUEST_SIZE, "MODBUS_GW_REQUEST_SIZE too small");
+
+struct mb_client {
+    int      sock;      // -1 if the slot is free
+    uint32_t gen;       // incremented on every close so stale responses are dropped
+    uint8_t  pending;   // requests queued or being processed on the bus
+    bool     drop;      // link of the local address is gone, abort the connection
+    uint32_t local_ip;
+    uint16_t rx_len;
+    uint8_t  rx[MBAP_HDR_LEN + MB_PDU_MAX];
+};
+
+static struct {
+    uart_port_t       uart;
+    uint16_t          port;
+    uint32_t          char_us;      // one character time on the wire
+    uint32_t          t35_us;       // inter-frame silent interval
+    int64_t           bus_idle_at;  // time the bus became idle
+    QueueHandle_t     queue;        // requests from the pool, by pointer
+    StaticQueue_t     queue_buf;
+    mem_pool_t        requests;
+    bool              starved;      // a frame was left waiting for a free request
+    SemaphoreHandle_t lock;         // protects clients[].sock, gen and pending
+    struct mb_client  clients[MAX_CLIENTS];
+    modbus_gw_stats_t stats;
+    uint8_t           rtu[RTU_FRAME_MAX];
+} gw;
+
+static const uint16_t crc_table[256] = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+};
+
+uint16_t modbus_crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    while (len--) {
+        crc = (crc >> 8) ^ crc_table[(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+/** Modbus over serial line spec: 11 bit characters, fixed 1.75 ms silent interval above 19200 baud */
+static void rtu_timing_init(int baud_rate)
+{
+    gw.char_us = (11 * 1000000 + baud_rate - 1) / baud_rate;
+    gw.t35_us = baud_rate > 19200 ? 1750 : (gw.char_us * 7 + 1) / 2;
+}
+
+static TickType_t us_to_ticks(uint32_t us)
+{
+    // Round up and add one tick since the current tick is already partially elapsed
+    return (us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000) + 1;
+}
+
+/**
+ * Expected length of the RTU response frame given its first n bytes.
+ * Returns 0 if more bytes are needed to tell, -1 if the length can't be
+ * derived from the function code and the frame end is detected by the silent interval.
+ */
+static int rtu_expected_len(const uint8_t *buf, size_t n)
+{
+    if (n < 2)
+        return 0;
+    uint8_t const fc = buf[1];
+    if (fc & 0x80)
+        return 5;
+    switch (fc) {
+    case 0x01: case 0x02: case 0x03: case 0x04:
+    case 0x0C: case 0x11: case 0x14: case 0x15: case 0x17:
+        return n < 3 ? 0 : 3 + buf[2] + 2;
+    case 0x05: case 0x06: case 0x08: case 0x0B: case 0x0F: case 0x10:
+        return 8;
+    case 0x07:
+        return 5;
+    case 0x16:
+        return 10;
+    case 0x18:
+        return n < 4 ? 0 : 4 + get_be16(buf + 2) + 2;
+    default:
+        return -1;
+    }
+}
+
+/** Receive the RTU response frame, returns its length or 0 on timeout */
+static size_t rtu_receive(uint8_t *buf, size_t max, uint32_t timeout_ms)
+{
+#if CONFIG_UART_LINE_RS485
+    // Line noise right after the request does not start the response
+    TickType_t const start = xTaskGetTickCount();
+    do {
+        TickType_t const elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= pdMS_TO_TICKS(timeout_ms) ||
+            uart_read_bytes(gw.uart, buf, 1, pdMS_TO_TICKS(timeout_ms) - elapsed) <= 0)
+            return 0;
+    } while (!rs485_rx(buf, 1));
+#else
+    if (uart_read_bytes(gw.uart, buf, 1, pdMS_TO_TICKS(timeout_ms)) <= 0)
+        return 0;
+#endif
+
+    size_t n = 1;
+    while (n < max) {
+        int const expected = rtu_expected_len(buf, n);
+        size_t want = 1;
+        if (expected > 0) {
+            if (n >= (size_t)expected)
+                break;
+            want = MIN((size_t)expected, max) - n;
+        }
+        int const got = uart_read_bytes(gw.uart, buf + n, want, us_to_ticks(want * gw.char_us + gw.t35_us));
+        if (got <= 0)
+            break;
+#if CONFIG_UART_LINE_RS485
+        rs485_rx(buf + n, got);
+#endif
+        n += got;
+        if ((size_t)got < want)
+            break;
+    }
+    return n;
+}
+
+/** Keep the bus silent for at least 3.5 characters between frames */
+static void rtu_wait_silent_interval(void)
+{
+#if CONFIG_UART_LINE_RS485
+    // Also the turnaround guard after anything seen on the bus
+    while (!rs485_tx_ready())
+        vTaskDelay(1);
+#endif
+    int64_t const left = gw.bus_idle_at + gw.t35_us - esp_timer_get_time();
+    if (left <= 0)
+        return;
+    if (left >= portTICK_PERIOD_MS * 1000)
+        vTaskDelay(us_to_ticks(left));
+    else
+        esp_rom_delay_us(left);
+}
+
+/** Send the response frame to the client, the PDU is expected at MBAP_HDR_LEN offset of frame */
+static void client_send_frame(const mb_request_t *req, uint8_t *frame, size_t pdu_len)
+{
+    put_be16(frame, req->tid);
+    put_be16(frame + 2, 0);
+    put_be16(frame + 4, pdu_len + 1);
+    frame[6] = req->unit;
+
+    xSemaphoreTake(gw.lock, portMAX_DELAY);
+    struct mb_client *cl = &gw.clients[req->client];
+    if (cl->gen == req->gen && cl->sock >= 0) {
+        if (send(cl->sock, frame, MBAP_HDR_LEN + pdu_len, 0) < 0)
+            ESP_LOGW(TAG, "Error occurred during sending: errno %d", errno);
+    }
+    xSemaphoreGive(gw.lock);
+}
+
+static void client_send_response(const mb_request_t *req, const uint8_t *pdu, size_t pdu_len)
+{
+    uint8_t frame[MBAP_HDR_LEN + MB_PDU_MAX];
+    memcpy(frame + MBAP_HDR_LEN, pdu, pdu_len);
+    client_send_frame(req, frame, pdu_len);
+}
+
+static void client_send_exception(const mb_request_t *req, uint8_t code)
+{
+    uint8_t const pdu[2] = { req->pdu[0] | 0x80, code };
+    client_send_response(req, pdu, sizeof(pdu));
+}
+
+static void request_done(const mb_request_t *req)
+{
+    xSemaphoreTake(gw.lock, portMAX_DELAY);
+    struct mb_client *cl = &gw.clients[req->client];
+    if (cl->gen == req->gen && cl->pending)
+        cl->pending--;
+    xSemaphoreGive(gw.lock);
+}
+
+static void rtu_transaction(const mb_request_t *req)
+{
+    size_t const req_len = 1 + req->pdu_len;
+    gw.rtu[0] = req->unit;
+    memcpy(gw.rtu + 1, req->pdu, req->pdu_len);
+    uint16_t const crc = modbus_crc16(gw.rtu, req_len);
+    gw.rtu[req_len] = crc & 0xFF;
+    gw.rtu[req_len + 1] = crc >> 8;
+
+    rtu_wait_silent_interval();
+    // Drop whatever was left on the bus by late or unsolicited responses
+    uart_flush_input(gw.uart);
+    uart_write_bytes(gw.uart, gw.rtu, req_len + 2);
+#if CONFIG_UART_LINE_RS485
+    rs485_tx_start(gw.rtu, req_len + 2);
+#endif
+    uart_wait_tx_done(gw.uart, us_to_ticks((req_len + 2) * gw.char_us) + 1);
+#if CONFIG_UART_LINE_RS485
+    // Takes the end of the request, its echo is dropped while receiving the response
+    rs485_tx_busy();
+#endif
+
+    if (!req->unit) {
+        gw.stats.broadcasts++;
+        vTaskDelay(pdMS_TO_TICKS(BCAST_DELAY_MS));
+        gw.bus_idle_at = esp_timer_get_time();
+        return;
+    }
+
+    size_t const len = rtu_receive(gw.rtu, sizeof(gw.rtu), RESP_TIMEOUT_MS);
+    gw.bus_idle_at = esp_timer_get_time();
+
+    if (!len) {
+        gw.stats.timeouts++;
+        ESP_LOGW(TAG, "Unit %d fc 0x%02x: no response", req->unit, req->pdu[0]);
+        client_send_exception(req, MB_EXC_GW_TARGET_FAILED);
+        return;
+    }
+    if (len < 5 || modbus_crc16(gw.rtu, len) != 0 ||
+        gw.rtu[0] != req->unit || (gw.rtu[1] & 0x7F) != req->pdu[0]) {
+        gw.stats.crc_errors++;
+        ESP_LOGW(TAG, "Unit %d fc 0x%02x: bad response frame (%d bytes)", req->unit, req->pdu[0], (int)len);
+        client_send_exception(req, MB_EXC_GW_TARGET_FAILED);
+        return;
+    }
+    gw.stats.responses++;
+#if CONFIG_MODBUS_CACHE_ENABLE
+    modbus_cache_store(req->unit, req->pdu, req->pdu_len, gw.rtu + 1, len - 3);
+#endif
+    client_send_response(req, gw.rtu + 1, len - 3);
+}
+
+static void gw_bus_task(void *pvParameters)
+{
+    mb_request_t *req;
+    for (;;) {
+        if (xQueueReceive(gw.queue, &req, portMAX_DELAY) != pdTRUE)
+            continue;
+        rtu_transaction(req);
+#if CONFIG_MODBUS_CACHE_ENABLE
+        // Drop responses of reads executed while the write was queued
+        modbus_cache_write_done(req->unit, req->pdu, req->pdu_len);
+#endif
+        request_done(req);
+        mem_pool_free(&gw.requests, req);
+    }
+}
+
+static void client_close(struct mb_client *cl)
+{
+    xSemaphoreTake(gw.lock, portMAX_DELAY);
+#if CONFIG_LWIP_SO_LINGER
+    if (cl->drop) {
+        // Reset the connection instead of waiting for the peer which is not reachable
+        struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(cl->sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+#endif
+    shutdown(cl->sock, 0);
+    close(cl->sock);
+    cl->sock = -1;
+    cl->gen++;
+    cl->pending = 0;
+    cl->rx_len = 0;
+    cl->drop = false;
+    xSemaphoreGive(gw.lock);
+}
+
+static bool client_queue_frames(struct mb_client *cl, uint8_t idx)
+{
+#if CONFIG_MODBUS_CACHE_ENABLE
+    static uint8_t frame[MBAP_HDR_LEN + MB_PDU_MAX];
+#endif
+    uint16_t off = 0;
+    while (cl->rx_len - off >= MBAP_HDR_LEN) {
+        uint8_t const *hdr = cl->rx + off;
+        uint16_t const len = get_be16(hdr + 4);
+        if (get_be16(hdr + 2) != 0 || len < 2 || len > MB_PDU_MAX + 1) {
+            gw.stats.bad_frames++;
+            ESP_LOGW(TAG, "Bad MBAP header (protocol %d, length %d)", get_be16(hdr + 2), len);
+            return false;
+        }
+        if (cl->rx_len - off < 6 + len)
+            break;
+        if (cl->pending >= CLIENT_PIPELINE)
+            break;
+        // The frame stays in the receive buffer until a request is returned
+        mb_request_t *req = mem_pool_alloc(&gw.requests);
+        if (!req) {
+            gw.starved = true;
+            break;
+        }
+
+        req->client = idx;
+        req->gen = cl->gen;
+        req->tid = get_be16(hdr);
+        req->unit = hdr[6];
+        req->pdu_len = len - 1;
+        memcpy(req->pdu, hdr + MBAP_HDR_LEN, req->pdu_len);
+        off += 6 + len;
+        gw.stats.requests++;
+
+#if CONFIG_MODBUS_CACHE_ENABLE
+        // A hit would overtake the requests of the client still queued, responses keep the request order
+        size_t const cached = cl->pending ? 0 : modbus_cache_lookup(req->unit, req->pdu, req->pdu_len,
+                                                                    frame + MBAP_HDR_LEN);
+        if (cached) {
+            client_send_frame(req, frame, cached);
+            mem_pool_free(&gw.requests, req);
+            continue;
+        }
+        // Reads must not be answered with the data this request is going to change
+        modbus_cache_write_queued(req->unit, req->pdu, req->pdu_len);
+#endif
+
+        xSemaphoreTake(gw.lock, portMAX_DELAY);
+        cl->pending++;
+        xSemaphoreGive(gw.lock);
+        // Never blocks: the queue has room for the pipeline of every client
+        if (xQueueSend(gw.queue, &req, 0) != pdTRUE) {
+#if CONFIG_MODBUS_CACHE_ENABLE
+            modbus_cache_write_done(req->unit, req->pdu, req->pdu_len);
+#endif
+            client_send_exception(req, MB_EXC_GW_PATH_UNAVAILABLE);
+            request_done(req);
+            mem_pool_free(&gw.requests, req);
+        }
+    }
+    if (off) {
+        cl->rx_len -= off;
+        memmove(cl->rx, cl->rx + off, cl->rx_len);
+    }
+    return true;
+}
+
+static void client_accept(int listen_sock)
+{
+    struct sockaddr_storage source_addr;
+    socklen_t addr_len = sizeof(source_addr);
+    int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        return;
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        struct mb_client *cl = &gw.clients[i];
+        if (cl->sock >= 0)
+            continue;
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+        // Don't let a client which stopped reading stall the bus task
+        struct timeval tv = { .tv_sec = 1 };
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        char addr_str[16] = "";
+        if (source_addr.ss_family == PF_INET)
+            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+        ESP_LOGI(TAG, "Client %d connected from %s", i, addr_str);
+
+        struct sockaddr_in local_addr;
+        addr_len = sizeof(local_addr);
+        xSemaphoreTake(gw.lock, portMAX_DELAY);
+        cl->sock = sock;
+        cl->local_ip = getsockname(sock, (struct sockaddr *)&local_addr, &addr_len) == 0 ? local_addr.sin_addr.s_addr : 0;
+        xSemaphoreGive(gw.lock);
+        return;
+    }
+    ESP_LOGW(TAG, "Too many clients, connection refused");
+    close(sock);
+}
+
+static void gw_net_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(gw.port),
+    };
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    if (listen(listen_sock, MAX_CLIENTS) != 0) {
+        ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    ESP_LOGI(TAG, "Modbus TCP gateway listening on port %d", gw.port);
+
+    for (;;) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(listen_sock, &rfds);
+        int max_fd = listen_sock;
+        int connected = 0;
+        // Frames waiting for a free request are picked up on the next poll
+        bool throttled = gw.starved;
+        gw.starved = false;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct mb_client *cl = &gw.clients[i];
+            if (cl->sock < 0)
+                continue;
+            connected++;
+            if (cl->pending >= CLIENT_PIPELINE || cl->rx_len == sizeof(cl->rx)) {
+                throttled = true;
+                continue;
+            }
+            FD_SET(cl->sock, &rfds);
+            max_fd = MAX(max_fd, cl->sock);
+        }
+        gpio_set_level(CONFIG_BRIDGE_LED_GPIO, connected > 0);
+
+        struct timeval tv = { .tv_usec = THROTTLE_POLL_MS * 1000 };
+#if CONFIG_ETH_FAILOVER_ENABLE
+        struct timeval drop_tv = { .tv_usec = DROP_POLL_MS * 1000 };
+        int const ready = select(max_fd + 1, &rfds, NULL, NULL, throttled ? &tv : &drop_tv);
+#else
+        int const ready = select(max_fd + 1, &rfds, NULL, NULL, throttled ? &tv : NULL);
+#endif
+        if (ready < 0) {
+            ESP_LOGE(TAG, "Error occurred during select: errno %d", errno);
+            break;
+        }
+
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct mb_client *cl = &gw.clients[i];
+            if (cl->sock < 0)
+                continue;
+            if (cl->drop) {
+                ESP_LOGW(TAG, "Link down, client %d dropped", i);
+                client_close(cl);
+                continue;
+            }
+            if (FD_ISSET(cl->sock, &rfds)) {
+                int const len = recv(cl->sock, cl->rx + cl->rx_len, sizeof(cl->rx) - cl->rx_len, 0);
+                if (len <= 0) {
+                    ESP_LOGI(TAG, "Client %d disconnected", i);
+                    client_close(cl);
+                    continue;
+                }
+                cl->rx_len += len;
+            }
+            // Also picks up frames left in the buffer while the client was throttled
+            if (!client_queue_frames(cl, i))
+                client_close(cl);
+        }
+        if (FD_ISSET(listen_sock, &rfds))
+            client_accept(listen_sock);
+    }
+
+CLEAN_UP:
+    close(listen_sock);
+    vTaskDelete(NULL);
+}
+
+void modbus_gw_create(uart_port_t uart, const settings_t *settings)
+{
+    gw.uart = uart;
+    gw.port = settings->tcp_port;
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        gw.clients[i].sock = -1;
+    rtu_timing_init(settings->uart_baud_rate);
+    gw.bus_idle_at = esp_timer_get_time();
+
+    ESP_ERROR_CHECK(mem_pool_init(&gw.requests, MEM_MODBUS_REQUESTS, sizeof(mb_request_t)));
+    gw.queue = xQueueCreateStatic(MODBUS_GW_QUEUE_LEN, sizeof(mb_request_t *),
+                                  mem_arena_get(MEM_MODBUS_QUEUE), &gw.queue_buf);
+    gw.lock = xSemaphoreCreateMutex();
+    assert(gw.queue && gw.lock);
+#if CONFIG_MODBUS_CACHE_ENABLE
+    ESP_ERROR_CHECK(modbus_cache_init());
+#endif
+
+    ESP_LOGI(TAG, "RTU character time %u us, silent interval %u us", (unsigned)gw.char_us, (unsigned)gw.t35_us);
+    xTaskCreatePinnedToCore(gw_bus_task, "modbus_bus", 3072, NULL, 6, NULL, BRIDGE_TASK_CORE);
+    xTaskCreatePinnedToCore(gw_net_task, "modbus_net", 4096, NULL, 5, NULL, BRIDGE_TASK_CORE);
+}
+
+int modbus_gw_drop_clients(uint32_t local_ip)
+{
+    int dropped = 0;
+    if (!gw.lock)
+        return 0;
+    xSemaphoreTake(gw.lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        struct mb_client *cl = &gw.clients[i];
+        if (cl->sock >= 0 && cl->local_ip == local_ip) {
+            cl->drop = true;
+            dropped++;
+        }
+    }
+    xSemaphoreGive(gw.lock);
+    return dropped;
+}
+
+void modbus_gw_get_stats(modbus_gw_stats_t *stats)
+{
+    *stats = gw.stats;
+}
+
+void modbus_gw_set_baud_rate(int baud_rate)
+{
+    rtu_timing_init(baud_rate);
+    ESP_LOGI(TAG, "RTU character time %u us, silent interval %u us", (unsigned)gw.char_us, (unsigned)gw.t35_us);
+}
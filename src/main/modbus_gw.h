@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef MODBUS_GW_H
+#define MODBUS_GW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "driver/uart.h"
+#include "settings.h"
+
+// Requests queued for the bus, the pipeline of every client
+#define MODBUS_GW_QUEUE_LEN     (CONFIG_MODBUS_GW_MAX_CLIENTS * CONFIG_MODBUS_GW_CLIENT_PIPELINE)
+// Room for one queued request in the request pool
+#define MODBUS_GW_REQUEST_SIZE  272
+
+typedef struct {
+    uint32_t requests;      // requests received from TCP clients
+    uint32_t responses;     // valid RTU responses forwarded to clients
+    uint32_t broadcasts;    // unit id 0 requests, no response expected
+    uint32_t timeouts;      // no (complete) response within the timeout
+    uint32_t crc_errors;    // response dropped because of bad CRC or framing
+    uint32_t bad_frames;    // malformed MBAP frames received from clients
+} modbus_gw_stats_t;
+
+/** Modbus CRC16 (polynomial 0xA001, initial value 0xFFFF) */
+uint16_t modbus_crc16(const uint8_t *data, size_t len);
+
+/** Start Modbus TCP listener and RTU bus tasks on the already installed UART driver */
+void modbus_gw_create(uart_port_t uart, const settings_t *settings);
+
+void modbus_gw_get_stats(modbus_gw_stats_t *stats);
+
+/** Recompute the RTU timing after the UART baud rate changed */
+void modbus_gw_set_baud_rate(int baud_rate);
+
+/** Abort clients connected to the given local address (network byte order), returns their number */
+int modbus_gw_drop_clients(uint32_t local_ip);
+
+#endif // MODBUS_GW_H
@@ -0,0 +1,413 @@
+/* Serial <-> MQTT client
+
+   UART data is split into frames by an idle gap or a delimiter character and
+   the frames are appended to the outbound queue, a ring in the memory arena
+   holding every frame with its length. Frames are published on the configured
+   topic, several of them per publish when they pile up, and with QoS 1 they stay
+   in the queue until the broker acknowledges their publish. Only a window of
+   publishes is in flight at a time; when the connection is lost the ones not
+   acknowledged are sent again after the reconnect, so frames are only lost when
+   the queue runs full. The client connects with a clean session and the MQTT
+   library drops its own copies of the unacknowledged publishes then.
+
+   Messages of the subscribed topic are written to the UART from the MQTT task.
+
+   The queue is protected by a spinlock which is never held across calls into
+   the MQTT client, whose event handler runs with the client lock held. Either
+   the UART task or the event handler publishes at a time, the other one leaves
+   it to the one already doing it.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mqtt_client.h"
+
+#include "mqtt_bridge.h"
+#include "tcp_server.h"
+#include "mem_arena.h"
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+
+static const char *TAG = "mqtt_bridge";
+
+// A power of two, offsets run freely through 2^32 and the ring index stays continuous across the wrap
+#define QUEUE_SZ        MQTT_BRIDGE_QUEUE_SZ
+#define FRAME_HDR_LEN   2
+#define TICKS_UP(ms)    MAX(1, ((ms) + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS)
+#define GAP_TICKS       TICKS_UP(CONFIG_MQTT_FRAME_GAP_MS)
+#define LINGER_TICKS    TICKS_UP(CONFIG_MQTT_BATCH_LINGER_MS)
+// UART data taken per read, frames are cut out of it
+#define UART_CHUNK      128
+
+struct inflight {
+    int      msg_id;
+    uint32_t end;           // queue offset behind the last frame of the publish
+    uint16_t frames;
+    int64_t  sent_us;
+    bool     acked;
+};
+
+static struct {
+    uart_port_t              uart;
+    esp_mqtt_client_handle_t client;
+    portMUX_TYPE             lock;          // protects everything below but the buffers
+    bool                     connected;
+    bool                     publishing;    // a context is building and sending publishes
+    uint32_t                 gen;           // incremented on every disconnect
+    // Queue offsets run freely, the ring index is the offset modulo the queue size
+    uint32_t                 head;          // oldest frame not acknowledged
+    uint32_t                 sent;          // oldest frame not published
+    uint32_t                 tail;          // where the next frame goes
+    uint32_t                 resend_end;    // frames before it were published on a lost connection
+    uint32_t                 unsent_frames;
+    TickType_t               unsent_since;  // oldest unsent frame queued, or the last publish
+    struct inflight          window[CONFIG_MQTT_INFLIGHT];
+    int                      inflight_cnt;
+    uint64_t                 ack_us_sum;
+    mqtt_bridge_stats_t      stats;
+    uint8_t                 *queue;
+    uint8_t                 *batch;         // payload being published
+    uint8_t                 *frame;         // frame being received from the UART
+} mq = { .lock = portMUX_INITIALIZER_UNLOCKED };
+
+static void ring_write(uint32_t off, const uint8_t *data, size_t len)
+{
+    size_t const idx = off % QUEUE_SZ;
+    size_t const first = MIN(len, QUEUE_SZ - idx);
+    memcpy(mq.queue + idx, data, first);
+    memcpy(mq.queue, data + first, len - first);
+}
+
+static void ring_read(uint32_t off, uint8_t *data, size_t len)
+{
+    size_t const idx = off % QUEUE_SZ;
+    size_t const first = MIN(len, QUEUE_SZ - idx);
+    memcpy(data, mq.queue + idx, first);
+    memcpy(data + first, mq.queue, len - first);
+}
+
+static uint16_t frame_len(uint32_t off)
+{
+    uint8_t hdr[FRAME_HDR_LEN];
+    ring_read(off, hdr, sizeof(hdr));
+    return hdr[0] << 8 | hdr[1];
+}
+
+/** Append a frame to the queue, dropped if it does not fit */
+static void queue_frame(const uint8_t *data, size_t len)
+{
+    uint8_t const hdr[FRAME_HDR_LEN] = { len >> 8, len & 0xFF };
+    portENTER_CRITICAL(&mq.lock);
+    uint32_t const used = mq.tail - mq.head;
+    if (used + FRAME_HDR_LEN + len > QUEUE_SZ) {
+        mq.stats.dropped++;
+        portEXIT_CRITICAL(&mq.lock);
+        return;
+    }
+    // Only this task writes behind the tail, acknowledgements only move the head
+    portEXIT_CRITICAL(&mq.lock);
+    ring_write(mq.tail, hdr, sizeof(hdr));
+    ring_write(mq.tail + FRAME_HDR_LEN, data, len);
+    portENTER_CRITICAL(&mq.lock);
+    mq.tail += FRAME_HDR_LEN + len;
+    if (!mq.unsent_frames)
+        mq.unsent_since = xTaskGetTickCount();
+    mq.unsent_frames++;
+    mq.stats.frames++;
+    mq.stats.queued_bytes = mq.tail - mq.head;
+    mq.stats.queued_max = MAX(mq.stats.queued_max, mq.stats.queued_bytes);
+    portEXIT_CRITICAL(&mq.lock);
+}
+
+/** True if the next publish may go now, called with the lock held */
+static bool may_publish(void)
+{
+    if (!mq.connected || !mq.unsent_frames)
+        return false;
+    if (CONFIG_MQTT_QOS && mq.inflight_cnt == CONFIG_MQTT_INFLIGHT)
+        return false;
+#if CONFIG_MQTT_BATCH_LINGER_MS
+    // Frames published before are sent again at once
+    bool const resend = (int32_t)(mq.resend_end - mq.sent) > 0;
+    if (!resend && mq.unsent_frames < CONFIG_MQTT_BATCH_FRAMES && xTaskGetTickCount() - mq.unsent_since < LINGER_TICKS)
+        return false;
+#endif
+    return true;
+}
+
+/** Copy frames from the queue into the publish payload, returns its length */
+static size_t build_batch(uint32_t off, int frames)
+{
+    size_t len = 0;
+    for (int i = 0; i < frames; i++) {
+        uint16_t const flen = frame_len(off);
+#if CONFIG_MQTT_BATCH_FRAMES > 1
+        ring_read(off, mq.batch + len, FRAME_HDR_LEN + flen);
+        len += FRAME_HDR_LEN + flen;
+#else
+        ring_read(off + FRAME_HDR_LEN, mq.batch + len, flen);
+        len += flen;
+#endif
+        off += FRAME_HDR_LEN + flen;
+    }
+    return len;
+}
+
+/** Publish queued frames while the window has room */
+static void publish(void)
+{
+    portENTER_CRITICAL(&mq.lock);
+    if (mq.publishing) {
+        // The other context checks for more after its current publish
+        portEXIT_CRITICAL(&mq.lock);
+        return;
+    }
+    mq.publishing = true;
+    while (may_publish()) {
+        uint32_t const from = mq.sent;
+        uint32_t const gen = mq.gen;
+        int const frames = MIN(mq.unsent_frames, CONFIG_MQTT_BATCH_FRAMES);
+        uint32_t to = from;
+        for (int i = 0; i < frames; i++)
+            to += FRAME_HDR_LEN + frame_len(to);
+        portEXIT_CRITICAL(&mq.lock);
+
+        // Frames between sent and tail stay put until acknowledged
+        size_t const len = build_batch(from, frames);
+        int const msg_id = esp_mqtt_client_enqueue(mq.client, CONFIG_MQTT_PUB_TOPIC, (const char *)mq.batch, len,
+                                                   CONFIG_MQTT_QOS, 0, true);
+        int64_t const now = esp_timer_get_time();
+
+        portENTER_CRITICAL(&mq.lock);
+        if (msg_id < 0)
+            break;      // tried again on the next frame or acknowledgement
+        if (gen != mq.gen)
+            continue;   // connection lost meanwhile, everything not acknowledged goes again
+        mq.stats.publishes++;
+        if ((int32_t)(mq.resend_end - from) > 0)
+            mq.stats.resent++;
+        mq.sent = to;
+        mq.unsent_frames -= frames;
+        mq.unsent_since = xTaskGetTickCount();
+#if CONFIG_MQTT_QOS
+        mq.window[mq.inflight_cnt++] = (struct inflight){ .msg_id = msg_id, .end = to, .frames = frames,
+                                                          .sent_us = now };
+        mq.stats.inflight = mq.inflight_cnt;
+#else
+        (void)now;
+        mq.head = mq.sent;
+        mq.stats.queued_bytes = mq.tail - mq.head;
+#endif
+    }
+    mq.publishing = false;
+    portEXIT_CRITICAL(&mq.lock);
+}
+
+/** Broker acknowledged a publish, release the frames of the ones acknowledged in order */
+static void publish_acked(int msg_id)
+{
+    int64_t const now = esp_timer_get_time();
+    portENTER_CRITICAL(&mq.lock);
+    for (int i = 0; i < mq.inflight_cnt; i++) {
+        struct inflight *f = &mq.window[i];
+        if (f->msg_id != msg_id || f->acked)
+            continue;
+        f->acked = true;
+        uint32_t const us = now - f->sent_us;
+        mq.stats.acked++;
+        mq.ack_us_sum += us;
+        mq.stats.ack_us_avg = mq.ack_us_sum / mq.stats.acked;
+        mq.stats.ack_us_max = MAX(mq.stats.ack_us_max, us);
+        break;
+    }
+    int done = 0;
+    while (done < mq.inflight_cnt && mq.window[done].acked)
+        mq.head = mq.window[done++].end;
+    if (done) {
+        mq.inflight_cnt -= done;
+        memmove(mq.window, mq.window + done, mq.inflight_cnt * sizeof(mq.window[0]));
+    }
+    mq.stats.inflight = mq.inflight_cnt;
+    mq.stats.queued_bytes = mq.tail - mq.head;
+    portEXIT_CRITICAL(&mq.lock);
+}
+
+/** Publish everything not acknowledged again, called with the lock held */
+static void requeue_inflight(void)
+{
+    mq.gen++;
+    if ((int32_t)(mq.sent - mq.resend_end) > 0)
+        mq.resend_end = mq.sent;
+    // Every frame between head and sent belongs to a publish in the window
+    for (int i = 0; i < mq.inflight_cnt; i++)
+        mq.unsent_frames += mq.window[i].frames;
+    mq.sent = mq.head;
+    mq.inflight_cnt = 0;
+    mq.stats.inflight = 0;
+}
+
+static void mqtt_event_handler(void *arg, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_mqtt_event_handle_t const event = event_data;
+    switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Connected to %s", CONFIG_MQTT_BROKER_URI);
+        if (*CONFIG_MQTT_SUB_TOPIC)
+            esp_mqtt_client_subscribe(event->client, CONFIG_MQTT_SUB_TOPIC, 1);
+        portENTER_CRITICAL(&mq.lock);
+        mq.connected = true;
+        mq.stats.connected = true;
+        mq.stats.connects++;
+        portEXIT_CRITICAL(&mq.lock);
+        publish();
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        ESP_LOGW(TAG, "Disconnected, %lu publishes not acknowledged", (unsigned long)mq.stats.inflight);
+        portENTER_CRITICAL(&mq.lock);
+        mq.connected = false;
+        mq.stats.connected = false;
+        requeue_inflight();
+        portEXIT_CRITICAL(&mq.lock);
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        publish_acked(event->msg_id);
+        publish();
+        break;
+    case MQTT_EVENT_DELETED:
+        // Not acknowledged in time and dropped by the client, start over from the oldest one
+        ESP_LOGW(TAG, "Publish %d expired", event->msg_id);
+        portENTER_CRITICAL(&mq.lock);
+        requeue_inflight();
+        portEXIT_CRITICAL(&mq.lock);
+        publish();
+        break;
+    case MQTT_EVENT_DATA:
+        // Long messages come in several parts, only the first one has the topic
+        if (!event->current_data_offset)
+            mq.stats.rx_messages++;
+        if (event->data_len > 0) {
+            uart_write_bytes(mq.uart, event->data, event->data_len);
+            mq.stats.rx_bytes += event->data_len;
+#if CONFIG_POWER_MGMT_ENABLE
+            power_mgmt_busy();
+#endif
+        }
+        break;
+    case MQTT_EVENT_ERROR:
+        ESP_LOGW(TAG, "MQTT error, type %d", event->error_handle ? (int)event->error_handle->error_type : -1);
+        break;
+    default:
+        break;
+    }
+}
+
+/** How long the UART may stay quiet before the next frame ends or a batch is due */
+static TickType_t uart_wait(size_t frame_len)
+{
+    TickType_t wait = portMAX_DELAY;
+#if CONFIG_MQTT_FRAMING_GAP
+    if (frame_len)
+        wait = GAP_TICKS;
+#endif
+#if CONFIG_MQTT_BATCH_LINGER_MS
+    portENTER_CRITICAL(&mq.lock);
+    if (mq.connected && mq.unsent_frames && (!CONFIG_MQTT_QOS || mq.inflight_cnt < CONFIG_MQTT_INFLIGHT)) {
+        TickType_t const waited = xTaskGetTickCount() - mq.unsent_since;
+        wait = MIN(wait, waited < LINGER_TICKS ? LINGER_TICKS - waited : 1);
+    }
+    portEXIT_CRITICAL(&mq.lock);
+#endif
+    return wait;
+}
+
+static void mqtt_uart_task(void *pvParameters)
+{
+    uint8_t buf[UART_CHUNK];
+    size_t len = 0;
+    for (;;) {
+        int got = uart_read_bytes(mq.uart, buf, 1, uart_wait(len));
+        if (got <= 0) {
+#if CONFIG_MQTT_FRAMING_GAP
+            if (len) {
+                queue_frame(mq.frame, len);
+                len = 0;
+            }
+#endif
+            publish();
+            continue;
+        }
+        size_t buffered = 0;
+        uart_get_buffered_data_len(mq.uart, &buffered);
+        if (buffered) {
+            int const more = uart_read_bytes(mq.uart, buf + 1, MIN(buffered, sizeof(buf) - 1), 0);
+            if (more > 0)
+                got += more;
+        }
+#if CONFIG_POWER_MGMT_ENABLE
+        power_mgmt_busy();
+#endif
+        for (int i = 0; i < got; i++) {
+            mq.frame[len++] = buf[i];
+#if CONFIG_MQTT_FRAMING_DELIMITER
+            if (buf[i] == CONFIG_MQTT_FRAME_DELIMITER) {
+                queue_frame(mq.frame, len);
+                len = 0;
+                continue;
+            }
+#endif
+            if (len == CONFIG_MQTT_FRAME_MAX) {
+                mq.stats.split++;
+                queue_frame(mq.frame, len);
+                len = 0;
+            }
+        }
+        publish();
+    }
+}
+
+void mqtt_bridge_create(uart_port_t uart)
+{
+    mq.uart = uart;
+    mq.queue = mem_arena_get(MEM_MQTT_QUEUE);
+    mq.batch = mem_arena_get(MEM_MQTT_BATCH);
+    mq.frame = mem_arena_get(MEM_MQTT_FRAME);
+
+    esp_mqtt_client_config_t const config = {
+        .broker.address.uri = CONFIG_MQTT_BROKER_URI,
+        .credentials = {
+            .client_id = *CONFIG_MQTT_CLIENT_ID ? CONFIG_MQTT_CLIENT_ID : NULL,
+            .username = *CONFIG_MQTT_USERNAME ? CONFIG_MQTT_USERNAME : NULL,
+            .authentication.password = *CONFIG_MQTT_PASSWORD ? CONFIG_MQTT_PASSWORD : NULL,
+        },
+        .session.keepalive = CONFIG_MQTT_KEEPALIVE,
+        // A whole batch has to fit, publishes are queued in one piece
+        .buffer.out_size = MAX(1024, MQTT_BRIDGE_BATCH_SZ + sizeof(CONFIG_MQTT_PUB_TOPIC) + 8),
+    };
+    mq.client = esp_mqtt_client_init(&config);
+    if (!mq.client) {
+        ESP_LOGE(TAG, "esp_mqtt_client_init failed");
+        return;
+    }
+    ESP_ERROR_CHECK(esp_mqtt_client_register_event(mq.client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_mqtt_client_start(mq.client));
+
+#if CONFIG_MQTT_FRAMING_GAP
+    ESP_LOGI(TAG, "Frames end after %d ms idle, up to %d per publish on %s, QoS %d", CONFIG_MQTT_FRAME_GAP_MS,
+             CONFIG_MQTT_BATCH_FRAMES, CONFIG_MQTT_PUB_TOPIC, CONFIG_MQTT_QOS);
+#else
+    ESP_LOGI(TAG, "Frames end with 0x%02X, up to %d per publish on %s, QoS %d", CONFIG_MQTT_FRAME_DELIMITER,
+             CONFIG_MQTT_BATCH_FRAMES, CONFIG_MQTT_PUB_TOPIC, CONFIG_MQTT_QOS);
+#endif
+    xTaskCreatePinnedToCore(mqtt_uart_task, "mqtt_uart", 3072, NULL, 5, NULL, BRIDGE_TASK_CORE);
+}
+
+void mqtt_bridge_get_stats(mqtt_bridge_stats_t *stats)
+{
+    portENTER_CRITICAL(&mq.lock);
+    *stats = mq.stats;
+    portEXIT_CRITICAL(&mq.lock);
+}
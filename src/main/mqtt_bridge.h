@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef MQTT_BRIDGE_H
+#define MQTT_BRIDGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/uart.h"
+
+// Outbound queue, every frame is stored with its 16 bit length
+#define MQTT_BRIDGE_QUEUE_SZ    (CONFIG_MQTT_QUEUE_KB * 1024)
+// Largest publish payload, the frames of a batch with their lengths
+#define MQTT_BRIDGE_BATCH_SZ    (CONFIG_MQTT_BATCH_FRAMES > 1 ? \
+                                 CONFIG_MQTT_BATCH_FRAMES * (2 + CONFIG_MQTT_FRAME_MAX) : CONFIG_MQTT_FRAME_MAX)
+
+typedef struct {
+    bool     connected;
+    uint32_t connects;          // broker connections made, the first one included
+    uint32_t frames;            // UART frames queued
+    uint32_t dropped;           // frames dropped, queue full
+    uint32_t split;             // frames cut at the largest frame size
+    uint32_t publishes;         // publishes sent, resent ones included
+    uint32_t resent;            // publishes sent again after a reconnect
+    uint32_t acked;             // QoS 1 publishes acknowledged
+    uint32_t queued_bytes;      // queue in use, acknowledged data is released
+    uint32_t queued_max;        // queue high water mark
+    uint32_t inflight;
+    uint32_t ack_us_avg;        // publish to acknowledge
+    uint32_t ack_us_max;
+    uint32_t rx_messages;       // messages of the subscribed topic written to the UART
+    uint64_t rx_bytes;
+} mqtt_bridge_stats_t;
+
+/** Start framing the UART data and the MQTT client on the already installed UART driver */
+void mqtt_bridge_create(uart_port_t uart);
+
+void mqtt_bridge_get_stats(mqtt_bridge_stats_t *stats);
+
+#endif // MQTT_BRIDGE_H
@@ -0,0 +1,464 @@
+/* Multiplexed channel port
+
+   One TCP connection carries the data of every UART and a control channel, see
+   mux_server.h for the framing. A single task services the connection: frames
+   received are parsed in place, data is copied into the per channel buffer the
+   client has credit for and passed on to the UART from there, UART data is read
+   straight into the send buffer behind a frame header. Credit bounds the data in
+   flight per channel in both directions, so a stalled UART or a client not reading
+   one channel never blocks the others and the bridge never has to buffer more than
+   it granted.
+
+   The bridge UART is taken through the same session arbitration as the bridge
+   port, the second UART belongs to the mux port only.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_check.h"
+
+#include "lwip/sockets.h"
+
+#include "mux_server.h"
+#include "tcp_server.h"
+#include "mem_arena.h"
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+
+#define CREDIT          CONFIG_MUX_CHANNEL_CREDIT
+#define RX_BUF_SZ       MUX_SERVER_BUF_SZ
+#define TX_BUF_SZ       MUX_SERVER_BUF_SZ
+// Room kept in the send buffer so any control request can be answered
+#define CTL_REPLY_MAX   (MUX_HDR_LEN + MUX_MAX_CHANNELS * 13)
+#define CREDIT_FRAME    (MUX_HDR_LEN + 4)
+
+// Room left in the UART TX ring buffer for the header the driver stores with every write
+#define UART_TX_HDR_MARGIN 32
+
+static const char *TAG = "mux_server";
+
+struct mux_channel {
+    uart_port_t uart;
+    bool        tx_buffered;        // the driver has a TX buffer, otherwise the FIFO is filled directly
+    uint16_t    rd;                 // data for the UART in ring
+    uint16_t    used;
+    uint32_t    credit_ret;         // bytes passed to the UART, credit not returned yet
+    uint32_t    credit_out;         // bytes the client accepts from the UART
+    uint8_t    *ring;               // CREDIT bytes
+};
+
+static struct {
+    uint16_t           port;
+    uint8_t            channels;
+    struct mux_channel ch[MUX_MAX_CHANNELS];
+    uint8_t           *rx;
+    size_t             rx_len;
+    uint8_t           *tx;
+    size_t             tx_len;
+    mux_server_stats_t stats;
+} mux;
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/** Append a frame header to the send buffer, returns where the payload goes or NULL if it does not fit */
+static uint8_t *frame_reserve(uint8_t ch, uint8_t type, size_t len)
+{
+    if (TX_BUF_SZ - mux.tx_len < MUX_HDR_LEN + len)
+        return NULL;
+    uint8_t *p = mux.tx + mux.tx_len;
+    p[0] = ch;
+    p[1] = type;
+    put_be16(p + 2, len);
+    return p + MUX_HDR_LEN;
+}
+
+/** Complete the frame started by frame_reserve with its final length */
+static void frame_commit(size_t len)
+{
+    put_be16(mux.tx + mux.tx_len + 2, len);
+    mux.tx_len += MUX_HDR_LEN + len;
+}
+
+static bool frame_add(uint8_t ch, uint8_t type, const void *payload, size_t len)
+{
+    uint8_t *p = frame_reserve(ch, type, len);
+    if (!p)
+        return false;
+    memcpy(p, payload, len);
+    frame_commit(len);
+    return true;
+}
+
+static int handle_control(uint8_t type, const uint8_t *p, uint16_t len)
+{
+    switch (type) {
+    case MUX_CTL_LINE: {
+        if (len != 5)
+            return MUX_ERR_FRAME;
+        if (p[0] < 1 || p[0] > mux.channels)
+            return MUX_ERR_CHANNEL;
+        uart_port_t const uart = mux.ch[p[0] - 1].uart;
+        uint32_t baud = get_be32(p + 1);
+        // The bridge UART goes through the bridge so the line timing follows the rate
+        esp_err_t const err = !baud ? ESP_OK :
+                              p[0] == 1 ? tcp_server_set_baud_rate(baud) : uart_set_baudrate(uart, baud);
+        if (err != ESP_OK)
+            ESP_LOGW(TAG, "Channel %d: baud rate %lu refused", p[0], (unsigned long)baud);
+        baud = 0;
+        uart_get_baudrate(uart, &baud);
+        uint8_t reply[5] = { p[0] };
+        put_be32(reply + 1, baud);
+        frame_add(MUX_CH_CONTROL, MUX_CTL_LINE, reply, sizeof(reply));
+        return 0;
+    }
+    case MUX_CTL_STATS: {
+        uint8_t *r = frame_reserve(MUX_CH_CONTROL, MUX_CTL_STATS, mux.channels * 13);
+        for (int i = 0; i < mux.channels; i++, r += 13) {
+            mux_channel_stats_t const *st = &mux.stats.ch[i];
+            r[0] = i + 1;
+            put_be32(r + 1, st->to_uart_bytes);
+            put_be32(r + 5, st->from_uart_bytes);
+            put_be32(r + 9, st->stalls);
+        }
+        frame_commit(mux.channels * 13);
+        return 0;
+    }
+    default:
+        return MUX_ERR_CHANNEL;
+    }
+}
+
+static int handle_frame(uint8_t ch, uint8_t type, const uint8_t *p, uint16_t len)
+{
+    if (ch == MUX_CH_CONTROL)
+        return handle_control(type, p, len);
+    if (ch > mux.channels)
+        return MUX_ERR_CHANNEL;
+    struct mux_channel *c = &mux.ch[ch - 1];
+
+    switch (type) {
+    case MUX_DATA: {
+        // What was granted and is neither buffered nor written without credit returned
+        if (len > CREDIT - c->used - c->credit_ret)
+            return MUX_ERR_CREDIT;
+        uint16_t const wr = (c->rd + c->used) % CREDIT;
+        uint16_t const first = MIN(len, CREDIT - wr);
+        memcpy(c->ring + wr, p, first);
+        memcpy(c->ring, p + first, len - first);
+        c->used += len;
+        return 0;
+    }
+    case MUX_CREDIT:
+        if (len != 4)
+            return MUX_ERR_FRAME;
+        c->credit_out += get_be32(p);
+        return 0;
+    default:
+        return MUX_ERR_CHANNEL;
+    }
+}
+
+/** Handle complete frames received while there is room for replies, returns an error code or 0 */
+static int parse_frames(void)
+{
+    size_t off = 0;
+    int err = 0;
+    while (mux.rx_len - off >= MUX_HDR_LEN && TX_BUF_SZ - mux.tx_len >= CTL_REPLY_MAX) {
+        uint8_t const *f = mux.rx + off;
+        uint16_t const len = f[2] << 8 | f[3];
+        if (len > MUX_MAX_PAYLOAD) {
+            err = MUX_ERR_FRAME;
+            break;
+        }
+        if (mux.rx_len - off < MUX_HDR_LEN + len)
+            break;
+        err = handle_frame(f[0], f[1], f + MUX_HDR_LEN, len);
+        if (err)
+            break;
+        off += MUX_HDR_LEN + len;
+    }
+    mux.rx_len -= off;
+    memmove(mux.rx, mux.rx + off, mux.rx_len);
+    return err;
+}
+
+static int uart_write_nonblock(struct mux_channel *c, const uint8_t *data, size_t len)
+{
+    if (!c->tx_buffered)
+        return uart_tx_chars(c->uart, (const char *)data, len);
+    size_t room = 0;
+    uart_get_tx_buffer_free_size(c->uart, &room);
+    if (room <= UART_TX_HDR_MARGIN)
+        return 0;
+    return uart_write_bytes(c->uart, data, MIN(len, room - UART_TX_HDR_MARGIN));
+}
+
+/** Pass buffered data to the UART and return credit for it, true if anything moved */
+static bool channel_to_uart(uint8_t ch, struct mux_channel *c)
+{
+    bool moved = false;
+    if (c->used) {
+        int const written = uart_write_nonblock(c, c->ring + c->rd, MIN(c->used, CREDIT - c->rd));
+        if (written > 0) {
+            c->rd = (c->rd + written) % CREDIT;
+            c->used -= written;
+            c->credit_ret += written;
+            mux.stats.ch[ch - 1].to_uart_bytes += written;
+            moved = true;
+        }
+    }
+    // Credit goes back in batches unless the buffer ran empty
+    if (c->credit_ret && (c->credit_ret >= CREDIT / 2 || !c->used)) {
+        uint8_t credit[4];
+        put_be32(credit, c->credit_ret);
+        if (frame_add(ch, MUX_CREDIT, credit, sizeof(credit)))
+            c->credit_ret = 0;
+    }
+    return moved;
+}
+
+/** Read UART data as far as the client has credit for it, true if anything moved */
+static bool uart_to_channel(uint8_t ch, struct mux_channel *c)
+{
+    size_t avail = 0;
+    uart_get_buffered_data_len(c->uart, &avail);
+    if (!avail)
+        return false;
+    if (!c->credit_out) {
+        mux.stats.ch[ch - 1].stalls++;
+        return false;
+    }
+    // Keep room for the credit frames and control replies
+    size_t const room = TX_BUF_SZ - mux.tx_len;
+    if (room <= MUX_HDR_LEN + CTL_REPLY_MAX + MUX_MAX_CHANNELS * CREDIT_FRAME)
+        return false;
+    size_t const len = MIN(MIN(avail, c->credit_out),
+                           MIN(MUX_MAX_PAYLOAD, room - MUX_HDR_LEN - CTL_REPLY_MAX - MUX_MAX_CHANNELS * CREDIT_FRAME));
+    uint8_t *p = frame_reserve(ch, MUX_DATA, len);
+    int const got = uart_read_bytes(c->uart, p, len, 0);
+    if (got <= 0)
+        return false;
+    frame_commit(got);
+    c->credit_out -= got;
+    mux.stats.ch[ch - 1].from_uart_bytes += got;
+    return true;
+}
+
+/** Send what the buffer holds without blocking, false if the connection failed */
+static bool flush_tx(int sock)
+{
+    if (!mux.tx_len)
+        return true;
+    int const sent = send(sock, mux.tx, mux.tx_len, 0);
+    if (sent < 0)
+        return errno == EWOULDBLOCK;
+    mux.tx_len -= sent;
+    memmove(mux.tx, mux.tx + sent, mux.tx_len);
+    return true;
+}
+
+/** Tell the client why the connection is about to be closed */
+static void send_error(int sock, uint8_t code)
+{
+    mux.tx_len = 0;
+    frame_add(MUX_CH_CONTROL, MUX_CTL_ERROR, &code, 1);
+    for (int i = 0; i < 10 && mux.tx_len && flush_tx(sock); i++)
+        vTaskDelay(1);
+}
+
+static void mux_session(int sock)
+{
+    mux.rx_len = mux.tx_len = 0;
+    for (int i = 0; i < mux.channels; i++) {
+        struct mux_channel *c = &mux.ch[i];
+        c->rd = c->used = 0;
+        c->credit_ret = c->credit_out = 0;
+        // Stale data belongs to nobody
+        uart_flush_input(c->uart);
+    }
+    uint8_t hello[6] = { MUX_VERSION, mux.channels };
+    put_be32(hello + 2, CREDIT);
+    frame_add(MUX_CH_CONTROL, MUX_CTL_HELLO, hello, sizeof(hello));
+
+    for (;;) {
+        bool idle = true;
+        if (tcp_server_session_dropped()) {
+            ESP_LOGW(TAG, "Link down, session dropped");
+            break;
+        }
+        if (mux.rx_len < RX_BUF_SZ) {
+            int const len = recv(sock, mux.rx + mux.rx_len, RX_BUF_SZ - mux.rx_len, 0);
+            if (len < 0) {
+                if (errno != EWOULDBLOCK) {
+                    ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
+                    break;
+                }
+            } else if (len == 0) {
+                ESP_LOGW(TAG, "Connection closed");
+                break;
+            } else {
+                mux.rx_len += len;
+                idle = false;
+            }
+        }
+        int const err = parse_frames();
+        if (err) {
+            ESP_LOGW(TAG, "Protocol error %d, closing", err);
+            mux.stats.protocol_errors++;
+            send_error(sock, err);
+            break;
+        }
+        for (int i = 0; i < mux.channels; i++) {
+            if (channel_to_uart(i + 1, &mux.ch[i]))
+                idle = false;
+            if (uart_to_channel(i + 1, &mux.ch[i]))
+                idle = false;
+        }
+        size_t const pending = mux.tx_len;
+        if (!flush_tx(sock)) {
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            break;
+        }
+        if (mux.tx_len != pending)
+            idle = false;
+#if CONFIG_POWER_MGMT_ENABLE
+        if (!idle)
+            power_mgmt_busy();
+#endif
+        if (idle)
+            vTaskDelay(1);
+    }
+}
+
+static void mux_server_task(void *pvParameters)
+{
+    struct sockaddr_in dest_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(mux.port),
+    };
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    if (bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    if (listen(listen_sock, 1) != 0) {
+        ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    ESP_LOGI(TAG, "Mux port %d, %d channel(s)", mux.port, mux.channels);
+
+    for (;;) {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+            break;
+        }
+        int keepIdle = CONFIG_EXAMPLE_KEEPALIVE_IDLE;
+        int keepInterval = CONFIG_EXAMPLE_KEEPALIVE_INTERVAL;
+        int keepCount = CONFIG_EXAMPLE_KEEPALIVE_COUNT;
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+        struct sockaddr_in local_addr;
+        socklen_t addr_len = sizeof(local_addr);
+        if (tcp_server_session_claim(getsockname(sock, (struct sockaddr *)&local_addr, &addr_len) == 0 ?
+                                     local_addr.sin_addr.s_addr : 0)) {
+            // A rate the client set on the bridge channel lasts for its session only
+            int const baud = tcp_server_baud_rate();
+            mux.stats.sessions++;
+            mux_session(sock);
+            if (tcp_server_baud_rate() != baud)
+                tcp_server_set_baud_rate(baud);
+            tcp_server_session_release();
+        } else {
+            ESP_LOGW(TAG, "UART is in use by another session");
+            send_error(sock, MUX_ERR_BUSY);
+        }
+        shutdown(sock, 0);
+        close(sock);
+    }
+
+CLEAN_UP:
+    close(listen_sock);
+    vTaskDelete(NULL);
+}
+
+#if CONFIG_MUX_UART2_ENABLE
+static esp_err_t uart2_init(void)
+{
+    uart_config_t uart_config = {
+        .baud_rate = CONFIG_MUX_UART2_BITRATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+    };
+    ESP_RETURN_ON_ERROR(uart_param_config(UART_NUM_2, &uart_config), TAG, "uart_param_config failed");
+    ESP_RETURN_ON_ERROR(uart_set_pin(UART_NUM_2, CONFIG_MUX_UART2_TX_GPIO, CONFIG_MUX_UART2_RX_GPIO,
+                                     UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE), TAG, "uart_set_pin failed");
+    ESP_RETURN_ON_ERROR(uart_driver_install(UART_NUM_2, MUX_UART2_BUF_SZ, MUX_UART2_BUF_SZ, 0, NULL, BRIDGE_UART_INTR_FLAGS), TAG,
+                        "uart_driver_install failed");
+    return ESP_OK;
+}
+#endif
+
+void mux_server_start(uart_port_t uart)
+{
+    uint8_t *const rings = mem_arena_get(MEM_MUX_CREDIT);
+    mux.port = CONFIG_MUX_PORT;
+    mux.rx = mem_arena_get(MEM_MUX_RX);
+    mux.tx = mem_arena_get(MEM_MUX_TX);
+    mux.ch[0].ring = rings;
+    mux.ch[0].uart = uart;
+    mux.ch[0].tx_buffered = CONFIG_UART_TX_BUFF_SIZE > 0;
+    mux.channels = 1;
+#if CONFIG_MUX_UART2_ENABLE
+    // Installed from the bridge core, its interrupt is allocated there
+    if (uart2_init() == ESP_OK) {
+        mux.ch[1].uart = UART_NUM_2;
+        mux.ch[1].ring = rings + CREDIT;
+        mux.ch[1].tx_buffered = true;
+        mux.channels = 2;
+    }
+#endif
+    mux.stats.channels = mux.channels;
+    xTaskCreatePinnedToCore(mux_server_task, "mux_server", 4096, NULL, 5, NULL, BRIDGE_TASK_CORE);
+}
+
+void mux_server_get_stats(mux_server_stats_t *stats)
+{
+    *stats = mux.stats;
+}
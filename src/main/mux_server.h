@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef MUX_SERVER_H
+#define MUX_SERVER_H
+
+#include <stdint.h>
+#include "driver/uart.h"
+
+/*
+   Mux protocol, every frame is [channel][type][length, 16 bit big endian][payload].
+
+   Channel 0 carries control frames, channel 1 is the bridge UART and channel 2 the
+   second UART if enabled. Data goes in MUX_DATA frames of at most MUX_MAX_PAYLOAD
+   bytes. Either side may send data on a channel only as far as the other side has
+   granted credit with MUX_CREDIT frames (32 bit big endian increment), so a channel
+   that is not drained never holds the others back.
+
+   On connection the bridge sends MUX_CTL_HELLO with the protocol version, the
+   number of UART channels and the initial credit every channel has for data sent
+   to the bridge; it returns credit as the data is passed to the UART. Data from
+   the UARTs flows only after the client grants credit for it.
+*/
+#define MUX_VERSION         1
+#define MUX_HDR_LEN         4
+#define MUX_MAX_PAYLOAD     1024
+#define MUX_CH_CONTROL      0
+#define MUX_MAX_CHANNELS    2
+
+// Receive and send buffer size, room for two full frames each
+#define MUX_SERVER_BUF_SZ   (2 * (MUX_HDR_LEN + MUX_MAX_PAYLOAD))
+// UART driver buffer in each direction of the second UART
+#define MUX_UART2_BUF_SZ    4096
+
+// Frame types on every channel
+#define MUX_DATA            0x00
+#define MUX_CREDIT          0x01
+
+// Control channel frame types
+#define MUX_CTL_HELLO       0x10    // -> version, channels, credit (32 bit)
+#define MUX_CTL_LINE        0x11    // <- channel, baud rate (32 bit, 0 to query) -> channel, baud rate
+#define MUX_CTL_STATS       0x12    // <- empty -> per channel: channel, to UART, from UART, stalls (32 bit each)
+#define MUX_CTL_ERROR       0x1F    // -> error code, sent before the bridge closes the connection
+
+// Error codes
+#define MUX_ERR_FRAME       1       // malformed frame
+#define MUX_ERR_CHANNEL     2       // no such channel or type
+#define MUX_ERR_CREDIT      3       // data beyond the granted credit
+#define MUX_ERR_BUSY        4       // the bridge UART is held by another session
+
+typedef struct {
+    uint64_t to_uart_bytes;
+    uint64_t from_uart_bytes;
+    uint32_t stalls;            // passes with UART data held back for lack of credit
+} mux_channel_stats_t;
+
+typedef struct {
+    uint32_t            sessions;
+    uint32_t            protocol_errors;
+    uint8_t             channels;
+    mux_channel_stats_t ch[MUX_MAX_CHANNELS];
+} mux_server_stats_t;
+
+/** Start the mux listener, uart is the already installed bridge UART */
+void mux_server_start(uart_port_t uart);
+
+void mux_server_get_stats(mux_server_stats_t *stats);
+
+#endif // MUX_SERVER_H
@@ -0,0 +1,356 @@
+/* Firmware update over Ethernet
+
+   The image is written to the inactive OTA partition while it is being received,
+   sector by sector, so there is neither a long erase up front nor a copy of the
+   whole image in RAM. Writing runs in the web server task (upload) or in its own
+   task (pull) at priority below the bridge tasks.
+
+   A pulled image is fetched over https checked against the certificate bundle and
+   has to match the SHA-256 given with the request, it is read back from the
+   partition and hashed before the new boot partition is selected.
+*/
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_ota_ops.h"
+#include "esp_https_ota.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+
+#include "ota_update.h"
+
+#define OTA_BUF_SZ          4096
+#define OTA_RECV_RETRIES    5
+#define OTA_URL_MAX         256
+#define OTA_REBOOT_DELAY_MS 2000
+
+static const char *TAG = "ota";
+
+static char ota_buf[OTA_BUF_SZ];
+static char ota_url[OTA_URL_MAX];
+static char ota_sha256[65];
+static ota_stats_t ota_stats;
+static int64_t ota_started_at;
+static portMUX_TYPE ota_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t verify_timer;
+
+static bool ota_claim(void)
+{
+    bool claimed = false;
+    portENTER_CRITICAL(&ota_lock);
+    if (ota_stats.state != OTA_STATE_RUNNING) {
+        memset(&ota_stats, 0, sizeof(ota_stats));
+        ota_stats.state = OTA_STATE_RUNNING;
+        claimed = true;
+    }
+    portEXIT_CRITICAL(&ota_lock);
+    if (claimed)
+        ota_started_at = esp_timer_get_time();
+    return claimed;
+}
+
+static void ota_progress(uint32_t bytes)
+{
+    ota_stats.bytes = bytes;
+    ota_stats.duration_ms = (esp_timer_get_time() - ota_started_at) / 1000;
+    if (ota_stats.duration_ms)
+        ota_stats.throughput = (uint64_t)bytes * 1000 / ota_stats.duration_ms;
+}
+
+static void ota_finish(esp_err_t err)
+{
+    ota_stats.last_error = err;
+    ota_stats.state = err == ESP_OK ? OTA_STATE_DONE : OTA_STATE_FAILED;
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Update done, %lu bytes in %lu ms (%lu bytes/s)", (unsigned long)ota_stats.bytes,
+                 (unsigned long)ota_stats.duration_ms, (unsigned long)ota_stats.throughput);
+    } else {
+        ESP_LOGE(TAG, "Update failed: %s", esp_err_to_name(err));
+    }
+}
+
+static bool ota_authorized(httpd_req_t *req)
+{
+    const char *expected = CONFIG_OTA_AUTH_TOKEN;
+    size_t const len = strlen(expected);
+    char token[64] = "";
+    if (!len || httpd_req_get_hdr_value_str(req, "X-OTA-Token", token, sizeof(token)) != ESP_OK)
+        return false;
+    // Constant time, the comparison must not tell how many bytes matched
+    uint8_t diff = strlen(token) != len;
+    for (size_t i = 0; i < len; i++)
+        diff |= token[i % sizeof(token)] ^ expected[i];
+    return diff == 0;
+}
+
+static bool ota_check_request(httpd_req_t *req)
+{
+    if (!ota_authorized(req)) {
+        httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Invalid update token");
+        return false;
+    }
+    if (!ota_claim()) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Update already in progress");
+        return false;
+    }
+    return true;
+}
+
+/** True if expected is the hex string of digest, any case */
+static bool digest_matches(const uint8_t digest[32], const char *expected)
+{
+    char actual[65];
+    for (int i = 0; i < 32; i++)
+        sprintf(actual + 2 * i, "%02x", digest[i]);
+    return !strcasecmp(actual, expected);
+}
+
+static void ota_reboot(void)
+{
+    vTaskDelay(OTA_REBOOT_DELAY_MS / portTICK_PERIOD_MS);
+    esp_restart();
+}
+
+esp_err_t ota_upload_handler(httpd_req_t *req)
+{
+    if (!ota_check_request(req))
+        return ESP_OK;
+
+    // Optional SHA-256 of the whole image file as hex string
+    char expected[65] = "";
+    httpd_req_get_hdr_value_str(req, "X-Image-SHA256", expected, sizeof(expected));
+
+    const esp_partition_t *part = esp_ota_get_next_update_partition(NULL);
+    esp_ota_handle_t handle = 0;
+    esp_err_t err = part ? esp_ota_begin(part, OTA_WITH_SEQUENTIAL_WRITES, &handle) : ESP_ERR_NOT_FOUND;
+    if (err != ESP_OK) {
+        ota_finish(err);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to start update");
+        return ESP_OK;
+    }
+    ESP_LOGI(TAG, "Receiving %d bytes to partition %s", (int)req->content_len, part->label);
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    size_t received = 0;
+    int retries = 0;
+    while (received < req->content_len) {
+        int const len = httpd_req_recv(req, ota_buf, MIN(req->content_len - received, OTA_BUF_SZ));
+        if (len == HTTPD_SOCK_ERR_TIMEOUT && ++retries < OTA_RECV_RETRIES)
+            continue;
+        if (len <= 0) {
+            err = ESP_ERR_TIMEOUT;
+            break;
+        }
+        retries = 0;
+        mbedtls_sha256_update(&sha, (const unsigned char *)ota_buf, len);
+        err = esp_ota_write(handle, ota_buf, len);
+        if (err != ESP_OK)
+            break;
+        received += len;
+        ota_progress(received);
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    if (err == ESP_OK && !received)
+        err = ESP_ERR_INVALID_SIZE;
+    if (err == ESP_OK && expected[0] && !digest_matches(digest, expected))
+        err = ESP_ERR_INVALID_CRC;
+    if (err != ESP_OK) {
+        esp_ota_abort(handle);
+    } else {
+        // Validates the image including the SHA-256 digest appended by the build
+        err = esp_ota_end(handle);
+    }
+    if (err == ESP_OK)
+        err = esp_ota_set_boot_partition(part);
+    ota_finish(err);
+
+    if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                            err == ESP_ERR_INVALID_CRC ? "Image hash mismatch" : "Update failed");
+        return ESP_OK;
+    }
+    char tmp[128];
+    snprintf(tmp, sizeof(tmp), "Update done, %lu bytes in %lu ms (%lu bytes/s). Rebooting...",
+             (unsigned long)ota_stats.bytes, (unsigned long)ota_stats.duration_ms, (unsigned long)ota_stats.throughput);
+    httpd_resp_sendstr(req, tmp);
+    ota_reboot();
+    return ESP_OK;
+}
+
+/** Hash the len bytes of image written to part, ESP_ERR_INVALID_CRC if they do not match ota_sha256 */
+static esp_err_t check_written_image(const esp_partition_t *part, size_t len)
+{
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    esp_err_t err = ESP_OK;
+    for (size_t off = 0; off < len && err == ESP_OK; off += OTA_BUF_SZ) {
+        size_t const n = MIN(len - off, OTA_BUF_SZ);
+        err = esp_partition_read(part, off, ota_buf, n);
+        if (err == ESP_OK)
+            mbedtls_sha256_update(&sha, (const unsigned char *)ota_buf, n);
+    }
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    if (err == ESP_OK && !digest_matches(digest, ota_sha256))
+        err = ESP_ERR_INVALID_CRC;
+    return err;
+}
+
+static void ota_pull_task(void *pvParameters)
+{
+    esp_http_client_config_t http_config = {
+        .url = ota_url,
+        .timeout_ms = 10000,
+        .buffer_size = OTA_BUF_SZ,
+        .keep_alive_enable = true,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+    };
+    esp_https_ota_config_t ota_config = {
+        .http_config = &http_config,
+    };
+    esp_https_ota_handle_t handle = NULL;
+
+    ESP_LOGI(TAG, "Downloading %s", ota_url);
+    esp_err_t err = esp_https_ota_begin(&ota_config, &handle);
+    if (err == ESP_OK) {
+        while ((err = esp_https_ota_perform(handle)) == ESP_ERR_HTTPS_OTA_IN_PROGRESS)
+            ota_progress(esp_https_ota_get_image_len_read(handle));
+        if (err == ESP_OK && !esp_https_ota_is_complete_data_received(handle))
+            err = ESP_ERR_INVALID_SIZE;
+        if (err == ESP_OK) {
+            int const len = esp_https_ota_get_image_len_read(handle);
+            ota_progress(len);
+            err = check_written_image(esp_ota_get_next_update_partition(NULL), len);
+            if (err != ESP_OK)
+                ESP_LOGE(TAG, "Image does not match the given SHA-256");
+        }
+        if (err == ESP_OK) {
+            // Validates the image and selects the new boot partition
+            err = esp_https_ota_finish(handle);
+        } else {
+            esp_https_ota_abort(handle);
+        }
+    }
+    ota_finish(err);
+    if (err == ESP_OK)
+        ota_reboot();
+    vTaskDelete(NULL);
+}
+
+static void url_decode(char *s)
+{
+    char *out = s;
+    for (; *s; s++) {
+        if (*s == '%' && s[1] && s[2]) {
+            char hex[3] = { s[1], s[2], 0 };
+            *out++ = strtol(hex, NULL, 16);
+            s += 2;
+        } else {
+            *out++ = *s == '+' ? ' ' : *s;
+        }
+    }
+    *out = '\0';
+}
+
+esp_err_t ota_pull_handler(httpd_req_t *req)
+{
+    char buf[OTA_URL_MAX + 96];     // url and sha256 form fields
+    int const len = httpd_req_recv(req, buf, MIN(req->content_len, sizeof(buf) - 1));
+    if (len <= 0) {
+        if (len == HTTPD_SOCK_ERR_TIMEOUT)
+            httpd_resp_send_408(req);
+        return ESP_FAIL;
+    }
+    buf[len] = '\0';
+
+    if (!ota_authorized(req)) {
+        httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Invalid update token");
+        return ESP_OK;
+    }
+    char url[OTA_URL_MAX];
+    if (httpd_query_key_value(buf, "url", url, sizeof(url)) != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing url");
+        return ESP_OK;
+    }
+    // The image is only taken if it is the one the requester expects
+    char sha256[sizeof(ota_sha256)];
+    if (httpd_query_key_value(buf, "sha256", sha256, sizeof(sha256)) != ESP_OK ||
+        strlen(sha256) != 64 || strspn(sha256, "0123456789abcdefABCDEF") != 64) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Missing or invalid sha256");
+        return ESP_OK;
+    }
+    if (!ota_claim()) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Update already in progress");
+        return ESP_OK;
+    }
+    url_decode(url);
+    strcpy(ota_url, url);
+    strcpy(ota_sha256, sha256);
+
+    if (xTaskCreate(ota_pull_task, "ota_pull", 8192, NULL, CONFIG_WEBSERVER_TASK_PRIORITY, NULL) != pdPASS) {
+        ota_finish(ESP_ERR_NO_MEM);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to start update");
+        return ESP_OK;
+    }
+    httpd_resp_set_status(req, "202 Accepted");
+    return httpd_resp_sendstr(req, "Update started, see /stats for progress");
+}
+
+#if CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+static void verify_timeout(void *arg)
+{
+    ESP_LOGE(TAG, "New firmware was not confirmed, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+#endif
+
+void ota_update_init(void)
+{
+#if CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK ||
+        state != ESP_OTA_IMG_PENDING_VERIFY)
+        return;
+
+    ESP_LOGW(TAG, "Running new firmware, it will be confirmed once network is up");
+    const esp_timer_create_args_t args = {
+        .callback = verify_timeout,
+        .name = "ota_verify",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&args, &verify_timer));
+    ESP_ERROR_CHECK(esp_timer_start_once(verify_timer, CONFIG_OTA_VERIFY_TIMEOUT * 1000000LL));
+#endif
+}
+
+void ota_update_confirm(void)
+{
+    if (!verify_timer)
+        return;
+    esp_timer_stop(verify_timer);
+    esp_timer_delete(verify_timer);
+    verify_timer = NULL;
+    esp_ota_mark_app_valid_cancel_rollback();
+    ESP_LOGI(TAG, "New firmware confirmed");
+}
+
+void ota_update_get_stats(ota_stats_t *stats)
+{
+    *stats = ota_stats;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef OTA_UPDATE_H
+#define OTA_UPDATE_H
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+typedef enum {
+    OTA_STATE_IDLE,
+    OTA_STATE_RUNNING,
+    OTA_STATE_DONE,
+    OTA_STATE_FAILED,
+} ota_state_t;
+
+typedef struct {
+    ota_state_t state;
+    uint32_t    bytes;          // image bytes written so far
+    uint32_t    duration_ms;
+    uint32_t    throughput;     // average write rate, bytes/s
+    esp_err_t   last_error;
+} ota_stats_t;
+
+/** Arm the rollback timer if running freshly updated firmware */
+void ota_update_init(void);
+
+/** Network is up, keep the running firmware */
+void ota_update_confirm(void);
+
+/** POST /ota - firmware image in the request body */
+esp_err_t ota_upload_handler(httpd_req_t *req);
+
+/** POST /ota/pull - download the firmware image from url=... form field */
+esp_err_t ota_pull_handler(httpd_req_t *req);
+
+void ota_update_get_stats(ota_stats_t *stats);
+
+#endif // OTA_UPDATE_H
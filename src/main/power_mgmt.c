@@ -0,0 +1,144 @@
+/* Power management
+
+   The CPU runs at 80 MHz while nothing moves and at the configured CPU frequency
+   while bridge data does: the data paths call power_mgmt_busy(), which takes a
+   CPU_FREQ_MAX lock on the first byte after a quiet period, and a timer releases
+   it once no data has moved for the hold time. The APB clock stays at 80 MHz at
+   both frequencies, so the UART baud rate and the EMAC are not disturbed.
+
+   With light sleep the chip sleeps whenever no lock is held and no task is ready,
+   which is only allowed while no Ethernet link is up: a sleeping chip does not
+   receive frames. The internal EMAC driver holds a lock of its own while started,
+   so light sleep only happens with SPI Ethernet modules. Edges on the UART RX line
+   wake the chip; the characters that do the waking are lost, the following ones
+   are received as usual and keep it awake through power_mgmt_busy().
+*/
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+
+#include "power_mgmt.h"
+
+static const char *TAG = "power_mgmt";
+
+#define HOLD_TICKS pdMS_TO_TICKS(CONFIG_POWER_MGMT_HOLD_MS)
+
+static struct {
+    esp_pm_lock_handle_t cpu_lock;      // full clock while data moves
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+    esp_pm_lock_handle_t sleep_lock;    // no light sleep while a link is up
+#endif
+    TimerHandle_t        hold;
+    portMUX_TYPE         lock;          // protects busy, busy_since, the counters and sleep_lock
+    volatile bool        busy;
+    volatile TickType_t  last_busy;
+    int64_t              busy_since;
+    power_mgmt_stats_t   stats;
+} pm = { .lock = portMUX_INITIALIZER_UNLOCKED };
+
+/** Hold time over, release the clock unless data moved meanwhile */
+static void hold_expired(TimerHandle_t timer)
+{
+    TickType_t const quiet = xTaskGetTickCount() - pm.last_busy;
+    if (quiet < HOLD_TICKS) {
+        xTimerChangePeriod(timer, HOLD_TICKS - quiet, 0);
+        return;
+    }
+    portENTER_CRITICAL(&pm.lock);
+    pm.stats.full_clock_us += esp_timer_get_time() - pm.busy_since;
+    pm.busy = false;
+    portEXIT_CRITICAL(&pm.lock);
+    esp_pm_lock_release(pm.cpu_lock);
+}
+
+void power_mgmt_busy(void)
+{
+    pm.last_busy = xTaskGetTickCount();
+    if (pm.busy || !pm.hold)
+        return;
+    portENTER_CRITICAL(&pm.lock);
+    bool const wake = !pm.busy;
+    if (wake) {
+        pm.busy = true;
+        pm.busy_since = esp_timer_get_time();
+        pm.stats.wakeups++;
+    }
+    portEXIT_CRITICAL(&pm.lock);
+    if (!wake)
+        return;
+    esp_pm_lock_acquire(pm.cpu_lock);
+    xTimerChangePeriod(pm.hold, HOLD_TICKS, portMAX_DELAY);
+}
+
+void power_mgmt_link(bool up)
+{
+    portENTER_CRITICAL(&pm.lock);
+    if (up) {
+        pm.stats.links_up++;
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+        if (pm.sleep_lock && pm.stats.links_up == 1)
+            esp_pm_lock_acquire(pm.sleep_lock);
+#endif
+    } else if (pm.stats.links_up) {
+        pm.stats.links_up--;
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+        if (pm.sleep_lock && !pm.stats.links_up)
+            esp_pm_lock_release(pm.sleep_lock);
+#endif
+    }
+    portEXIT_CRITICAL(&pm.lock);
+}
+
+esp_err_t power_mgmt_start(uart_port_t uart)
+{
+    ESP_RETURN_ON_ERROR(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "bridge_busy", &pm.cpu_lock),
+                        TAG, "esp_pm_lock_create failed");
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+    esp_pm_lock_handle_t sleep_lock;
+    ESP_RETURN_ON_ERROR(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "eth_link", &sleep_lock),
+                        TAG, "esp_pm_lock_create failed");
+    // Links may have come up before, the lock and the count change together
+    portENTER_CRITICAL(&pm.lock);
+    pm.sleep_lock = sleep_lock;
+    if (pm.stats.links_up)
+        esp_pm_lock_acquire(pm.sleep_lock);
+    portEXIT_CRITICAL(&pm.lock);
+    ESP_RETURN_ON_ERROR(uart_set_wakeup_threshold(uart, CONFIG_POWER_MGMT_UART_WAKE_EDGES),
+                        TAG, "uart_set_wakeup_threshold failed");
+    ESP_RETURN_ON_ERROR(esp_sleep_enable_uart_wakeup(uart), TAG, "esp_sleep_enable_uart_wakeup failed");
+#endif
+
+    esp_pm_config_t const config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_MGMT_MIN_FREQ_MHZ,
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+        .light_sleep_enable = true,
+#endif
+    };
+    ESP_RETURN_ON_ERROR(esp_pm_configure(&config), TAG, "esp_pm_configure failed");
+
+    pm.hold = xTimerCreate("pm_hold", HOLD_TICKS, pdFALSE, NULL, hold_expired);
+    ESP_RETURN_ON_FALSE(pm.hold, ESP_ERR_NO_MEM, TAG, "xTimerCreate failed");
+
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+    const char *const sleep = ", light sleep while no link is up";
+#else
+    const char *const sleep = "";
+#endif
+    ESP_LOGI(TAG, "CPU clock %d-%d MHz, full clock held %d ms after data moved%s",
+             POWER_MGMT_MIN_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, CONFIG_POWER_MGMT_HOLD_MS, sleep);
+    return ESP_OK;
+}
+
+void power_mgmt_get_stats(power_mgmt_stats_t *out)
+{
+    portENTER_CRITICAL(&pm.lock);
+    *out = pm.stats;
+    if (pm.busy)
+        out->full_clock_us += esp_timer_get_time() - pm.busy_since;
+    portEXIT_CRITICAL(&pm.lock);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#ifndef POWER_MGMT_H
+#define POWER_MGMT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "driver/uart.h"
+
+// Lowest CPU clock, the APB clock the UART baud rate and the EMAC run from stays at 80 MHz down to it
+#define POWER_MGMT_MIN_FREQ_MHZ 80
+
+typedef struct {
+    uint32_t wakeups;           // full clock periods started by data moving
+    uint64_t full_clock_us;     // time spent at full clock, the running period included
+    uint32_t links_up;          // Ethernet ports with link, light sleep is held off while any is up
+} power_mgmt_stats_t;
+
+/** Enable frequency scaling, and light sleep with wake on UART activity if configured */
+esp_err_t power_mgmt_start(uart_port_t uart);
+
+/**
+ * Data moved on a bridge path: keep the CPU at full clock until none has moved
+ * for CONFIG_POWER_MGMT_HOLD_MS. Cheap enough to call on every pass of a loop.
+ */
+void power_mgmt_busy(void);
+
+/** Ethernet link change of one port */
+void power_mgmt_link(bool up);
+
+void power_mgmt_get_stats(power_mgmt_stats_t *stats);
+
+#endif // POWER_MGMT_H
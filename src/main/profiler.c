@@ -0,0 +1,206 @@
+/* Task profiler
+
+   A low priority task takes a FreeRTOS system state snapshot every sampling period
+   and turns the run time counters into per task and per core CPU load. Per core
+   load is kept for the last PROFILER_HISTORY periods so it can be averaged over
+   sliding windows. All buffers are static and sized by the task limit, so the
+   sampling cost grows only with the number of tasks; it is measured on every pass.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "profiler.h"
+
+#define MAX_TASKS         CONFIG_PROFILER_MAX_TASKS
+#define PERIOD_MS         CONFIG_PROFILER_PERIOD_MS
+#define PROFILER_HISTORY  60
+
+static const char *TAG = "profiler";
+
+static const uint8_t windows[PROFILER_WINDOWS] = { 1, 10, PROFILER_HISTORY };
+
+struct task_sample {
+    char     name[configMAX_TASK_NAME_LEN];
+    uint32_t number;            // unique task number to match tasks between samples
+    uint64_t run_time;
+    uint16_t load;              // share of one core in 0.1 % over the last period
+    uint32_t stack_free;        // stack high water mark, bytes never used
+    uint8_t  priority;
+    int8_t   core;              // -1 if not pinned
+};
+
+static struct {
+    SemaphoreHandle_t  lock;    // protects tasks, task_cnt and stats
+    TaskStatus_t       status[MAX_TASKS];
+    struct task_sample tasks[MAX_TASKS];
+    struct task_sample prev[MAX_TASKS];
+    uint16_t           task_cnt;
+    uint16_t           prev_cnt;
+    uint64_t           prev_total;
+    uint64_t           prev_idle[portNUM_PROCESSORS];
+    uint16_t           history[PROFILER_HISTORY][portNUM_PROCESSORS];
+    uint8_t            history_pos;
+    uint8_t            history_len;
+    uint64_t           sample_total_us;
+    profiler_stats_t   stats;
+} prof;
+
+static uint64_t prev_run_time(uint32_t number)
+{
+    for (int i = 0; i < prof.prev_cnt; i++) {
+        if (prof.prev[i].number == number)
+            return prof.prev[i].run_time;
+    }
+    return 0;
+}
+
+static uint16_t permille(uint64_t part, uint64_t whole)
+{
+    if (!whole)
+        return 0;
+    return part >= whole ? 1000 : part * 1000 / whole;
+}
+
+static void sample(void)
+{
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t const cnt = uxTaskGetSystemState(prof.status, MAX_TASKS, &total);
+    if (!cnt) {
+        ESP_LOGW(TAG, "More than %d tasks, increase the profiler task limit", MAX_TASKS);
+        return;
+    }
+    uint64_t const elapsed = total - prof.prev_total;
+    bool const first = !prof.prev_total;
+
+    memcpy(prof.prev, prof.tasks, prof.task_cnt * sizeof(prof.tasks[0]));
+    prof.prev_cnt = prof.task_cnt;
+
+    xSemaphoreTake(prof.lock, portMAX_DELAY);
+    for (int i = 0; i < cnt; i++) {
+        TaskStatus_t const *st = &prof.status[i];
+        struct task_sample *t = &prof.tasks[i];
+        strlcpy(t->name, st->pcTaskName, sizeof(t->name));
+        t->number = st->xTaskNumber;
+        t->run_time = st->ulRunTimeCounter;
+        t->load = first ? 0 : permille(t->run_time - prev_run_time(t->number), elapsed);
+        // Stack is counted in bytes on this port
+        t->stack_free = st->usStackHighWaterMark;
+        t->priority = st->uxCurrentPriority;
+        BaseType_t const core = xTaskGetCoreID(st->xHandle);
+        t->core = core == tskNO_AFFINITY ? -1 : core;
+    }
+    prof.task_cnt = cnt;
+
+    if (!first) {
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            uint64_t const idle = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+            prof.history[prof.history_pos][core] = 1000 - permille(idle - prof.prev_idle[core], elapsed);
+            prof.prev_idle[core] = idle;
+        }
+        prof.history_pos = (prof.history_pos + 1) % PROFILER_HISTORY;
+        if (prof.history_len < PROFILER_HISTORY)
+            prof.history_len++;
+
+        for (int core = 0; core < portNUM_PROCESSORS; core++) {
+            for (int w = 0; w < PROFILER_WINDOWS; w++) {
+                int const n = MIN(windows[w], prof.history_len);
+                uint32_t sum = 0;
+                for (int k = 1; k <= n; k++)
+                    sum += prof.history[(prof.history_pos + PROFILER_HISTORY - k) % PROFILER_HISTORY][core];
+                prof.stats.cores[core].load[w] = sum / n;
+            }
+        }
+    } else {
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+            prof.prev_idle[core] = ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core));
+    }
+    prof.stats.tasks = cnt;
+    xSemaphoreGive(prof.lock);
+    prof.prev_total = total;
+}
+
+static void profiler_task(void *pvParameters)
+{
+    int64_t const started = esp_timer_get_time();
+    TickType_t wake = xTaskGetTickCount();
+    for (;;) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(PERIOD_MS));
+        int64_t const t0 = esp_timer_get_time();
+        sample();
+        uint32_t const us = esp_timer_get_time() - t0;
+        prof.sample_total_us += us;
+        prof.stats.samples++;
+        prof.stats.sample_us = us;
+        prof.stats.sample_max_us = MAX(prof.stats.sample_max_us, us);
+        prof.stats.overhead = prof.sample_total_us * 10000 / (esp_timer_get_time() - started);
+    }
+}
+
+void profiler_start(void)
+{
+    prof.lock = xSemaphoreCreateMutex();
+    assert(prof.lock);
+    xTaskCreate(profiler_task, "profiler", 3072, NULL, 2, NULL);
+}
+
+void profiler_get_stats(profiler_stats_t *stats)
+{
+    if (!prof.lock) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(prof.lock, portMAX_DELAY);
+    *stats = prof.stats;
+    xSemaphoreGive(prof.lock);
+}
+
+esp_err_t profiler_get_handler(httpd_req_t *req)
+{
+    if (!prof.lock) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Profiler is not running");
+        return ESP_OK;
+    }
+    httpd_resp_set_type(req, "application/json");
+
+    // Format under the lock into a static buffer, then send without holding it
+    static char buf[128 + MAX_TASKS * (72 + configMAX_TASK_NAME_LEN)];
+    static const char *const win_names[PROFILER_WINDOWS] = { "1", "10", "60" };
+    size_t len = 0;
+
+    xSemaphoreTake(prof.lock, portMAX_DELAY);
+    len += snprintf(buf + len, sizeof(buf) - len, "{\"period_ms\":%d,\"samples\":%lu,\"sample_us\":%lu,"
+                    "\"sample_max_us\":%lu,\"overhead_pct\":%u.%02u,\"cores\":[",
+                    PERIOD_MS, (unsigned long)prof.stats.samples, (unsigned long)prof.stats.sample_us,
+                    (unsigned long)prof.stats.sample_max_us, prof.stats.overhead / 100, prof.stats.overhead % 100);
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s{", core ? "," : "");
+        for (int w = 0; w < PROFILER_WINDOWS; w++) {
+            uint16_t const load = prof.stats.cores[core].load[w];
+            len += snprintf(buf + len, sizeof(buf) - len, "%s\"load_%s\":%u.%u", w ? "," : "",
+                            win_names[w], load / 10, load % 10);
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, "}");
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "],\"tasks\":[");
+    for (int i = 0; i < prof.task_cnt && len < sizeof(buf); i++) {
+        struct task_sample const *t = &prof.tasks[i];
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        "%s{\"name\":\"%s\",\"prio\":%u,\"core\":%d,\"cpu\":%u.%u,\"stack_free\":%lu}",
+                        i ? "," : "", t->name, t->priority, t->core, t->load / 10, t->load % 10,
+                        (unsigned long)t->stack_free);
+    }
+    xSemaphoreGive(prof.lock);
+    if (len < sizeof(buf))
+        len += snprintf(buf + len, sizeof(buf) - len, "]}");
+
+    if (len >= sizeof(buf)) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Profile does not fit");
+        return ESP_OK;
+    }
+    return httpd_resp_send(req, buf, len);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_http_server.h"
+
+#define PROFILER_WINDOWS 3
+
+typedef struct {
+    uint16_t load[PROFILER_WINDOWS];    // CPU load in 0.1 % over 1, 10 and 60 sampling periods
+} profiler_core_t;
+
+typedef struct {
+    uint32_t        samples;
+    uint32_t        sample_us;          // duration of the last sampling pass
+    uint32_t        sample_max_us;
+    uint16_t        overhead;           // sampling time share of one core in 0.01 %
+    uint16_t        tasks;
+    profiler_core_t cores[portNUM_PROCESSORS];
+} profiler_stats_t;
+
+/** Start the sampling task */
+void profiler_start(void);
+
+void profiler_get_stats(profiler_stats_t *stats);
+
+/** GET /profile - per task CPU usage and stack high water marks as JSON */
+esp_err_t profiler_get_handler(httpd_req_t *req);
+
+#endif // PROFILER_H
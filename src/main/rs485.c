@@ -0,0 +1,208 @@
+/* RS-485 half duplex line
+
+   The UART driver runs in RS-485 half duplex mode with RTS driving the driver
+   enable (DE) input of the transceiver, so no auto direction transceiver is needed
+   and the bus is released right after the last stop bit.
+
+   Nothing waits for a transmission to leave the line. Its end is estimated from
+   the bytes written and the character time, and once the estimate has passed
+   the UART is asked, without blocking, whether it is done. When the transceiver
+   receiver stays enabled while transmitting (RE tied to ground) the own
+   transmission comes back on RX meanwhile. It is compared on the following reads
+   with a copy of the last bytes sent and dropped; a difference means another node
+   drove the bus at the same time. The UART also flags collisions it detects itself.
+
+   The turnaround guard covers the time the direction switch takes on either side:
+   bytes arriving right after the own transmission are line noise, and a new
+   transmission waits until the bus has been quiet for the guard time.
+
+   While waiting for the first byte after a transmission the RX FIFO threshold is
+   one byte, so its arrival time and the turnaround latency are precise.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_rom_sys.h"
+
+#include "rs485.h"
+
+#define GUARD_US           CONFIG_UART_RS485_GUARD_US
+#define RX_FULL_THRESH     120          // UART driver default
+#define TURNAROUND_MAX_US  1000000      // later bytes are not taken as a response
+#define SPIN_MAX_US        (portTICK_PERIOD_MS * 100)   // a tenth of a tick
+#define ECHO_BUF_SZ        256          // sent bytes kept for the echo comparison, older ones are not compared
+
+static const char *TAG = "rs485";
+
+static struct {
+    uart_port_t   uart;
+    int           baud_rate;
+    uint32_t      char_us;
+    int64_t       tx_done_at;           // end of the last transmission
+    int64_t       tx_end_at;            // expected end of the transmission in progress
+    int64_t       bus_busy_at;          // last time the bus was seen busy
+    bool          sending;              // own transmission in progress
+    bool          collision;            // echo differed during this transmission
+    bool          awaiting;             // no byte received since the last transmission
+    uint32_t      tx_seq;               // bytes written in this transmission
+    uint32_t      echo_seq;             // bytes received back so far
+    size_t        echo_left;            // bytes buffered at the end, still to be dropped as echo
+    uint8_t       echo_buf[ECHO_BUF_SZ];  // last bytes written, by their number
+    uint64_t      turnaround_sum;
+    rs485_stats_t stats;
+} rs;
+
+esp_err_t rs485_init(uart_port_t uart, int baud_rate)
+{
+    rs.uart = uart;
+    rs.baud_rate = baud_rate;
+    rs.char_us = (10 * 1000000 + baud_rate - 1) / baud_rate;
+    rs.stats.turnaround_min_us = UINT32_MAX;
+    ESP_RETURN_ON_ERROR(uart_set_mode(uart, UART_MODE_RS485_HALF_DUPLEX), TAG, "uart_set_mode failed");
+    ESP_LOGI(TAG, "Half duplex, turnaround guard %d us", GUARD_US);
+    return ESP_OK;
+}
+
+void rs485_set_baud_rate(int baud_rate)
+{
+    rs.baud_rate = baud_rate;
+    rs.char_us = (10 * 1000000 + baud_rate - 1) / baud_rate;
+}
+
+/** The whole echo has been compared, count the transmission as garbled if it differed */
+static void echo_done(void)
+{
+    bool collision = rs.collision;
+    uart_get_collision_flag(rs.uart, &collision);
+    if (collision || rs.collision) {
+        rs.stats.collisions++;
+        ESP_LOGW(TAG, "Collision on %lu byte frame", (unsigned long)rs.tx_seq);
+    }
+}
+
+/** End the transmission once its time is up and the UART has sent it all */
+static void tx_check(int64_t now)
+{
+    if (!rs.sending || now < rs.tx_end_at)
+        return;
+    if (uart_wait_tx_done(rs.uart, 0) != ESP_OK) {
+        // Started later than estimated, look again a character later
+        rs.tx_end_at = now + rs.char_us;
+        return;
+    }
+    rs.sending = false;
+    rs.tx_done_at = rs.bus_busy_at = now;
+    rs.stats.frames++;
+
+    // Whatever the driver holds now was received while the bus was ours. It drops
+    // what is still in the FIFO when the transmission ends.
+    uart_get_buffered_data_len(rs.uart, &rs.echo_left);
+    if (!rs.echo_left)
+        echo_done();
+
+    rs.awaiting = true;
+    uart_set_rx_full_threshold(rs.uart, 1);
+}
+
+bool rs485_tx_ready(void)
+{
+    int64_t const now = esp_timer_get_time();
+    tx_check(now);
+    // The bus is ours until the transmission ends, keep it going
+    if (rs.sending)
+        return true;
+    int64_t const left = rs.bus_busy_at + GUARD_US - now;
+    if (left <= 0)
+        return true;
+    if (left > SPIN_MAX_US)
+        return false;
+    esp_rom_delay_us(left);
+    return true;
+}
+
+bool rs485_tx_busy(void)
+{
+    tx_check(esp_timer_get_time());
+    return rs.sending;
+}
+
+void rs485_tx_start(const uint8_t *data, size_t len)
+{
+    int64_t const now = esp_timer_get_time();
+    if (!rs.sending) {
+        rs.sending = true;
+        rs.collision = false;
+        rs.tx_seq = rs.echo_seq = 0;
+        rs.tx_end_at = now;
+    }
+    // Behind what is still queued in the UART, 10 bits per byte
+    rs.tx_end_at = MAX(rs.tx_end_at, now) + (int64_t)len * 10000000 / rs.baud_rate;
+
+    for (size_t i = 0; i < len; i++, rs.tx_seq++)
+        rs.echo_buf[rs.tx_seq % ECHO_BUF_SZ] = data[i];
+}
+
+/** Compare the own bytes received back and drop them, returns how many of buf they are */
+static size_t echo_drop(const uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+    for (; n < len && (rs.sending || rs.echo_left); n++, rs.echo_seq++) {
+        if (rs.echo_left)
+            rs.echo_left--;
+        if (rs.echo_seq >= rs.tx_seq)
+            rs.collision = true;        // more came back than was sent
+        else if (rs.tx_seq - rs.echo_seq <= ECHO_BUF_SZ &&
+                 rs.echo_buf[rs.echo_seq % ECHO_BUF_SZ] != buf[n])
+            rs.collision = true;
+    }
+    rs.stats.echo_bytes += n;
+    if (n && !rs.sending && !rs.echo_left)
+        echo_done();
+    return n;
+}
+
+size_t rs485_rx(uint8_t *buf, size_t len)
+{
+    int64_t const now = esp_timer_get_time();
+    // Bytes read while the own transmission is on the line are its echo
+    size_t const echo = echo_drop(buf, len);
+    tx_check(now);
+    if (echo) {
+        len -= echo;
+        memmove(buf, buf + echo, len);
+    }
+    if (!len)
+        return 0;
+    rs.bus_busy_at = now;
+    if (!rs.awaiting)
+        return len;
+
+    uint32_t const since_tx = now - rs.tx_done_at;
+    if (since_tx < GUARD_US) {
+        rs.stats.noise_bytes += len;
+        return 0;
+    }
+    rs.awaiting = false;
+    uart_set_rx_full_threshold(rs.uart, RX_FULL_THRESH);
+    if (since_tx < TURNAROUND_MAX_US) {
+        // Arrival time is the end of the first byte
+        uint32_t const t = since_tx > rs.char_us ? since_tx - rs.char_us : 0;
+        rs.stats.turnarounds++;
+        rs.stats.turnaround_us = t;
+        rs.stats.turnaround_min_us = MIN(rs.stats.turnaround_min_us, t);
+        rs.stats.turnaround_max_us = MAX(rs.stats.turnaround_max_us, t);
+        rs.turnaround_sum += t;
+        rs.stats.turnaround_avg_us = rs.turnaround_sum / rs.stats.turnarounds;
+    }
+    return len;
+}
+
+void rs485_get_stats(rs485_stats_t *stats)
+{
+    *stats = rs.stats;
+    if (!stats->turnarounds)
+        stats->turnaround_min_us = 0;
+}
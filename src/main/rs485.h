@@ -0,0 +1,50 @@
+#pragma once
+
+#ifndef RS485_H
+#define RS485_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "driver/uart.h"
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t frames;            // transmissions
+    uint32_t collisions;        // transmissions garbled on the bus
+    uint32_t echo_bytes;        // own bytes received back and dropped
+    uint32_t noise_bytes;       // bytes dropped within the turnaround guard
+    uint32_t turnarounds;       // first bytes received after a transmission
+    uint32_t turnaround_us;     // last time from the end of transmission to the first byte received
+    uint32_t turnaround_min_us;
+    uint32_t turnaround_max_us;
+    uint32_t turnaround_avg_us;
+} rs485_stats_t;
+
+/** Switch the configured UART to half duplex RS-485 with RTS driving the transceiver DE input */
+esp_err_t rs485_init(uart_port_t uart, int baud_rate);
+
+/** Follow a baud rate change of the UART, the character time sizes the collision check */
+void rs485_set_baud_rate(int baud_rate);
+
+/**
+ * True if a transmission may start now or continue the one in progress. Waits for
+ * remainders of the turnaround guard up to a tenth of a tick.
+ */
+bool rs485_tx_ready(void);
+
+/**
+ * Note data just written to the UART, does not wait for it to leave the line. Its
+ * echo is compared and dropped by the following rs485_rx() calls.
+ */
+void rs485_tx_start(const uint8_t *data, size_t len);
+
+/** True while the own transmission is on the line, takes its end once it is over */
+bool rs485_tx_busy(void);
+
+/** Pass received data through, drops line noise after own transmission, returns the bytes left in buf */
+size_t rs485_rx(uint8_t *buf, size_t len);
+
+void rs485_get_stats(rs485_stats_t *stats);
+
+#endif // RS485_H
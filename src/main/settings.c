@@ -1,23 +1,170 @@
+#include <string.h>
+#include <stddef.h>
 #include "settings.h"
 #include "nvs_flash.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
 
 static const char *TAG = "settings";
 static const char *NVS_NAMESPACE = "bridge_cfg";
+static const char *NVS_RECORD_KEY = "settings";
 
-esp_err_t load_settings(settings_t *settings) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+// Keys used before settings were stored as one record
+static const char *const LEGACY_KEYS[] = {
+    "baud_rate", "tcp_port", "use_static_ip", "ip_addr", "netmask", "gateway", "dns1", "dns2"
+};
+
+#define RECORD_MAGIC   0x5342   // "BS"
+#define RECORD_VERSION 1
+
+// The separate keys are still written along with the record, see settings_release_legacy()
+#define RECORD_FLAG_LEGACY_KEPT 0x01
+
+/*
+ * Settings record stored as a single NVS blob. New fields are only ever appended
+ * to the payload, so a record written by other firmware version is read up to the
+ * fields both versions know, the rest is set to defaults.
+ */
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t  version;       // version of the firmware layout which wrote the record
+    uint8_t  flags;
+    uint16_t length;        // payload length
+    uint32_t crc;           // CRC32 of the payload
+} record_header_t;
+
+typedef struct __attribute__((packed)) {
+    // version 1
+    int32_t  uart_baud_rate;
+    int32_t  tcp_port;
+    uint8_t  use_static_ip;
+    char     ip_addr[16];
+    char     netmask[16];
+    char     gateway[16];
+    char     dns1[16];
+    char     dns2[16];
+} record_payload_t;
+
+typedef struct __attribute__((packed)) {
+    record_header_t  hdr;
+    record_payload_t payload;
+} settings_record_t;
+
+static settings_t cached;
+static bool cached_valid;
+static bool legacy_kept;
+static settings_stats_t load_stats;
+
+static void default_settings(settings_t *settings) {
+    memset(settings, 0, sizeof(*settings));
+    settings->uart_baud_rate = DEFAULT_UART_BAUD_RATE;
+    settings->tcp_port = DEFAULT_TCP_PORT;
+}
+
+static void copy_str(char *dst, const char *src, size_t size) {
+    memcpy(dst, src, size);
+    dst[size - 1] = '\0';
+}
+
+static void record_from_settings(settings_record_t *rec, const settings_t *settings) {
+    memset(rec, 0, sizeof(*rec));
+    record_payload_t *p = &rec->payload;
+    p->uart_baud_rate = settings->uart_baud_rate;
+    p->tcp_port = settings->tcp_port;
+    p->use_static_ip = settings->use_static_ip;
+    copy_str(p->ip_addr, settings->ip_addr, sizeof(p->ip_addr));
+    copy_str(p->netmask, settings->netmask, sizeof(p->netmask));
+    copy_str(p->gateway, settings->gateway, sizeof(p->gateway));
+    copy_str(p->dns1, settings->dns1, sizeof(p->dns1));
+    copy_str(p->dns2, settings->dns2, sizeof(p->dns2));
+    rec->hdr.magic = RECORD_MAGIC;
+    rec->hdr.version = RECORD_VERSION;
+    rec->hdr.flags = legacy_kept ? RECORD_FLAG_LEGACY_KEPT : 0;
+    rec->hdr.length = sizeof(*p);
+    rec->hdr.crc = esp_rom_crc32_le(0, (const uint8_t *)p, sizeof(*p));
+}
+
+/** Fields beyond the stored payload length keep their defaults */
+#define RECORD_HAS(len, field) ((len) >= offsetof(record_payload_t, field) + sizeof(((record_payload_t *)0)->field))
+
+static void settings_from_record(settings_t *settings, const record_payload_t *p, size_t len) {
+    default_settings(settings);
+    if (RECORD_HAS(len, uart_baud_rate))
+        settings->uart_baud_rate = p->uart_baud_rate;
+    if (RECORD_HAS(len, tcp_port))
+        settings->tcp_port = p->tcp_port;
+    if (RECORD_HAS(len, use_static_ip))
+        settings->use_static_ip = p->use_static_ip;
+    if (RECORD_HAS(len, ip_addr))
+        copy_str(settings->ip_addr, p->ip_addr, sizeof(settings->ip_addr));
+    if (RECORD_HAS(len, netmask))
+        copy_str(settings->netmask, p->netmask, sizeof(settings->netmask));
+    if (RECORD_HAS(len, gateway))
+        copy_str(settings->gateway, p->gateway, sizeof(settings->gateway));
+    if (RECORD_HAS(len, dns1))
+        copy_str(settings->dns1, p->dns1, sizeof(settings->dns1));
+    if (RECORD_HAS(len, dns2))
+        copy_str(settings->dns2, p->dns2, sizeof(settings->dns2));
+}
+
+/** Read the settings record, fails if there is none or it is damaged */
+static esp_err_t load_record(nvs_handle_t nvs_handle, settings_t *settings) {
+    // Room for a longer payload written by newer firmware
+    uint8_t buf[sizeof(record_header_t) + 2 * sizeof(record_payload_t)];
+    size_t size = sizeof(buf);
+    esp_err_t err = nvs_get_blob(nvs_handle, NVS_RECORD_KEY, buf, &size);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
         return err;
     }
 
+    record_header_t hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (size < sizeof(hdr) || hdr.magic != RECORD_MAGIC || hdr.length > size - sizeof(hdr)) {
+        ESP_LOGE(TAG, "Invalid settings record");
+        return ESP_ERR_INVALID_SIZE;
+    }
+    const uint8_t *payload = buf + sizeof(hdr);
+    if (esp_rom_crc32_le(0, payload, hdr.length) != hdr.crc) {
+        ESP_LOGE(TAG, "Settings record CRC mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+    if (hdr.version != RECORD_VERSION) {
+        ESP_LOGW(TAG, "Settings record version %d, converting to %d", hdr.version, RECORD_VERSION);
+    }
+    record_payload_t p = { 0 };
+    memcpy(&p, payload, hdr.length < sizeof(p) ? hdr.length : sizeof(p));
+    settings_from_record(settings, &p, hdr.length);
+    legacy_kept = hdr.flags & RECORD_FLAG_LEGACY_KEPT;
+    return ESP_OK;
+}
+
+static esp_err_t save_record(nvs_handle_t nvs_handle, const settings_t *settings) {
+    settings_record_t rec;
+    record_from_settings(&rec, settings);
+    // The blob replaces the previous record in one write
+    esp_err_t err = nvs_set_blob(nvs_handle, NVS_RECORD_KEY, &rec, sizeof(rec));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error writing settings record: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = nvs_commit(nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error committing NVS changes: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+/**
+ * Read the separate keys of older firmware over settings, returns ESP_ERR_NVS_NOT_FOUND
+ * if there are none
+ */
+static esp_err_t load_legacy_settings(nvs_handle_t nvs_handle, settings_t *settings) {
     int32_t uart_baud_rate = 0;
-    err = nvs_get_i32(nvs_handle, "baud_rate", &uart_baud_rate);
+    esp_err_t err = nvs_get_i32(nvs_handle, "baud_rate", &uart_baud_rate);
     if (err == ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGW(TAG, "Baud rate not found in NVS, using default");
-        settings->uart_baud_rate = DEFAULT_UART_BAUD_RATE;
+        // Always written by older firmware, nothing was saved if it is missing
+        return err;
     } else if (err == ESP_OK) {
         settings->uart_baud_rate = uart_baud_rate;
     } else {
@@ -109,70 +256,124 @@ esp_err_t load_settings(settings_t *settings) {
         settings->dns2[0] = '\0';
     }
 
-    nvs_close(nvs_handle);
     return ESP_OK;
 }
 
-esp_err_t save_settings(const settings_t *settings) {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+/** Write the separate keys so older firmware finds the current settings */
+static esp_err_t save_legacy_settings(nvs_handle_t nvs_handle, const settings_t *settings) {
+    esp_err_t err = nvs_set_i32(nvs_handle, "baud_rate", settings->uart_baud_rate);
+    if (err == ESP_OK)
+        err = nvs_set_i32(nvs_handle, "tcp_port", settings->tcp_port);
+    if (err == ESP_OK)
+        err = nvs_set_i32(nvs_handle, "use_static_ip", settings->use_static_ip);
+    if (err == ESP_OK)
+        err = nvs_set_str(nvs_handle, "ip_addr", settings->ip_addr);
+    if (err == ESP_OK)
+        err = nvs_set_str(nvs_handle, "netmask", settings->netmask);
+    if (err == ESP_OK)
+        err = nvs_set_str(nvs_handle, "gateway", settings->gateway);
+    if (err == ESP_OK)
+        err = nvs_set_str(nvs_handle, "dns1", settings->dns1);
+    if (err == ESP_OK)
+        err = nvs_set_str(nvs_handle, "dns2", settings->dns2);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
-        return err;
+        ESP_LOGE(TAG, "Error writing settings of older firmware: %s", esp_err_to_name(err));
     }
+    return err;
+}
 
-    err = nvs_set_i32(nvs_handle, "baud_rate", settings->uart_baud_rate);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error setting baud rate in NVS: %s", esp_err_to_name(err));
+static void erase_legacy_settings(nvs_handle_t nvs_handle) {
+    for (int i = 0; i < sizeof(LEGACY_KEYS) / sizeof(LEGACY_KEYS[0]); i++) {
+        nvs_erase_key(nvs_handle, LEGACY_KEYS[i]);
     }
+    nvs_commit(nvs_handle);
+}
 
-    err = nvs_set_i32(nvs_handle, "tcp_port", settings->tcp_port);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error setting TCP port in NVS: %s", esp_err_to_name(err));
+esp_err_t load_settings(settings_t *settings) {
+    if (cached_valid) {
+        *settings = cached;
+        return ESP_OK;
     }
 
-    // Save static IP config
-    err = nvs_set_i32(nvs_handle, "use_static_ip", settings->use_static_ip);
+    int64_t const started = esp_timer_get_time();
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error setting use_static_ip in NVS: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        default_settings(settings);
+        return err;
     }
 
-    if (settings->ip_addr[0] != '\0') {
-        err = nvs_set_str(nvs_handle, "ip_addr", settings->ip_addr);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error setting ip_addr in NVS: %s", esp_err_to_name(err));
+    err = load_record(nvs_handle, settings);
+    if (err == ESP_OK) {
+        load_stats.source = SETTINGS_SOURCE_RECORD;
+        // Older firmware may have run after a rollback and changed the keys since
+        if (legacy_kept && load_legacy_settings(nvs_handle, settings) == ESP_OK) {
+            save_record(nvs_handle, settings);
         }
-    }
-    if (settings->netmask[0] != '\0') {
-        err = nvs_set_str(nvs_handle, "netmask", settings->netmask);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error setting netmask in NVS: %s", esp_err_to_name(err));
+    } else {
+        default_settings(settings);
+        if (load_legacy_settings(nvs_handle, settings) == ESP_OK) {
+            // The keys stay until this firmware is confirmed, a rollback still finds them
+            ESP_LOGI(TAG, "Converting settings to single record");
+            legacy_kept = true;
+            save_record(nvs_handle, settings);
+            load_stats.source = SETTINGS_SOURCE_LEGACY;
+        } else {
+            ESP_LOGW(TAG, "No settings in NVS, using defaults");
+            load_stats.source = SETTINGS_SOURCE_DEFAULTS;
         }
     }
-    if (settings->gateway[0] != '\0') {
-        err = nvs_set_str(nvs_handle, "gateway", settings->gateway);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error setting gateway in NVS: %s", esp_err_to_name(err));
-        }
+    nvs_close(nvs_handle);
+
+    load_stats.load_us = esp_timer_get_time() - started;
+    ESP_LOGI(TAG, "Settings loaded in %lu us", (unsigned long)load_stats.load_us);
+    cached = *settings;
+    cached_valid = true;
+    return ESP_OK;
+}
+
+esp_err_t save_settings(const settings_t *settings) {
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return err;
     }
-    if (settings->dns1[0] != '\0') {
-        err = nvs_set_str(nvs_handle, "dns1", settings->dns1);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error setting dns1 in NVS: %s", esp_err_to_name(err));
-        }
+    if (legacy_kept) {
+        err = save_legacy_settings(nvs_handle, settings);
     }
-    if (settings->dns2[0] != '\0') {
-        err = nvs_set_str(nvs_handle, "dns2", settings->dns2);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Error setting dns2 in NVS: %s", esp_err_to_name(err));
-        }
+    if (err == ESP_OK) {
+        err = save_record(nvs_handle, settings);
+    }
+    nvs_close(nvs_handle);
+    if (err == ESP_OK) {
+        cached = *settings;
+        cached_valid = true;
     }
+    return err;
+}
 
-    err = nvs_commit(nvs_handle);
+void settings_release_legacy(void) {
+    if (!legacy_kept || !cached_valid) {
+        return;
+    }
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs_handle);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error committing NVS changes: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Error opening NVS handle: %s", esp_err_to_name(err));
+        return;
+    }
+    // Keys first, a record still flagged finds them gone and the release is repeated
+    erase_legacy_settings(nvs_handle);
+    legacy_kept = false;
+    if (save_record(nvs_handle, &cached) != ESP_OK) {
+        legacy_kept = true;
     }
-
     nvs_close(nvs_handle);
-    return err;
+    ESP_LOGI(TAG, "Settings of older firmware dropped");
+}
+
+void settings_get_stats(settings_stats_t *stats) {
+    *stats = load_stats;
 }
@@ -1,6 +1,7 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
+#include <stdint.h>
 #include "esp_err.h"
 
 #define DEFAULT_UART_BAUD_RATE CONFIG_UART_BITRATE
@@ -18,10 +19,32 @@ typedef struct {
     char dns2[16];
 } settings_t;
 
+typedef enum {
+    SETTINGS_SOURCE_DEFAULTS,
+    SETTINGS_SOURCE_RECORD,     // single settings record
+    SETTINGS_SOURCE_LEGACY,     // separate keys of older firmware, converted to record
+} settings_source_t;
+
+typedef struct {
+    settings_source_t source;
+    uint32_t load_us;           // time spent reading NVS at boot
+} settings_stats_t;
+
+/** Read settings from NVS on the first call, later calls return the copy kept in RAM */
 esp_err_t load_settings(settings_t *settings);
+/** Write all settings at once, either the old or the new settings are kept on power loss */
 esp_err_t save_settings(const settings_t *settings);
+/**
+ * Settings converted from the separate keys of older firmware keep those keys up to
+ * date, so a rollback to that firmware still finds them. Drop them once this
+ * firmware is known to work.
+ */
+void settings_release_legacy(void);
+void settings_get_stats(settings_stats_t *stats);
 
 void start_webserver(void);
+/** Start the web server with /stats and firmware update only, no configuration pages */
+void start_service_webserver(void);
 void stop_webserver(void);
 
 #endif // SETTINGS_H
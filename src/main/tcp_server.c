@@ -28,6 +28,37 @@
 
 #include "settings.h"
 #include "tcp_server.h"
+#include "modbus_gw.h"
+#if CONFIG_BRIDGE_MODE_MQTT
+#include "mqtt_bridge.h"
+#endif
+#include "token_bucket.h"
+#include "mem_arena.h"
+#if CONFIG_UART_DMA_ENABLE
+#include "uart_dma.h"
+#else
+#include "uart_events.h"
+#endif
+#if CONFIG_UART_LINE_RS485
+#include "rs485.h"
+#endif
+#if CONFIG_WS_BRIDGE_ENABLE
+#include "ws_bridge.h"
+#endif
+#if CONFIG_MUX_ENABLE
+#include "mux_server.h"
+#endif
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+#if CONFIG_ADMISSION_ENABLE
+#include "admission.h"
+#endif
+#if CONFIG_BRIDGE_TRANSPORT_NETCONN
+#include "lwip/api.h"
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#endif
 
 #define KEEPALIVE_IDLE              CONFIG_EXAMPLE_KEEPALIVE_IDLE
 #define KEEPALIVE_INTERVAL          CONFIG_EXAMPLE_KEEPALIVE_INTERVAL
@@ -38,68 +69,319 @@ static const char *TAG = "bridge_eth";
 struct server_port;
 typedef void (*sock_handler_t)(int, struct server_port*);
 
-#define BUFF_SZ 4096
+// Room left in the UART TX ring buffer for the header the driver stores with every write
+#define UART_TX_HDR_MARGIN 32
 
 struct server_port {
     uint16_t       port;
     sock_handler_t handler;
     uart_port_t    uart;
-    char           buff[BUFF_SZ];
+    token_bucket_t shaper;
+    const char    *rx_data;  // UART -> Eth data, in buff or in the DMA buffer
+    int            rx_len;
+    int            rx_off;
+    int            tx_len;   // Eth -> UART data waiting in tx_buff
+    int            tx_off;
+    char          *buff;     // placed by the arena, NULL with DMA
+    char          *tx_buff;  // NULL with netconn, data is written from the pbufs
+#if CONFIG_BRIDGE_TRANSPORT_NETCONN
+    int            ring_head; // where the next UART data goes in buff
+#endif
+#if CONFIG_ADMISSION_ENABLE
+    int            listen_sock;
+    int            pending_sock; // trusted peer to serve next, -1 if none
+    bool           trusted;      // the peer being served is trusted
+#endif
 };
 
+static tcp_server_stats_t stats;
+static portMUX_TYPE session_lock = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool session_active;
+static volatile bool session_drop;   // tear the session down, its link is gone
+static uint32_t session_local_ip;
+static int loopback_saved_baud;      // baud rate to restore, 0 while the UART is not looped back
+#if CONFIG_ADMISSION_ENABLE
+static volatile bool session_trusted;
+#endif
+
+#if !CONFIG_UART_DMA_ENABLE
+/** Pass data to the UART driver without blocking, returns the number of bytes accepted */
+static int uart_write_nonblock(uart_port_t uart, const char *data, size_t len)
+{
+#if CONFIG_UART_TX_BUFF_SIZE
+    size_t room = 0;
+    uart_get_tx_buffer_free_size(uart, &room);
+    if (room <= UART_TX_HDR_MARGIN)
+        return 0;
+    return uart_write_bytes(uart, data, MIN(len, room - UART_TX_HDR_MARGIN));
+#else
+    // No driver TX buffer, fill the hardware FIFO directly
+    return uart_tx_chars(uart, data, len);
+#endif
+}
+#endif
+
+#if !CONFIG_BRIDGE_TRANSPORT_NETCONN
+/** Make the following close() reset the connection instead of waiting for the peer */
+static void sock_abort(int sock)
+{
+#if CONFIG_LWIP_SO_LINGER
+    struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+#endif
+}
+
+#if CONFIG_ADMISSION_ENABLE
+// Listen backlog, connections coming in while a session runs are checked from the bridge loop
+#define ADMISSION_BACKLOG       4
+// How often a running session looks at the connections waiting
+#define ADMISSION_POLL_TICKS    MAX(1, pdMS_TO_TICKS(100))
+// Most connections taken per look, so a flood cannot keep the session from being serviced
+#define ADMISSION_DRAIN_MAX     16
+#define FIRST_BYTE_TICKS        MAX(1, pdMS_TO_TICKS(CONFIG_ADMISSION_FIRST_BYTE_TIMEOUT))
+// Longest wait for a preempted session to hand the UART over
+#define PREEMPT_WAIT_TICKS      MAX(1, pdMS_TO_TICKS(2000))
+
+/** Make an untrusted session (bridge, WebSocket or mux) give the UART up for a trusted peer */
+static void session_preempt(void)
+{
+    if (!session_active || session_trusted)
+        return;
+    ESP_LOGW(TAG, "Trusted peer, dropping the session holding the UART");
+    stats.preempted++;
+    session_drop = true;
+    for (TickType_t waited = 0; session_active && waited < PREEMPT_WAIT_TICKS; waited++)
+        vTaskDelay(1);
+}
+
+/**
+ * Take the connections waiting while a session runs, the listen socket does not
+ * block. A trusted peer is kept in srv->pending_sock to be served next, anyone
+ * else is refused at once rather than left in the backlog. True if the running
+ * session has to give way.
+ */
+static bool check_waiting(struct server_port *srv)
+{
+    for (int i = 0; i < ADMISSION_DRAIN_MAX; i++) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int const sock = accept(srv->listen_sock, (struct sockaddr *)&addr, &addr_len);
+        if (sock < 0)
+            return false;
+        admission_t const verdict = admission_check(addr.sin_addr.s_addr);
+        if (verdict == ADMISSION_TRUSTED && !session_trusted) {
+            srv->pending_sock = sock;
+            return true;
+        }
+        if (verdict == ADMISSION_ACCEPT || verdict == ADMISSION_TRUSTED)
+            stats.rejected++;
+        sock_abort(sock);
+        close(sock);
+    }
+    return false;
+}
+#endif
+
 static void do_bridge(int sock, struct server_port* srv)
 {
     ESP_ERROR_CHECK(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK));
-    gpio_set_level(CONFIG_BRIDGE_LED_GPIO, 1);
+    struct sockaddr_in local_addr;
+    socklen_t addr_len = sizeof(local_addr);
+#if CONFIG_ADMISSION_ENABLE
+    if (srv->trusted)
+        session_preempt();
+#endif
+    if (!tcp_server_session_claim(getsockname(sock, (struct sockaddr *)&local_addr, &addr_len) == 0 ?
+                                  local_addr.sin_addr.s_addr : 0)) {
+        ESP_LOGW(TAG, "UART is in use by another session");
+        sock_abort(sock);
+        return;
+    }
+    token_bucket_init(&srv->shaper, CONFIG_BRIDGE_TX_RATE_LIMIT, CONFIG_BRIDGE_TX_BURST);
+    srv->rx_len = srv->tx_len = 0;
+#if CONFIG_ADMISSION_ENABLE
+    session_trusted = srv->trusted;
+    TickType_t const started = xTaskGetTickCount();
+    TickType_t checked = started;
+#if CONFIG_ADMISSION_FIRST_BYTE_TIMEOUT
+    bool got_data = false;
+#endif
+#endif
+#if CONFIG_UART_DMA_ENABLE
+    uart_dma_set_waiter(xTaskGetCurrentTaskHandle());
+#endif
+    // Both directions are serviced in turn moving at most one buffer each time
+    // so a blocked direction never holds the other one back
     for (;;) {
         bool idle = true;
+        if (session_drop) {
+            ESP_LOGW(TAG, "Link down, session dropped");
+            sock_abort(sock);
+            break;
+        }
+#if CONFIG_ADMISSION_ENABLE
+        TickType_t const now = xTaskGetTickCount();
+#if CONFIG_ADMISSION_FIRST_BYTE_TIMEOUT
+        if (!session_trusted && !got_data && now - started >= FIRST_BYTE_TICKS) {
+            ESP_LOGW(TAG, "Nothing received within the first byte timeout, session dropped");
+            stats.first_byte_timeouts++;
+            sock_abort(sock);
+            break;
+        }
+#endif
+        if (now - checked >= ADMISSION_POLL_TICKS) {
+            checked = now;
+            if (check_waiting(srv)) {
+                ESP_LOGW(TAG, "Trusted peer waiting, session dropped");
+                stats.preempted++;
+                sock_abort(sock);
+                break;
+            }
+        }
+#endif
         // Read UART
-        for (;;) {
-            int size = uart_read_bytes(srv->uart, (uint8_t*)srv->buff, BUFF_SZ, idle ? 0 : 1);
+        if (!srv->rx_len) {
+#if CONFIG_UART_DMA_ENABLE
+            // Send straight from the DMA buffer, it is released once all of it is sent
+            int size = uart_dma_rx_peek((const uint8_t **)&srv->rx_data);
+#else
+            srv->rx_data = srv->buff;
+            int size = uart_read_bytes(srv->uart, (uint8_t*)srv->buff, BRIDGE_BUFF_SZ, 0);
+#endif
             if (size < 0) {
                 ESP_LOGE(TAG, "Uart read failed");
-                return;
-            }
-            if (!size)
                 break;
-
-            ESP_LOGI(TAG, "UART -> Eth  %d bytes", size);
-            char* ptr = srv->buff;
-            while (size > 0) {
-                int const written = send(sock, ptr, size, 0);
-                if (written < 0) {
+            }
+#if CONFIG_UART_LINE_RS485
+            size = rs485_rx((uint8_t*)srv->buff, size);
+#endif
+            srv->rx_len = size;
+            srv->rx_off = 0;
+            if (size)
+                ESP_LOGI(TAG, "UART -> Eth  %d bytes", size);
+        }
+        if (srv->rx_len) {
+            int const written = send(sock, srv->rx_data + srv->rx_off, srv->rx_len, 0);
+            if (written < 0) {
+                if (errno != EWOULDBLOCK) {
                     ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
                     break;
                 }
-                size -= written;
-                ptr  += written;
+            } else {
+                srv->rx_len -= written;
+                srv->rx_off += written;
+                stats.uart_to_eth_bytes += written;
+                idle = false;
+#if CONFIG_UART_DMA_ENABLE
+                if (!srv->rx_len)
+                    uart_dma_rx_consume(srv->rx_off);
+#endif
             }
-            idle = false;
         }
-        // Read Eth
-        int const rx_len = recv(sock, srv->buff, BUFF_SZ, 0);
-        if (rx_len < 0) {
-            if (errno != EWOULDBLOCK) {
-                ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
+        // Read Eth only when the previous chunk has been passed to the UART,
+        // TCP flow control holds the sender back meanwhile
+        if (!srv->tx_len) {
+#if CONFIG_UART_DMA_ENABLE
+            // Receive straight into a free DMA buffer, as much as the rate limit allows
+            uint32_t room;
+            char *dst = (char *)uart_dma_tx_acquire(&room);
+            room = dst ? MIN(room, token_bucket_available(&srv->shaper)) : 0;
+#else
+            char *dst = srv->tx_buff;
+            uint32_t const room = BRIDGE_BUFF_SZ;
+#endif
+            int const rx_len = room ? recv(sock, dst, room, 0) : 0;
+            if (!room) {
+                stats.tx_throttled++;
+            } else if (rx_len < 0) {
+                if (errno != EWOULDBLOCK) {
+                    ESP_LOGE(TAG, "Error occurred during receiving: errno %d", errno);
+                    break;
+                }
+            } else if (rx_len == 0) {
+                ESP_LOGW(TAG, "Connection closed");
                 break;
+            } else {
+                ESP_LOGI(TAG, "Eth -> UART %d bytes: %.*s", rx_len, rx_len, dst);
+#if CONFIG_ADMISSION_FIRST_BYTE_TIMEOUT
+                got_data = true;
+#endif
+#if CONFIG_UART_DMA_ENABLE
+                if (uart_dma_tx_commit(rx_len) != ESP_OK)
+                    break;
+                token_bucket_consume(&srv->shaper, rx_len);
+                stats.eth_to_uart_bytes += rx_len;
+                idle = false;
+#else
+                srv->tx_len = rx_len;
+                srv->tx_off = 0;
+#endif
             }
-        } else if (rx_len == 0) {
-            ESP_LOGW(TAG, "Connection closed");
-            break;
-        } else {
-            ESP_LOGI(TAG, "Eth -> UART %d bytes: %.*s", rx_len, rx_len, srv->buff);
-            uart_write_bytes(srv->uart, srv->buff, rx_len);
-            idle = false;
         }
-        if (idle)
+#if !CONFIG_UART_DMA_ENABLE
+        if (srv->tx_len) {
+            uint32_t allowed = MIN((uint32_t)srv->tx_len, token_bucket_available(&srv->shaper));
+#if CONFIG_UART_LINE_RS485
+            // Wait for the bus to be released by the other side
+            if (!rs485_tx_ready())
+                allowed = 0;
+#endif
+            int const written = allowed ? uart_write_nonblock(srv->uart, srv->tx_buff + srv->tx_off, allowed) : 0;
+            if (written > 0) {
+#if CONFIG_UART_LINE_RS485
+                rs485_tx_start((uint8_t*)srv->tx_buff + srv->tx_off, written);
+#endif
+                token_bucket_consume(&srv->shaper, written);
+                srv->tx_len -= written;
+                srv->tx_off += written;
+                stats.eth_to_uart_bytes += written;
+                idle = false;
+            } else {
+                stats.tx_throttled++;
+            }
+        }
+#endif
+#if CONFIG_POWER_MGMT_ENABLE
+        if (!idle)
+            power_mgmt_busy();
+#endif
+        if (idle) {
+#if CONFIG_UART_DMA_ENABLE
+            // DMA completions wake the task up early
+            ulTaskNotifyTake(pdTRUE, 1);
+#elif CONFIG_UART_LINE_RS485
+            if (rs485_tx_busy()) {
+                // Wake up as soon as the own transmission has left the line so its end
+                // is taken before a response can arrive
+                uart_wait_tx_done(srv->uart, 1);
+            } else if (!srv->rx_len) {
+                // Wait on the UART so the arrival of a response is timed without a tick delay
+                int const size = uart_read_bytes(srv->uart, (uint8_t*)srv->buff, 1, 1);
+                if (size > 0) {
+                    srv->rx_data = srv->buff;
+                    srv->rx_len = rs485_rx((uint8_t*)srv->buff, size);
+                    srv->rx_off = 0;
+                }
+            } else {
+                vTaskDelay(1);
+            }
+#else
             vTaskDelay(1);
+#endif
+        }
     }
+#if CONFIG_UART_DMA_ENABLE
+    do {
+        vTaskDelay(8);
+    } while (uart_dma_rx_flush());
+#else
     for (;;) {
-        int const left = uart_read_bytes(srv->uart, (uint8_t*)srv->buff, BUFF_SZ, 8);
+        int const left = uart_read_bytes(srv->uart, (uint8_t*)srv->buff, BRIDGE_BUFF_SZ, 8);
         if (left <= 0)
             break;
     }
-    gpio_set_level(CONFIG_BRIDGE_LED_GPIO, 0);
+#endif
+    tcp_server_session_release();
 }
 
 static void tcp_server_task(void *pvParameters)
@@ -137,11 +419,22 @@ static void tcp_server_task(void *pvParameters)
     }
     ESP_LOGI(TAG, "Socket bound, port %d", srv->port);
 
+#if CONFIG_ADMISSION_ENABLE
+    admission_init();
+    srv->listen_sock = listen_sock;
+    srv->pending_sock = -1;
+    err = listen(listen_sock, ADMISSION_BACKLOG);
+#else
     err = listen(listen_sock, 1);
+#endif
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
     }
+#if CONFIG_ADMISSION_ENABLE
+    // Connections waiting while a session runs are all taken by check_waiting()
+    fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
 
     while (1) {
 
@@ -149,11 +442,43 @@ static void tcp_server_task(void *pvParameters)
 
         struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
         socklen_t addr_len = sizeof(source_addr);
+#if CONFIG_ADMISSION_ENABLE
+        // A trusted peer the previous session gave way to is served first, it was checked already
+        int sock = srv->pending_sock;
+        srv->pending_sock = -1;
+        srv->trusted = sock >= 0;
+        if (sock >= 0) {
+            getpeername(sock, (struct sockaddr *)&source_addr, &addr_len);
+        } else {
+            // The listen socket does not block, wait for a connection first
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(listen_sock, &fds);
+            select(listen_sock + 1, &fds, NULL, NULL, NULL);
+            sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+            if (sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+        }
+#else
         int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+#endif
         if (sock < 0) {
             ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
             break;
         }
+#if CONFIG_ADMISSION_ENABLE
+        if (!srv->trusted) {
+            // Refused quietly, a flood would otherwise be held up by the console
+            admission_t const verdict = admission_check(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr);
+            if (verdict == ADMISSION_DENIED || verdict == ADMISSION_RATE_LIMITED) {
+                ESP_LOGD(TAG, "Connection refused by admission control (%d)", verdict);
+                sock_abort(sock);
+                close(sock);
+                continue;
+            }
+            srv->trusted = verdict == ADMISSION_TRUSTED;
+        }
+#endif
 
         // Set tcp keepalive option
         setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
@@ -176,8 +501,214 @@ CLEAN_UP:
     close(listen_sock);
     vTaskDelete(NULL);
 }
+#else
+/* Bridge port on the lwIP netconn API, every call goes to the TCP/IP task without
+   the socket layer on top.
+
+   UART data is queued for sending without copy: lwIP keeps pointing into the ring
+   until the peer acknowledges the data, which is never more than TCP_SND_BUF bytes
+   behind the chunk being written, so the ring only overwrites data that is gone.
+   Closing the connection waits for the acknowledgment (or aborts) for the same
+   reason. Network data goes to the UART straight from the received pbufs, and the
+   receive window is only reopened once they are passed on, so a full UART holds
+   the sender back without an intermediate buffer. */
+
+// Time the peer gets to acknowledge the last data on close before the connection is reset
+#define NETCONN_LINGER_S 2
+
+static TaskHandle_t netconn_waiter;
+
+/** Runs in the TCP/IP task, wakes the bridge loop up once data or send room arrives */
+static void netconn_event(struct netconn *conn, enum netconn_evt evt, u16_t len)
+{
+    if (netconn_waiter && (evt == NETCONN_EVT_RCVPLUS || evt == NETCONN_EVT_SENDPLUS))
+        xTaskNotifyGive(netconn_waiter);
+}
+
+/** Runs in the TCP/IP task, the netconn API has no keepalive options */
+static void netconn_keepalive(void *arg)
+{
+    struct tcp_pcb *pcb = ((struct netconn *)arg)->pcb.tcp;
+    if (!pcb)
+        return;
+    ip_set_option(pcb, SOF_KEEPALIVE);
+    pcb->keep_idle = KEEPALIVE_IDLE * 1000;
+    pcb->keep_intvl = KEEPALIVE_INTERVAL * 1000;
+    pcb->keep_cnt = KEEPALIVE_COUNT;
+}
+
+static void do_bridge_netconn(struct netconn *conn, struct server_port *srv)
+{
+    ip_addr_t local_addr;
+    u16_t local_port;
+    if (!tcp_server_session_claim(netconn_getaddr(conn, &local_addr, &local_port, 1) == ERR_OK ?
+                                  ip4_addr_get_u32(ip_2_ip4(&local_addr)) : 0)) {
+        ESP_LOGW(TAG, "UART is in use by another session");
+        conn->linger = 0;
+        return;
+    }
+    token_bucket_init(&srv->shaper, CONFIG_BRIDGE_TX_RATE_LIMIT, CONFIG_BRIDGE_TX_BURST);
+    srv->rx_len = 0;
+    struct pbuf *chain = NULL;      // Eth -> UART data being written
+    struct pbuf *seg = NULL;        // pbuf of the chain being written
+    int seg_off = 0;
+    // Both directions are serviced in turn moving at most one chunk each time
+    // so a blocked direction never holds the other one back
+    for (;;) {
+        bool idle = true;
+        if (session_drop) {
+            ESP_LOGW(TAG, "Link down, session dropped");
+            conn->linger = 0;
+            break;
+        }
+        // Read UART into the ring right behind the data queued before
+        if (!srv->rx_len) {
+            int const size = uart_read_bytes(srv->uart, (uint8_t*)srv->buff + srv->ring_head,
+                                             MIN(BRIDGE_NETCONN_CHUNK, BRIDGE_NETCONN_RING_SZ - srv->ring_head), 0);
+            if (size < 0) {
+                ESP_LOGE(TAG, "Uart read failed");
+                break;
+            }
+            srv->rx_data = srv->buff + srv->ring_head;
+            srv->rx_len = size;
+            srv->rx_off = 0;
+            if (size)
+                ESP_LOGI(TAG, "UART -> Eth  %d bytes", size);
+        }
+        if (srv->rx_len) {
+            size_t written = 0;
+            err_t const err = netconn_write_partly(conn, srv->rx_data + srv->rx_off, srv->rx_len,
+                                                   NETCONN_NOCOPY | NETCONN_DONTBLOCK, &written);
+            if (err != ERR_OK && err != ERR_WOULDBLOCK) {
+                ESP_LOGE(TAG, "Error occurred during sending: err %d", err);
+                break;
+            }
+            if (written) {
+                srv->rx_len -= written;
+                srv->rx_off += written;
+                stats.uart_to_eth_bytes += written;
+                idle = false;
+                if (!srv->rx_len)
+                    srv->ring_head = (srv->ring_head + srv->rx_off) % BRIDGE_NETCONN_RING_SZ;
+            }
+        }
+        // Take the next pbuf chain only when the previous one has been passed to the UART,
+        // the receive window stays closed meanwhile
+        if (!chain) {
+            err_t const err = netconn_recv_tcp_pbuf_flags(conn, &chain, NETCONN_DONTBLOCK | NETCONN_NOAUTORCVD);
+            if (err == ERR_CLSD) {
+                ESP_LOGW(TAG, "Connection closed");
+                break;
+            } else if (err != ERR_OK && err != ERR_WOULDBLOCK) {
+                ESP_LOGE(TAG, "Error occurred during receiving: err %d", err);
+                break;
+            }
+            if (err == ERR_OK) {
+                ESP_LOGI(TAG, "Eth -> UART %d bytes", chain->tot_len);
+                seg = chain;
+                seg_off = 0;
+            } else {
+                chain = NULL;
+            }
+        }
+        if (chain) {
+            while (seg && seg_off == seg->len) {
+                seg = seg->next;
+                seg_off = 0;
+            }
+            if (!seg) {
+                // All of it is in the UART buffer, let the sender go on
+                netconn_tcp_recvd(conn, chain->tot_len);
+                pbuf_free(chain);
+                chain = NULL;
+            } else {
+                uint32_t const allowed = MIN((uint32_t)(seg->len - seg_off), token_bucket_available(&srv->shaper));
+                int const written = allowed ? uart_write_nonblock(srv->uart, (const char *)seg->payload + seg_off,
+                                                                  allowed) : 0;
+                if (written > 0) {
+                    token_bucket_consume(&srv->shaper, written);
+                    seg_off += written;
+                    stats.eth_to_uart_bytes += written;
+                    idle = false;
+                } else {
+                    stats.tx_throttled++;
+                }
+            }
+        }
+#if CONFIG_POWER_MGMT_ENABLE
+        if (!idle)
+            power_mgmt_busy();
+#endif
+        if (idle) {
+            // Network events wake the task up early
+            ulTaskNotifyTake(pdTRUE, 1);
+        }
+    }
+    if (chain)
+        pbuf_free(chain);
+    for (;;) {
+        int const left = uart_read_bytes(srv->uart, (uint8_t*)srv->buff, BRIDGE_NETCONN_CHUNK, 8);
+        if (left <= 0)
+            break;
+    }
+    tcp_server_session_release();
+}
+
+static void tcp_server_task(void *pvParameters)
+{
+    struct server_port* srv = pvParameters;
+    netconn_waiter = xTaskGetCurrentTaskHandle();
+    struct netconn *listener = netconn_new_with_callback(NETCONN_TCP, netconn_event);
+    if (!listener) {
+        ESP_LOGE(TAG, "Unable to create netconn");
+        vTaskDelete(NULL);
+        return;
+    }
+    err_t err = netconn_bind(listener, IP4_ADDR_ANY, srv->port);
+    if (err != ERR_OK) {
+        ESP_LOGE(TAG, "Netconn unable to bind: err %d", err);
+        goto CLEAN_UP;
+    }
+    err = netconn_listen_with_backlog(listener, 1);
+    if (err != ERR_OK) {
+        ESP_LOGE(TAG, "Error occurred during listen: err %d", err);
+        goto CLEAN_UP;
+    }
+    ESP_LOGI(TAG, "Netconn listening, port %d", srv->port);
+
+    for (;;) {
+        struct netconn *conn;
+        err = netconn_accept(listener, &conn);
+        if (err != ERR_OK) {
+            ESP_LOGE(TAG, "Unable to accept connection: err %d", err);
+            break;
+        }
+        conn->linger = NETCONN_LINGER_S;
+        if (tcpip_callback(netconn_keepalive, conn) != ERR_OK)
+            ESP_LOGW(TAG, "Keepalive not enabled");
+
+        ip_addr_t addr;
+        u16_t port;
+        char addr_str[IPADDR_STRLEN_MAX];
+        if (netconn_getaddr(conn, &addr, &port, 0) == ERR_OK)
+            ESP_LOGI(TAG, "Netconn accepted ip address: %s", ipaddr_ntoa_r(&addr, addr_str, sizeof(addr_str)));
+
+        do_bridge_netconn(conn, srv);
+        // Waits up to the linger time for the peer to acknowledge data still in the ring
+        netconn_delete(conn);
+    }
+
+CLEAN_UP:
+    netconn_delete(listener);
+    vTaskDelete(NULL);
+}
+#endif // CONFIG_BRIDGE_TRANSPORT_NETCONN
 
-#ifdef CONFIG_UART_CTS_EN
+#if CONFIG_UART_LINE_RS485
+// RTS drives the transceiver DE, the driver controls it
+#define UART_FLOWCTRL UART_HW_FLOWCTRL_DISABLE
+#define UART_CTS_GPIO UART_PIN_NO_CHANGE
+#elif defined(CONFIG_UART_CTS_EN)
 #define UART_FLOWCTRL UART_HW_FLOWCTRL_CTS_RTS
 #define UART_CTS_GPIO CONFIG_UART_CTS_GPIO
 #else
@@ -206,7 +737,21 @@ static esp_err_t bridge_uart_init(int baud_rate)
 
     ESP_RETURN_ON_ERROR(uart_param_config(UART_NUM_1, &uart_config), TAG, "uart_param_config failed");
     ESP_RETURN_ON_ERROR(uart_set_pin(UART_NUM_1, UART_TX_GPIO, UART_RX_GPIO, UART_RTS_GPIO, UART_CTS_GPIO), TAG, "uart_set_pin failed");
-    ESP_RETURN_ON_ERROR(uart_driver_install(UART_NUM_1, UART_RX_BUF_SZ, UART_TX_BUF_SZ, 0, NULL, 0), TAG, "uart_driver_install failed");
+#if CONFIG_UART_DMA_ENABLE
+    ESP_RETURN_ON_ERROR(uart_dma_init(UART_NUM_1), TAG, "uart_dma_init failed");
+#else
+    QueueHandle_t events;
+    ESP_RETURN_ON_ERROR(uart_driver_install(UART_NUM_1, UART_RX_BUF_SZ, UART_TX_BUF_SZ, UART_EVENTS_QUEUE_LEN, &events,
+                                            BRIDGE_UART_INTR_FLAGS), TAG, "uart_driver_install failed");
+    uart_events_start(UART_NUM_1, events);
+#endif
+#if CONFIG_UART_LINE_RS485
+    ESP_RETURN_ON_ERROR(rs485_init(UART_NUM_1, baud_rate), TAG, "rs485_init failed");
+#endif
+#if CONFIG_POWER_MGMT_ENABLE
+    // UART wake up is set on the configured port
+    ESP_RETURN_ON_ERROR(power_mgmt_start(UART_NUM_1), TAG, "power_mgmt_start failed");
+#endif
 
     gpio_set_level(CONFIG_BRIDGE_LED_GPIO, 0);
     gpio_set_direction(CONFIG_BRIDGE_LED_GPIO, GPIO_MODE_OUTPUT);
@@ -214,11 +759,185 @@ static esp_err_t bridge_uart_init(int baud_rate)
     return ESP_OK;
 }
 
+#if CONFIG_BRIDGE_TRANSPORT_NETCONN
+static struct server_port bridge_server = { .uart = UART_NUM_1};
+#else
 static struct server_port bridge_server = { .handler = do_bridge, .uart = UART_NUM_1};
+#endif
+static settings_t bridge_settings;
+
+static void bridge_start(void)
+{
+    ESP_ERROR_CHECK(bridge_uart_init(bridge_settings.uart_baud_rate));
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+    modbus_gw_create(bridge_server.uart, &bridge_settings);
+#elif CONFIG_BRIDGE_MODE_MQTT
+    mqtt_bridge_create(bridge_server.uart);
+#else
+#if CONFIG_WS_BRIDGE_ENABLE
+    ws_bridge_init(bridge_server.uart);
+#endif
+#if CONFIG_MUX_ENABLE
+    mux_server_start(bridge_server.uart);
+#endif
+    bridge_server.buff = mem_arena_get(MEM_BRIDGE_RX);
+    bridge_server.tx_buff = mem_arena_get(MEM_BRIDGE_TX);
+    bridge_server.port = bridge_settings.tcp_port;
+    xTaskCreatePinnedToCore(tcp_server_task, "bridge_server", 4096, (void*)&bridge_server, 5, NULL, BRIDGE_TASK_CORE);
+#endif
+}
+
+#if BRIDGE_TASK_PINNED
+static void bridge_start_task(void *pvParameters)
+{
+    bridge_start();
+    vTaskDelete(NULL);
+}
+#endif
 
 void tcp_server_create(const settings_t *settings)
 {
-    ESP_ERROR_CHECK(bridge_uart_init(settings->uart_baud_rate));
-    bridge_server.port = settings->tcp_port;
-    xTaskCreate(tcp_server_task, "bridge_server", 4096, (void*)&bridge_server, 5, NULL);
+    bridge_settings = *settings;
+#if BRIDGE_TASK_PINNED
+    // The UART interrupt is allocated on the core the driver is installed from
+    xTaskCreatePinnedToCore(bridge_start_task, "bridge_start", 3072, NULL, 5, NULL, BRIDGE_TASK_CORE);
+#else
+    bridge_start();
+#endif
+}
+
+int tcp_server_drop_sessions(uint32_t local_ip)
+{
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+    return modbus_gw_drop_clients(local_ip);
+#else
+    if (!session_active || session_local_ip != local_ip)
+        return 0;
+    session_drop = true;
+    return 1;
+#endif
+}
+
+esp_err_t tcp_server_set_baud_rate(int baud_rate)
+{
+    ESP_RETURN_ON_ERROR(uart_set_baudrate(bridge_server.uart, baud_rate), TAG, "uart_set_baudrate failed");
+#if CONFIG_UART_LINE_RS485
+    rs485_set_baud_rate(baud_rate);
+#endif
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+    modbus_gw_set_baud_rate(baud_rate);
+#endif
+    bridge_settings.uart_baud_rate = baud_rate;
+    ESP_LOGI(TAG, "UART baud rate %d", baud_rate);
+    return ESP_OK;
+}
+
+int tcp_server_baud_rate(void)
+{
+    return bridge_settings.uart_baud_rate;
+}
+
+uint16_t tcp_server_port(void)
+{
+    return bridge_settings.tcp_port;
+}
+
+#if CONFIG_UART_LINE_RS485
+#define RTS_IDLE_LEVEL 0    // transceiver driver off
+#else
+#define RTS_IDLE_LEVEL 1    // deasserted
+#endif
+
+/*
+ * The loopback only joins TX to RX inside the peripheral, the TX and RTS pads keep
+ * following the UART. Meanwhile they are switched to plain GPIO outputs at their
+ * idle levels, so none of the looped back data reaches the line.
+ */
+static void line_hold_idle(void)
+{
+    // Setting the direction routes the pad to the GPIO output, off the UART signal
+    gpio_set_level(UART_TX_GPIO, 1);
+    gpio_set_direction(UART_TX_GPIO, GPIO_MODE_OUTPUT);
+    gpio_set_level(UART_RTS_GPIO, RTS_IDLE_LEVEL);
+    gpio_set_direction(UART_RTS_GPIO, GPIO_MODE_OUTPUT);
+}
+
+static esp_err_t line_attach(void)
+{
+    return uart_set_pin(bridge_server.uart, UART_TX_GPIO, UART_PIN_NO_CHANGE, UART_RTS_GPIO, UART_PIN_NO_CHANGE);
+}
+
+esp_err_t tcp_server_set_loopback(bool enable, int baud_rate)
+{
+    if (!enable) {
+        if (!loopback_saved_baud)
+            return ESP_OK;
+        int const saved = loopback_saved_baud;
+        loopback_saved_baud = 0;
+        ESP_RETURN_ON_ERROR(uart_set_loop_back(bridge_server.uart, false), TAG, "uart_set_loop_back failed");
+        ESP_RETURN_ON_ERROR(line_attach(), TAG, "uart_set_pin failed");
+        ESP_LOGW(TAG, "UART loopback off");
+        return saved == bridge_settings.uart_baud_rate ? ESP_OK : tcp_server_set_baud_rate(saved);
+    }
+    // The local session is the self test, anyone else's data must not be echoed
+    if (loopback_saved_baud || !session_active || session_local_ip != htonl(INADDR_LOOPBACK))
+        return ESP_ERR_INVALID_STATE;
+    int const saved = bridge_settings.uart_baud_rate;
+    line_hold_idle();
+    esp_err_t err = baud_rate && baud_rate != saved ? tcp_server_set_baud_rate(baud_rate) : ESP_OK;
+    if (err == ESP_OK)
+        err = uart_set_loop_back(bridge_server.uart, true);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "UART not looped back at %d baud: %s", baud_rate ? baud_rate : saved, esp_err_to_name(err));
+        if (saved != bridge_settings.uart_baud_rate)
+            tcp_server_set_baud_rate(saved);
+        line_attach();
+        return err;
+    }
+    loopback_saved_baud = saved;
+    ESP_LOGW(TAG, "UART looped back at %d baud, TX and RTS held idle", bridge_settings.uart_baud_rate);
+    return ESP_OK;
+}
+
+void tcp_server_get_stats(tcp_server_stats_t *out)
+{
+    *out = stats;
+}
+
+bool tcp_server_session_active(void)
+{
+    return session_active;
+}
+
+bool tcp_server_session_claim(uint32_t local_ip)
+{
+    portENTER_CRITICAL(&session_lock);
+    bool const claimed = !session_active;
+    if (claimed) {
+        session_active = true;
+        session_drop = false;
+        session_local_ip = local_ip;
+#if CONFIG_ADMISSION_ENABLE
+        session_trusted = false;
+#endif
+    }
+    portEXIT_CRITICAL(&session_lock);
+    if (!claimed) {
+        stats.rejected++;
+        return false;
+    }
+    stats.sessions++;
+    gpio_set_level(CONFIG_BRIDGE_LED_GPIO, 1);
+    return true;
+}
+
+bool tcp_server_session_dropped(void)
+{
+    return session_drop;
+}
+
+void tcp_server_session_release(void)
+{
+    gpio_set_level(CONFIG_BRIDGE_LED_GPIO, 0);
+    session_active = false;
 }
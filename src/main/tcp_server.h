@@ -3,9 +3,92 @@
 #ifndef TCP_SERVER_H
 #define TCP_SERVER_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_intr_alloc.h"
+#include "esp_err.h"
 #include "settings.h"
 
+// Core for the bridge tasks and UART interrupt, opposite to the Ethernet RX task if that one is pinned
+#if CONFIG_EXAMPLE_ETH_RX_TASK_CORE >= 0 && !CONFIG_FREERTOS_UNICORE
+#define BRIDGE_TASK_PINNED 1
+#define BRIDGE_TASK_CORE (1 - CONFIG_EXAMPLE_ETH_RX_TASK_CORE)
+#else
+#define BRIDGE_TASK_PINNED 0
+#define BRIDGE_TASK_CORE tskNO_AFFINITY
+#endif
+
+// The UART interrupts keep being served while flash writes disable the cache
+#if CONFIG_UART_ISR_IN_IRAM
+#define BRIDGE_UART_INTR_FLAGS ESP_INTR_FLAG_IRAM
+#else
+#define BRIDGE_UART_INTR_FLAGS 0
+#endif
+
+// Bridge port buffer in each direction
+#define BRIDGE_BUFF_SZ 4096
+
+#if CONFIG_BRIDGE_TRANSPORT_NETCONN
+#define BRIDGE_TRANSPORT_NAME "netconn"
+// UART data read at once on the netconn transport
+#define BRIDGE_NETCONN_CHUNK 2048
+// UART -> network ring, lwIP refers to up to TCP_SND_BUF bytes of it until they are acknowledged
+#define BRIDGE_NETCONN_RING_SZ (CONFIG_LWIP_TCP_SND_BUF_DEFAULT + 2 * BRIDGE_NETCONN_CHUNK)
+#else
+#define BRIDGE_TRANSPORT_NAME "sockets"
+#endif
+
+typedef struct {
+    uint32_t sessions;
+    uint64_t uart_to_eth_bytes;
+    uint64_t eth_to_uart_bytes;
+    uint32_t tx_throttled;  // bridge loop passes with network data held back by the rate limit or full UART buffer
+    uint32_t rejected;      // connections refused while another session holds the UART
+    uint32_t first_byte_timeouts;   // sessions dropped for sending nothing in time, admission control only
+    uint32_t preempted;     // untrusted sessions dropped for a trusted peer, admission control only
+} tcp_server_stats_t;
+
 void tcp_server_create(const settings_t *settings);
+void tcp_server_get_stats(tcp_server_stats_t *stats);
+
+/**
+ * Change the bridge UART baud rate while running, along with the line timing derived
+ * from it. The stored settings are not touched.
+ */
+esp_err_t tcp_server_set_baud_rate(int baud_rate);
+
+/** Baud rate the bridge UART runs at */
+int tcp_server_baud_rate(void);
+
+/** True while a client is connected to the bridge port */
+bool tcp_server_session_active(void);
+
+/**
+ * Take the UART for a new session, false if another session holds it. The TCP
+ * bridge and the WebSocket endpoint share the UART through these calls.
+ * local_ip is the session local address (network byte order) for tcp_server_drop_sessions.
+ */
+bool tcp_server_session_claim(uint32_t local_ip);
+
+/** True if the claimed session has to be torn down, its link is gone */
+bool tcp_server_session_dropped(void);
+
+void tcp_server_session_release(void);
+
+/** Abort sessions accepted on the given local address (network byte order), returns their number */
+int tcp_server_drop_sessions(uint32_t local_ip);
+
+/** Port the bridge listens on */
+uint16_t tcp_server_port(void);
+
+/**
+ * Loop the UART back inside the peripheral for the self test, at baud_rate (0 keeps
+ * the running rate). Only allowed while a session from the bridge itself holds the
+ * UART. The TX and RTS pins are held idle meanwhile. Switching it off attaches them
+ * to the UART again and restores the baud rate of before.
+ */
+esp_err_t tcp_server_set_loopback(bool enable, int baud_rate);
 
 #endif // TCP_SERVER_H
 
@@ -0,0 +1,32 @@
+#include "esp_timer.h"
+#include "token_bucket.h"
+
+#define SCALE 1000000LL
+
+void token_bucket_init(token_bucket_t *tb, uint32_t rate, uint32_t burst)
+{
+    tb->rate = rate;
+    tb->burst = burst;
+    tb->credit = (int64_t)burst * SCALE;
+    tb->last_us = esp_timer_get_time();
+}
+
+uint32_t token_bucket_available(token_bucket_t *tb)
+{
+    if (!tb->rate)
+        return UINT32_MAX;
+
+    int64_t const now = esp_timer_get_time();
+    // One microsecond at the given rate is worth exactly 'rate' scaled units
+    tb->credit += (now - tb->last_us) * tb->rate;
+    tb->last_us = now;
+    if (tb->credit > (int64_t)tb->burst * SCALE)
+        tb->credit = (int64_t)tb->burst * SCALE;
+    return tb->credit > 0 ? (uint32_t)(tb->credit / SCALE) : 0;
+}
+
+void token_bucket_consume(token_bucket_t *tb, uint32_t bytes)
+{
+    if (tb->rate)
+        tb->credit -= (int64_t)bytes * SCALE;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t rate;      // bytes per second, 0 - unlimited
+    uint32_t burst;     // bucket depth in bytes
+    int64_t  credit;    // available bytes scaled by 1000000
+    int64_t  last_us;   // time of the last refill
+} token_bucket_t;
+
+void token_bucket_init(token_bucket_t *tb, uint32_t rate, uint32_t burst);
+
+/** Refill the bucket and return the number of bytes that may be sent now */
+uint32_t token_bucket_available(token_bucket_t *tb);
+
+void token_bucket_consume(token_bucket_t *tb, uint32_t bytes);
+
+#endif // TOKEN_BUCKET_H
@@ -0,0 +1,172 @@
+/* UART data path through UHCI DMA
+
+   Above 1 Mbaud the interrupt per FIFO threshold of the UART driver costs a lot
+   of CPU time. Here the UHCI controller moves the data between the UART and
+   rings of buffers by DMA. Received data is handed to the network stage right
+   from the DMA buffer and network data is received straight into a transmit
+   buffer, so nothing is copied on the way. The buffer handling lives in dma_ring.c.
+
+   A receive transfer spans all free buffers following each other in memory, one
+   DMA descriptor each, so the line keeps being received into the next buffer
+   while the bridge task sends the full ones. The transfer ends when the line goes
+   idle or the buffers are full and is started again right in the completion
+   callback; the bridge task, woken up on every completion, only starts it when
+   all buffers were taken at that moment. The completion callbacks are kept in
+   IRAM, with UART_IRAM_SAFE the UHCI interrupt keeps running while the flash
+   cache is off.
+*/
+#include <string.h>
+#include "esp_log.h"
+#include "esp_check.h"
+#include "esp_attr.h"
+#include "driver/uhci.h"
+
+#include "uart_dma.h"
+#include "dma_ring.h"
+#include "mem_arena.h"
+
+#define SLOT_SZ   CONFIG_UART_DMA_BUFF_SIZE
+#define SLOT_CNT  CONFIG_UART_DMA_BUFF_COUNT
+
+_Static_assert((SLOT_CNT & (SLOT_CNT - 1)) == 0, "UART_DMA_BUFF_COUNT must be a power of two");
+
+static const char *TAG = "uart_dma";
+
+static struct {
+    uhci_controller_handle_t uhci;
+    dma_ring_t               rx;
+    dma_ring_t               tx;
+    TaskHandle_t             waiter;
+    portMUX_TYPE             rx_lock;   // receive started from the task or the interrupt
+} dma = { .rx_lock = portMUX_INITIALIZER_UNLOCKED };
+
+static IRAM_ATTR bool wake_waiter(void)
+{
+    BaseType_t woken = pdFALSE;
+    if (dma.waiter)
+        vTaskNotifyGiveFromISR(dma.waiter, &woken);
+    return woken == pdTRUE;
+}
+
+/** Start a receive transfer over the free buffers unless one is running, call with rx_lock held */
+static IRAM_ATTR esp_err_t rx_arm(void)
+{
+    if (dma_ring_dma_slots(&dma.rx))
+        return ESP_OK;
+    uint32_t cnt = SLOT_CNT;
+    uint8_t *buf = dma_ring_rx_arm(&dma.rx, &cnt);
+    if (!buf)
+        return ESP_OK;      // all buffers hold data, the task starts it once one is sent
+    esp_err_t const err = uhci_receive(dma.uhci, buf, cnt * SLOT_SZ);
+    if (err != ESP_OK) {
+        // Give the buffers back empty
+        dma_ring_rx_data(&dma.rx, 0, true);
+    }
+    return err;
+}
+
+static IRAM_ATTR bool on_rx(uhci_controller_handle_t uhci, const uhci_rx_event_data_t *edata, void *ctx)
+{
+    portENTER_CRITICAL_ISR(&dma.rx_lock);
+    dma_ring_rx_data(&dma.rx, edata->recv_size, edata->flags.totally_received);
+    if (edata->flags.totally_received) {
+        // A failure is left to the task, it retries on its next pass
+        rx_arm();
+    }
+    portEXIT_CRITICAL_ISR(&dma.rx_lock);
+    return wake_waiter();
+}
+
+static IRAM_ATTR bool on_tx_done(uhci_controller_handle_t uhci, const uhci_tx_done_event_data_t *edata, void *ctx)
+{
+    dma_ring_tx_done(&dma.tx);
+    return wake_waiter();
+}
+
+esp_err_t uart_dma_init(uart_port_t uart)
+{
+    // DMA capable buffers placed by the arena
+    dma_ring_init(&dma.rx, mem_arena_get(MEM_UART_DMA_RX), SLOT_SZ, SLOT_CNT);
+    dma_ring_init(&dma.tx, mem_arena_get(MEM_UART_DMA_TX), SLOT_SZ, SLOT_CNT);
+
+    uhci_controller_config_t const config = {
+        .uart_port = uart,
+        .tx_trans_queue_depth = SLOT_CNT,
+        .max_transmit_size = SLOT_SZ,
+        .max_receive_internal_mem = SLOT_SZ * SLOT_CNT,
+        .dma_burst_size = 32,
+        .rx_eof_flags.idle_eof = 1,
+    };
+    ESP_RETURN_ON_ERROR(uhci_new_controller(&config, &dma.uhci), TAG, "uhci_new_controller failed");
+    uhci_event_callbacks_t const cbs = {
+        .on_rx_trans_event = on_rx,
+        .on_tx_trans_done = on_tx_done,
+    };
+    ESP_RETURN_ON_ERROR(uhci_register_event_callbacks(dma.uhci, &cbs, NULL), TAG, "uhci_register_event_callbacks failed");
+    ESP_LOGI(TAG, "%d x %d byte buffers each way", SLOT_CNT, SLOT_SZ);
+    return ESP_OK;
+}
+
+void uart_dma_set_waiter(TaskHandle_t task)
+{
+    dma.waiter = task;
+}
+
+/** Start the receive transfer the interrupt could not start, no free buffer or a failure */
+static void rx_restart(void)
+{
+    portENTER_CRITICAL(&dma.rx_lock);
+    esp_err_t const err = rx_arm();
+    portEXIT_CRITICAL(&dma.rx_lock);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "uhci_receive failed: %s", esp_err_to_name(err));
+}
+
+uint32_t uart_dma_rx_peek(const uint8_t **data)
+{
+    rx_restart();
+    return dma_ring_rx_peek(&dma.rx, data);
+}
+
+void uart_dma_rx_consume(uint32_t len)
+{
+    dma_ring_rx_consume(&dma.rx, len);
+    rx_restart();
+}
+
+uint32_t uart_dma_rx_flush(void)
+{
+    const uint8_t *data;
+    uint32_t len, dropped = 0;
+    while ((len = dma_ring_rx_peek(&dma.rx, &data)) != 0) {
+        dma_ring_rx_consume(&dma.rx, len);
+        dropped += len;
+    }
+    rx_restart();
+    return dropped;
+}
+
+uint8_t *uart_dma_tx_acquire(uint32_t *cap)
+{
+    *cap = SLOT_SZ;
+    return dma_ring_tx_acquire(&dma.tx);
+}
+
+esp_err_t uart_dma_tx_commit(uint32_t len)
+{
+    uint8_t *buf = dma_ring_tx_commit(&dma.tx, len);
+    esp_err_t const err = uhci_transmit(dma.uhci, buf, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "uhci_transmit failed: %s", esp_err_to_name(err));
+        dma_ring_tx_done(&dma.tx);
+    }
+    return err;
+}
+
+void uart_dma_get_stats(uart_dma_stats_t *stats)
+{
+    stats->rx_slots_max = dma.rx.used_max;
+    stats->rx_starved = dma.rx.starved;
+    stats->tx_slots_max = dma.tx.used_max;
+    stats->tx_full = dma.tx.starved;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#ifndef UART_DMA_H
+#define UART_DMA_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "esp_err.h"
+
+typedef struct {
+    uint32_t rx_slots_max;      // most receive buffers holding data at once
+    uint32_t rx_starved;        // receive could not be restarted, all buffers hold unsent data
+    uint32_t tx_slots_max;
+    uint32_t tx_full;           // network data held back, all transmit buffers queued
+} uart_dma_stats_t;
+
+/** Move the UART data through UHCI DMA, the port must be configured with uart_param_config() */
+esp_err_t uart_dma_init(uart_port_t uart);
+
+/** Task notified whenever DMA completes a buffer in either direction */
+void uart_dma_set_waiter(TaskHandle_t task);
+
+/** Received bytes not consumed yet, data points into the DMA buffer */
+uint32_t uart_dma_rx_peek(const uint8_t **data);
+
+void uart_dma_rx_consume(uint32_t len);
+
+/** Drop everything received so far, returns the number of bytes dropped */
+uint32_t uart_dma_rx_flush(void);
+
+/** Free transmit buffer to fill, NULL if all of them are queued */
+uint8_t *uart_dma_tx_acquire(uint32_t *cap);
+
+/** Send len bytes of the buffer returned by uart_dma_tx_acquire() */
+esp_err_t uart_dma_tx_commit(uint32_t len);
+
+void uart_dma_get_stats(uart_dma_stats_t *stats);
+
+#endif // UART_DMA_H
@@ -0,0 +1,76 @@
+/* UART driver event monitor
+
+   The driver reports receive errors on its event queue. A FIFO overrun means the
+   interrupt was not served within the time the 128 byte hardware FIFO takes to
+   fill, about 1.4 ms at 921600 baud, which is what happens when the handler is
+   not in IRAM and a flash write has the cache disabled. The errors are only
+   counted here, the bridge carries on with the data that made it.
+*/
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "uart_events.h"
+#include "tcp_server.h"
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+
+static const char *TAG = "uart_events";
+
+static struct {
+    uart_port_t         uart;
+    QueueHandle_t       events;
+    uart_events_stats_t stats;
+} mon;
+
+static void uart_events_task(void *pvParameters)
+{
+    uart_event_t event;
+    for (;;) {
+        if (xQueueReceive(mon.events, &event, portMAX_DELAY) != pdTRUE)
+            continue;
+        // The driver drops events while the queue is full, data events fill it fastest
+        if (uxQueueMessagesWaiting(mon.events) == UART_EVENTS_QUEUE_LEN - 1)
+            mon.stats.queue_full++;
+        switch (event.type) {
+#if CONFIG_POWER_MGMT_ENABLE
+        case UART_DATA:
+            // Serial data keeps the clock up and the chip awake, with or without a session
+            power_mgmt_busy();
+            break;
+#endif
+        case UART_FIFO_OVF:
+            mon.stats.fifo_overruns++;
+            ESP_LOGW(TAG, "UART%d FIFO overrun", mon.uart);
+            break;
+        case UART_BUFFER_FULL:
+            mon.stats.buffer_full++;
+            break;
+        case UART_FRAME_ERR:
+            mon.stats.frame_errors++;
+            break;
+        case UART_PARITY_ERR:
+            mon.stats.parity_errors++;
+            break;
+        case UART_BREAK:
+            mon.stats.breaks++;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void uart_events_start(uart_port_t uart, QueueHandle_t events)
+{
+    mon.uart = uart;
+    mon.events = events;
+    // Above the bridge tasks so the queue is drained before it fills with data events
+    xTaskCreatePinnedToCore(uart_events_task, "uart_events", 2048, NULL, 6, NULL, BRIDGE_TASK_CORE);
+}
+
+void uart_events_get_stats(uart_events_stats_t *stats)
+{
+    *stats = mon.stats;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#ifndef UART_EVENTS_H
+#define UART_EVENTS_H
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "driver/uart.h"
+
+// Driver events waiting for the monitor task, data events included
+#define UART_EVENTS_QUEUE_LEN 32
+
+typedef struct {
+    uint32_t fifo_overruns;     // hardware FIFO overflowed before the interrupt drained it, data lost
+    uint32_t buffer_full;       // driver receive buffer full, reception paused (RTS deasserted)
+    uint32_t frame_errors;
+    uint32_t parity_errors;
+    uint32_t breaks;
+    uint32_t queue_full;        // event queue found full, events may have been dropped
+} uart_events_stats_t;
+
+/** Start the task counting the line errors the driver reports on the event queue */
+void uart_events_start(uart_port_t uart, QueueHandle_t events);
+
+void uart_events_get_stats(uart_events_stats_t *stats);
+
+#endif // UART_EVENTS_H
@@ -0,0 +1,236 @@
+/* UART loopback self test
+
+   Characterizes the UART of a deployed bridge without touching the wiring. The
+   test connects to the bridge port from the bridge itself, so the data takes the
+   path of a client's: socket, bridge loop, UART driver and peripheral, and back.
+   Once the bridge has given the UART to that session the peripheral is looped
+   back (TX to RX inside the chip) at the requested baud rate and a counting
+   pattern is streamed for the test time, every byte coming back is checked
+   against it. The data on the way is bounded to 100 ms of line time, so the test
+   drains quickly at any baud rate. Unless CTS flow control is enabled nothing
+   holds the transmitter back when the receive side falls behind, so FIFO
+   overruns and a full driver buffer show when the bridge loop does not keep up.
+
+   The network leg never leaves lwIP (loopback interface), the numbers are for
+   the UART and the bridge loop, not for the Ethernet link.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/uart.h"
+#include "lwip/sockets.h"
+
+#include "uart_selftest.h"
+#include "tcp_server.h"
+#include "uart_events.h"
+
+static const char *TAG = "uart_selftest";
+
+// The bridge UART, see tcp_server.c
+#define UART_PORT           UART_NUM_1
+#define UART_TX_BUF_SZ      (1024 * CONFIG_UART_TX_BUFF_SIZE)
+#define CHUNK               1024
+// Pattern period, prime so it does not line up with any buffer size
+#define PATTERN_PERIOD      251
+// Time the bridge gets to accept the connection and give it the UART
+#define CLAIM_WAIT_TICKS    MAX(1, pdMS_TO_TICKS(2000))
+// Data left over on the line before the loopback is dropped for this long
+#define SETTLE_TICKS        MAX(1, pdMS_TO_TICKS(50))
+// Time the data on the way gets to come back after the test time
+#define DRAIN_US            2000000
+// Publish the progress this often
+#define PROGRESS_US         100000
+
+static struct {
+    portMUX_TYPE           lock;    // guards res, 64 bit counters are read from other tasks
+    uart_selftest_result_t res;
+    int                    baud_rate;
+    int                    seconds;
+    uint8_t                tx[CHUNK];
+    uint8_t                rx[CHUNK];
+} st = { .lock = portMUX_INITIALIZER_UNLOCKED };
+
+static void publish(const uart_selftest_result_t *res)
+{
+    portENTER_CRITICAL(&st.lock);
+    st.res = *res;
+    portEXIT_CRITICAL(&st.lock);
+}
+
+/** Drop whatever arrives on the socket for a while */
+static void discard_input(int sock, TickType_t ticks)
+{
+    vTaskDelay(ticks);
+    while (recv(sock, st.rx, sizeof(st.rx), 0) > 0)
+        ;
+}
+
+/** Stream the pattern through the looped back bridge and check what comes back */
+static esp_err_t stream(int sock, uart_selftest_result_t *res)
+{
+    uart_events_stats_t ev_before, ev_after;
+    uart_events_get_stats(&ev_before);
+    // 100 ms of line time on the way at most, 10 bits per byte
+    uint64_t const window = MAX(256, res->baud_rate / 100);
+    uint64_t pos = 0;       // position in the pattern of the next byte expected
+    esp_err_t err = ESP_OK;
+    int64_t const start = esp_timer_get_time();
+    int64_t const end = start + st.seconds * 1000000LL;
+    int64_t last_rx = start, published = start;
+    for (;;) {
+        bool idle = true;
+        int64_t const now = esp_timer_get_time();
+        uint64_t const on_way = res->sent > pos ? res->sent - pos : 0;
+        if (now < end && on_way < window) {
+            size_t const len = MIN(CHUNK, window - on_way);
+            for (size_t i = 0; i < len; i++)
+                st.tx[i] = (res->sent + i) % PATTERN_PERIOD;
+            int const n = send(sock, st.tx, len, 0);
+            if (n < 0 && errno != EWOULDBLOCK) {
+                ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+                err = ESP_FAIL;
+                break;
+            }
+            if (n > 0) {
+                res->sent += n;
+                idle = false;
+            }
+        }
+        int const n = recv(sock, st.rx, sizeof(st.rx), 0);
+        if (n == 0 || (n < 0 && errno != EWOULDBLOCK)) {
+            ESP_LOGE(TAG, "Bridge closed the connection");
+            err = ESP_FAIL;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            uint8_t const expected = pos % PATTERN_PERIOD;
+            if (st.rx[i] != expected) {
+                res->errors++;
+                // Take it for lost data and go on from the byte received, corrupted bytes cost one more error
+                if (st.rx[i] < PATTERN_PERIOD)
+                    pos += (st.rx[i] + PATTERN_PERIOD - expected) % PATTERN_PERIOD;
+            }
+            pos++;
+        }
+        if (n > 0) {
+            res->received += n;
+            last_rx = now;
+            idle = false;
+        }
+        size_t rx_buffered = 0, tx_free = 0;
+        uart_get_buffered_data_len(UART_PORT, &rx_buffered);
+        uart_get_tx_buffer_free_size(UART_PORT, &tx_free);
+        res->rx_buffered_max = MAX(res->rx_buffered_max, rx_buffered);
+        res->tx_buffered_max = MAX(res->tx_buffered_max, UART_TX_BUF_SZ - MIN(tx_free, UART_TX_BUF_SZ));
+        if (now >= end && (pos >= res->sent || now >= end + DRAIN_US))
+            break;
+        if (now - published >= PROGRESS_US) {
+            published = now;
+            publish(res);
+        }
+        if (idle)
+            vTaskDelay(1);
+    }
+    uart_events_get_stats(&ev_after);
+    res->fifo_overruns = ev_after.fifo_overruns - ev_before.fifo_overruns;
+    res->buffer_full = ev_after.buffer_full - ev_before.buffer_full;
+    int64_t const took = MAX(1, last_rx - start);
+    res->duration_ms = took / 1000;
+    res->bytes_per_s = res->received * 1000000 / took;
+    res->line_pct = (uint64_t)res->bytes_per_s * 10 * 100 / res->baud_rate;
+    if (err == ESP_OK && res->received < res->sent)
+        ESP_LOGW(TAG, "%llu bytes did not come back", (unsigned long long)(res->sent - res->received));
+    return err;
+}
+
+static esp_err_t selftest_run(uart_selftest_result_t *res)
+{
+    int const sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return ESP_ERR_NO_MEM;
+    }
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(tcp_server_port()),
+    };
+    esp_err_t err = ESP_FAIL;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ESP_LOGE(TAG, "Unable to connect to the bridge port: errno %d", errno);
+        goto CLEAN_UP;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    // Refused while the bridge has not given the UART to the connection yet
+    for (TickType_t waited = 0;; waited++) {
+        err = tcp_server_set_loopback(true, st.baud_rate);
+        if (err != ESP_ERR_INVALID_STATE || waited >= CLAIM_WAIT_TICKS)
+            break;
+        vTaskDelay(1);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "UART not looped back: %s", esp_err_to_name(err));
+        goto CLEAN_UP;
+    }
+    uart_get_baudrate(UART_PORT, &res->baud_rate);
+    publish(res);
+    ESP_LOGI(TAG, "Streaming for %d s", st.seconds);
+    discard_input(sock, SETTLE_TICKS);
+    err = stream(sock, res);
+    // Let the driver send what it holds into the loop rather than onto the line
+    uart_wait_tx_done(UART_PORT, pdMS_TO_TICKS(500));
+    tcp_server_set_loopback(false, 0);
+
+CLEAN_UP:
+    // Reset rather than close, the bridge session ends at once
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, &(struct linger){ .l_onoff = 1, .l_linger = 0 }, sizeof(struct linger));
+    close(sock);
+    return err;
+}
+
+static void uart_selftest_task(void *pvParameters)
+{
+    uart_selftest_result_t res = { .state = UART_SELFTEST_RUNNING, .baud_rate = st.baud_rate };
+    esp_err_t const err = selftest_run(&res);
+    res.state = err == ESP_OK ? UART_SELFTEST_DONE : UART_SELFTEST_FAILED;
+    res.error = err;
+    publish(&res);
+    ESP_LOGI(TAG, "%llu bytes sent, %llu received, %lu errors, %lu bytes/s (%lu%% of the line rate), "
+             "%lu FIFO overruns", (unsigned long long)res.sent, (unsigned long long)res.received,
+             (unsigned long)res.errors, (unsigned long)res.bytes_per_s, (unsigned long)res.line_pct,
+             (unsigned long)res.fifo_overruns);
+    vTaskDelete(NULL);
+}
+
+esp_err_t uart_selftest_start(int baud_rate, int seconds)
+{
+    if ((baud_rate && (baud_rate < UART_SELFTEST_MIN_BAUD || baud_rate > UART_SELFTEST_MAX_BAUD)) ||
+        seconds < 1 || seconds > UART_SELFTEST_MAX_S)
+        return ESP_ERR_INVALID_ARG;
+    bool const session = tcp_server_session_active();
+    portENTER_CRITICAL(&st.lock);
+    bool const busy = session || st.res.state == UART_SELFTEST_RUNNING;
+    if (!busy)
+        st.res = (uart_selftest_result_t){ .state = UART_SELFTEST_RUNNING, .baud_rate = baud_rate };
+    portEXIT_CRITICAL(&st.lock);
+    if (busy)
+        return ESP_ERR_INVALID_STATE;
+    st.baud_rate = baud_rate;
+    st.seconds = seconds;
+    // Below the bridge task, the test stands in for a client on the network
+    if (xTaskCreate(uart_selftest_task, "uart_selftest", 3072, NULL, 4, NULL) != pdPASS) {
+        publish(&(uart_selftest_result_t){ .state = UART_SELFTEST_FAILED, .error = ESP_ERR_NO_MEM });
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void uart_selftest_get_result(uart_selftest_result_t *result)
+{
+    portENTER_CRITICAL(&st.lock);
+    *result = st.res;
+    portEXIT_CRITICAL(&st.lock);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#ifndef UART_SELFTEST_H
+#define UART_SELFTEST_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define UART_SELFTEST_MIN_BAUD  1200
+#define UART_SELFTEST_MAX_BAUD  5000000
+#define UART_SELFTEST_DEFAULT_S 10
+#define UART_SELFTEST_MAX_S     60
+
+typedef enum {
+    UART_SELFTEST_IDLE,
+    UART_SELFTEST_RUNNING,
+    UART_SELFTEST_DONE,
+    UART_SELFTEST_FAILED,       // the test could not run or was cut short, see error
+} uart_selftest_state_t;
+
+typedef struct {
+    uart_selftest_state_t state;
+    esp_err_t error;
+    uint32_t  baud_rate;
+    uint32_t  duration_ms;      // first byte sent to the last one received
+    uint64_t  sent;
+    uint64_t  received;
+    uint32_t  errors;           // breaks in the pattern, bytes lost or corrupted
+    uint32_t  bytes_per_s;      // bytes received
+    uint32_t  line_pct;         // bytes_per_s in percent of the line rate, 10 bits per byte
+    uint32_t  fifo_overruns;    // during the test
+    uint32_t  buffer_full;
+    uint32_t  rx_buffered_max;  // driver buffer high water marks, sampled every pass
+    uint32_t  tx_buffered_max;
+} uart_selftest_result_t;
+
+/**
+ * Start a test of the given length at baud_rate, 0 keeps the running rate. Fails
+ * with ESP_ERR_INVALID_STATE while a test runs or a session holds the UART.
+ */
+esp_err_t uart_selftest_start(int baud_rate, int seconds);
+
+/** Progress of the running test or the result of the last one */
+void uart_selftest_get_result(uart_selftest_result_t *result);
+
+#endif // UART_SELFTEST_H
@@ -1,12 +1,68 @@
 #include "esp_http_server.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "settings.h"
+#include "tcp_server.h"
+#include "mem_arena.h"
+#include "ethernet_init.h"
+#if CONFIG_LWIP_STATS
+#include "lwip/stats.h"
+#endif
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+#include "modbus_gw.h"
+#endif
+#if CONFIG_MODBUS_CACHE_ENABLE
+#include "modbus_cache.h"
+#endif
+#if CONFIG_BRIDGE_MODE_MQTT
+#include "mqtt_bridge.h"
+#endif
+#if CONFIG_OTA_ENABLE
+#include "ota_update.h"
+#endif
+#if CONFIG_ETH_FAILOVER_ENABLE
+#include "eth_failover.h"
+#endif
+#if CONFIG_PROFILER_ENABLE
+#include "profiler.h"
+#endif
+#if CONFIG_UART_DMA_ENABLE
+#include "uart_dma.h"
+#else
+#include "uart_events.h"
+#endif
+#if CONFIG_FLASH_STRESS_ENABLE
+#include "flash_stress.h"
+#endif
+#if CONFIG_UART_SELFTEST_ENABLE
+#include "uart_selftest.h"
+#endif
+#if CONFIG_UART_LINE_RS485
+#include "rs485.h"
+#endif
+#if CONFIG_WS_BRIDGE_ENABLE
+#include "ws_bridge.h"
+#endif
+#if CONFIG_MUX_ENABLE
+#include "mux_server.h"
+#endif
+#if CONFIG_MGMT_ENABLE
+#include "mgmt_server.h"
+#endif
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+#if CONFIG_ADMISSION_ENABLE
+#include "admission.h"
+#endif
 #include <string.h>
 #include <stdlib.h>
+#include <sys/param.h>
 
 static const char *TAG = "web_server";
 static httpd_handle_t server = NULL;
+static bool config_pages = false;
 
 extern const char* settings_html_start;
 
@@ -85,6 +141,30 @@ static esp_err_t root_get_handler(httpd_req_t *req) {
 
     httpd_resp_sendstr_chunk(req, "<div class=\"actions\"><button type=\"submit\">Save and Reboot</button></div>\n");
     httpd_resp_sendstr_chunk(req, "</fieldset>\n");
+
+#if CONFIG_UART_SELFTEST_ENABLE
+    httpd_resp_sendstr_chunk(req, "<fieldset><legend>UART Self Test</legend>\n<div class=\"row\">\n");
+    snprintf(tmp, sizeof(tmp), "<div><label>Baud Rate</label><input type=\"number\" name=\"st_baud_rate\" min=\"%d\" max=\"%d\" placeholder=\"running rate\"></div>\n",
+             UART_SELFTEST_MIN_BAUD, UART_SELFTEST_MAX_BAUD);
+    httpd_resp_sendstr_chunk(req, tmp);
+    snprintf(tmp, sizeof(tmp), "<div><label>Duration (s)</label><input type=\"number\" name=\"st_seconds\" value=\"%d\" min=\"1\" max=\"%d\"></div>\n",
+             UART_SELFTEST_DEFAULT_S, UART_SELFTEST_MAX_S);
+    httpd_resp_sendstr_chunk(req, tmp);
+    httpd_resp_sendstr_chunk(req, "</div>\n");
+    uart_selftest_result_t sr;
+    uart_selftest_get_result(&sr);
+    if (sr.state == UART_SELFTEST_DONE) {
+        snprintf(tmp, sizeof(tmp), "<label>Last test: %lu bytes/s at %lu baud (%lu%% of the line rate), %lu errors, %lu FIFO overruns</label>\n",
+                 (unsigned long)sr.bytes_per_s, (unsigned long)sr.baud_rate, (unsigned long)sr.line_pct,
+                 (unsigned long)sr.errors, (unsigned long)sr.fifo_overruns);
+        httpd_resp_sendstr_chunk(req, tmp);
+    } else if (sr.state == UART_SELFTEST_FAILED) {
+        snprintf(tmp, sizeof(tmp), "<label>Last test failed: %s</label>\n", esp_err_to_name(sr.error));
+        httpd_resp_sendstr_chunk(req, tmp);
+    }
+    httpd_resp_sendstr_chunk(req, "<div class=\"actions\"><button type=\"submit\" formaction=\"/selftest\">Run Self Test</button></div>\n");
+    httpd_resp_sendstr_chunk(req, "</fieldset>\n");
+#endif
     httpd_resp_sendstr_chunk(req, PAGE_TAIL);
     return httpd_resp_sendstr_chunk(req, NULL);
 }
@@ -169,6 +249,331 @@ static esp_err_t save_post_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
+#if CONFIG_UART_SELFTEST_ENABLE
+static esp_err_t selftest_post_handler(httpd_req_t *req) {
+    // The whole configuration form is posted, only the self test fields are used
+    char buf[512];
+    int const len = httpd_req_recv(req, buf, MIN(req->content_len, sizeof(buf) - 1));
+    if (len <= 0) {
+        if (len == HTTPD_SOCK_ERR_TIMEOUT) {
+            httpd_resp_send_408(req);
+        }
+        return ESP_FAIL;
+    }
+    buf[len] = '\0';
+
+    char val[16];
+    int baud_rate = 0;
+    int seconds = UART_SELFTEST_DEFAULT_S;
+    if (httpd_query_key_value(buf, "st_baud_rate", val, sizeof(val)) == ESP_OK && val[0]) {
+        baud_rate = atoi(val);
+    }
+    if (httpd_query_key_value(buf, "st_seconds", val, sizeof(val)) == ESP_OK && val[0]) {
+        seconds = atoi(val);
+    }
+    esp_err_t const err = uart_selftest_start(baud_rate, seconds);
+    if (err == ESP_ERR_INVALID_ARG) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid baud rate or duration");
+    } else if (err == ESP_ERR_INVALID_STATE) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "UART in use, close the bridge session first");
+    } else if (err != ESP_OK) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Unable to start the self test");
+    } else {
+        httpd_resp_set_status(req, "202 Accepted");
+        httpd_resp_sendstr(req, "Self test started, see /stats for the result");
+    }
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t stats_get_handler(httpd_req_t *req) {
+    httpd_resp_set_type(req, "application/json");
+
+    char tmp[256];
+    snprintf(tmp, sizeof(tmp), "{\"uptime_s\":%lld", (long long)(esp_timer_get_time() / 1000000));
+    httpd_resp_sendstr_chunk(req, tmp);
+
+    static const char *const settings_sources[] = { "defaults", "record", "legacy" };
+    settings_stats_t st;
+    settings_get_stats(&st);
+    snprintf(tmp, sizeof(tmp), ",\"settings\":{\"source\":\"%s\",\"load_us\":%lu}",
+             settings_sources[st.source], (unsigned long)st.load_us);
+    httpd_resp_sendstr_chunk(req, tmp);
+
+#if CONFIG_BRIDGE_MODE_RAW
+    tcp_server_stats_t br;
+    tcp_server_get_stats(&br);
+    snprintf(tmp, sizeof(tmp), ",\"bridge\":{\"transport\":\"%s\",\"sessions\":%lu,\"uart_to_eth_bytes\":%llu,"
+             "\"eth_to_uart_bytes\":%llu,\"tx_throttled\":%lu,\"rejected\":%lu}",
+             BRIDGE_TRANSPORT_NAME, (unsigned long)br.sessions, (unsigned long long)br.uart_to_eth_bytes,
+             (unsigned long long)br.eth_to_uart_bytes, (unsigned long)br.tx_throttled, (unsigned long)br.rejected);
+    httpd_resp_sendstr_chunk(req, tmp);
+#if CONFIG_ADMISSION_ENABLE
+    admission_stats_t adm;
+    admission_get_stats(&adm);
+    snprintf(tmp, sizeof(tmp), ",\"admission\":{\"denied\":%lu,\"rate_limited\":%lu,\"first_byte_timeouts\":%lu,"
+             "\"preempted\":%lu}",
+             (unsigned long)adm.denied, (unsigned long)adm.rate_limited, (unsigned long)br.first_byte_timeouts,
+             (unsigned long)br.preempted);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_WS_BRIDGE_ENABLE
+    ws_bridge_stats_t wsb;
+    ws_bridge_get_stats(&wsb);
+    snprintf(tmp, sizeof(tmp), ",\"ws\":{\"frames_out\":%lu,\"frames_in\":%lu,\"uart_to_ws_bytes\":%llu,"
+             "\"ws_to_uart_bytes\":%llu,\"oversized\":%lu,\"tx_waits\":%lu,"
+             "\"tx_overruns\":%lu,\"tx_stalls\":%lu}",
+             (unsigned long)wsb.frames_out, (unsigned long)wsb.frames_in, (unsigned long long)wsb.uart_to_ws_bytes,
+             (unsigned long long)wsb.ws_to_uart_bytes, (unsigned long)wsb.oversized, (unsigned long)wsb.tx_waits,
+             (unsigned long)wsb.tx_overruns, (unsigned long)wsb.tx_stalls);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_UART_DMA_ENABLE
+    uart_dma_stats_t dma;
+    uart_dma_get_stats(&dma);
+    snprintf(tmp, sizeof(tmp), ",\"uart_dma\":{\"rx_buffers_max\":%lu,\"rx_starved\":%lu,"
+             "\"tx_buffers_max\":%lu,\"tx_full\":%lu}",
+             (unsigned long)dma.rx_slots_max, (unsigned long)dma.rx_starved,
+             (unsigned long)dma.tx_slots_max, (unsigned long)dma.tx_full);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_MUX_ENABLE
+    mux_server_stats_t mux;
+    mux_server_get_stats(&mux);
+    snprintf(tmp, sizeof(tmp), ",\"mux\":{\"sessions\":%lu,\"protocol_errors\":%lu,\"channels\":[",
+             (unsigned long)mux.sessions, (unsigned long)mux.protocol_errors);
+    httpd_resp_sendstr_chunk(req, tmp);
+    for (int i = 0; i < mux.channels; i++) {
+        snprintf(tmp, sizeof(tmp), "%s{\"to_uart_bytes\":%llu,\"from_uart_bytes\":%llu,\"stalls\":%lu}",
+                 i ? "," : "", (unsigned long long)mux.ch[i].to_uart_bytes,
+                 (unsigned long long)mux.ch[i].from_uart_bytes, (unsigned long)mux.ch[i].stalls);
+        httpd_resp_sendstr_chunk(req, tmp);
+    }
+    httpd_resp_sendstr_chunk(req, "]}");
+#endif
+#endif
+#if !CONFIG_UART_DMA_ENABLE
+    uart_events_stats_t ue;
+    uart_events_get_stats(&ue);
+    snprintf(tmp, sizeof(tmp), ",\"uart\":{\"fifo_overruns\":%lu,\"buffer_full\":%lu,\"frame_errors\":%lu,"
+             "\"parity_errors\":%lu,\"breaks\":%lu,\"queue_full\":%lu}",
+             (unsigned long)ue.fifo_overruns, (unsigned long)ue.buffer_full, (unsigned long)ue.frame_errors,
+             (unsigned long)ue.parity_errors, (unsigned long)ue.breaks, (unsigned long)ue.queue_full);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_FLASH_STRESS_ENABLE
+    flash_stress_stats_t fs;
+    flash_stress_get_stats(&fs);
+    snprintf(tmp, sizeof(tmp), ",\"flash_stress\":{\"writes\":%lu,\"errors\":%lu,\"write_us\":%lu,"
+             "\"write_max_us\":%lu}",
+             (unsigned long)fs.writes, (unsigned long)fs.errors, (unsigned long)fs.write_us,
+             (unsigned long)fs.write_max_us);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_UART_SELFTEST_ENABLE
+    static const char *const selftest_states[] = { "idle", "running", "done", "failed" };
+    uart_selftest_result_t sr;
+    uart_selftest_get_result(&sr);
+    snprintf(tmp, sizeof(tmp), ",\"selftest\":{\"state\":\"%s\",\"error\":\"%s\",\"baud_rate\":%lu,\"duration_ms\":%lu,"
+             "\"sent\":%llu,\"received\":%llu,\"errors\":%lu,",
+             selftest_states[sr.state], sr.error ? esp_err_to_name(sr.error) : "", (unsigned long)sr.baud_rate,
+             (unsigned long)sr.duration_ms, (unsigned long long)sr.sent, (unsigned long long)sr.received,
+             (unsigned long)sr.errors);
+    httpd_resp_sendstr_chunk(req, tmp);
+    snprintf(tmp, sizeof(tmp), "\"bytes_per_s\":%lu,\"line_pct\":%lu,\"fifo_overruns\":%lu,\"buffer_full\":%lu,"
+             "\"rx_buffered_max\":%lu,\"tx_buffered_max\":%lu}",
+             (unsigned long)sr.bytes_per_s, (unsigned long)sr.line_pct, (unsigned long)sr.fifo_overruns,
+             (unsigned long)sr.buffer_full, (unsigned long)sr.rx_buffered_max, (unsigned long)sr.tx_buffered_max);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_MGMT_ENABLE
+    mgmt_server_stats_t mg;
+    mgmt_server_get_stats(&mg);
+    snprintf(tmp, sizeof(tmp), ",\"mgmt\":{\"sessions\":%lu,\"auth_failures\":%lu,\"requests\":%lu,"
+             "\"settings_saved\":%lu}",
+             (unsigned long)mg.sessions, (unsigned long)mg.auth_failures, (unsigned long)mg.requests,
+             (unsigned long)mg.settings_saved);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_POWER_MGMT_ENABLE
+#if CONFIG_POWER_MGMT_LIGHT_SLEEP
+    const char *const light_sleep = "true";
+#else
+    const char *const light_sleep = "false";
+#endif
+    power_mgmt_stats_t pw;
+    power_mgmt_get_stats(&pw);
+    snprintf(tmp, sizeof(tmp), ",\"power\":{\"min_mhz\":%d,\"max_mhz\":%d,\"light_sleep\":%s,\"wakeups\":%lu,"
+             "\"full_clock_ms\":%llu,\"links_up\":%lu}",
+             POWER_MGMT_MIN_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ, light_sleep,
+             (unsigned long)pw.wakeups, (unsigned long long)(pw.full_clock_us / 1000), (unsigned long)pw.links_up);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_UART_LINE_RS485
+    rs485_stats_t rs;
+    rs485_get_stats(&rs);
+    snprintf(tmp, sizeof(tmp), ",\"rs485\":{\"frames\":%lu,\"collisions\":%lu,\"echo_bytes\":%lu,"
+             "\"noise_bytes\":%lu,\"turnarounds\":%lu,\"turnaround_us\":%lu,\"turnaround_min_us\":%lu,"
+             "\"turnaround_max_us\":%lu,\"turnaround_avg_us\":%lu}",
+             (unsigned long)rs.frames, (unsigned long)rs.collisions, (unsigned long)rs.echo_bytes,
+             (unsigned long)rs.noise_bytes, (unsigned long)rs.turnarounds, (unsigned long)rs.turnaround_us,
+             (unsigned long)rs.turnaround_min_us, (unsigned long)rs.turnaround_max_us,
+             (unsigned long)rs.turnaround_avg_us);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_BRIDGE_MODE_MODBUS_GW
+    modbus_gw_stats_t gw;
+    modbus_gw_get_stats(&gw);
+    snprintf(tmp, sizeof(tmp), ",\"modbus\":{\"requests\":%lu,\"responses\":%lu,\"broadcasts\":%lu,"
+             "\"timeouts\":%lu,\"crc_errors\":%lu,\"bad_frames\":%lu}",
+             (unsigned long)gw.requests, (unsigned long)gw.responses, (unsigned long)gw.broadcasts,
+             (unsigned long)gw.timeouts, (unsigned long)gw.crc_errors, (unsigned long)gw.bad_frames);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_BRIDGE_MODE_MQTT
+    mqtt_bridge_stats_t mqtt;
+    mqtt_bridge_get_stats(&mqtt);
+    snprintf(tmp, sizeof(tmp), ",\"mqtt\":{\"connected\":%s,\"connects\":%lu,\"frames\":%lu,\"dropped\":%lu,"
+             "\"split\":%lu,\"publishes\":%lu,\"resent\":%lu,\"acked\":%lu,\"inflight\":%lu,",
+             mqtt.connected ? "true" : "false", (unsigned long)mqtt.connects, (unsigned long)mqtt.frames,
+             (unsigned long)mqtt.dropped, (unsigned long)mqtt.split, (unsigned long)mqtt.publishes,
+             (unsigned long)mqtt.resent, (unsigned long)mqtt.acked, (unsigned long)mqtt.inflight);
+    httpd_resp_sendstr_chunk(req, tmp);
+    snprintf(tmp, sizeof(tmp), "\"queued_bytes\":%lu,\"queued_max\":%lu,\"queue_size\":%d,\"ack_us_avg\":%lu,"
+             "\"ack_us_max\":%lu,\"rx_messages\":%lu,\"rx_bytes\":%llu}",
+             (unsigned long)mqtt.queued_bytes, (unsigned long)mqtt.queued_max, MQTT_BRIDGE_QUEUE_SZ,
+             (unsigned long)mqtt.ack_us_avg, (unsigned long)mqtt.ack_us_max, (unsigned long)mqtt.rx_messages,
+             (unsigned long long)mqtt.rx_bytes);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_MODBUS_CACHE_ENABLE
+    modbus_cache_stats_t cache;
+    modbus_cache_get_stats(&cache);
+    snprintf(tmp, sizeof(tmp), ",\"modbus_cache\":{\"hits\":%lu,\"misses\":%lu,\"stores\":%lu,"
+             "\"evictions\":%lu,\"invalidations\":%lu,\"bypasses\":%lu,\"capacity\":%u,\"used\":%u}",
+             (unsigned long)cache.hits, (unsigned long)cache.misses, (unsigned long)cache.stores,
+             (unsigned long)cache.evictions, (unsigned long)cache.invalidations, (unsigned long)cache.bypasses,
+             cache.capacity, cache.used);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+
+    eth_perf_profile_t eth;
+    example_eth_get_perf_profile(&eth);
+    snprintf(tmp, sizeof(tmp), ",\"eth\":{\"profile\":\"%s\",\"rx_task_prio\":%lu,\"rx_task_core\":%d,"
+             "\"dma_rx_buffers\":%d,\"dma_tx_buffers\":%d,\"spi_polling_ms\":%lu",
+             eth.name, (unsigned long)eth.rx_task_prio, eth.rx_task_core,
+             eth.dma_rx_buffers, eth.dma_tx_buffers, (unsigned long)eth.spi_polling_ms[0]);
+    httpd_resp_sendstr_chunk(req, tmp);
+#if CONFIG_LWIP_STATS
+    // 16 bit lwIP counters, wrap around
+    snprintf(tmp, sizeof(tmp), ",\"rx_packets\":%u,\"tx_packets\":%u,\"rx_drops\":%u,\"tcp_drops\":%u",
+             (unsigned)lwip_stats.ip.recv, (unsigned)lwip_stats.ip.xmit,
+             (unsigned)(lwip_stats.link.drop + lwip_stats.ip.drop), (unsigned)lwip_stats.tcp.drop);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    // Idle task run time against uptime gives CPU load between two samples
+    snprintf(tmp, sizeof(tmp), ",\"uptime_us\":%lld,\"idle_us\":[", (long long)esp_timer_get_time());
+    httpd_resp_sendstr_chunk(req, tmp);
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        snprintf(tmp, sizeof(tmp), "%s%llu", core ? "," : "",
+                 (unsigned long long)ulTaskGetRunTimeCounter(xTaskGetIdleTaskHandleForCore(core)));
+        httpd_resp_sendstr_chunk(req, tmp);
+    }
+    httpd_resp_sendstr_chunk(req, "]");
+#endif
+    httpd_resp_sendstr_chunk(req, "}");
+#if CONFIG_ETH_FAILOVER_ENABLE
+    eth_failover_stats_t fo;
+    eth_failover_get_stats(&fo);
+    snprintf(tmp, sizeof(tmp), ",\"failover\":{\"active\":%d,\"switches\":%lu,\"link_downs\":%lu,"
+             "\"sessions_dropped\":%lu,\"last_switch_us\":%lu}",
+             fo.active, (unsigned long)fo.switches, (unsigned long)fo.link_downs,
+             (unsigned long)fo.sessions_dropped, (unsigned long)fo.last_switch_us);
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+#if CONFIG_PROFILER_ENABLE
+    // Per task details are served by /profile
+    profiler_stats_t prof;
+    profiler_get_stats(&prof);
+    snprintf(tmp, sizeof(tmp), ",\"profiler\":{\"tasks\":%u,\"sample_us\":%lu,\"overhead_pct\":%u.%02u,\"load\":[",
+             prof.tasks, (unsigned long)prof.sample_us, prof.overhead / 100, prof.overhead % 100);
+    httpd_resp_sendstr_chunk(req, tmp);
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        uint16_t const *load = prof.cores[core].load;
+        snprintf(tmp, sizeof(tmp), "%s[%u.%u,%u.%u,%u.%u]", core ? "," : "",
+                 load[0] / 10, load[0] % 10, load[1] / 10, load[1] % 10, load[2] / 10, load[2] % 10);
+        httpd_resp_sendstr_chunk(req, tmp);
+    }
+    httpd_resp_sendstr_chunk(req, "]}");
+#endif
+
+#if CONFIG_OTA_ENABLE
+    static const char *const ota_states[] = { "idle", "running", "done", "failed" };
+    ota_stats_t ota;
+    ota_update_get_stats(&ota);
+    snprintf(tmp, sizeof(tmp), ",\"ota\":{\"state\":\"%s\",\"bytes\":%lu,\"duration_ms\":%lu,"
+             "\"throughput\":%lu,\"error\":\"%s\"}",
+             ota_states[ota.state], (unsigned long)ota.bytes, (unsigned long)ota.duration_ms,
+             (unsigned long)ota.throughput, ota.last_error ? esp_err_to_name(ota.last_error) : "");
+    httpd_resp_sendstr_chunk(req, tmp);
+#endif
+
+    httpd_resp_sendstr_chunk(req, "}");
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+static esp_err_t mem_get_handler(httpd_req_t *req) {
+    httpd_resp_set_type(req, "application/json");
+
+    char tmp[192];
+    size_t count;
+    const mem_arena_entry_t *map = mem_arena_map(&count);
+    httpd_resp_sendstr_chunk(req, "{\"buffers\":[");
+    bool first = true;
+    for (size_t i = 0; i < count; i++) {
+        if (!map[i].size)
+            continue;
+        // Buffers of the drivers and lwIP are only counted, they have no address here
+        char addr[16] = "null";
+        if (!map[i].external)
+            snprintf(addr, sizeof(addr), "\"0x%08lx\"", (unsigned long)(uintptr_t)map[i].addr);
+        snprintf(tmp, sizeof(tmp), "%s{\"name\":\"%s\",\"region\":\"%s\",\"size\":%lu,\"addr\":%s}",
+                 first ? "" : ",", map[i].name, mem_arena_region_name(map[i].region), (unsigned long)map[i].size,
+                 addr);
+        httpd_resp_sendstr_chunk(req, tmp);
+        first = false;
+    }
+
+    httpd_resp_sendstr_chunk(req, "],\"regions\":{");
+    first = true;
+    for (int r = 0; r < MEM_REGION_COUNT; r++) {
+        mem_region_stats_t st;
+        mem_arena_get_region(r, &st);
+        if (!st.reserved && !st.external && !st.free)
+            continue;
+        snprintf(tmp, sizeof(tmp), "%s\"%s\":{\"reserved\":%lu,\"external\":%lu,\"free\":%lu,"
+                 "\"min_free\":%lu,\"largest_block\":%lu}",
+                 first ? "" : ",", mem_arena_region_name(r), (unsigned long)st.reserved,
+                 (unsigned long)st.external, (unsigned long)st.free, (unsigned long)st.min_free,
+                 (unsigned long)st.largest_block);
+        httpd_resp_sendstr_chunk(req, tmp);
+        first = false;
+    }
+
+    httpd_resp_sendstr_chunk(req, "},\"pools\":[");
+    mem_pool_stats_t pools[MEM_POOL_MAX];
+    int const pool_cnt = mem_pool_get_stats(pools, MEM_POOL_MAX);
+    for (int i = 0; i < pool_cnt; i++) {
+        snprintf(tmp, sizeof(tmp), "%s{\"name\":\"%s\",\"block_size\":%u,\"blocks\":%u,\"used\":%u,"
+                 "\"used_max\":%u,\"exhausted\":%lu}",
+                 i ? "," : "", pools[i].name, pools[i].block_size, pools[i].blocks, pools[i].used,
+                 pools[i].used_max, (unsigned long)pools[i].exhausted);
+        httpd_resp_sendstr_chunk(req, tmp);
+    }
+    httpd_resp_sendstr_chunk(req, "]}");
+    return httpd_resp_sendstr_chunk(req, NULL);
+}
 
 static const httpd_uri_t root = {
     .uri       = "/",
@@ -182,29 +587,122 @@ static const httpd_uri_t save = {
     .handler   = save_post_handler
 };
 
+#if CONFIG_UART_SELFTEST_ENABLE
+static const httpd_uri_t selftest = {
+    .uri       = "/selftest",
+    .method    = HTTP_POST,
+    .handler   = selftest_post_handler
+};
+#endif
+
+static const httpd_uri_t stats = {
+    .uri       = "/stats",
+    .method    = HTTP_GET,
+    .handler   = stats_get_handler
+};
 
-void start_webserver(void) {
+static const httpd_uri_t mem = {
+    .uri       = "/mem",
+    .method    = HTTP_GET,
+    .handler   = mem_get_handler
+};
+
+#if CONFIG_OTA_ENABLE
+static const httpd_uri_t ota = {
+    .uri       = "/ota",
+    .method    = HTTP_POST,
+    .handler   = ota_upload_handler
+};
+
+static const httpd_uri_t ota_pull = {
+    .uri       = "/ota/pull",
+    .method    = HTTP_POST,
+    .handler   = ota_pull_handler
+};
+#endif
+
+#if CONFIG_WS_BRIDGE_ENABLE
+static const httpd_uri_t ws = {
+    .uri                      = "/ws",
+    .method                   = HTTP_GET,
+    .handler                  = ws_bridge_handler,
+    .is_websocket             = true,
+    .handle_ws_control_frames = true
+};
+#endif
+
+#if CONFIG_PROFILER_ENABLE
+static const httpd_uri_t profile = {
+    .uri       = "/profile",
+    .method    = HTTP_GET,
+    .handler   = profiler_get_handler
+};
+#endif
+
+/** Start the server with the endpoints that are always available */
+static esp_err_t webserver_init(void) {
     if (server) {
-        return;
+        return ESP_OK;
     }
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 8;
+    config.max_uri_handlers = 10;
+    // Flash writes during update must not delay the bridge tasks
+    config.task_priority = CONFIG_WEBSERVER_TASK_PRIORITY;
     // Increase stack size to avoid overflow when rendering pages
     if (config.stack_size < 6144) {
         config.stack_size = 6144;
     }
-    
+#if CONFIG_WS_BRIDGE_ENABLE
+    config.close_fn = ws_bridge_sock_close;
+#endif
+
     ESP_LOGI(TAG, "Starting server on port: \'%d\'", config.server_port);
-    if (httpd_start(&server, &config) == ESP_OK) {
-        httpd_register_uri_handler(server, &root);
-        httpd_register_uri_handler(server, &save);
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK) {
+        return err;
+    }
+    httpd_register_uri_handler(server, &stats);
+    httpd_register_uri_handler(server, &mem);
+#if CONFIG_OTA_ENABLE
+    // Firmware update is never open to anyone on the network
+    if (CONFIG_OTA_AUTH_TOKEN[0]) {
+        httpd_register_uri_handler(server, &ota);
+        httpd_register_uri_handler(server, &ota_pull);
+    } else {
+        ESP_LOGW(TAG, "Firmware update disabled, no update token set");
+    }
+#endif
+#if CONFIG_PROFILER_ENABLE
+    httpd_register_uri_handler(server, &profile);
+#endif
+#if CONFIG_WS_BRIDGE_ENABLE
+    httpd_register_uri_handler(server, &ws);
+#endif
+    return ESP_OK;
+}
+
+void start_service_webserver(void) {
+    webserver_init();
+}
+
+void start_webserver(void) {
+    if (config_pages || webserver_init() != ESP_OK) {
+        return;
     }
+    httpd_register_uri_handler(server, &root);
+    httpd_register_uri_handler(server, &save);
+#if CONFIG_UART_SELFTEST_ENABLE
+    // Takes the UART over, only with the configuration pages
+    httpd_register_uri_handler(server, &selftest);
+#endif
+    config_pages = true;
 }
 
 void stop_webserver(void) {
     if (server) {
         httpd_stop(server);
         server = NULL;
+        config_pages = false;
     }
 }
@@ -0,0 +1,337 @@
+/* WebSocket bridge
+
+   The /ws endpoint of the web server bridges the UART to a WebSocket, so a browser
+   terminal or any WebSocket tool can reach it without a raw TCP client. It takes
+   the UART through the same session arbitration as the bridge port, only one of
+   them holds it at a time.
+
+   UART data is collected into a single buffer until it is full or the line
+   has been quiet for the coalescing time and then sent as one binary frame, so the
+   per frame overhead stays small at high rates and the latency low at low rates.
+   Received data frames are read into another buffer by the web server task, which
+   passes to the UART what the rate limit and the driver buffer take right away and
+   holds the rest for the bridge task. A client sending the next frame before the
+   held one is written gets a short grace time, then its session is closed with
+   status 1013 rather than stalling the web server task shared by every page. A
+   held frame the UART takes nothing of for a while (CTS held by the peer) also
+   ends the session. Nothing is allocated per frame.
+
+   Frames sent from the bridge task and the control frame replies sent from the web
+   server task are serialized by a lock; the session socket is released under the
+   same lock, so no frame goes to a socket that was closed meanwhile.
+*/
+#include <string.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_check.h"
+
+#include "lwip/sockets.h"
+
+#include "ws_bridge.h"
+#include "tcp_server.h"
+#include "token_bucket.h"
+#include "mem_arena.h"
+#if CONFIG_POWER_MGMT_ENABLE
+#include "power_mgmt.h"
+#endif
+
+#define FRAME_SIZE      CONFIG_WS_BRIDGE_FRAME_SIZE
+#define COALESCE_TICKS  MAX(1, pdMS_TO_TICKS(CONFIG_WS_BRIDGE_COALESCE_MS))
+
+// Longest wait of the web server task for the held frame to be written
+#define TX_WAIT_TICKS   MAX(1, pdMS_TO_TICKS(100))
+// A held frame the UART takes nothing of for this long ends the session
+#define TX_STALL_TICKS  pdMS_TO_TICKS(2000)
+
+// Room left in the UART TX ring buffer for the header the driver stores with every write
+#define UART_TX_HDR_MARGIN 32
+
+// Close frame status codes, RFC 6455 section 7.4.1
+#define WS_CLOSE_NORMAL      1000
+#define WS_CLOSE_GOING_AWAY  1001
+#define WS_CLOSE_TOO_BIG     1009
+#define WS_CLOSE_INTERNAL    1011
+#define WS_CLOSE_TRY_LATER   1013
+
+static const char *TAG = "ws_bridge";
+
+static struct {
+    uart_port_t       uart;
+    TaskHandle_t      task;
+    SemaphoreHandle_t lock;             // serializes sending, writing the held frame and the release of fd
+    SemaphoreHandle_t tx_free;          // given while tx_buf holds no frame
+    httpd_handle_t    hd;
+    int               fd;               // socket of the session holding the UART, -1 if none
+    token_bucket_t    shaper;
+    uint8_t          *rx_buf;           // UART -> WebSocket, bridge task only
+    uint8_t          *tx_buf;           // WebSocket -> UART, owned by the holder of tx_free
+    size_t            tx_len;           // frame held in tx_buf, 0 if none
+    size_t            tx_off;           // passed to the UART so far
+    ws_bridge_stats_t stats;
+} ws = { .fd = -1 };
+
+static void send_close(httpd_handle_t hd, int fd, uint16_t code)
+{
+    uint8_t status[2] = { code >> 8, code & 0xFF };
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_CLOSE,
+        .payload = status,
+        .len = sizeof(status)
+    };
+    httpd_ws_send_frame_async(hd, fd, &frame);
+}
+
+/** Close the socket and end the session if the socket holds it, called with the lock held */
+static void close_session(httpd_handle_t hd, int fd, uint16_t code)
+{
+    send_close(hd, fd, code);
+    if (fd == ws.fd)
+        ws.fd = -1;
+    httpd_sess_trigger_close(hd, fd);
+}
+
+static int uart_write_nonblock(const uint8_t *data, size_t len)
+{
+#if CONFIG_UART_TX_BUFF_SIZE
+    size_t room = 0;
+    uart_get_tx_buffer_free_size(ws.uart, &room);
+    if (room <= UART_TX_HDR_MARGIN)
+        return 0;
+    return uart_write_bytes(ws.uart, data, MIN(len, room - UART_TX_HDR_MARGIN));
+#else
+    // No driver TX buffer, fill the hardware FIFO directly
+    return uart_tx_chars(ws.uart, (const char *)data, len);
+#endif
+}
+
+/** Free the frame buffer once the held frame is written or its session ended, called with the lock held */
+static void release_held(void)
+{
+    if (ws.tx_len) {
+        ws.tx_len = ws.tx_off = 0;
+        xSemaphoreGive(ws.tx_free);
+    }
+}
+
+/**
+ * Pass the held frame to the UART as far as the rate limit and the driver take it,
+ * called with the lock held. True if anything was written.
+ */
+static bool write_held(void)
+{
+    bool moved = false;
+    while (ws.tx_off < ws.tx_len) {
+        uint32_t const allowed = MIN(ws.tx_len - ws.tx_off, token_bucket_available(&ws.shaper));
+        int const written = allowed ? uart_write_nonblock(ws.tx_buf + ws.tx_off, allowed) : 0;
+        if (written <= 0)
+            return moved;
+        moved = true;
+        token_bucket_consume(&ws.shaper, written);
+        ws.stats.ws_to_uart_bytes += written;
+        ws.tx_off += written;
+#if CONFIG_POWER_MGMT_ENABLE
+        power_mgmt_busy();
+#endif
+    }
+    release_held();
+    return moved;
+}
+
+static void ws_bridge_task(void *pvParameters)
+{
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        ESP_LOGI(TAG, "Session started");
+        bool end = false;
+        bool held = false;
+        TickType_t moved_at = xTaskGetTickCount();
+        while (!end) {
+            // Returns with a full frame or once the line has been quiet for the coalescing
+            // time, every tick while the rest of a received frame waits for the UART
+            int const len = uart_read_bytes(ws.uart, ws.rx_buf, FRAME_SIZE, held ? 1 : COALESCE_TICKS);
+
+            xSemaphoreTake(ws.lock, portMAX_DELAY);
+            TickType_t const now = xTaskGetTickCount();
+            if (write_held() || !ws.tx_len)
+                moved_at = now;
+            held = ws.tx_len;
+            int const fd = ws.fd;
+            if (fd < 0) {
+                end = true;
+            } else if (held && now - moved_at >= TX_STALL_TICKS) {
+                ESP_LOGW(TAG, "UART takes no data, session closed");
+                ws.stats.tx_stalls++;
+                close_session(ws.hd, fd, WS_CLOSE_TRY_LATER);
+                end = true;
+            } else if (tcp_server_session_dropped()) {
+                ESP_LOGW(TAG, "Link down, session dropped");
+                close_session(ws.hd, fd, WS_CLOSE_GOING_AWAY);
+                end = true;
+            } else if (len < 0) {
+                ESP_LOGE(TAG, "Uart read failed");
+                close_session(ws.hd, fd, WS_CLOSE_INTERNAL);
+                end = true;
+            } else if (len > 0) {
+                httpd_ws_frame_t frame = {
+                    .final = true,
+                    .type = HTTPD_WS_TYPE_BINARY,
+                    .payload = ws.rx_buf,
+                    .len = len
+                };
+                if (httpd_ws_send_frame_async(ws.hd, fd, &frame) == ESP_OK) {
+                    ws.stats.frames_out++;
+                    ws.stats.uart_to_ws_bytes += len;
+#if CONFIG_POWER_MGMT_ENABLE
+                    power_mgmt_busy();
+#endif
+                } else {
+                    ESP_LOGW(TAG, "Error occurred during sending");
+                    ws.fd = -1;
+                    httpd_sess_trigger_close(ws.hd, fd);
+                    end = true;
+                }
+            }
+            xSemaphoreGive(ws.lock);
+        }
+        // Whatever is left belongs to the closed session
+        xSemaphoreTake(ws.lock, portMAX_DELAY);
+        release_held();
+        xSemaphoreGive(ws.lock);
+        uart_flush_input(ws.uart);
+        tcp_server_session_release();
+        ESP_LOGI(TAG, "Session closed");
+    }
+}
+
+static esp_err_t session_open(httpd_req_t *req, int fd)
+{
+    struct sockaddr_in local_addr;
+    socklen_t addr_len = sizeof(local_addr);
+    uint32_t const local_ip = getsockname(fd, (struct sockaddr *)&local_addr, &addr_len) == 0 ?
+                              local_addr.sin_addr.s_addr : 0;
+
+    xSemaphoreTake(ws.lock, portMAX_DELAY);
+    if (!tcp_server_session_claim(local_ip)) {
+        ESP_LOGW(TAG, "UART is in use by another session");
+        close_session(req->handle, fd, WS_CLOSE_TRY_LATER);
+    } else {
+        token_bucket_init(&ws.shaper, CONFIG_BRIDGE_TX_RATE_LIMIT, CONFIG_BRIDGE_TX_BURST);
+        ws.hd = req->handle;
+        ws.fd = fd;
+        xTaskNotifyGive(ws.task);
+    }
+    xSemaphoreGive(ws.lock);
+    return ESP_OK;
+}
+
+esp_err_t ws_bridge_handler(httpd_req_t *req)
+{
+    int const fd = httpd_req_to_sockfd(req);
+    if (!ws.task) {
+        // The bridge is not up yet
+        send_close(req->handle, fd, WS_CLOSE_TRY_LATER);
+        return ESP_FAIL;
+    }
+    // Called with GET once the handshake is done, then for every frame received
+    if (req->method == HTTP_GET)
+        return session_open(req, fd);
+
+    httpd_ws_frame_t frame = { 0 };
+    ESP_RETURN_ON_ERROR(httpd_ws_recv_frame(req, &frame, 0), TAG, "Frame header receive failed");
+    if (frame.len > FRAME_SIZE) {
+        ESP_LOGW(TAG, "%u byte frame does not fit", (unsigned)frame.len);
+        ws.stats.oversized++;
+        xSemaphoreTake(ws.lock, portMAX_DELAY);
+        send_close(req->handle, fd, WS_CLOSE_TOO_BIG);
+        if (fd == ws.fd)
+            ws.fd = -1;
+        xSemaphoreGive(ws.lock);
+        // The rest of the frame cannot be skipped, the server drops the connection
+        return ESP_FAIL;
+    }
+    // The buffer is free unless the client is a frame ahead of the UART
+    if (xSemaphoreTake(ws.tx_free, 0) != pdTRUE) {
+        ws.stats.tx_waits++;
+        if (xSemaphoreTake(ws.tx_free, TX_WAIT_TICKS) != pdTRUE) {
+            ESP_LOGW(TAG, "Client is ahead of the UART, session closed");
+            ws.stats.tx_overruns++;
+            xSemaphoreTake(ws.lock, portMAX_DELAY);
+            close_session(req->handle, fd, WS_CLOSE_TRY_LATER);
+            xSemaphoreGive(ws.lock);
+            // The frame is left unread, the server drops the connection
+            return ESP_FAIL;
+        }
+    }
+    frame.payload = ws.tx_buf;
+    if (frame.len && httpd_ws_recv_frame(req, &frame, frame.len) != ESP_OK) {
+        xSemaphoreGive(ws.tx_free);
+        ESP_LOGE(TAG, "Frame receive failed");
+        return ESP_FAIL;
+    }
+    bool handed = false;
+
+    switch (frame.type) {
+    case HTTPD_WS_TYPE_TEXT:
+    case HTTPD_WS_TYPE_BINARY:
+    case HTTPD_WS_TYPE_CONTINUE:
+        // Frames of a refused connection still on its way out are ignored
+        xSemaphoreTake(ws.lock, portMAX_DELAY);
+        if (fd == ws.fd && frame.len) {
+            ws.stats.frames_in++;
+            ws.tx_len = frame.len;
+            write_held();
+            handed = true;
+        }
+        xSemaphoreGive(ws.lock);
+        break;
+    case HTTPD_WS_TYPE_PING:
+        frame.type = HTTPD_WS_TYPE_PONG;
+        xSemaphoreTake(ws.lock, portMAX_DELAY);
+        httpd_ws_send_frame_async(req->handle, fd, &frame);
+        xSemaphoreGive(ws.lock);
+        break;
+    case HTTPD_WS_TYPE_CLOSE:
+        xSemaphoreTake(ws.lock, portMAX_DELAY);
+        close_session(req->handle, fd, frame.len >= 2 ? (frame.payload[0] << 8) | frame.payload[1] : WS_CLOSE_NORMAL);
+        xSemaphoreGive(ws.lock);
+        break;
+    default:
+        break;
+    }
+    // Otherwise the buffer is freed once the frame has gone to the UART
+    if (!handed)
+        xSemaphoreGive(ws.tx_free);
+    return ESP_OK;
+}
+
+void ws_bridge_sock_close(httpd_handle_t hd, int sockfd)
+{
+    if (ws.lock) {
+        xSemaphoreTake(ws.lock, portMAX_DELAY);
+        if (sockfd == ws.fd)
+            ws.fd = -1;
+        xSemaphoreGive(ws.lock);
+    }
+    close(sockfd);
+}
+
+void ws_bridge_init(uart_port_t uart)
+{
+    ws.uart = uart;
+    ws.rx_buf = mem_arena_get(MEM_WS_RX);
+    ws.tx_buf = mem_arena_get(MEM_WS_TX);
+    ws.lock = xSemaphoreCreateMutex();
+    ws.tx_free = xSemaphoreCreateBinary();
+    assert(ws.lock && ws.tx_free);
+    xSemaphoreGive(ws.tx_free);
+    xTaskCreatePinnedToCore(ws_bridge_task, "ws_bridge", 3072, NULL, 5, &ws.task, BRIDGE_TASK_CORE);
+}
+
+void ws_bridge_get_stats(ws_bridge_stats_t *stats)
+{
+    *stats = ws.stats;
+}
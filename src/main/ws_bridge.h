@@ -0,0 +1,32 @@
+#pragma once
+
+#ifndef WS_BRIDGE_H
+#define WS_BRIDGE_H
+
+#include <stdint.h>
+#include "driver/uart.h"
+#include "esp_http_server.h"
+
+typedef struct {
+    uint32_t frames_out;        // binary frames sent with UART data
+    uint32_t frames_in;         // data frames received for the UART
+    uint64_t uart_to_ws_bytes;
+    uint64_t ws_to_uart_bytes;
+    uint32_t oversized;         // frames larger than the frame buffer, the session is closed
+    uint32_t tx_waits;          // frames received while the previous one still waited for the UART
+    uint32_t tx_overruns;       // sessions closed for staying ahead of the UART past the grace time
+    uint32_t tx_stalls;         // sessions closed for the UART taking no data
+} ws_bridge_stats_t;
+
+/** Start the task streaming UART data to the WebSocket session */
+void ws_bridge_init(uart_port_t uart);
+
+/** GET /ws - WebSocket bridge endpoint, register with is_websocket and handle_ws_control_frames set */
+esp_err_t ws_bridge_handler(httpd_req_t *req);
+
+/** Web server close_fn, ends the WebSocket session when its socket goes away */
+void ws_bridge_sock_close(httpd_handle_t hd, int sockfd);
+
+void ws_bridge_get_stats(ws_bridge_stats_t *stats);
+
+#endif // WS_BRIDGE_H
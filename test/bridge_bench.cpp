@@ -0,0 +1,1011 @@
+// Benchmark and integrity test for the serial bridge sockets.
+//
+// Opens N connections to an echo endpoint (the bridge port with the UART looped
+// back, or any other echo server) and sends chunks of sequence stamped data over
+// every one of them. Every chunk starts with a header carrying the connection id,
+// the chunk sequence number and its length, followed by payload bytes derived from
+// those, so the echoed data is verified byte by byte and lost, duplicated or
+// reordered data is reported with the exact place it went wrong.
+//
+// In request / response mode every connection sends one chunk and waits for it to
+// come back before sending the next one, optionally after an idle gap so every
+// request meets a quiet bridge. In streaming mode a writer keeps up to a window
+// of bytes in flight while a reader consumes the echo. Latency is measured from
+// writing a chunk to receiving its last byte back.
+//
+// With --flood N that many more threads keep opening junk connections to the
+// same port for the whole run and count how the bridge turns them away, which
+// shows whether its admission control keeps the measured sessions undisturbed.
+//
+// With --ws the data goes through the WebSocket endpoint of the web server
+// instead, chunks are sent in masked binary frames and the payload of the frames
+// coming back makes up the echoed stream, so both paths are measured the same way.
+//
+// Build: g++ -O2 -std=c++17 -pthread -o bridge_bench bridge_bench.cpp
+// Run with --help for options. With --serve PORT the tool runs an echo server
+// standing in for the bridge, which is handy to check the harness itself.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr uint32_t CHUNK_MAGIC = 0x42424348;    // "BBCH"
+constexpr size_t HDR_LEN = 16;
+constexpr size_t CHUNK_LIMIT = 16 * 1024 * 1024;
+constexpr int POLL_MS = 100;
+constexpr char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+constexpr size_t WS_HDR_MAX = 14;
+constexpr int FLOOD_HOLD_MS = 500;      // how long a junk connection waits to be closed
+constexpr int FLOOD_START_MS = 200;     // head start of the measured connections
+
+enum class Mode { REQ, STREAM };
+
+struct Options {
+    std::string host;
+    std::string port = "3142";
+    int conns = 1;
+    size_t chunk_min = 1024;
+    size_t chunk_max = 1024;
+    Mode mode = Mode::STREAM;
+    double duration = 10;
+    size_t window = 64 * 1024;
+    double drain = 10;
+    double gap = 0;                     // ms of silence before every request
+    bool json = false;
+    bool nodelay = true;
+    uint32_t seed = 1;
+    std::string serve;
+    std::string ws_path;                // WebSocket endpoint, raw TCP if empty
+    size_t ws_frame = 2048;
+    int flood = 0;                      // junk connection threads
+};
+
+struct Flood {
+    std::atomic<uint64_t> attempts{0};
+    std::atomic<uint64_t> failed{0};    // connect failed, backlog full or refused by the stack
+    std::atomic<uint64_t> closed{0};    // closed by the bridge within FLOOD_HOLD_MS
+    std::atomic<uint64_t> held{0};      // still open after FLOOD_HOLD_MS
+};
+
+struct Chunk {
+    uint32_t seq;
+    uint32_t len;
+    Clock::time_point sent;
+};
+
+struct Conn {
+    uint32_t id = 0;
+    int fd = -1;
+    std::mt19937 rng;
+
+    std::mutex lock;                    // protects pending, sent, writer_done and error
+    std::condition_variable cv;
+    std::deque<Chunk> pending;          // written, not yet echoed
+    uint64_t sent = 0;
+    bool writer_done = false;
+    Clock::time_point drain_until;
+    std::string error;
+    std::atomic<bool> failed{false};
+
+    std::atomic<uint64_t> received{0};
+    uint64_t ws_left = 0;               // payload bytes of the current frame not read yet
+    uint64_t ws_mask = 0;               // mask key generator, chunk sizes do not depend on it
+    std::vector<uint8_t> ws_tx;         // frame being sent, header and masked payload
+    uint32_t chunks = 0;
+    uint32_t connect_us = 0;
+    std::vector<uint32_t> latency_us;
+};
+
+std::atomic<bool> interrupted{false};
+
+/** Record the first error of a connection */
+void fail(Conn &c, const std::string &error)
+{
+    std::lock_guard<std::mutex> lk(c.lock);
+    if (c.error.empty())
+        c.error = error;
+    c.failed = true;
+    c.cv.notify_all();
+}
+
+uint64_t splitmix64(uint64_t &state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/** SHA-1 for the WebSocket handshake only */
+std::string sha1(const std::string &msg)
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    std::string data = msg + '\x80';
+    while (data.size() % 64 != 56)
+        data += '\0';
+    uint8_t bits[8];
+    put32(bits, (uint64_t)msg.size() * 8 >> 32);
+    put32(bits + 4, msg.size() * 8);
+    data.append((const char *)bits, 8);
+
+    auto const rol = [](uint32_t v, int n) { return v << n | v >> (32 - n); };
+    for (size_t blk = 0; blk < data.size(); blk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = get32((const uint8_t *)&data[blk + i * 4]);
+        for (int i = 16; i < 80; i++)
+            w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            uint32_t const t = rol(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = rol(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    std::string out(20, '\0');
+    for (int i = 0; i < 5; i++)
+        put32((uint8_t *)&out[i * 4], h[i]);
+    return out;
+}
+
+std::string base64(const std::string &in)
+{
+    static const char tbl[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < in.size(); i += 3) {
+        uint32_t v = (uint8_t)in[i] << 16;
+        if (i + 1 < in.size())
+            v |= (uint8_t)in[i + 1] << 8;
+        if (i + 2 < in.size())
+            v |= (uint8_t)in[i + 2];
+        out += tbl[v >> 18 & 63];
+        out += tbl[v >> 12 & 63];
+        out += i + 1 < in.size() ? tbl[v >> 6 & 63] : '=';
+        out += i + 2 < in.size() ? tbl[v & 63] : '=';
+    }
+    return out;
+}
+
+std::string ws_accept_key(const std::string &key)
+{
+    return base64(sha1(key + WS_GUID));
+}
+
+/** Frame header, the mask key follows it if given */
+size_t ws_put_header(uint8_t *p, uint8_t opcode, uint64_t len, const uint8_t *mask)
+{
+    size_t n = 2;
+    p[0] = 0x80 | opcode;
+    if (len < 126) {
+        p[1] = len;
+    } else if (len < 65536) {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+        n = 4;
+    } else {
+        p[1] = 127;
+        put32(p + 2, len >> 32);
+        put32(p + 6, len);
+        n = 10;
+    }
+    if (mask) {
+        p[1] |= 0x80;
+        std::memcpy(p + n, mask, 4);
+        n += 4;
+    }
+    return n;
+}
+
+/** Header followed by payload which depends on the seed, connection and sequence only */
+void fill_chunk(std::vector<uint8_t> &buf, uint32_t seed, uint32_t conn, uint32_t seq, uint32_t len)
+{
+    buf.resize(len);
+    put32(&buf[0], CHUNK_MAGIC);
+    put32(&buf[4], conn);
+    put32(&buf[8], seq);
+    put32(&buf[12], len);
+    uint64_t state = (uint64_t)seed << 48 ^ (uint64_t)conn << 32 ^ seq;
+    for (size_t i = HDR_LEN; i < len; i += 8) {
+        uint64_t const r = splitmix64(state);
+        std::memcpy(&buf[i], &r, std::min<size_t>(8, len - i));
+    }
+}
+
+/** Wait for the socket to become ready, false once should_stop() says so */
+template <typename Stop>
+bool wait_fd(int fd, short events, Stop should_stop)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    for (;;) {
+        if (interrupted || should_stop())
+            return false;
+        int const rc = poll(&pfd, 1, POLL_MS);
+        if (rc > 0 || (rc < 0 && errno != EINTR))
+            return true;
+    }
+}
+
+template <typename Stop>
+bool send_raw(Conn &c, const uint8_t *buf, size_t len, Stop should_stop)
+{
+    while (len) {
+        if (!wait_fd(c.fd, POLLOUT, should_stop))
+            return false;
+        ssize_t const n = send(c.fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (n < 0) {
+            fail(c, std::string("send: ") + strerror(errno));
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/** Send data, over WebSocket split into binary frames of at most ws_frame bytes */
+template <typename Stop>
+bool send_all(Conn &c, const Options &opt, const uint8_t *buf, size_t len, Stop should_stop)
+{
+    if (opt.ws_path.empty())
+        return send_raw(c, buf, len, should_stop);
+    while (len) {
+        size_t const n = std::min(len, opt.ws_frame);
+        uint8_t mask[4];
+        put32(mask, splitmix64(c.ws_mask));
+        c.ws_tx.resize(WS_HDR_MAX + n);
+        size_t const hdr = ws_put_header(c.ws_tx.data(), 0x2, n, mask);
+        for (size_t i = 0; i < n; i++)
+            c.ws_tx[hdr + i] = buf[i] ^ mask[i & 3];
+        if (!send_raw(c, c.ws_tx.data(), hdr + n, should_stop))
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+template <typename Stop>
+bool recv_raw(Conn &c, uint8_t *buf, size_t len, bool payload, Stop should_stop)
+{
+    while (len) {
+        if (!wait_fd(c.fd, POLLIN, should_stop)) {
+            fail(c, interrupted ? "interrupted" : "timed out waiting for echo");
+            return false;
+        }
+        ssize_t const n = recv(c.fd, buf, len, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (n <= 0) {
+            fail(c, n ? std::string("recv: ") + strerror(errno) : "connection closed by peer");
+            return false;
+        }
+        buf += n;
+        len -= n;
+        if (payload)
+            c.received += n;
+    }
+    return true;
+}
+
+/** Read frame headers up to the next data frame, control frames are skipped */
+template <typename Stop>
+bool ws_next_frame(Conn &c, Stop should_stop)
+{
+    for (;;) {
+        uint8_t hdr[8];
+        if (!recv_raw(c, hdr, 2, false, should_stop))
+            return false;
+        uint8_t const opcode = hdr[0] & 0x0F;
+        if (hdr[1] & 0x80) {
+            fail(c, "masked frame from the server");
+            return false;
+        }
+        uint64_t len = hdr[1] & 0x7F;
+        if (len == 126) {
+            if (!recv_raw(c, hdr, 2, false, should_stop))
+                return false;
+            len = hdr[0] << 8 | hdr[1];
+        } else if (len == 127) {
+            if (!recv_raw(c, hdr, 8, false, should_stop))
+                return false;
+            len = (uint64_t)get32(hdr) << 32 | get32(hdr + 4);
+        }
+        if (opcode <= 0x2) {
+            c.ws_left = len;
+            if (len)
+                return true;
+            continue;
+        }
+        uint8_t ctl[125];
+        if (len > sizeof(ctl)) {
+            fail(c, "oversized control frame");
+            return false;
+        }
+        if (!recv_raw(c, ctl, len, false, should_stop))
+            return false;
+        if (opcode == 0x8) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "closed by the server, status %u", len >= 2 ? ctl[0] << 8 | ctl[1] : 0);
+            fail(c, msg);
+            return false;
+        }
+    }
+}
+
+/** Receive echoed data, over WebSocket the payload of the frames */
+template <typename Stop>
+bool recv_all(Conn &c, const Options &opt, uint8_t *buf, size_t len, Stop should_stop)
+{
+    if (opt.ws_path.empty())
+        return recv_raw(c, buf, len, true, should_stop);
+    while (len) {
+        if (!c.ws_left && !ws_next_frame(c, should_stop))
+            return false;
+        size_t const n = std::min<uint64_t>(len, c.ws_left);
+        if (!recv_raw(c, buf, n, true, should_stop))
+            return false;
+        c.ws_left -= n;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/** Upgrade the connection to WebSocket, the response is read byte by byte so no frame data is consumed */
+bool ws_handshake(Conn &c, const Options &opt)
+{
+    std::string key(16, '\0');
+    for (auto &ch : key)
+        ch = splitmix64(c.ws_mask);
+    key = base64(key);
+    std::string const req = "GET " + opt.ws_path + " HTTP/1.1\r\nHost: " + opt.host +
+                            "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: " + key +
+                            "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    auto const deadline = Clock::now() + std::chrono::milliseconds((int)(opt.drain * 1000));
+    auto const timeout = [&] { return Clock::now() > deadline; };
+    if (!send_raw(c, (const uint8_t *)req.data(), req.size(), timeout))
+        return false;
+
+    std::string resp;
+    while (resp.size() < 4 || resp.compare(resp.size() - 4, 4, "\r\n\r\n")) {
+        uint8_t ch;
+        if (resp.size() > 4096 || !recv_raw(c, &ch, 1, false, timeout)) {
+            fail(c, "no WebSocket handshake response");
+            return false;
+        }
+        resp += ch;
+    }
+    if (resp.compare(0, 12, "HTTP/1.1 101")) {
+        fail(c, "WebSocket upgrade refused: " + resp.substr(0, resp.find('\r')));
+        return false;
+    }
+    if (resp.find("Sec-WebSocket-Accept: " + ws_accept_key(key) + "\r\n") == std::string::npos) {
+        fail(c, "bad Sec-WebSocket-Accept");
+        return false;
+    }
+    return true;
+}
+
+/** Receive the next chunk and compare it with the expected one byte by byte */
+template <typename Stop>
+bool recv_chunk(Conn &c, const Options &opt, const Chunk &expect, std::vector<uint8_t> &rx,
+                std::vector<uint8_t> &ref, Stop should_stop)
+{
+    uint64_t const offset = c.received;
+    rx.resize(expect.len);
+    if (!recv_all(c, opt, rx.data(), expect.len, should_stop))
+        return false;
+    auto const done = Clock::now();
+
+    fill_chunk(ref, opt.seed, c.id, expect.seq, expect.len);
+    if (std::memcmp(rx.data(), ref.data(), expect.len)) {
+        size_t i = 0;
+        while (rx[i] == ref[i])
+            i++;
+        char msg[160];
+        if (get32(&rx[0]) == CHUNK_MAGIC && get32(&rx[4]) == c.id && get32(&rx[8]) != expect.seq)
+            snprintf(msg, sizeof(msg), "expected chunk %u at stream offset %llu, got chunk %u",
+                     expect.seq, (unsigned long long)offset, get32(&rx[8]));
+        else
+            snprintf(msg, sizeof(msg), "chunk %u corrupted at byte %zu (stream offset %llu)",
+                     expect.seq, i, (unsigned long long)(offset + i));
+        fail(c, msg);
+        return false;
+    }
+    c.chunks++;
+    c.latency_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(done - expect.sent).count());
+    return true;
+}
+
+uint32_t next_len(Conn &c, const Options &opt)
+{
+    if (opt.chunk_min == opt.chunk_max)
+        return opt.chunk_min;
+    return std::uniform_int_distribution<uint32_t>(opt.chunk_min, opt.chunk_max)(c.rng);
+}
+
+void run_req(Conn &c, const Options &opt, Clock::time_point end)
+{
+    std::vector<uint8_t> tx, rx, ref;
+    auto const drain = [&] { return Clock::now() > c.drain_until; };
+    for (uint32_t seq = 0; Clock::now() < end && !interrupted; seq++) {
+        if (opt.gap > 0) {
+            // Let the bridge go idle so every request is the first data after a quiet period
+            auto const until = std::min(end, Clock::now() + std::chrono::microseconds((int64_t)(opt.gap * 1000)));
+            while (Clock::now() < until && !interrupted)
+                std::this_thread::sleep_for(std::min<Clock::duration>(until - Clock::now(),
+                                                                      std::chrono::milliseconds(POLL_MS)));
+            if (Clock::now() >= end || interrupted)
+                break;
+        }
+        Chunk const chunk = { seq, next_len(c, opt), Clock::now() };
+        fill_chunk(tx, opt.seed, c.id, chunk.seq, chunk.len);
+        // A response must come back within the drain time
+        c.drain_until = chunk.sent + std::chrono::milliseconds((int)(opt.drain * 1000));
+        if (!send_all(c, opt, tx.data(), tx.size(), drain)) {
+            fail(c, interrupted ? "interrupted" : "send stalled");
+            return;
+        }
+        c.sent += chunk.len;
+        if (!recv_chunk(c, opt, chunk, rx, ref, drain))
+            return;
+    }
+}
+
+void stream_writer(Conn &c, const Options &opt, Clock::time_point end)
+{
+    std::vector<uint8_t> tx;
+    auto const stop = [&] { return Clock::now() >= end || c.failed; };
+    // A chunk once started is sent completely unless the echo stalls for the drain time
+    auto const stalled = [&] { return c.failed || Clock::now() > c.drain_until; };
+    for (uint32_t seq = 0; !stop() && !interrupted; seq++) {
+        uint32_t const len = next_len(c, opt);
+        fill_chunk(tx, opt.seed, c.id, seq, len);
+        {
+            std::unique_lock<std::mutex> lk(c.lock);
+            // Keep at most a window of data in flight, but always allow one chunk
+            while (!c.pending.empty() && c.sent - c.received + len > opt.window && !stop() && !interrupted)
+                c.cv.wait_for(lk, std::chrono::milliseconds(POLL_MS));
+            if (stop() || interrupted)
+                break;
+            c.pending.push_back({ seq, len, Clock::now() });
+            c.cv.notify_all();
+            c.drain_until = Clock::now() + std::chrono::milliseconds((int)(opt.drain * 1000));
+        }
+        if (!send_all(c, opt, tx.data(), tx.size(), stalled)) {
+            fail(c, interrupted ? "interrupted" : "send stalled");
+            break;
+        }
+        std::lock_guard<std::mutex> lk(c.lock);
+        c.sent += len;
+    }
+    std::lock_guard<std::mutex> lk(c.lock);
+    c.writer_done = true;
+    c.drain_until = Clock::now() + std::chrono::milliseconds((int)(opt.drain * 1000));
+    c.cv.notify_all();
+}
+
+void stream_reader(Conn &c, const Options &opt)
+{
+    std::vector<uint8_t> rx, ref;
+    auto const drain = [&] {
+        std::lock_guard<std::mutex> lk(c.lock);
+        return c.writer_done && Clock::now() > c.drain_until;
+    };
+    for (;;) {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lk(c.lock);
+            while (c.pending.empty() && !c.writer_done && !c.failed && !interrupted)
+                c.cv.wait_for(lk, std::chrono::milliseconds(POLL_MS));
+            if (c.pending.empty() || c.failed || interrupted)
+                return;
+            chunk = c.pending.front();
+        }
+        bool const ok = recv_chunk(c, opt, chunk, rx, ref, drain);
+        std::lock_guard<std::mutex> lk(c.lock);
+        c.pending.pop_front();
+        c.cv.notify_all();
+        if (!ok)
+            return;
+    }
+}
+
+int connect_to(const Options &opt, std::string &error)
+{
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int const rc = getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &res);
+    if (rc) {
+        error = gai_strerror(rc);
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        error = std::string("connect: ") + strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0 && opt.nodelay) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+void run_conn(Conn &c, const Options &opt, Clock::time_point end)
+{
+    auto const t0 = Clock::now();
+    std::string error;
+    c.fd = connect_to(opt, error);
+    if (c.fd < 0) {
+        fail(c, error);
+        return;
+    }
+    if (!opt.ws_path.empty() && !ws_handshake(c, opt)) {
+        close(c.fd);
+        return;
+    }
+    c.connect_us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - t0).count();
+
+    if (opt.mode == Mode::REQ) {
+        run_req(c, opt, end);
+    } else {
+        std::thread writer(stream_writer, std::ref(c), std::cref(opt), end);
+        stream_reader(c, opt);
+        writer.join();
+    }
+    close(c.fd);
+}
+
+/** Keep opening connections that send nothing until end, counting how they end */
+void run_flood(Flood &f, const Options &opt, Clock::time_point end)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(FLOOD_START_MS));
+    while (!interrupted && Clock::now() < end) {
+        f.attempts++;
+        std::string error;
+        int const fd = connect_to(opt, error);
+        if (fd < 0) {
+            f.failed++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        uint8_t byte;
+        if (poll(&pfd, 1, FLOOD_HOLD_MS) > 0 && recv(fd, &byte, 1, 0) <= 0)
+            f.closed++;
+        else
+            f.held++;
+        // Reset rather than leave thousands of sockets in TIME_WAIT behind
+        struct linger const lg = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(fd);
+    }
+}
+
+uint32_t percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p * sorted.size() + 0.999999);
+    return sorted[std::min(sorted.size(), std::max<size_t>(idx, 1)) - 1];
+}
+
+std::string json_escape(const std::string &s)
+{
+    std::string out;
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        out += ch;
+    }
+    return out;
+}
+
+int run_bench(const Options &opt)
+{
+    std::vector<Conn> conns(opt.conns);
+    auto const start = Clock::now();
+    auto const end = start + std::chrono::milliseconds((int)(opt.duration * 1000));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < opt.conns; i++) {
+        conns[i].id = i;
+        conns[i].rng.seed(opt.seed + i);
+        conns[i].ws_mask = opt.seed + i;
+        threads.emplace_back(run_conn, std::ref(conns[i]), std::cref(opt), end);
+    }
+    Flood flood;
+    std::vector<std::thread> flooders;
+    for (int i = 0; i < opt.flood; i++)
+        flooders.emplace_back(run_flood, std::ref(flood), std::cref(opt), end);
+    for (auto &t : threads)
+        t.join();
+    double const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    for (auto &t : flooders)
+        t.join();
+
+    uint64_t sent = 0, received = 0, chunks = 0;
+    int failed = 0;
+    uint32_t connect_max = 0;
+    std::vector<uint32_t> lat;
+    for (auto &c : conns) {
+        sent += c.sent;
+        received += c.received;
+        chunks += c.chunks;
+        connect_max = std::max(connect_max, c.connect_us);
+        lat.insert(lat.end(), c.latency_us.begin(), c.latency_us.end());
+        if (!c.error.empty() || c.received != c.sent)
+            failed++;
+    }
+    std::sort(lat.begin(), lat.end());
+    double const mbps = received / elapsed / 1e6;
+    static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *const pct_names[] = { "p50", "p90", "p99", "p999" };
+
+    if (opt.json) {
+        printf("{\"host\":\"%s\",\"port\":%s,\"transport\":\"%s\",\"mode\":\"%s\",\"connections\":%d,"
+               "\"chunk_min\":%zu,\"chunk_max\":%zu,"
+               "\"window\":%zu,\"elapsed_s\":%.3f,\"sent_bytes\":%llu,\"received_bytes\":%llu,\"chunks\":%llu,"
+               "\"throughput_Bps\":%.0f,\"connect_max_us\":%u,\"latency_us\":{\"min\":%u",
+               json_escape(opt.host).c_str(), opt.port.c_str(), opt.ws_path.empty() ? "tcp" : "ws",
+               opt.mode == Mode::REQ ? "req" : "stream",
+               opt.conns, opt.chunk_min, opt.chunk_max, opt.window, elapsed, (unsigned long long)sent,
+               (unsigned long long)received, (unsigned long long)chunks, received / elapsed, connect_max,
+               lat.empty() ? 0 : lat.front());
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            printf(",\"%s\":%u", pct_names[i], percentile(lat, pcts[i]));
+        printf(",\"max\":%u},\"failed\":%d,", lat.empty() ? 0 : lat.back(), failed);
+        if (opt.flood)
+            printf("\"flood\":{\"threads\":%d,\"attempts\":%llu,\"connect_failed\":%llu,\"closed\":%llu,"
+                   "\"held\":%llu},", opt.flood, (unsigned long long)flood.attempts,
+                   (unsigned long long)flood.failed, (unsigned long long)flood.closed,
+                   (unsigned long long)flood.held);
+        printf("\"conns\":[");
+        for (size_t i = 0; i < conns.size(); i++) {
+            Conn const &c = conns[i];
+            printf("%s{\"id\":%u,\"sent\":%llu,\"received\":%llu,\"chunks\":%u,\"connect_us\":%u,\"error\":\"%s\"}",
+                   i ? "," : "", c.id, (unsigned long long)c.sent, (unsigned long long)c.received, c.chunks,
+                   c.connect_us, json_escape(c.error).c_str());
+        }
+        printf("]}\n");
+    } else {
+        printf("%s mode over %s, %d connection(s), chunk %zu-%zu bytes, %.1f s\n",
+               opt.mode == Mode::REQ ? "request / response" : "streaming",
+               opt.ws_path.empty() ? "TCP" : "WebSocket", opt.conns, opt.chunk_min, opt.chunk_max, elapsed);
+        printf("sent %llu bytes, received %llu bytes in %llu chunks, %.3f MB/s\n",
+               (unsigned long long)sent, (unsigned long long)received, (unsigned long long)chunks, mbps);
+        printf("latency us: min %u", lat.empty() ? 0 : lat.front());
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            printf(" %s %u", pct_names[i], percentile(lat, pcts[i]));
+        printf(" max %u\n", lat.empty() ? 0 : lat.back());
+        if (opt.flood)
+            printf("flood: %llu junk connections, %llu failed to connect, %llu closed by the bridge, %llu held open\n",
+                   (unsigned long long)flood.attempts, (unsigned long long)flood.failed,
+                   (unsigned long long)flood.closed, (unsigned long long)flood.held);
+        for (auto const &c : conns) {
+            if (!c.error.empty())
+                printf("!!! connection %u: %s !!!\n", c.id, c.error.c_str());
+            else if (c.received != c.sent)
+                printf("!!! connection %u: %llu bytes not echoed !!!\n", c.id,
+                       (unsigned long long)(c.sent - c.received));
+        }
+        if (!failed)
+            printf("integrity ok\n");
+    }
+    return failed ? 1 : 0;
+}
+
+bool read_full(int fd, uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t const n = recv(fd, buf, len, 0);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool write_full(int fd, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t const n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/** WebSocket echo session, the payload of every data frame goes back in a binary frame */
+void serve_ws(int fd)
+{
+    std::string req;
+    uint8_t ch;
+    while (req.size() < 8192 && (req.size() < 4 || req.compare(req.size() - 4, 4, "\r\n\r\n"))) {
+        if (!read_full(fd, &ch, 1)) {
+            close(fd);
+            return;
+        }
+        req += ch;
+    }
+    static const std::string key_hdr = "Sec-WebSocket-Key: ";
+    size_t const pos = req.find(key_hdr);
+    if (pos == std::string::npos) {
+        static const char bad[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        write_full(fd, (const uint8_t *)bad, sizeof(bad) - 1);
+        close(fd);
+        return;
+    }
+    size_t const start = pos + key_hdr.size();
+    std::string const resp = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                             "Sec-WebSocket-Accept: " + ws_accept_key(req.substr(start, req.find('\r', start) - start)) +
+                             "\r\n\r\n";
+    if (!write_full(fd, (const uint8_t *)resp.data(), resp.size())) {
+        close(fd);
+        return;
+    }
+
+    std::vector<uint8_t> buf;
+    for (;;) {
+        uint8_t hdr[14];
+        if (!read_full(fd, hdr, 2))
+            break;
+        uint8_t const opcode = hdr[0] & 0x0F;
+        uint64_t len = hdr[1] & 0x7F;
+        if (len == 126) {
+            if (!read_full(fd, hdr + 2, 2))
+                break;
+            len = hdr[2] << 8 | hdr[3];
+        } else if (len == 127) {
+            if (!read_full(fd, hdr + 2, 8))
+                break;
+            len = (uint64_t)get32(hdr + 2) << 32 | get32(hdr + 6);
+        }
+        uint8_t mask[4] = {};
+        if (len > CHUNK_LIMIT || ((hdr[1] & 0x80) && !read_full(fd, mask, 4)))
+            break;
+        buf.resize(WS_HDR_MAX + len);
+        uint8_t *const payload = buf.data() + WS_HDR_MAX;
+        if (!read_full(fd, payload, len))
+            break;
+        for (size_t i = 0; i < len; i++)
+            payload[i] ^= mask[i & 3];
+        uint8_t const reply = opcode <= 0x2 ? 0x2 : opcode == 0x9 ? 0xA : opcode;
+        if (opcode == 0xA)
+            continue;
+        // Header right in front of the payload so the frame goes out in one piece
+        uint8_t tmp[WS_HDR_MAX];
+        size_t const hlen = ws_put_header(tmp, reply, len, NULL);
+        std::memcpy(payload - hlen, tmp, hlen);
+        if (!write_full(fd, payload - hlen, hlen + len) || opcode == 0x8)
+            break;
+    }
+    close(fd);
+}
+
+/** Echo server standing in for the bridge */
+int run_server(const Options &opt)
+{
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, opt.serve.c_str(), &hints, &res)) {
+        fprintf(stderr, "bad port %s\n", opt.serve.c_str());
+        return 2;
+    }
+    int const lfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int one = 1, zero = 0;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(lfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    if (bind(lfd, res->ai_addr, res->ai_addrlen) || listen(lfd, 16)) {
+        perror("listen");
+        return 2;
+    }
+    freeaddrinfo(res);
+    fprintf(stderr, "%s echo server listening on port %s\n", opt.ws_path.empty() ? "TCP" : "WebSocket",
+            opt.serve.c_str());
+    for (;;) {
+        int const fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR && !interrupted)
+                continue;
+            break;
+        }
+        // Every frame goes out at once like it does from the bridge
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (opt.ws_path.empty()) {
+            std::thread([fd] {
+                std::vector<uint8_t> buf(64 * 1024);
+                ssize_t n;
+                while ((n = recv(fd, buf.data(), buf.size(), 0)) > 0) {
+                    if (!write_full(fd, buf.data(), n))
+                        break;
+                }
+                close(fd);
+            }).detach();
+        } else {
+            std::thread(serve_ws, fd).detach();
+        }
+    }
+    close(lfd);
+    return 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <host>\n"
+            "       %s --serve <port> [--ws]\n"
+            "  -p, --port PORT        echo port (default 3142, the bridge port, 80 with --ws)\n"
+            "  -c, --conns N          concurrent connections (default 1)\n"
+            "  -s, --chunk MIN[-MAX]  chunk size in bytes, random in range (default 1024, minimum %zu)\n"
+            "  -m, --mode req|stream  request / response or streaming (default stream)\n"
+            "  -d, --duration S       seconds to send data for (default 10)\n"
+            "  -w, --window BYTES     bytes in flight per connection when streaming (default 65536)\n"
+            "  -t, --drain S          seconds to wait for outstanding echo (default 10)\n"
+            "  -g, --gap MS           idle time before every request in req mode (default 0)\n"
+            "  -S, --seed N           payload seed (default 1)\n"
+            "  -f, --flood N          threads opening junk connections meanwhile (default 0)\n"
+            "      --nagle            keep Nagle's algorithm enabled\n"
+            "      --ws[=PATH]        go through the WebSocket endpoint (default path /ws)\n"
+            "      --ws-frame BYTES   largest frame sent over WebSocket (default 2048)\n"
+            "  -j, --json             print results as JSON\n"
+            "      --serve PORT       run an echo server instead\n"
+            "Exits with 1 if any data was lost or corrupted.\n",
+            prog, prog, HDR_LEN);
+}
+
+bool parse_size_range(const char *arg, size_t &min, size_t &max)
+{
+    char *end;
+    min = strtoul(arg, &end, 10);
+    max = min;
+    if (*end == '-')
+        max = strtoul(end + 1, &end, 10);
+    return !*end && min >= HDR_LEN && max >= min && max <= CHUNK_LIMIT;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    static const struct option long_opts[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "conns", required_argument, NULL, 'c' },
+        { "chunk", required_argument, NULL, 's' },
+        { "mode", required_argument, NULL, 'm' },
+        { "duration", required_argument, NULL, 'd' },
+        { "window", required_argument, NULL, 'w' },
+        { "drain", required_argument, NULL, 't' },
+        { "gap", required_argument, NULL, 'g' },
+        { "seed", required_argument, NULL, 'S' },
+        { "flood", required_argument, NULL, 'f' },
+        { "nagle", no_argument, NULL, 'N' },
+        { "json", no_argument, NULL, 'j' },
+        { "serve", required_argument, NULL, 'L' },
+        { "ws", optional_argument, NULL, 'W' },
+        { "ws-frame", required_argument, NULL, 'F' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    Options opt;
+    bool port_set = false;
+    int ch;
+    while ((ch = getopt_long(argc, argv, "p:c:s:m:d:w:t:g:S:f:jh", long_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'p': opt.port = optarg; port_set = true; break;
+        case 'c': opt.conns = atoi(optarg); break;
+        case 's':
+            if (!parse_size_range(optarg, opt.chunk_min, opt.chunk_max)) {
+                fprintf(stderr, "bad chunk size %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'm':
+            if (!strcmp(optarg, "req"))
+                opt.mode = Mode::REQ;
+            else if (!strcmp(optarg, "stream"))
+                opt.mode = Mode::STREAM;
+            else {
+                fprintf(stderr, "bad mode %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'w': opt.window = strtoul(optarg, NULL, 10); break;
+        case 't': opt.drain = atof(optarg); break;
+        case 'g': opt.gap = atof(optarg); break;
+        case 'S': opt.seed = strtoul(optarg, NULL, 10); break;
+        case 'f': opt.flood = atoi(optarg); break;
+        case 'N': opt.nodelay = false; break;
+        case 'j': opt.json = true; break;
+        case 'L': opt.serve = optarg; break;
+        case 'W': opt.ws_path = optarg ? optarg : "/ws"; break;
+        case 'F':
+            opt.ws_frame = strtoul(optarg, NULL, 10);
+            if (!opt.ws_frame) {
+                fprintf(stderr, "bad frame size %s\n", optarg);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 2;
+        }
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = [](int) { interrupted = true; };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (!opt.serve.empty())
+        return run_server(opt);
+    if (optind != argc - 1 || opt.conns < 1 || opt.flood < 0 || opt.duration <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    opt.host = argv[optind];
+    if (!opt.ws_path.empty() && !port_set)
+        opt.port = "80";
+    return run_bench(opt);
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# Builds bridge_bench from bridge_bench.cpp next to this script when it is missing
+# or outdated and runs it with the given arguments. Requires g++.
+
+dir=$(dirname "$0")
+bin=$dir/bridge_bench
+
+if [ ! -x "$bin" ] || [ "$dir/bridge_bench.cpp" -nt "$bin" ]; then
+    g++ -O2 -std=c++17 -pthread -o "$bin" "$dir/bridge_bench.cpp" || exit 2
+fi
+exec "$bin" "$@"
@@ -0,0 +1,703 @@
+// Batch client for the management port of the serial bridge (CONFIG_MGMT_ENABLE).
+//
+// Runs one command against a list of bridges, several at a time: read or change
+// the stored settings, apply them, reboot, fetch the counters or run the UART
+// self test and wait for its result. Every bridge is handled on its own
+// connection, authenticated with HMAC-SHA256 over the challenge the bridge
+// sends, so the key never crosses the network. The result of
+// every bridge is printed as one line, or as one JSON object per line with
+// --json, and the tool exits with 1 if any bridge failed.
+//
+// The protocol is described in src/main/mgmt_server.h, the constants below must
+// match it.
+//
+// Build: g++ -O2 -std=c++17 -pthread -o bridge_mgmt bridge_mgmt.cpp
+// Run with --help for options. The key is taken from BRIDGE_MGMT_KEY if -k is not
+// given, which keeps it out of the process list.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr uint8_t MGMT_VERSION = 1;
+constexpr size_t MGMT_HDR_LEN = 3;
+constexpr size_t MGMT_MAX_LEN = 512;
+constexpr size_t MGMT_CHALLENGE_LEN = 16;
+
+constexpr uint8_t MGMT_HELLO = 0x01;
+constexpr uint8_t MGMT_AUTH = 0x02;
+constexpr uint8_t MGMT_GET_SETTINGS = 0x10;
+constexpr uint8_t MGMT_SET_SETTINGS = 0x11;
+constexpr uint8_t MGMT_APPLY = 0x12;
+constexpr uint8_t MGMT_REBOOT = 0x13;
+constexpr uint8_t MGMT_GET_STATS = 0x20;
+constexpr uint8_t MGMT_SELFTEST = 0x21;
+constexpr uint8_t MGMT_STATUS = 0x7F;
+
+constexpr uint8_t MGMT_APPLIED_LIVE = 0x01;
+constexpr uint8_t MGMT_NEEDS_REBOOT = 0x02;
+
+const char *const SELFTEST_STATES[] = { "idle", "running", "done", "failed" };
+// Longest test plus the time the bridge gives the data to come back
+constexpr int SELFTEST_WAIT_S = 60 + 5;
+constexpr int SELFTEST_POLL_MS = 500;
+
+enum class FieldKind { NUM, STR };
+
+struct FieldName {
+    uint8_t tag;
+    const char *name;
+    FieldKind kind;
+    uint8_t len;                        // bytes of a number
+};
+
+const FieldName SETTINGS[] = {
+    { 0x01, "baud_rate", FieldKind::NUM, 4 },
+    { 0x02, "tcp_port", FieldKind::NUM, 2 },
+    { 0x03, "static_ip", FieldKind::NUM, 1 },
+    { 0x04, "ip_addr", FieldKind::STR, 0 },
+    { 0x05, "netmask", FieldKind::STR, 0 },
+    { 0x06, "gateway", FieldKind::STR, 0 },
+    { 0x07, "dns1", FieldKind::STR, 0 },
+    { 0x08, "dns2", FieldKind::STR, 0 },
+};
+
+const FieldName COUNTERS[] = {
+    { 0x01, "uptime_s", FieldKind::NUM, 8 },
+    { 0x02, "free_heap", FieldKind::NUM, 8 },
+    { 0x03, "min_free_heap", FieldKind::NUM, 8 },
+    { 0x10, "sessions", FieldKind::NUM, 8 },
+    { 0x11, "uart_to_eth_bytes", FieldKind::NUM, 8 },
+    { 0x12, "eth_to_uart_bytes", FieldKind::NUM, 8 },
+    { 0x13, "tx_throttled", FieldKind::NUM, 8 },
+    { 0x14, "rejected", FieldKind::NUM, 8 },
+    { 0x15, "denied", FieldKind::NUM, 8 },
+    { 0x16, "rate_limited", FieldKind::NUM, 8 },
+    { 0x17, "first_byte_timeouts", FieldKind::NUM, 8 },
+    { 0x18, "preempted", FieldKind::NUM, 8 },
+    { 0x20, "mb_requests", FieldKind::NUM, 8 },
+    { 0x21, "mb_responses", FieldKind::NUM, 8 },
+    { 0x22, "mb_timeouts", FieldKind::NUM, 8 },
+    { 0x23, "mb_crc_errors", FieldKind::NUM, 8 },
+    { 0x24, "mb_bad_frames", FieldKind::NUM, 8 },
+    { 0x28, "mqtt_frames", FieldKind::NUM, 8 },
+    { 0x29, "mqtt_dropped", FieldKind::NUM, 8 },
+    { 0x2A, "mqtt_publishes", FieldKind::NUM, 8 },
+    { 0x2B, "mqtt_resent", FieldKind::NUM, 8 },
+    { 0x2C, "mqtt_connects", FieldKind::NUM, 8 },
+    { 0x2D, "mqtt_rx_messages", FieldKind::NUM, 8 },
+    { 0x30, "fifo_overruns", FieldKind::NUM, 8 },
+    { 0x31, "buffer_full", FieldKind::NUM, 8 },
+    { 0x32, "frame_errors", FieldKind::NUM, 8 },
+    { 0x33, "parity_errors", FieldKind::NUM, 8 },
+    { 0x40, "mgmt_sessions", FieldKind::NUM, 8 },
+    { 0x41, "mgmt_auth_failures", FieldKind::NUM, 8 },
+};
+
+const FieldName SELFTEST[] = {
+    { 0x01, "baud_rate", FieldKind::NUM, 4 },
+    { 0x02, "seconds", FieldKind::NUM, 1 },
+    { 0x10, "state", FieldKind::NUM, 1 },
+    { 0x11, "error", FieldKind::NUM, 4 },
+    { 0x12, "sent", FieldKind::NUM, 8 },
+    { 0x13, "received", FieldKind::NUM, 8 },
+    { 0x14, "duration_ms", FieldKind::NUM, 4 },
+    { 0x15, "errors", FieldKind::NUM, 4 },
+    { 0x16, "bytes_per_s", FieldKind::NUM, 4 },
+    { 0x17, "line_pct", FieldKind::NUM, 4 },
+    { 0x18, "fifo_overruns", FieldKind::NUM, 4 },
+    { 0x19, "buffer_full", FieldKind::NUM, 4 },
+    { 0x1A, "rx_buffered_max", FieldKind::NUM, 4 },
+    { 0x1B, "tx_buffered_max", FieldKind::NUM, 4 },
+};
+
+const char *const STATUS_TEXT[] = {
+    "ok", "malformed message", "authentication failed", "unknown request", "invalid value", "storage error",
+    "busy",
+};
+
+enum class Command { GET, SET, APPLY, REBOOT, STATS, SELFTEST };
+
+struct Options {
+    std::string port = "3144";
+    std::string key;
+    int parallel = 16;
+    double timeout = 5;
+    bool json = false;
+    bool apply = false;                 // apply right after set
+    Command cmd = Command::GET;
+    std::string fields;                 // encoded settings fields for set, test fields for selftest
+    std::vector<std::string> hosts;
+};
+
+// SHA-256 and HMAC, enough for the challenge answer without pulling in a crypto library
+
+struct Sha256 {
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    uint8_t blk[64];
+    size_t used = 0;
+    uint64_t total = 0;
+
+    static uint32_t ror(uint32_t v, int n) { return v >> n | v << (32 - n); }
+
+    void compress()
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)blk[i * 4] << 24 | (uint32_t)blk[i * 4 + 1] << 16 | (uint32_t)blk[i * 4 + 2] << 8 |
+                   blk[i * 4 + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t const s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ w[i - 15] >> 3;
+            uint32_t const s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ w[i - 2] >> 10;
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t const t1 = hh + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t const t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    void update(const void *data, size_t len)
+    {
+        const uint8_t *p = (const uint8_t *)data;
+        total += len;
+        while (len--) {
+            blk[used++] = *p++;
+            if (used == 64) {
+                compress();
+                used = 0;
+            }
+        }
+    }
+
+    std::string finish()
+    {
+        uint64_t const bits = total * 8;
+        uint8_t const pad = 0x80;
+        update(&pad, 1);
+        uint8_t const zero = 0;
+        while (used != 56)
+            update(&zero, 1);
+        uint8_t len[8];
+        for (int i = 0; i < 8; i++)
+            len[i] = bits >> (56 - i * 8);
+        update(len, 8);
+        std::string out(32, '\0');
+        for (int i = 0; i < 8; i++)
+            for (int j = 0; j < 4; j++)
+                out[i * 4 + j] = h[i] >> (24 - j * 8);
+        return out;
+    }
+};
+
+std::string hmac_sha256(std::string key, const std::string &msg)
+{
+    if (key.size() > 64) {
+        Sha256 s;
+        s.update(key.data(), key.size());
+        key = s.finish();
+    }
+    key.resize(64, '\0');
+    std::string ipad = key, opad = key;
+    for (int i = 0; i < 64; i++) {
+        ipad[i] ^= 0x36;
+        opad[i] ^= 0x5c;
+    }
+    Sha256 inner;
+    inner.update(ipad.data(), 64);
+    inner.update(msg.data(), msg.size());
+    Sha256 outer;
+    outer.update(opad.data(), 64);
+    outer.update(inner.finish().data(), 32);
+    return outer.finish();
+}
+
+uint64_t get_be(const uint8_t *p, size_t len)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < len; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+const FieldName *find_field(const FieldName *tbl, size_t n, uint8_t tag)
+{
+    for (size_t i = 0; i < n; i++)
+        if (tbl[i].tag == tag)
+            return &tbl[i];
+    return nullptr;
+}
+
+std::string json_escape(const std::string &s)
+{
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if ((unsigned char)c < 0x20)
+            continue;
+        out += c;
+    }
+    return out;
+}
+
+/** One bridge: connection, request and result */
+class Session {
+public:
+    Session(const Options &opt, const std::string &target) : opt_(opt), target_(target) {}
+    ~Session()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    bool run()
+    {
+        if (!connect_to() || !authenticate())
+            return false;
+        switch (opt_.cmd) {
+        case Command::GET:
+            return request(MGMT_GET_SETTINGS, "") && fields(MGMT_GET_SETTINGS, SETTINGS, std::size(SETTINGS));
+        case Command::STATS:
+            return request(MGMT_GET_STATS, "") && fields(MGMT_GET_STATS, COUNTERS, std::size(COUNTERS));
+        case Command::SET:
+            if (!request(MGMT_SET_SETTINGS, opt_.fields) || !status())
+                return false;
+            return !opt_.apply || (request(MGMT_APPLY, "") && status());
+        case Command::APPLY:
+            return request(MGMT_APPLY, "") && status();
+        case Command::REBOOT:
+            return request(MGMT_REBOOT, "") && status();
+        case Command::SELFTEST:
+            return request(MGMT_SELFTEST, opt_.fields) && status() && selftest_result();
+        }
+        return false;
+    }
+
+    std::string report(bool ok) const
+    {
+        if (opt_.json) {
+            std::string out = "{\"host\":\"" + json_escape(target_) + "\",\"ok\":" + (ok ? "true" : "false");
+            if (!ok)
+                out += ",\"error\":\"" + json_escape(error_) + "\"";
+            for (auto &r : result_)
+                out += ",\"" + r.first + "\":" + (r.second.second ? r.second.first :
+                                                  "\"" + json_escape(r.second.first) + "\"");
+            return out + "}";
+        }
+        std::string out = target_ + (ok ? ": ok" : ": failed, " + error_);
+        for (auto &r : result_)
+            out += " " + r.first + "=" + r.second.first;
+        return out;
+    }
+
+private:
+    bool fail(const std::string &msg)
+    {
+        if (error_.empty())
+            error_ = msg;
+        return false;
+    }
+
+    bool connect_to()
+    {
+        std::string host = target_, port = opt_.port;
+        size_t const colon = host.rfind(':');
+        if (colon != std::string::npos && host.find(':') == colon) {
+            port = host.substr(colon + 1);
+            host.resize(colon);
+        }
+        struct addrinfo hints = {}, *res;
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        int const rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (rc != 0)
+            return fail(gai_strerror(rc));
+        fd_ = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd_ < 0) {
+            freeaddrinfo(res);
+            return fail(strerror(errno));
+        }
+        // Connect without blocking so an unreachable bridge costs the timeout only
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL, 0) | O_NONBLOCK);
+        int err = connect(fd_, res->ai_addr, res->ai_addrlen) == 0 ? 0 : errno;
+        freeaddrinfo(res);
+        if (err == EINPROGRESS) {
+            struct pollfd pfd = { fd_, POLLOUT, 0 };
+            if (poll(&pfd, 1, (int)(opt_.timeout * 1000)) != 1)
+                return fail("connect timeout");
+            socklen_t len = sizeof(err);
+            getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+        }
+        if (err)
+            return fail(strerror(err));
+        fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL, 0) & ~O_NONBLOCK);
+        struct timeval tv;
+        tv.tv_sec = (time_t)opt_.timeout;
+        tv.tv_usec = (suseconds_t)((opt_.timeout - tv.tv_sec) * 1e6);
+        setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        int one = 1;
+        setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return true;
+    }
+
+    bool send_msg(uint8_t type, const std::string &value)
+    {
+        std::string msg(MGMT_HDR_LEN, '\0');
+        msg[0] = type;
+        msg[1] = value.size() >> 8;
+        msg[2] = value.size();
+        msg += value;
+        for (size_t sent = 0; sent < msg.size();) {
+            ssize_t const n = send(fd_, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+            if (n < 0)
+                return fail(std::string("send: ") + strerror(errno));
+            sent += n;
+        }
+        return true;
+    }
+
+    bool recv_all(uint8_t *buf, size_t len)
+    {
+        for (size_t got = 0; got < len;) {
+            ssize_t const n = recv(fd_, buf + got, len - got, 0);
+            if (n < 0)
+                return fail(errno == EAGAIN ? "timeout" : std::string("recv: ") + strerror(errno));
+            if (n == 0)
+                return fail("connection closed");
+            got += n;
+        }
+        return true;
+    }
+
+    bool recv_msg()
+    {
+        uint8_t hdr[MGMT_HDR_LEN];
+        if (!recv_all(hdr, sizeof(hdr)))
+            return false;
+        type_ = hdr[0];
+        size_t const len = get_be(hdr + 1, 2);
+        if (len > MGMT_MAX_LEN)
+            return fail("oversized reply");
+        value_.resize(len);
+        return recv_all(value_.data(), len);
+    }
+
+    bool authenticate()
+    {
+        if (!recv_msg())
+            return false;
+        if (type_ != MGMT_HELLO || value_.size() != 1 + MGMT_CHALLENGE_LEN)
+            return fail("not a management port");
+        if (value_[0] != MGMT_VERSION)
+            return fail("protocol version " + std::to_string(value_[0]));
+        std::string const challenge((const char *)&value_[1], MGMT_CHALLENGE_LEN);
+        return send_msg(MGMT_AUTH, hmac_sha256(opt_.key, challenge)) && recv_msg() && status();
+    }
+
+    bool request(uint8_t type, const std::string &value)
+    {
+        return send_msg(type, value) && recv_msg();
+    }
+
+    /** Check a MGMT_STATUS reply, keeps the apply flags in the result */
+    bool status()
+    {
+        if (type_ != MGMT_STATUS || value_.empty())
+            return fail("unexpected reply");
+        if (value_[0] != 0)
+            return fail(value_[0] < std::size(STATUS_TEXT) ? STATUS_TEXT[value_[0]] :
+                        "status " + std::to_string(value_[0]));
+        if (value_.size() > 1) {
+            result_.push_back({ "applied", { value_[1] & MGMT_APPLIED_LIVE ? "true" : "false", true } });
+            result_.push_back({ "reboot_needed", { value_[1] & MGMT_NEEDS_REBOOT ? "true" : "false", true } });
+            if (!(value_[1] & MGMT_APPLIED_LIVE))
+                return fail("baud rate refused by the UART");
+        }
+        return true;
+    }
+
+    bool fields(uint8_t type, const FieldName *tbl, size_t n)
+    {
+        if (type_ == MGMT_STATUS)
+            return status() && fail("unexpected status");
+        if (type_ != type)
+            return fail("unexpected reply");
+        for (size_t i = 0; i < value_.size();) {
+            if (value_.size() - i < 2 || value_.size() - i - 2 < value_[i + 1])
+                return fail("malformed reply");
+            uint8_t const tag = value_[i], len = value_[i + 1];
+            const uint8_t *v = &value_[i + 2];
+            i += 2 + len;
+            const FieldName *f = find_field(tbl, n, tag);
+            std::string const name = f ? f->name : "field_" + std::to_string(tag);
+            if (f && f->kind == FieldKind::STR)
+                result_.push_back({ name, { std::string((const char *)v, len), false } });
+            else
+                result_.push_back({ name, { std::to_string(get_be(v, len)), true } });
+        }
+        return true;
+    }
+
+    /** Poll the self test until it is over and keep its result */
+    bool selftest_result()
+    {
+        for (int waited = 0;; waited += SELFTEST_POLL_MS) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(SELFTEST_POLL_MS));
+            if (!request(MGMT_SELFTEST, "") || !fields(MGMT_SELFTEST, SELFTEST, std::size(SELFTEST)))
+                return false;
+            auto const state = std::find_if(result_.begin(), result_.end(),
+                                            [](const auto &r) { return r.first == "state"; });
+            if (state == result_.end())
+                return fail("malformed reply");
+            unsigned const st = std::stoul(state->second.first);
+            if (st != 1 || waited >= SELFTEST_WAIT_S * 1000) {
+                state->second = { st < std::size(SELFTEST_STATES) ? SELFTEST_STATES[st] : std::to_string(st), false };
+                return st == 2 || fail(st == 1 ? "self test did not finish" : "self test failed");
+            }
+            result_.clear();
+        }
+    }
+
+    const Options &opt_;
+    std::string target_;
+    int fd_ = -1;
+    uint8_t type_ = 0;
+    std::vector<uint8_t> value_;
+    std::string error_;
+    // name, value and whether the value is a number or boolean
+    std::vector<std::pair<std::string, std::pair<std::string, bool>>> result_;
+};
+
+/** Encode name=value into a field of the table, false if unknown or out of range */
+bool encode_field(const FieldName *tbl, size_t n, const std::string &arg, std::string &out)
+{
+    size_t const eq = arg.find('=');
+    if (eq == std::string::npos)
+        return false;
+    std::string const name = arg.substr(0, eq), value = arg.substr(eq + 1);
+    for (size_t i = 0; i < n; i++) {
+        const FieldName &f = tbl[i];
+        if (name != f.name)
+            continue;
+        out += (char)f.tag;
+        if (f.kind == FieldKind::STR) {
+            if (value.size() > 15)
+                return false;
+            out += (char)value.size();
+            out += value;
+            return true;
+        }
+        char *end;
+        unsigned long long const v = strtoull(value.c_str(), &end, 10);
+        if (value.empty() || *end || (f.len < 8 && v >> (f.len * 8)))
+            return false;
+        out += (char)f.len;
+        for (int i = f.len - 1; i >= 0; i--)
+            out += (char)(v >> (i * 8));
+        return true;
+    }
+    return false;
+}
+
+bool read_hosts(const std::string &arg, std::vector<std::string> &hosts)
+{
+    if (arg[0] != '@') {
+        size_t start = 0;
+        for (;;) {
+            size_t const comma = arg.find(',', start);
+            std::string const h = arg.substr(start, comma - start);
+            if (!h.empty())
+                hosts.push_back(h);
+            if (comma == std::string::npos)
+                return true;
+            start = comma + 1;
+        }
+    }
+    std::ifstream file;
+    std::istream *in = &std::cin;
+    if (arg != "@-") {
+        file.open(arg.substr(1));
+        if (!file)
+            return false;
+        in = &file;
+    }
+    std::string line;
+    while (std::getline(*in, line)) {
+        size_t const hash = line.find('#');
+        if (hash != std::string::npos)
+            line.resize(hash);
+        size_t const b = line.find_first_not_of(" \t\r");
+        if (b == std::string::npos)
+            continue;
+        hosts.push_back(line.substr(b, line.find_last_not_of(" \t\r") + 1 - b));
+    }
+    return true;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <hosts> <command> [name=value ...]\n"
+            "  hosts is a comma separated list, @FILE with one host per line or @- for stdin,\n"
+            "  every host may carry its own :port\n"
+            "Commands:\n"
+            "  get                    print the stored settings\n"
+            "  set name=value ...     change stored settings: baud_rate, tcp_port, static_ip (0|1),\n"
+            "                         ip_addr, netmask, gateway, dns1, dns2 (empty value clears)\n"
+            "  apply                  use the stored baud rate now, tells if a reboot is needed\n"
+            "  reboot                 restart the bridges\n"
+            "  stats                  print the counters\n"
+            "  selftest [name=value]  run the UART loopback self test and print the result:\n"
+            "                         baud_rate (default the running rate), seconds (default 10)\n"
+            "Options:\n"
+            "  -k, --key KEY          management key (default $BRIDGE_MGMT_KEY)\n"
+            "  -p, --port PORT        management port (default 3144)\n"
+            "  -P, --parallel N       bridges handled at once (default 16)\n"
+            "  -t, --timeout S        connect and reply timeout (default 5)\n"
+            "  -a, --apply            apply right after set\n"
+            "  -j, --json             print one JSON object per bridge\n"
+            "Exits with 1 if any bridge failed.\n",
+            prog);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    static const struct option long_opts[] = {
+        { "key", required_argument, NULL, 'k' },
+        { "port", required_argument, NULL, 'p' },
+        { "parallel", required_argument, NULL, 'P' },
+        { "timeout", required_argument, NULL, 't' },
+        { "apply", no_argument, NULL, 'a' },
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    Options opt;
+    if (const char *key = getenv("BRIDGE_MGMT_KEY"))
+        opt.key = key;
+    int ch;
+    while ((ch = getopt_long(argc, argv, "k:p:P:t:ajh", long_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'k': opt.key = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'P': opt.parallel = atoi(optarg); break;
+        case 't': opt.timeout = atof(optarg); break;
+        case 'a': opt.apply = true; break;
+        case 'j': opt.json = true; break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 2;
+        }
+    }
+    if (argc - optind < 2 || opt.parallel < 1 || opt.timeout <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (opt.key.empty()) {
+        fprintf(stderr, "no key, use -k or BRIDGE_MGMT_KEY\n");
+        return 2;
+    }
+    if (!read_hosts(argv[optind], opt.hosts) || opt.hosts.empty()) {
+        fprintf(stderr, "no hosts in %s\n", argv[optind]);
+        return 2;
+    }
+    std::string const cmd = argv[optind + 1];
+    int const nargs = argc - optind - 2;
+    if (cmd == "get")
+        opt.cmd = Command::GET;
+    else if (cmd == "set")
+        opt.cmd = Command::SET;
+    else if (cmd == "apply")
+        opt.cmd = Command::APPLY;
+    else if (cmd == "reboot")
+        opt.cmd = Command::REBOOT;
+    else if (cmd == "stats")
+        opt.cmd = Command::STATS;
+    else if (cmd == "selftest")
+        opt.cmd = Command::SELFTEST;
+    else {
+        fprintf(stderr, "unknown command %s\n", cmd.c_str());
+        return 2;
+    }
+    if ((opt.cmd == Command::SET && !nargs) || (opt.cmd != Command::SET && opt.cmd != Command::SELFTEST && nargs)) {
+        usage(argv[0]);
+        return 2;
+    }
+    bool const selftest = opt.cmd == Command::SELFTEST;
+    for (int i = optind + 2; i < argc; i++) {
+        if ((selftest && !encode_field(SELFTEST, 2, argv[i], opt.fields)) ||
+            (!selftest && !encode_field(SETTINGS, std::size(SETTINGS), argv[i], opt.fields))) {
+            fprintf(stderr, "bad %s %s\n", selftest ? "test field" : "setting", argv[i]);
+            return 2;
+        }
+    }
+    // An empty request asks for the result, a test needs at least one field
+    if (selftest && opt.fields.empty())
+        encode_field(SELFTEST, 2, "seconds=10", opt.fields);
+
+    std::atomic<size_t> next{0};
+    std::atomic<int> failed{0};
+    std::mutex out_lock;
+    auto const worker = [&] {
+        for (size_t i; (i = next++) < opt.hosts.size();) {
+            Session s(opt, opt.hosts[i]);
+            bool const ok = s.run();
+            if (!ok)
+                failed++;
+            std::string const line = s.report(ok);
+            std::lock_guard<std::mutex> lock(out_lock);
+            printf("%s\n", line.c_str());
+            fflush(stdout);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::min<int>(opt.parallel, opt.hosts.size()); i++)
+        threads.emplace_back(worker);
+    for (auto &t : threads)
+        t.join();
+
+    if (!opt.json)
+        fprintf(stderr, "%zu bridge(s), %d failed\n", opt.hosts.size(), failed.load());
+    return failed ? 1 : 0;
+}
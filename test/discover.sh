@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Lists serial bridges advertised on the local network by mDNS / DNS-SD.
+# Requires avahi-daemon and avahi-utils.
+#
+# Call $0 --stand-in to publish a fake bridge from this host first and verify
+# it is resolved with all the TXT record fields.
+
+service=_serial-bridge._tcp
+
+if [ "$1" == "--stand-in" ]; then
+    avahi-publish -s serial-bridge-standin $service 3142 \
+        baud=921600 port=3142 fw=standin mac=00:00:00:00:00:00 mode=raw session=free &
+    pub_pid=$!
+    trap "kill $pub_pid 2>/dev/null" EXIT
+    sleep 2
+fi
+
+found=0
+while IFS=';' read -r kind iface proto name type domain host addr port txt; do
+    [ "$kind" == "=" ] || continue
+    [ "$proto" == "IPv4" ] || continue
+    echo "$name $host $addr:$port $txt"
+    if [ "$name" == "serial-bridge-standin" ]; then
+        for key in baud port fw mac mode session; do
+            if ! echo "$txt" | grep -q "\"$key="; then
+                echo "!!! stand-in TXT record has no $key field !!!"
+                exit 1
+            fi
+        done
+        found=1
+    fi
+done < <(avahi-browse -rpt $service)
+
+if [ "$1" == "--stand-in" ] && [ $found -eq 0 ]; then
+    echo "!!! stand-in bridge was not resolved !!!"
+    exit 1
+fi
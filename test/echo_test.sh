@@ -1,33 +1,9 @@
 #!/bin/bash
 
 if [ -z "$1" ]; then
-    echo -e "Call $0 <esp32 IP address> to run this test"
+    echo -e "Call $0 <esp32 IP address> [seconds] [bridge_bench options] to run this test"
     exit 1
 fi
 
-fifo=/tmp/esp32-eth-echo
-cktx=echo_test_tx.txt
-ckrx=echo_test_rx.txt
-
-rm -f $fifo
-mkfifo $fifo
-
-echo Sending / receiving random data ...
-
-for (( ; ; )); do
-    sum $fifo > $cktx &
-    sum_pid=$!
-
-    size=$((1 + ($RANDOM % 4096) + 4096 * ($RANDOM % 4096)))
-    (dd if=/dev/urandom bs=1 count=$size 2>/dev/null ; sleep .5) | tee $fifo | nc -N $1 3333 | sum > $ckrx
-    wait $sum_pid
-
-    if diff $cktx $ckrx; then
-        echo -n .
-        continue
-    fi
-
-    echo
-    echo !!! send and receive data don\'t match !!!
-    exit 1
-done
+echo Sending / receiving random sized chunks ...
+exec "$(dirname "$0")/bridge_bench.sh" -p 3333 -m req -s 16-65536 -d ${2:-60} "${@:3}" $1
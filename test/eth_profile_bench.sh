@@ -0,0 +1,78 @@
+#!/bin/bash
+
+# Measures the Ethernet data path of the bridge firmware built with the given
+# Ethernet data path profile. Streams random data to the bridge port for the given
+# number of seconds and reports received / sent packets per second, packets dropped
+# by the bridge network stack, TCP retransmissions seen by this host and CPU load
+# of both cores. The UART should be looped back (RX connected to TX, RTS to CTS)
+# so the same data goes back to the network.
+#
+# Requires curl and python3. Run it once for every profile to compare them.
+
+if [ -z "$1" ]; then
+    echo -e "Call $0 <esp32 IP address> [seconds] [port] to run this test"
+    exit 1
+fi
+
+ip=$1
+duration=${2:-30}
+port=${3:-3142}
+
+stats() {
+    curl -s -m 2 http://$ip/stats
+}
+
+# Prints space separated counters from /stats: profile rx tx drops tcp_drops uptime_us idle_us...
+parse() {
+    python3 -c '
+import json, sys
+e = json.load(sys.stdin)["eth"]
+print(e["profile"], e["rx_packets"], e["tx_packets"], e["rx_drops"], e["tcp_drops"], e["uptime_us"], *e["idle_us"])'
+}
+
+retrans() {
+    awk '/^Tcp:/ { if (!hdr) { for (i = 1; i <= NF; i++) if ($i == "RetransSegs") col = i; hdr = 1 } else print $col }' /proc/net/snmp
+}
+
+prev=($(stats | parse)) || exit 1
+if [ ${#prev[@]} -lt 7 ]; then
+    echo "!!! /stats has no packet or CPU counters, build with CONFIG_LWIP_STATS and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS !!!"
+    exit 1
+fi
+first=("${prev[@]}")
+retrans0=$(retrans)
+rx=0; tx=0; drops=0; tcp_drops=0
+
+echo "Profile ${prev[0]}, streaming to $ip:$port for $duration seconds ..."
+(dd if=/dev/urandom bs=1460 2>/dev/null | nc $ip $port > /dev/null) &
+nc_pid=$!
+trap "kill $nc_pid 2>/dev/null; pkill -P $nc_pid 2>/dev/null" EXIT
+
+# lwIP packet counters are 16 bit, sample them often enough to not miss a wrap
+for (( t = 0; t < duration; t++ )); do
+    sleep 1
+    cur=($(stats | parse)) || continue
+    [ ${#cur[@]} -ge 7 ] || continue
+    rx=$((rx + (cur[1] - prev[1] + 65536) % 65536))
+    tx=$((tx + (cur[2] - prev[2] + 65536) % 65536))
+    drops=$((drops + (cur[3] - prev[3] + 65536) % 65536))
+    tcp_drops=$((tcp_drops + (cur[4] - prev[4] + 65536) % 65536))
+    prev=("${cur[@]}")
+done
+
+elapsed_us=$((prev[5] - first[5]))
+if [ $elapsed_us -le 0 ]; then
+    echo "!!! no statistics received from $ip !!!"
+    exit 1
+fi
+
+echo "profile:        ${prev[0]}"
+echo "rx packets/s:   $((rx * 1000000 / elapsed_us))"
+echo "tx packets/s:   $((tx * 1000000 / elapsed_us))"
+echo "rx drops:       $drops"
+echo "tcp drops:      $tcp_drops"
+echo "host retrans:   $(($(retrans) - retrans0))"
+for (( core = 0; core < ${#prev[@]} - 6; core++ )); do
+    idle=$((prev[6 + core] - first[6 + core]))
+    echo "cpu$core load:      $((100 - idle * 100 / elapsed_us))%"
+done
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+if [ -z "$1" ]; then
+    echo -e "Call $0 <esp32 IP address> [seconds] [bridge_bench options] to run this test"
+    echo -e "The firmware has to be built with the flash write stress test enabled"
+    exit 1
+fi
+
+# Counter from the /stats JSON, empty if missing
+counter() {
+    curl -s "http://$1/stats" | grep -o "\"$2\":[0-9]*" | head -1 | cut -d: -f2
+}
+
+writes=$(counter $1 writes)
+overruns=$(counter $1 fifo_overruns)
+if [ -z "$writes" ] || [ -z "$overruns" ]; then
+    echo "No flash_stress or uart counters in http://$1/stats"
+    exit 1
+fi
+
+echo Testing UART echo throughput during flash writes ...
+"$(dirname "$0")/bridge_bench.sh" -p 3142 -m stream -s 1460 -d ${2:-30} "${@:3}" $1
+status=$?
+
+writes=$(( $(counter $1 writes) - writes ))
+overruns=$(( $(counter $1 fifo_overruns) - overruns ))
+echo "Flash writes: $writes, UART FIFO overruns: $overruns"
+if [ $writes -eq 0 ]; then
+    echo "FAIL: no flash writes"
+    exit 1
+fi
+if [ $overruns -ne 0 ] || [ $status -ne 0 ]; then
+    echo FAIL
+    exit 1
+fi
+echo PASS
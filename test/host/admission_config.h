@@ -0,0 +1,28 @@
+/* Configuration of the admission test: raw bridge on the sockets transport with
+   admission control, 10.1.0.0/16 allowed, 10.2.0.7 trusted, no rate limit on the
+   UART side */
+#define CONFIG_BRIDGE_MODE_RAW              1
+#define CONFIG_BRIDGE_TRANSPORT_SOCKETS     1
+#define CONFIG_UART_LINE_RS232              1
+#define CONFIG_ADMISSION_ENABLE             1
+#define CONFIG_ADMISSION_ALLOW              "10.1.0.0/16"
+#define CONFIG_ADMISSION_TRUSTED            "10.2.0.7"
+#define CONFIG_ADMISSION_RATE_PER_MIN       60
+#define CONFIG_ADMISSION_RATE_BURST         3
+#define CONFIG_ADMISSION_FIRST_BYTE_TIMEOUT 300
+#define CONFIG_BRIDGE_PORT                  3142
+#define CONFIG_UART_BITRATE                 921600
+#define CONFIG_UART_TX_GPIO                 14
+#define CONFIG_UART_RX_GPIO                 17
+#define CONFIG_UART_RTS_GPIO                15
+#define CONFIG_UART_TX_BUFF_SIZE            17
+#define CONFIG_UART_RX_BUFF_SIZE            17
+#define CONFIG_BRIDGE_LED_GPIO              2
+#define CONFIG_WEBSERVER_GPIO               32
+#define CONFIG_EXAMPLE_KEEPALIVE_IDLE       5
+#define CONFIG_EXAMPLE_KEEPALIVE_INTERVAL   5
+#define CONFIG_EXAMPLE_KEEPALIVE_COUNT      3
+#define CONFIG_EXAMPLE_ETH_RX_TASK_CORE     -1
+#define CONFIG_LWIP_SO_LINGER               1
+#define CONFIG_BRIDGE_TX_RATE_LIMIT         0
+#define CONFIG_BRIDGE_TX_BURST              4096
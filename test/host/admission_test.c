@@ -0,0 +1,201 @@
+/* Bridge port admission control
+
+   tcp_server.c serves clients on loopback addresses the firmware sees as 10.a.b.c,
+   with the UART looped back so every request comes back as its response:
+   - a source off the allow list is reset at once
+   - an untrusted session sending nothing is dropped after the first byte timeout
+   - while a session runs, a flood of connections from several addresses is reset
+     within one look at the backlog each, rate limited once past the burst, and the
+     round trip time of the session stays where it was without the flood
+   - a trusted peer takes the UART over and is exempt from the first byte timeout
+
+   Firmware sources: tcp_server.c token_bucket.c admission.c
+*/
+#include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include "host.h"
+#include "lwip/sockets.h"
+
+#include "tcp_server.h"
+#include "admission.h"
+#include "mem_arena.h"
+#include "uart_events.h"
+
+#define BRIDGE_UART     UART_NUM_1
+#define FLOOD_THREADS   4
+#define ROUND_TRIPS     60
+#define REQ_LEN         64
+#define POLL_MS         100     // how often the bridge loop looks at the backlog
+#define FIRST_BYTE_MS   CONFIG_ADMISSION_FIRST_BYTE_TIMEOUT
+
+static uint8_t bridge_rx[BRIDGE_BUFF_SZ], bridge_tx[BRIDGE_BUFF_SZ];
+
+void *mem_arena_get(mem_buf_t buf)
+{
+    return buf == MEM_BRIDGE_RX ? bridge_rx : buf == MEM_BRIDGE_TX ? bridge_tx : NULL;
+}
+
+void uart_events_start(uart_port_t uart, QueueHandle_t events)
+{
+}
+
+static uint16_t port;
+
+static int64_t now_ms(void)
+{
+    return esp_timer_get_time() / 1000;
+}
+
+static tcp_server_stats_t bridge_stats(void)
+{
+    tcp_server_stats_t s;
+    tcp_server_get_stats(&s);
+    return s;
+}
+
+static admission_stats_t adm_stats(void)
+{
+    admission_stats_t s;
+    admission_get_stats(&s);
+    return s;
+}
+
+/** Milliseconds until the server closes the connection, -1 if it does not within timeout_ms */
+static int closed_after(int sock, int timeout_ms)
+{
+    int64_t const start = now_ms();
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char c;
+    ssize_t const n = recv(sock, &c, 1, 0);
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+        return -1;
+    return now_ms() - start;
+}
+
+/** Send a request through the bridge and wait for it to come back, returns the round trip in ms */
+static int round_trip(int sock, uint8_t seed)
+{
+    uint8_t req[REQ_LEN], resp[REQ_LEN];
+    for (int i = 0; i < REQ_LEN; i++)
+        req[i] = seed + i;
+    int64_t const start = esp_timer_get_time();
+    CHECK(send(sock, req, sizeof(req), 0) == sizeof(req));
+    CHECK(host_recv_all(sock, resp, sizeof(resp), 1000) == sizeof(resp));
+    CHECK(!memcmp(req, resp, sizeof(req)));
+    return (esp_timer_get_time() - start + 999) / 1000;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/** Median and maximum round trip of the session */
+static void measure(int sock, int *median, int *max)
+{
+    int rtt[ROUND_TRIPS];
+    for (int i = 0; i < ROUND_TRIPS; i++)
+        rtt[i] = round_trip(sock, i);
+    qsort(rtt, ROUND_TRIPS, sizeof(rtt[0]), cmp_int);
+    *median = rtt[ROUND_TRIPS / 2];
+    *max = rtt[ROUND_TRIPS - 1];
+}
+
+static struct flood {
+    pthread_t thread;
+    uint32_t  from;
+    int       connections;
+    int       closed;
+    int       close_max_ms;
+} floods[FLOOD_THREADS];
+
+static volatile bool flood_stop;
+
+/** Connect in a loop sending nothing, timing how soon the bridge resets each connection */
+static void *flood_thread(void *arg)
+{
+    struct flood *f = arg;
+    while (!flood_stop) {
+        int const sock = host_connect_from(port, f->from);
+        CHECK(sock >= 0);
+        f->connections++;
+        int const ms = closed_after(sock, 2000);
+        if (ms >= 0) {
+            f->closed++;
+            f->close_max_ms = MAX(f->close_max_ms, ms);
+        }
+        close(sock);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    port = host_free_port(0);
+    settings_t settings = { .uart_baud_rate = CONFIG_UART_BITRATE, .tcp_port = port };
+    tcp_server_create(&settings);
+    uart_set_loop_back(BRIDGE_UART, true);
+
+    host_step("a source off the allow list is reset at once");
+    int sock = host_connect_from(port, 0x7F030001);
+    CHECK(sock >= 0);
+    CHECK(closed_after(sock, 1000) >= 0);
+    close(sock);
+    CHECK(adm_stats().denied == 1);
+
+    host_step("an untrusted session sending nothing is dropped after the first byte timeout");
+    sock = host_connect_from(port, 0x7F010005);
+    CHECK(sock >= 0);
+    int const ms = closed_after(sock, 3 * FIRST_BYTE_MS);
+    CHECK_MSG(ms >= FIRST_BYTE_MS - 50, "closed after %d ms", ms);
+    close(sock);
+    CHECK(bridge_stats().first_byte_timeouts == 1);
+
+    host_step("round trip time of a session");
+    int const session = host_connect_from(port, 0x7F01000A);
+    CHECK(session >= 0);
+    int base_median, base_max;
+    measure(session, &base_median, &base_max);
+    printf("round trip median %d ms, max %d ms\n", base_median, base_max);
+
+    host_step("connection flood from %d addresses while the session runs", FLOOD_THREADS);
+    for (int i = 0; i < FLOOD_THREADS; i++) {
+        floods[i].from = 0x7F010100 + i;
+        CHECK(!pthread_create(&floods[i].thread, NULL, flood_thread, &floods[i]));
+    }
+    usleep(200000);
+    int flood_median, flood_max;
+    measure(session, &flood_median, &flood_max);
+    flood_stop = true;
+    int connections = 0, close_max = 0;
+    for (int i = 0; i < FLOOD_THREADS; i++) {
+        pthread_join(floods[i].thread, NULL);
+        CHECK_MSG(floods[i].closed == floods[i].connections, "%d of %d closed",
+                  floods[i].closed, floods[i].connections);
+        connections += floods[i].connections;
+        close_max = MAX(close_max, floods[i].close_max_ms);
+    }
+    printf("round trip median %d ms, max %d ms, %d connections reset within %d ms\n",
+           flood_median, flood_max, connections, close_max);
+    // Every connection waiting is reset on the next look at the backlog
+    CHECK_MSG(close_max < 2 * POLL_MS + 50, "reset after %d ms", close_max);
+    CHECK(flood_median <= base_median + 10 && flood_max < 2 * POLL_MS);
+    CHECK(bridge_stats().rejected >= FLOOD_THREADS);
+    CHECK(adm_stats().rate_limited > 0);
+    CHECK(bridge_stats().rejected + adm_stats().rate_limited == connections);
+    round_trip(session, 0);
+
+    host_step("a trusted peer takes the UART over");
+    int const trusted = host_connect_from(port, 0x7F020007);
+    CHECK(trusted >= 0);
+    CHECK(closed_after(session, 2 * POLL_MS + 500) >= 0);
+    close(session);
+    CHECK(bridge_stats().preempted == 1);
+    // Trusted peers are exempt from the first byte timeout
+    CHECK(closed_after(trusted, 2 * FIRST_BYTE_MS) < 0);
+    round_trip(trusted, 7);
+    close(trusted);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/* Bridge port write path
+
+   The token bucket is run against a frozen clock. The bridge loop of tcp_server.c
+   then serves a loopback client over the fake UART:
+   - while the UART transmitter is stalled and the client keeps sending, UART data
+     still reaches the client, the loop never blocks on the full TX buffer
+   - once the transmitter runs, network data reaches the UART in order at the
+     configured rate limit
+
+   Firmware sources: tcp_server.c token_bucket.c
+*/
+#include <pthread.h>
+#include "host.h"
+#include "lwip/sockets.h"
+
+#include "tcp_server.h"
+#include "token_bucket.h"
+#include "mem_arena.h"
+#include "uart_events.h"
+
+#define BRIDGE_UART     UART_NUM_1
+#define TX_TOTAL        (160 * 1024)    // client -> UART
+#define RX_TOTAL        (32 * 1024)     // UART -> client
+#define RATE            CONFIG_BRIDGE_TX_RATE_LIMIT
+
+static uint8_t bridge_rx[BRIDGE_BUFF_SZ], bridge_tx[BRIDGE_BUFF_SZ];
+
+void *mem_arena_get(mem_buf_t buf)
+{
+    return buf == MEM_BRIDGE_RX ? bridge_rx : buf == MEM_BRIDGE_TX ? bridge_tx : NULL;
+}
+
+void uart_events_start(uart_port_t uart, QueueHandle_t events)
+{
+}
+
+static uint8_t pattern(size_t i, uint8_t seed)
+{
+    return (uint8_t)(i * 31 + (i >> 9) + seed);
+}
+
+static void test_token_bucket(void)
+{
+    host_step("token bucket refills at its rate up to the burst");
+    host_time_freeze();
+    token_bucket_t tb;
+    token_bucket_init(&tb, 1000, 500);
+    CHECK(token_bucket_available(&tb) == 500);
+    token_bucket_consume(&tb, 500);
+    CHECK(token_bucket_available(&tb) == 0);
+    host_time_advance(100000);
+    CHECK(token_bucket_available(&tb) == 100);
+    host_time_advance(10000000);
+    CHECK(token_bucket_available(&tb) == 500);
+
+    host_step("token bucket pays off debt before giving credit again");
+    token_bucket_consume(&tb, 800);
+    CHECK(token_bucket_available(&tb) == 0);
+    host_time_advance(300000);
+    CHECK(token_bucket_available(&tb) == 0);
+    host_time_advance(100000);
+    CHECK(token_bucket_available(&tb) == 100);
+
+    host_step("token bucket without a rate is unlimited");
+    token_bucket_init(&tb, 0, 500);
+    token_bucket_consume(&tb, 100000);
+    CHECK(token_bucket_available(&tb) == UINT32_MAX);
+    host_time_release();
+}
+
+static void *client_sender(void *arg)
+{
+    int const sock = *(int *)arg;
+    static uint8_t chunk[1024];
+    for (size_t sent = 0; sent < TX_TOTAL; ) {
+        size_t const len = TX_TOTAL - sent < sizeof(chunk) ? TX_TOTAL - sent : sizeof(chunk);
+        for (size_t i = 0; i < len; i++)
+            chunk[i] = pattern(sent + i, 0);
+        ssize_t const n = send(sock, chunk, len, 0);
+        CHECK(n > 0);
+        sent += n;
+    }
+    return NULL;
+}
+
+static void test_stalled_uart(int sock)
+{
+    host_step("UART data reaches the client while the UART transmitter is stalled");
+    static uint8_t rx[RX_TOTAL];
+    size_t fed = 0, got = 0;
+    int64_t const started = esp_timer_get_time();
+    while (got < RX_TOTAL) {
+        CHECK_MSG(esp_timer_get_time() - started < 5000000, "%zu of %d bytes received", got, RX_TOTAL);
+        uint8_t chunk[512];
+        size_t const len = RX_TOTAL - fed < sizeof(chunk) ? RX_TOTAL - fed : sizeof(chunk);
+        for (size_t i = 0; i < len; i++)
+            chunk[i] = pattern(fed + i, 0x55);
+        fed += host_uart_feed(BRIDGE_UART, chunk, len);
+        got += host_recv_all(sock, rx + got, RX_TOTAL - got, 5);
+    }
+    for (size_t i = 0; i < RX_TOTAL; i++)
+        CHECK_MSG(rx[i] == pattern(i, 0x55), "byte %zu", i);
+
+    // The bridge task counts the data after send() returned, give it time to catch up
+    tcp_server_stats_t stats;
+    int64_t const counted = esp_timer_get_time();
+    for (;;) {
+        tcp_server_get_stats(&stats);
+        if (stats.uart_to_eth_bytes == RX_TOTAL)
+            break;
+        CHECK_MSG(esp_timer_get_time() - counted < 1000000, "%llu of %d bytes counted",
+                  (unsigned long long)stats.uart_to_eth_bytes, RX_TOTAL);
+        usleep(1000);
+    }
+    // Held back by the full TX buffer the whole time
+    CHECK(stats.eth_to_uart_bytes < TX_TOTAL / 2);
+    CHECK(stats.tx_throttled > 0);
+}
+
+static void test_rate_limit(void)
+{
+    host_step("network data reaches the UART in order at %d bytes/s", RATE);
+    // The first part drains what piled up in the TX buffer and the burst, then the rate shows
+    size_t const mark = TX_TOTAL / 3;
+    int64_t const started = esp_timer_get_time();
+    int64_t mark_at = 0;
+    size_t taken = 0;
+    while (taken < TX_TOTAL) {
+        CHECK_MSG(esp_timer_get_time() - started < 10000000, "%zu of %d bytes written", taken, TX_TOTAL);
+        uint8_t chunk[2048];
+        size_t const n = host_uart_take(BRIDGE_UART, chunk, sizeof(chunk));
+        for (size_t i = 0; i < n; i++)
+            CHECK_MSG(chunk[i] == pattern(taken + i, 0), "byte %zu", taken + i);
+        taken += n;
+        if (!mark_at && taken >= mark)
+            mark_at = esp_timer_get_time();
+        if (!n)
+            usleep(1000);
+    }
+    double const rate = (TX_TOTAL - mark) * 1e6 / (esp_timer_get_time() - mark_at);
+    host_step("%.0f bytes/s", rate);
+    CHECK(rate > RATE * 0.85 && rate < RATE * 1.15);
+}
+
+int main(void)
+{
+    test_token_bucket();
+
+    settings_t settings = { .uart_baud_rate = CONFIG_UART_BITRATE, .tcp_port = host_free_port(0) };
+    tcp_server_create(&settings);
+    int sock = host_connect(settings.tcp_port);
+    CHECK(sock >= 0);
+
+    pthread_t sender;
+    pthread_create(&sender, NULL, client_sender, &sock);
+    // Let the client fill the UART TX buffer first
+    for (int i = 0; i < 200 && host_uart_tx_pending(BRIDGE_UART) < 16 * 1024; i++)
+        usleep(10000);
+    CHECK(host_uart_tx_pending(BRIDGE_UART) >= 16 * 1024);
+
+    test_stalled_uart(sock);
+    test_rate_limit();
+    pthread_join(sender, NULL);
+    close(sock);
+    return 0;
+}
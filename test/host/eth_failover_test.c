@@ -0,0 +1,153 @@
+/* Ethernet link failover
+
+   Two ports are driven through link and address events while a client holds a
+   bridge session of tcp_server.c bound to the address of port 0:
+   - losing the link of the other port leaves the default route and the session alone
+   - losing the link of port 0 moves the default route to port 1 at once and the
+     session is torn down right away, the client may connect again
+   - the active port is kept while usable, the route goes back only when it is not
+   - a new address on the port of the session also drops the session
+
+   Firmware sources: eth_failover.c tcp_server.c token_bucket.c
+*/
+#include <errno.h>
+#include "host.h"
+#include "lwip/sockets.h"
+#include "esp_eth.h"
+
+#include "eth_failover.h"
+#include "tcp_server.h"
+#include "mem_arena.h"
+#include "uart_events.h"
+
+#define BRIDGE_UART     UART_NUM_1
+#define PORT_CNT        2
+#define DROP_MS         500     // well below any TCP keepalive timeout
+
+static uint8_t bridge_rx[BRIDGE_BUFF_SZ], bridge_tx[BRIDGE_BUFF_SZ];
+
+void *mem_arena_get(mem_buf_t buf)
+{
+    return buf == MEM_BRIDGE_RX ? bridge_rx : buf == MEM_BRIDGE_TX ? bridge_tx : NULL;
+}
+
+void uart_events_start(uart_port_t uart, QueueHandle_t events)
+{
+}
+
+static int eth_dummy[PORT_CNT];
+static esp_eth_handle_t eths[PORT_CNT] = { &eth_dummy[0], &eth_dummy[1] };
+static char netif_dummy[PORT_CNT];
+static esp_netif_t *netifs[PORT_CNT] = { (esp_netif_t *)&netif_dummy[0], (esp_netif_t *)&netif_dummy[1] };
+
+static void link_event(int port, eth_event_t id)
+{
+    host_event_post(ETH_EVENT, id, &eths[port]);
+}
+
+static void ip_event(int port, ip_event_t id, uint32_t addr)
+{
+    ip_event_got_ip_t event = { .esp_netif = netifs[port], .ip_info.ip.addr = addr };
+    host_event_post(IP_EVENT, id, &event);
+}
+
+static eth_failover_stats_t stats(void)
+{
+    eth_failover_stats_t s;
+    eth_failover_get_stats(&s);
+    return s;
+}
+
+/** Data goes both ways through the session */
+static void check_session(int sock)
+{
+    static const char req[] = "ping", resp[] = "pong";
+    char buf[8];
+    CHECK(send(sock, req, 4, 0) == 4);
+    size_t got = 0;
+    for (int i = 0; i < 100 && got < 4; i++) {
+        got += host_uart_take(BRIDGE_UART, buf + got, 4 - got);
+        if (got < 4)
+            usleep(10000);
+    }
+    CHECK(got == 4 && !memcmp(buf, req, 4));
+    CHECK(host_uart_feed(BRIDGE_UART, resp, 4) == 4);
+    CHECK(host_recv_all(sock, buf, 4, 1000) == 4 && !memcmp(buf, resp, 4));
+}
+
+/** True if the server closes the connection within timeout_ms */
+static bool closed_within(int sock, int timeout_ms)
+{
+    struct timeval tv = { .tv_sec = 0, .tv_usec = timeout_ms * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char c;
+    ssize_t const n = recv(sock, &c, 1, 0);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+int main(void)
+{
+    uint32_t const session_ip = htonl(INADDR_LOOPBACK);
+    uint32_t const other_ip = htonl(0x0A000002);
+
+    host_step("both ports come up, port 0 carries the default route");
+    eth_failover_start(eths, netifs, PORT_CNT);
+    link_event(1, ETHERNET_EVENT_CONNECTED);
+    ip_event(1, IP_EVENT_ETH_GOT_IP, other_ip);
+    CHECK(stats().active == 1);
+    CHECK(host_default_netif() == netifs[1]);
+    link_event(0, ETHERNET_EVENT_CONNECTED);
+    ip_event(0, IP_EVENT_ETH_GOT_IP, session_ip);
+    // Port 1 stays active while usable even though port 0 ranks higher
+    CHECK(stats().active == 1);
+    link_event(1, ETHERNET_EVENT_DISCONNECTED);
+    CHECK(stats().active == 0);
+    CHECK(host_default_netif() == netifs[0]);
+    link_event(1, ETHERNET_EVENT_CONNECTED);
+    CHECK(stats().active == 0);
+    CHECK(stats().switches == 1 && stats().link_downs == 1);
+
+    settings_t settings = { .uart_baud_rate = CONFIG_UART_BITRATE, .tcp_port = host_free_port(0) };
+    tcp_server_create(&settings);
+    int sock = host_connect(settings.tcp_port);
+    CHECK(sock >= 0);
+    check_session(sock);
+
+    host_step("link loss on the other port leaves the session alone");
+    link_event(1, ETHERNET_EVENT_DISCONNECTED);
+    CHECK(stats().active == 0 && stats().sessions_dropped == 0);
+    CHECK(!closed_within(sock, 100));
+    check_session(sock);
+    link_event(1, ETHERNET_EVENT_CONNECTED);
+
+    host_step("link loss on the session port moves the route and drops the session");
+    link_event(0, ETHERNET_EVENT_DISCONNECTED);
+    CHECK(stats().active == 1);
+    CHECK(host_default_netif() == netifs[1]);
+    CHECK(stats().switches == 2 && stats().sessions_dropped == 1);
+    CHECK(closed_within(sock, DROP_MS));
+    close(sock);
+    // A repeated link down event is not a new one
+    link_event(0, ETHERNET_EVENT_STOP);
+    CHECK(stats().link_downs == 3 && stats().sessions_dropped == 1);
+
+    host_step("the client connects again");
+    sock = host_connect(settings.tcp_port);
+    CHECK(sock >= 0);
+    check_session(sock);
+
+    host_step("the route goes back once the active port loses its address");
+    link_event(0, ETHERNET_EVENT_CONNECTED);
+    CHECK(stats().active == 1);
+    ip_event(1, IP_EVENT_ETH_LOST_IP, 0);
+    CHECK(stats().active == 0);
+    CHECK(host_default_netif() == netifs[0]);
+    check_session(sock);
+
+    host_step("a new address on the session port drops the session");
+    ip_event(0, IP_EVENT_ETH_GOT_IP, htonl(0x0A000005));
+    CHECK(stats().sessions_dropped == 2);
+    CHECK(closed_within(sock, DROP_MS));
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/* Test side of the host runtime
+
+   Checks, the clock, NVS, events and the fake UART the firmware modules under
+   test talk to through the IDF stand-in.
+*/
+#pragma once
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "host_idf.h"
+#include "driver/uart.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+
+/** Fail the test, printing the location and the condition */
+#define CHECK(cond) do {                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                                \
+        }                                                                           \
+    } while (0)
+
+#define CHECK_MSG(cond, fmt, ...) do {                                              \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s: " fmt "\n", __FILE__, __LINE__, \
+                    #cond, ##__VA_ARGS__);                                          \
+            exit(1);                                                                \
+        }                                                                           \
+    } while (0)
+
+/** Print the test step, the runner shows it on failure */
+void host_step(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/** Stop esp_timer_get_time() at its current value, it only moves by host_time_advance() */
+void host_time_freeze(void);
+void host_time_advance(int64_t us);
+/** Let esp_timer_get_time() follow the monotonic clock again, from the frozen value */
+void host_time_release(void);
+
+/**
+ * Erase the NVS stand-in. Its contents are shared with processes forked after the
+ * first call, a test forks to "reboot" and start over with fresh module state.
+ */
+void host_nvs_erase(void);
+
+/** Run the handlers registered for the event right away in the calling thread */
+void host_event_post(esp_event_base_t base, int32_t id, void *data);
+/** Interface last given to esp_netif_set_default_netif() */
+esp_netif_t *host_default_netif(void);
+
+/** Port on the loopback interface the test may listen on, unique per process */
+uint16_t host_free_port(int index);
+
+/** Connect a blocking TCP client to 127.0.0.1:port, retrying until the listener is up */
+int host_connect(uint16_t port);
+
+/**
+ * Connect from the loopback address 127.a.b.c (host byte order). With a nonzero
+ * the firmware sees the peer as 10.a.b.c, for source address checks.
+ */
+int host_connect_from(uint16_t port, uint32_t from);
+
+/** Receive exactly len bytes within timeout_ms, returns the number received */
+size_t host_recv_all(int sock, void *buf, size_t len, int timeout_ms);
+
+/**
+ * Fake UART. The driver ring buffers have the sizes given to uart_driver_install().
+ * Data written by the firmware waits in the TX ring until the test takes it, the
+ * transmitter "stalls" while the test does not. Data fed by the test is what the
+ * firmware reads. With loopback on, written data goes straight to the RX ring.
+ */
+size_t host_uart_feed(uart_port_t port, const void *data, size_t len);
+size_t host_uart_take(uart_port_t port, void *buf, size_t len);
+size_t host_uart_tx_pending(uart_port_t port);
+
+#endif // HOST_H
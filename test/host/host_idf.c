@@ -0,0 +1,863 @@
+/* ESP-IDF stand-in for the host tests
+
+   FreeRTOS tasks run as POSIX threads, each with its notification value, and the
+   tick follows the monotonic clock. The UART driver is a pair of ring buffers
+   per port, the test plays the other end of the line through host.h.
+*/
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "host.h"
+#include "driver/gpio.h"
+#include "esp_mac.h"
+#include "esp_app_desc.h"
+#include "esp_eth.h"
+#include "esp_netif.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
+#include "lwip/sockets.h"
+
+/* Logging */
+
+static int log_level(void)
+{
+    static int level = -1;
+    if (level < 0) {
+        const char *env = getenv("HOST_LOG");
+        level = env ? atoi(env) : 2;
+    }
+    return level;
+}
+
+void host_log(int level, const char *tag, const char *fmt, ...)
+{
+    if (level > log_level())
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%c (%s) ", "?EWIDV"[level], tag);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+void host_step(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    printf("-- ");
+    vprintf(fmt, ap);
+    putchar('\n');
+    fflush(stdout);
+    va_end(ap);
+}
+
+const char *esp_err_to_name(esp_err_t err)
+{
+    switch (err) {
+    case ESP_OK:                return "ESP_OK";
+    case ESP_FAIL:              return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:   return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:  return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:     return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:       return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_CRC:   return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_NOT_ENOUGH_SPACE: return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    default:                    return "ESP_ERR_UNKNOWN";
+    }
+}
+
+/* System */
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    static const uint8_t host_mac[6] = { 0x02, 0x00, 0x00, 0xa1, 0xb2, 0xc3 };
+    memcpy(mac, host_mac, sizeof(host_mac));
+    return ESP_OK;
+}
+
+const esp_app_desc_t *esp_app_get_description(void)
+{
+    static const esp_app_desc_t desc = { .version = "host", .project_name = "host_test" };
+    return &desc;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int i = 0; i < 8; i++)
+            crc = crc >> 1 ^ (crc & 1 ? 0xEDB88320 : 0);
+    }
+    return ~crc;
+}
+
+/* NVS, the entries live in memory shared with the processes forked later */
+
+#define NVS_ENTRIES     64
+#define NVS_VALUE_MAX   512
+#define NVS_HANDLES     8
+
+enum { NVS_FREE, NVS_I32, NVS_STR, NVS_BLOB };
+
+struct nvs_entry {
+    char    ns[16];
+    char    key[16];
+    uint8_t type;
+    size_t  len;
+    uint8_t value[NVS_VALUE_MAX];
+};
+
+static struct nvs_entry *nvs;
+static char nvs_handles[NVS_HANDLES][16];   // namespace of handle i + 1
+
+void host_nvs_erase(void)
+{
+    if (!nvs) {
+        nvs = mmap(NULL, NVS_ENTRIES * sizeof(*nvs), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        CHECK(nvs != MAP_FAILED);
+    }
+    memset(nvs, 0, NVS_ENTRIES * sizeof(*nvs));
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+    if (!nvs)
+        host_nvs_erase();
+    for (int i = 0; i < NVS_HANDLES; i++) {
+        if (!nvs_handles[i][0]) {
+            snprintf(nvs_handles[i], sizeof(nvs_handles[i]), "%s", name);
+            *handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    nvs_handles[handle - 1][0] = '\0';
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+/** Entry of the key of any type, a free one to write it to if create, NULL if none */
+static struct nvs_entry *nvs_find(nvs_handle_t handle, const char *key, bool create)
+{
+    CHECK(handle >= 1 && handle <= NVS_HANDLES && nvs_handles[handle - 1][0]);
+    const char *ns = nvs_handles[handle - 1];
+    struct nvs_entry *free_entry = NULL;
+    for (int i = 0; i < NVS_ENTRIES; i++) {
+        struct nvs_entry *e = &nvs[i];
+        if (e->type != NVS_FREE && !strcmp(e->ns, ns) && !strcmp(e->key, key))
+            return e;
+        if (e->type == NVS_FREE && !free_entry)
+            free_entry = e;
+    }
+    if (!create || !free_entry)
+        return NULL;
+    snprintf(free_entry->ns, sizeof(free_entry->ns), "%s", ns);
+    snprintf(free_entry->key, sizeof(free_entry->key), "%s", key);
+    return free_entry;
+}
+
+static esp_err_t nvs_get(nvs_handle_t handle, const char *key, uint8_t type, void *value, size_t *length)
+{
+    struct nvs_entry *e = nvs_find(handle, key, false);
+    if (!e || e->type != type)
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (value && *length < e->len)
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    if (value)
+        memcpy(value, e->value, e->len);
+    *length = e->len;
+    return ESP_OK;
+}
+
+static esp_err_t nvs_set(nvs_handle_t handle, const char *key, uint8_t type, const void *value, size_t length)
+{
+    if (length > NVS_VALUE_MAX)
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    struct nvs_entry *e = nvs_find(handle, key, true);
+    if (!e)
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    e->type = type;
+    e->len = length;
+    memcpy(e->value, value, length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    struct nvs_entry *e = nvs_find(handle, key, false);
+    if (!e)
+        return ESP_ERR_NVS_NOT_FOUND;
+    e->type = NVS_FREE;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_i32(nvs_handle_t handle, const char *key, int32_t *value)
+{
+    size_t length = sizeof(*value);
+    return nvs_get(handle, key, NVS_I32, value, &length);
+}
+
+esp_err_t nvs_set_i32(nvs_handle_t handle, const char *key, int32_t value)
+{
+    return nvs_set(handle, key, NVS_I32, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_str(nvs_handle_t handle, const char *key, char *value, size_t *length)
+{
+    return nvs_get(handle, key, NVS_STR, value, length);
+}
+
+esp_err_t nvs_set_str(nvs_handle_t handle, const char *key, const char *value)
+{
+    return nvs_set(handle, key, NVS_STR, value, strlen(value) + 1);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length)
+{
+    return nvs_get(handle, key, NVS_BLOB, value, length);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return nvs_set(handle, key, NVS_BLOB, value, length);
+}
+
+/* Events, handlers run in the task posting the event */
+
+#define HOST_EVENT_HANDLERS 16
+
+esp_event_base_t const ETH_EVENT = "ETH_EVENT";
+esp_event_base_t const IP_EVENT = "IP_EVENT";
+
+static struct {
+    esp_event_base_t    base;
+    int32_t             id;
+    esp_event_handler_t handler;
+    void               *arg;
+} handlers[HOST_EVENT_HANDLERS];
+static esp_netif_t *default_netif;
+
+esp_err_t esp_event_handler_register(esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg)
+{
+    for (int i = 0; i < HOST_EVENT_HANDLERS; i++) {
+        if (!handlers[i].handler) {
+            handlers[i].base = base;
+            handlers[i].id = id;
+            handlers[i].handler = handler;
+            handlers[i].arg = arg;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void host_event_post(esp_event_base_t base, int32_t id, void *data)
+{
+    for (int i = 0; i < HOST_EVENT_HANDLERS && handlers[i].handler; i++) {
+        if (handlers[i].base == base && (handlers[i].id == ESP_EVENT_ANY_ID || handlers[i].id == id))
+            handlers[i].handler(handlers[i].arg, base, id, data);
+    }
+}
+
+esp_err_t esp_netif_set_default_netif(esp_netif_t *netif)
+{
+    default_netif = netif;
+    return ESP_OK;
+}
+
+esp_netif_t *host_default_netif(void)
+{
+    return default_netif;
+}
+
+/* Clock */
+
+static pthread_mutex_t time_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool time_frozen;
+static int64_t time_frozen_us;
+static int64_t time_offset_us;  // added to the monotonic clock once released
+
+static int64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    pthread_mutex_lock(&time_lock);
+    int64_t const now = time_frozen ? time_frozen_us : monotonic_us() + time_offset_us;
+    pthread_mutex_unlock(&time_lock);
+    return now;
+}
+
+void host_time_freeze(void)
+{
+    int64_t const now = esp_timer_get_time();
+    pthread_mutex_lock(&time_lock);
+    time_frozen_us = now;
+    time_frozen = true;
+    pthread_mutex_unlock(&time_lock);
+}
+
+void host_time_advance(int64_t us)
+{
+    pthread_mutex_lock(&time_lock);
+    time_frozen_us += us;
+    pthread_mutex_unlock(&time_lock);
+}
+
+void esp_rom_delay_us(uint32_t us)
+{
+    pthread_mutex_lock(&time_lock);
+    bool const frozen = time_frozen;
+    // Busy waits of the firmware move the frozen clock along
+    if (frozen)
+        time_frozen_us += us;
+    pthread_mutex_unlock(&time_lock);
+    if (!frozen)
+        usleep(us);
+}
+
+void host_time_release(void)
+{
+    pthread_mutex_lock(&time_lock);
+    time_offset_us = time_frozen_us - monotonic_us();
+    time_frozen = false;
+    pthread_mutex_unlock(&time_lock);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return monotonic_us() / (1000000 / configTICK_RATE_HZ);
+}
+
+/** Absolute CLOCK_MONOTONIC deadline ticks from now, NULL for portMAX_DELAY */
+static const struct timespec *deadline(struct timespec *ts, TickType_t ticks)
+{
+    if (ticks == portMAX_DELAY)
+        return NULL;
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    int64_t const ns = ts->tv_nsec + (int64_t)ticks * (1000000000 / configTICK_RATE_HZ);
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+static void cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/** Wait on cond until the deadline, false once it has passed */
+static bool cond_wait(pthread_cond_t *cond, pthread_mutex_t *lock, const struct timespec *until)
+{
+    if (!until)
+        return pthread_cond_wait(cond, lock) == 0;
+    return pthread_cond_timedwait(cond, lock, until) == 0;
+}
+
+/* Tasks */
+
+struct host_task {
+    TaskFunction_t  fn;
+    void           *arg;
+    char            name[16];
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint32_t        notified;
+};
+
+static __thread struct host_task *current_task;
+
+static struct host_task *task_new(TaskFunction_t fn, void *arg, const char *name)
+{
+    struct host_task *t = calloc(1, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    pthread_mutex_init(&t->lock, NULL);
+    cond_init(&t->cond);
+    return t;
+}
+
+static void *task_entry(void *arg)
+{
+    current_task = arg;
+    current_task->fn(current_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core)
+{
+    struct host_task *t = task_new(fn, arg, name);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, task_entry, t) != 0) {
+        free(t);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    if (handle)
+        *handle = t;
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio,
+                       TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(fn, name, stack, arg, prio, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    // Only tasks deleting themselves are supported, the record is kept for late notifications
+    if (!task || task == current_task)
+        pthread_exit(NULL);
+    abort();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    usleep(ticks * (1000000 / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    // The test main thread gets a record on first use
+    if (!current_task)
+        current_task = task_new(NULL, NULL, "main");
+    return current_task;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+    xTaskNotifyGive(task);
+    if (woken)
+        *woken = pdTRUE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *t = xTaskGetCurrentTaskHandle();
+    struct timespec ts;
+    const struct timespec *until = deadline(&ts, ticks);
+    pthread_mutex_lock(&t->lock);
+    while (!t->notified && cond_wait(&t->cond, &t->lock, until))
+        ;
+    uint32_t const value = t->notified;
+    if (value)
+        t->notified = clear ? 0 : value - 1;
+    pthread_mutex_unlock(&t->lock);
+    return value;
+}
+
+/* Semaphores, only the mutex kind */
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool            taken;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    struct host_queue *q = calloc(1, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    cond_init(&q->cond);
+    return q;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    struct timespec ts;
+    const struct timespec *until = deadline(&ts, ticks);
+    pthread_mutex_lock(&sem->lock);
+    while (sem->taken && cond_wait(&sem->cond, &sem->lock, until))
+        ;
+    bool const got = !sem->taken;
+    sem->taken = true;
+    pthread_mutex_unlock(&sem->lock);
+    return got ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    sem->taken = false;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+    return pdTRUE;
+}
+
+/* GPIO, levels are not looked at */
+
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+/* Fake UART */
+
+struct ring {
+    uint8_t *data;
+    size_t   size;
+    size_t   head;
+    size_t   len;
+};
+
+static struct fake_uart {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;       // data fed, data taken
+    struct ring     rx;
+    struct ring     tx;
+    uint32_t        baud_rate;
+    bool            loop_back;
+    uart_mode_t     mode;
+} uarts[UART_NUM_MAX];
+
+static pthread_once_t uarts_once = PTHREAD_ONCE_INIT;
+
+static void uarts_init(void)
+{
+    for (int i = 0; i < UART_NUM_MAX; i++) {
+        pthread_mutex_init(&uarts[i].lock, NULL);
+        cond_init(&uarts[i].cond);
+    }
+}
+
+static struct fake_uart *uart_get(uart_port_t port)
+{
+    pthread_once(&uarts_once, uarts_init);
+    return port >= 0 && port < UART_NUM_MAX ? &uarts[port] : NULL;
+}
+
+static size_t ring_put(struct ring *r, const uint8_t *data, size_t len)
+{
+    size_t n = 0;
+    for (; n < len && r->len < r->size; n++, r->len++)
+        r->data[(r->head + r->len) % r->size] = data[n];
+    return n;
+}
+
+static size_t ring_get(struct ring *r, uint8_t *buf, size_t len)
+{
+    size_t n = 0;
+    for (; n < len && r->len; n++, r->len--, r->head = (r->head + 1) % r->size)
+        buf[n] = r->data[r->head];
+    return n;
+}
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config)
+{
+    struct fake_uart *u = uart_get(port);
+    if (!u)
+        return ESP_ERR_INVALID_ARG;
+    u->baud_rate = config->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts)
+{
+    return uart_get(port) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              QueueHandle_t *queue, int intr_flags)
+{
+    struct fake_uart *u = uart_get(port);
+    if (!u || u->rx.data)
+        return ESP_ERR_INVALID_STATE;
+    u->rx = (struct ring){ .data = malloc(rx_buffer_size), .size = rx_buffer_size };
+    // Without a TX buffer writes wait for the hardware FIFO
+    u->tx.size = tx_buffer_size ? tx_buffer_size : UART_HW_FIFO_LEN(port);
+    u->tx.data = malloc(u->tx.size);
+    if (queue)
+        *queue = NULL;
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t len, TickType_t ticks)
+{
+    struct fake_uart *u = uart_get(port);
+    struct timespec ts;
+    const struct timespec *until = deadline(&ts, ticks);
+    size_t n = 0;
+    pthread_mutex_lock(&u->lock);
+    // Like the driver, wait until len bytes are there or the time is up
+    for (;;) {
+        n += ring_get(&u->rx, (uint8_t *)buf + n, len - n);
+        if (n == len || !ticks || !cond_wait(&u->cond, &u->lock, until))
+            break;
+    }
+    n += ring_get(&u->rx, (uint8_t *)buf + n, len - n);
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+/** Queue data for the line, returns the bytes accepted, called with the lock held */
+static size_t uart_line_put(struct fake_uart *u, const uint8_t *data, size_t len)
+{
+    size_t const n = ring_put(u->loop_back ? &u->rx : &u->tx, data, len);
+    if (n)
+        pthread_cond_broadcast(&u->cond);
+    return n;
+}
+
+int uart_write_bytes(uart_port_t port, const void *src, size_t size)
+{
+    struct fake_uart *u = uart_get(port);
+    size_t n = 0;
+    pthread_mutex_lock(&u->lock);
+    // Blocks until all of it is in the TX ring, like the driver
+    for (;;) {
+        n += uart_line_put(u, (const uint8_t *)src + n, size - n);
+        if (n == size)
+            break;
+        pthread_cond_wait(&u->cond, &u->lock);
+    }
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+int uart_tx_chars(uart_port_t port, const char *buffer, uint32_t len)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    size_t const n = uart_line_put(u, (const uint8_t *)buffer, len);
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks)
+{
+    struct fake_uart *u = uart_get(port);
+    struct timespec ts;
+    const struct timespec *until = deadline(&ts, ticks);
+    bool done;
+    pthread_mutex_lock(&u->lock);
+    while (u->tx.len && cond_wait(&u->cond, &u->lock, until))
+        ;
+    done = !u->tx.len;
+    pthread_mutex_unlock(&u->lock);
+    return done ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t uart_get_tx_buffer_free_size(uart_port_t port, size_t *size)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    *size = u->tx.size - u->tx.len;
+    pthread_mutex_unlock(&u->lock);
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    *size = u->rx.len;
+    pthread_mutex_unlock(&u->lock);
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t port)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    u->rx.len = 0;
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud_rate)
+{
+    uart_get(port)->baud_rate = baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_baudrate(uart_port_t port, uint32_t *baud_rate)
+{
+    *baud_rate = uart_get(port)->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_loop_back(uart_port_t port, bool loop_back_en)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    u->loop_back = loop_back_en;
+    pthread_mutex_unlock(&u->lock);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_mode(uart_port_t port, uart_mode_t mode)
+{
+    uart_get(port)->mode = mode;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_collision_flag(uart_port_t port, bool *collision_flag)
+{
+    // The line has no other node, the firmware sees collisions in the echo only
+    if (uart_get(port)->mode != UART_MODE_RS485_HALF_DUPLEX)
+        return ESP_ERR_INVALID_ARG;
+    *collision_flag = false;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t port, int threshold)
+{
+    return uart_get(port) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+size_t host_uart_feed(uart_port_t port, const void *data, size_t len)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    size_t const n = u->rx.data ? ring_put(&u->rx, data, len) : 0;
+    if (n)
+        pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+size_t host_uart_take(uart_port_t port, void *buf, size_t len)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    size_t const n = u->tx.data ? ring_get(&u->tx, buf, len) : 0;
+    if (n)
+        pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+size_t host_uart_tx_pending(uart_port_t port)
+{
+    struct fake_uart *u = uart_get(port);
+    pthread_mutex_lock(&u->lock);
+    size_t const n = u->tx.len;
+    pthread_mutex_unlock(&u->lock);
+    return n;
+}
+
+/* Sockets */
+
+char *inet_ntoa_r(struct in_addr addr, char *buf, int buflen)
+{
+    return (char *)inet_ntop(AF_INET, &addr, buf, buflen);
+}
+
+uint16_t host_free_port(int index)
+{
+    // Spread the tests run at once over the dynamic range
+    return 20000 + (getpid() % 2000) * 8 + index;
+}
+
+int host_connect_from(uint16_t port, uint32_t from)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct sockaddr_in local = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(from) };
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int const sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (bind(sock, (struct sockaddr *)&local, sizeof(local)) == 0 &&
+            connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return sock;
+        close(sock);
+        usleep(10000);
+    }
+    return -1;
+}
+
+int host_connect(uint16_t port)
+{
+    return host_connect_from(port, INADDR_LOOPBACK);
+}
+
+/** Move peers on 127.a.b.c with a nonzero to 10.a.b.c */
+static void peer_map(struct sockaddr *addr, socklen_t len)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    if (!addr || len < sizeof(*in) || in->sin_family != AF_INET)
+        return;
+    uint32_t const ip = ntohl(in->sin_addr.s_addr);
+    if ((ip >> 24) == 127 && (ip & 0x00FF0000))
+        in->sin_addr.s_addr = htonl((10u << 24) | (ip & 0x00FFFFFF));
+}
+
+#undef accept
+#undef getpeername
+
+int host_accept(int sock, struct sockaddr *addr, socklen_t *addr_len)
+{
+    int const s = accept(sock, addr, addr_len);
+    if (s >= 0 && addr_len)
+        peer_map(addr, *addr_len);
+    return s;
+}
+
+int host_getpeername(int sock, struct sockaddr *addr, socklen_t *addr_len)
+{
+    int const err = getpeername(sock, addr, addr_len);
+    if (!err)
+        peer_map(addr, *addr_len);
+    return err;
+}
+
+size_t host_recv_all(int sock, void *buf, size_t len, int timeout_ms)
+{
+    int64_t const until = monotonic_us() + timeout_ms * 1000LL;
+    size_t got = 0;
+    while (got < len) {
+        int64_t const left = until - monotonic_us();
+        if (left <= 0)
+            break;
+        struct timeval tv = { .tv_sec = left / 1000000, .tv_usec = left % 1000000 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ssize_t const n = recv(sock, (uint8_t *)buf + got, len - got, 0);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    return got;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "host_idf.h"
+
+typedef int gpio_num_t;
+typedef enum {
+    GPIO_MODE_DISABLE,
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT,
+} gpio_mode_t;
+
+esp_err_t gpio_set_level(gpio_num_t gpio, uint32_t level);
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode);
@@ -0,0 +1,51 @@
+#pragma once
+#include "host_idf.h"
+
+/* UART driver API served by the fake UART of host_idf.c, see host.h to feed and drain it */
+typedef int uart_port_t;
+
+#define UART_NUM_0              0
+#define UART_NUM_1              1
+#define UART_NUM_2              2
+#define UART_NUM_MAX            3
+#define UART_PIN_NO_CHANGE      (-1)
+#define UART_HW_FIFO_LEN(port)  128
+
+typedef enum { UART_DATA_5_BITS, UART_DATA_6_BITS, UART_DATA_7_BITS, UART_DATA_8_BITS } uart_word_length_t;
+typedef enum { UART_PARITY_DISABLE, UART_PARITY_EVEN = 2, UART_PARITY_ODD = 3 } uart_parity_t;
+typedef enum { UART_STOP_BITS_1 = 1, UART_STOP_BITS_1_5, UART_STOP_BITS_2 } uart_stop_bits_t;
+typedef enum {
+    UART_HW_FLOWCTRL_DISABLE,
+    UART_HW_FLOWCTRL_RTS,
+    UART_HW_FLOWCTRL_CTS,
+    UART_HW_FLOWCTRL_CTS_RTS,
+} uart_hw_flowcontrol_t;
+
+typedef enum { UART_MODE_UART, UART_MODE_RS485_HALF_DUPLEX } uart_mode_t;
+
+typedef struct {
+    int                   baud_rate;
+    uart_word_length_t    data_bits;
+    uart_parity_t         parity;
+    uart_stop_bits_t      stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uint8_t               rx_flow_ctrl_thresh;
+} uart_config_t;
+
+esp_err_t uart_param_config(uart_port_t port, const uart_config_t *config);
+esp_err_t uart_set_pin(uart_port_t port, int tx, int rx, int rts, int cts);
+esp_err_t uart_driver_install(uart_port_t port, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                              QueueHandle_t *queue, int intr_flags);
+int uart_read_bytes(uart_port_t port, void *buf, uint32_t len, TickType_t ticks);
+int uart_write_bytes(uart_port_t port, const void *src, size_t size);
+int uart_tx_chars(uart_port_t port, const char *buffer, uint32_t len);
+esp_err_t uart_wait_tx_done(uart_port_t port, TickType_t ticks);
+esp_err_t uart_get_tx_buffer_free_size(uart_port_t port, size_t *size);
+esp_err_t uart_get_buffered_data_len(uart_port_t port, size_t *size);
+esp_err_t uart_flush_input(uart_port_t port);
+esp_err_t uart_set_baudrate(uart_port_t port, uint32_t baud_rate);
+esp_err_t uart_get_baudrate(uart_port_t port, uint32_t *baud_rate);
+esp_err_t uart_set_loop_back(uart_port_t port, bool loop_back_en);
+esp_err_t uart_set_mode(uart_port_t port, uart_mode_t mode);
+esp_err_t uart_get_collision_flag(uart_port_t port, bool *collision_flag);
+esp_err_t uart_set_rx_full_threshold(uart_port_t port, int threshold);
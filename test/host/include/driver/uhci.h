@@ -0,0 +1,45 @@
+#pragma once
+#include "host_idf.h"
+#include "driver/uart.h"
+
+typedef struct uhci_controller_t *uhci_controller_handle_t;
+
+typedef struct {
+    uart_port_t uart_port;
+    size_t      tx_trans_queue_depth;
+    size_t      max_transmit_size;
+    size_t      max_receive_internal_mem;
+    size_t      dma_burst_size;
+    size_t      max_packet_receive;
+    struct {
+        uint16_t rx_brk_eof: 1;
+        uint16_t idle_eof: 1;
+        uint16_t length_eof: 1;
+    } rx_eof_flags;
+} uhci_controller_config_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t   recv_size;
+    struct {
+        uint32_t totally_received: 1;
+    } flags;
+} uhci_rx_event_data_t;
+
+typedef struct {
+    void  *buffer;
+    size_t sent_size;
+} uhci_tx_done_event_data_t;
+
+typedef bool (*uhci_rx_event_callback_t)(uhci_controller_handle_t uhci, const uhci_rx_event_data_t *edata, void *ctx);
+typedef bool (*uhci_tx_done_callback_t)(uhci_controller_handle_t uhci, const uhci_tx_done_event_data_t *edata, void *ctx);
+
+typedef struct {
+    uhci_rx_event_callback_t on_rx_trans_event;
+    uhci_tx_done_callback_t  on_tx_trans_done;
+} uhci_event_callbacks_t;
+
+esp_err_t uhci_new_controller(const uhci_controller_config_t *config, uhci_controller_handle_t *ret_uhci);
+esp_err_t uhci_register_event_callbacks(uhci_controller_handle_t uhci, const uhci_event_callbacks_t *cbs, void *ctx);
+esp_err_t uhci_receive(uhci_controller_handle_t uhci, uint8_t *read_buffer, size_t buffer_size);
+esp_err_t uhci_transmit(uhci_controller_handle_t uhci, uint8_t *write_buffer, size_t write_size);
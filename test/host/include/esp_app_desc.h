@@ -0,0 +1,13 @@
+#pragma once
+#include "host_idf.h"
+
+typedef struct {
+    char version[32];
+    char project_name[32];
+    char time[16];
+    char date[16];
+    char idf_ver[32];
+} esp_app_desc_t;
+
+/** Version "host" */
+const esp_app_desc_t *esp_app_get_description(void);
@@ -0,0 +1,14 @@
+#pragma once
+#include "host_idf.h"
+#include "esp_event.h"
+
+typedef void *esp_eth_handle_t;
+
+extern esp_event_base_t const ETH_EVENT;
+
+typedef enum {
+    ETHERNET_EVENT_START,
+    ETHERNET_EVENT_STOP,
+    ETHERNET_EVENT_CONNECTED,
+    ETHERNET_EVENT_DISCONNECTED,
+} eth_event_t;
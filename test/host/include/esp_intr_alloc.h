@@ -0,0 +1,4 @@
+#pragma once
+#include "host_idf.h"
+
+#define ESP_INTR_FLAG_IRAM (1 << 10)
@@ -0,0 +1,6 @@
+#pragma once
+#include "host_idf.h"
+
+typedef struct {
+    uint32_t addr;
+} esp_ip4_addr_t;
@@ -0,0 +1,5 @@
+#pragma once
+#include "host_idf.h"
+
+/** Busy wait, moves the clock by us while it is frozen */
+void esp_rom_delay_us(uint32_t us);
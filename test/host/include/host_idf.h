@@ -0,0 +1,130 @@
+/* ESP-IDF stand-in for the host tests
+
+   Declares the part of ESP-IDF and FreeRTOS the firmware modules under test use.
+   The functions are implemented on top of POSIX threads in host_idf.c, the IDF
+   headers in this directory only include this file and add what is specific to
+   them. Anything not declared here is not supported on the host.
+*/
+#pragma once
+
+#ifndef HOST_IDF_H
+#define HOST_IDF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* esp_err */
+typedef int esp_err_t;
+
+#define ESP_OK                          0
+#define ESP_FAIL                        -1
+#define ESP_ERR_NO_MEM                  0x101
+#define ESP_ERR_INVALID_ARG             0x102
+#define ESP_ERR_INVALID_STATE           0x103
+#define ESP_ERR_INVALID_SIZE            0x104
+#define ESP_ERR_NOT_FOUND               0x105
+#define ESP_ERR_NOT_SUPPORTED           0x106
+#define ESP_ERR_TIMEOUT                 0x107
+#define ESP_ERR_INVALID_CRC             0x109
+
+const char *esp_err_to_name(esp_err_t err);
+
+#define ESP_ERROR_CHECK(x) do {                                                     \
+        esp_err_t const err_rc_ = (x);                                              \
+        if (err_rc_ != ESP_OK) {                                                    \
+            fprintf(stderr, "%s:%d: %s failed: %s\n", __FILE__, __LINE__, #x,       \
+                    esp_err_to_name(err_rc_));                                      \
+            abort();                                                                \
+        }                                                                           \
+    } while (0)
+
+/* esp_log, printed if the level is at most HOST_LOG (2 - warnings by default) */
+void host_log(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, fmt, ...) host_log(1, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log(2, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log(3, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) host_log(4, tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) host_log(5, tag, fmt, ##__VA_ARGS__)
+
+/* esp_check */
+#define ESP_RETURN_ON_ERROR(x, tag, fmt, ...) do {                                  \
+        esp_err_t const err_rc_ = (x);                                              \
+        if (err_rc_ != ESP_OK) {                                                    \
+            ESP_LOGE(tag, fmt, ##__VA_ARGS__);                                      \
+            return err_rc_;                                                         \
+        }                                                                           \
+    } while (0)
+#define ESP_RETURN_ON_FALSE(a, err_code, tag, fmt, ...) do {                        \
+        if (!(a)) {                                                                 \
+            ESP_LOGE(tag, fmt, ##__VA_ARGS__);                                      \
+            return err_code;                                                        \
+        }                                                                           \
+    } while (0)
+
+/* esp_attr */
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define DMA_ATTR
+
+/* FreeRTOS, ticks of 10 ms like the firmware configuration */
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef struct host_task *TaskHandle_t;
+typedef struct host_queue *QueueHandle_t;
+typedef struct host_queue *SemaphoreHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdTRUE                  1
+#define pdFALSE                 0
+#define pdPASS                  1
+#define pdFAIL                  0
+#define portMAX_DELAY           0xFFFFFFFFu
+#define configTICK_RATE_HZ      100
+#define portTICK_PERIOD_MS      (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)       ((TickType_t)((uint64_t)(ms) * configTICK_RATE_HZ / 1000))
+#define tskIDLE_PRIORITY        0
+#define tskNO_AFFINITY          0x7FFFFFFF
+#define portYIELD_FROM_ISR(...) do { } while (0)
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio,
+                       TaskHandle_t *handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *handle, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks);
+
+/* Critical sections are a real lock, there is no scheduler to suspend */
+typedef struct {
+    pthread_mutex_t lock;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_MUTEX_INITIALIZER }
+#define portENTER_CRITICAL(mux)     pthread_mutex_lock(&(mux)->lock)
+#define portEXIT_CRITICAL(mux)      pthread_mutex_unlock(&(mux)->lock)
+#define portENTER_CRITICAL_ISR(mux) pthread_mutex_lock(&(mux)->lock)
+#define portEXIT_CRITICAL_ISR(mux)  pthread_mutex_unlock(&(mux)->lock)
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+
+/* esp_timer */
+int64_t esp_timer_get_time(void);
+
+#endif // HOST_IDF_H
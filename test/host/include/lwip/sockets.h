@@ -0,0 +1,16 @@
+#pragma once
+#include "host_idf.h"
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// The host socket API stands in for the lwIP one
+char *inet_ntoa_r(struct in_addr addr, char *buf, int buflen);
+
+// Peers on 127.a.b.c with a nonzero show up as 10.a.b.c, see host_connect_from()
+int host_accept(int sock, struct sockaddr *addr, socklen_t *addr_len);
+int host_getpeername(int sock, struct sockaddr *addr, socklen_t *addr_len);
+#define accept      host_accept
+#define getpeername host_getpeername
@@ -0,0 +1,3 @@
+#pragma once
+#include "host_idf.h"
+#include "nvs.h"
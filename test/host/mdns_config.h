@@ -0,0 +1,8 @@
+/* Configuration of the mdns test: raw bridge with the responder enabled */
+#define CONFIG_BRIDGE_MODE_RAW              1
+#define CONFIG_MDNS_RESPONDER_ENABLE        1
+#define CONFIG_MDNS_HOSTNAME_PREFIX         "serial-bridge"
+#define CONFIG_BRIDGE_PORT                  3142
+#define CONFIG_UART_BITRATE                 921600
+#define CONFIG_WEBSERVER_GPIO               32
+#define CONFIG_EXAMPLE_ETH_RX_TASK_CORE     -1
@@ -0,0 +1,427 @@
+/* mDNS / DNS-SD responder
+
+   Starts the responder of mdns_responder.c on the mDNS port of the host and sends
+   it DNS queries from another port, so the answers come back as legacy unicast
+   responses (RFC 6762 6.7) which are checked record by record: the A, PTR, SRV and
+   TXT records, the DNS-SD meta query, compressed and upper case names, several
+   questions in one query, the TXT record following the session state and the
+   running baud rate, and
+   queries which must not be answered.
+
+   Firmware sources: mdns_responder.c
+*/
+#include <strings.h>
+#include "host.h"
+#include "lwip/sockets.h"
+
+#include "mdns_responder.h"
+#include "tcp_server.h"
+
+#define HOST_NAME       "serial-bridge-a1b2c3.local"
+#define SERVICE         "_serial-bridge._tcp.local"
+#define INSTANCE        "serial-bridge-a1b2c3._serial-bridge._tcp.local"
+#define META            "_services._dns-sd._udp.local"
+#define BRIDGE_PORT     4142
+#define BAUD_RATE       460800
+
+#define TYPE_A          1
+#define TYPE_PTR        12
+#define TYPE_TXT        16
+#define TYPE_SRV        33
+#define TYPE_ANY        255
+
+static volatile bool session_busy;
+static volatile int baud_rate = BAUD_RATE;
+
+bool tcp_server_session_active(void)
+{
+    return session_busy;
+}
+
+int tcp_server_baud_rate(void)
+{
+    return baud_rate;
+}
+
+struct query {
+    uint8_t buf[512];
+    size_t  len;
+};
+
+struct rr {
+    char           name[128];
+    uint16_t       type;
+    uint16_t       cls;
+    uint32_t       ttl;
+    const uint8_t *rdata;
+    uint16_t       rdlen;
+    size_t         rdoff;   // of the data in the message, for names inside it
+};
+
+struct response {
+    uint8_t   buf[1500];
+    size_t    len;
+    uint16_t  id;
+    uint16_t  flags;
+    uint16_t  counts[4];    // questions, answers, authority, additional
+    struct rr rrs[16];      // answers followed by additional records
+    int       rr_cnt;
+};
+
+static int sock = -1;
+
+static void put16(struct query *q, uint16_t v)
+{
+    q->buf[q->len++] = v >> 8;
+    q->buf[q->len++] = v & 0xFF;
+}
+
+static void query_begin(struct query *q, uint16_t id, uint16_t flags, uint16_t qdcount)
+{
+    q->len = 0;
+    put16(q, id);
+    put16(q, flags);
+    put16(q, qdcount);
+    put16(q, 0);
+    put16(q, 0);
+    put16(q, 0);
+}
+
+/** Write the labels of name, ending with a pointer to ptr if it is not 0 */
+static void put_name(struct query *q, const char *name, uint16_t ptr)
+{
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t const len = dot ? (size_t)(dot - name) : strlen(name);
+        q->buf[q->len++] = len;
+        memcpy(q->buf + q->len, name, len);
+        q->len += len;
+        name += len + (dot ? 1 : 0);
+    }
+    if (ptr)
+        put16(q, 0xC000 | ptr);
+    else
+        q->buf[q->len++] = 0;
+}
+
+static void put_question(struct query *q, const char *name, uint16_t type)
+{
+    put_name(q, name, 0);
+    put16(q, type);
+    put16(q, 1);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+/** Read the possibly compressed name at off, returns the offset past it */
+static size_t read_name(const struct response *r, size_t off, char *out, size_t out_len)
+{
+    size_t end = 0, pos = 0;
+    for (int jumps = 0; ; ) {
+        CHECK(off < r->len);
+        uint8_t const len = r->buf[off];
+        if ((len & 0xC0) == 0xC0) {
+            CHECK(++jumps < 16);
+            if (!end)
+                end = off + 2;
+            off = (len & 0x3F) << 8 | r->buf[off + 1];
+            continue;
+        }
+        if (!len)
+            break;
+        CHECK(off + 1 + len <= r->len && pos + len + 1 < out_len);
+        if (pos)
+            out[pos++] = '.';
+        memcpy(out + pos, r->buf + off + 1, len);
+        pos += len;
+        off += 1 + len;
+    }
+    out[pos] = '\0';
+    return end ? end : off + 1;
+}
+
+static void parse(struct response *r)
+{
+    CHECK(r->len >= 12);
+    r->id = get16(r->buf);
+    r->flags = get16(r->buf + 2);
+    for (int i = 0; i < 4; i++)
+        r->counts[i] = get16(r->buf + 4 + 2 * i);
+    size_t off = 12;
+    char name[128];
+    for (int i = 0; i < r->counts[0]; i++)
+        off = read_name(r, off, name, sizeof(name)) + 4;
+    r->rr_cnt = r->counts[1] + r->counts[2] + r->counts[3];
+    CHECK(r->rr_cnt <= 16);
+    for (int i = 0; i < r->rr_cnt; i++) {
+        struct rr *rr = &r->rrs[i];
+        off = read_name(r, off, rr->name, sizeof(rr->name));
+        CHECK(off + 10 <= r->len);
+        rr->type = get16(r->buf + off);
+        rr->cls = get16(r->buf + off + 2);
+        rr->ttl = (uint32_t)get16(r->buf + off + 4) << 16 | get16(r->buf + off + 6);
+        rr->rdlen = get16(r->buf + off + 8);
+        rr->rdoff = off + 10;
+        rr->rdata = r->buf + rr->rdoff;
+        off += 10 + rr->rdlen;
+        CHECK(off <= r->len);
+    }
+    CHECK(off == r->len);
+}
+
+/** Send the query and wait for the response, false if none came within timeout_ms */
+static bool ask(const struct query *q, struct response *r, int timeout_ms)
+{
+    struct sockaddr_in to = {
+        .sin_family = AF_INET,
+        .sin_port = htons(5353),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    CHECK(sendto(sock, q->buf, q->len, 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)q->len);
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ssize_t const len = recv(sock, r->buf, sizeof(r->buf), 0);
+    if (len <= 0)
+        return false;
+    r->len = len;
+    parse(r);
+    return true;
+}
+
+static void ask_one(const char *name, uint16_t type, uint16_t id, struct response *r)
+{
+    struct query q;
+    query_begin(&q, id, 0, 1);
+    put_question(&q, name, type);
+    CHECK_MSG(ask(&q, r, 1000), "no answer to %s type %d", name, type);
+    CHECK(r->id == id);
+    CHECK(r->flags == 0x8400);
+    // Legacy unicast responses repeat the question
+    CHECK(r->counts[0] == 1);
+}
+
+static const struct rr *find(const struct response *r, const char *name, uint16_t type, bool answer)
+{
+    int const from = answer ? 0 : r->counts[1];
+    int const to = answer ? r->counts[1] : r->rr_cnt;
+    for (int i = from; i < to; i++) {
+        if (r->rrs[i].type == type && !strcasecmp(r->rrs[i].name, name))
+            return &r->rrs[i];
+    }
+    return NULL;
+}
+
+/** Record class IN without cache flush and the TTL capped for legacy unicast */
+static void check_legacy(const struct rr *rr)
+{
+    CHECK(rr->cls == 1);
+    CHECK(rr->ttl > 0 && rr->ttl <= 10);
+}
+
+static void check_a(const struct rr *rr)
+{
+    CHECK(rr);
+    check_legacy(rr);
+    CHECK(rr->rdlen == 4);
+    CHECK(!memcmp(rr->rdata, (uint8_t[]){ 127, 0, 0, 1 }, 4));
+}
+
+static void check_srv(const struct response *r, const struct rr *rr)
+{
+    CHECK(rr);
+    check_legacy(rr);
+    CHECK(rr->rdlen >= 7);
+    CHECK(get16(rr->rdata + 4) == BRIDGE_PORT);
+    char target[128];
+    read_name(r, rr->rdoff + 6, target, sizeof(target));
+    CHECK(!strcmp(target, HOST_NAME));
+}
+
+/** True if the TXT record data holds the item */
+static bool txt_has(const struct rr *rr, const char *item)
+{
+    for (size_t off = 0; off < rr->rdlen; off += 1 + rr->rdata[off]) {
+        if (rr->rdata[off] == strlen(item) && !memcmp(rr->rdata + off + 1, item, rr->rdata[off]))
+            return true;
+    }
+    return false;
+}
+
+static void check_txt(const struct rr *rr, bool busy)
+{
+    char item[32];
+    CHECK(rr);
+    check_legacy(rr);
+    snprintf(item, sizeof(item), "baud=%d", baud_rate);
+    CHECK(txt_has(rr, item));
+    snprintf(item, sizeof(item), "port=%d", BRIDGE_PORT);
+    CHECK(txt_has(rr, item));
+    CHECK(txt_has(rr, "fw=host"));
+    CHECK(txt_has(rr, "mac=02:00:00:a1:b2:c3"));
+    CHECK(txt_has(rr, "mode=raw"));
+    CHECK(txt_has(rr, busy ? "session=busy" : "session=free"));
+}
+
+static void test_host_name(void)
+{
+    host_step("A query for the host name");
+    struct response r;
+    struct query q;
+    query_begin(&q, 0x1234, 0, 1);
+    put_question(&q, HOST_NAME, TYPE_A);
+    // The responder task binds its socket on its own time
+    bool answered = false;
+    for (int i = 0; i < 20 && !answered; i++)
+        answered = ask(&q, &r, 100);
+    CHECK(answered);
+    CHECK(r.id == 0x1234 && r.counts[1] == 1);
+    check_a(find(&r, HOST_NAME, TYPE_A, true));
+
+    host_step("names are matched regardless of case");
+    ask_one("SERIAL-BRIDGE-A1B2C3.LOCAL", TYPE_A, 2, &r);
+    CHECK(r.counts[1] == 1);
+    check_a(find(&r, HOST_NAME, TYPE_A, true));
+}
+
+static void test_service(void)
+{
+    host_step("PTR query for the service type, SRV, TXT and A come along");
+    struct response r;
+    ask_one(SERVICE, TYPE_PTR, 3, &r);
+    CHECK(r.counts[1] == 1 && r.counts[3] == 3);
+    const struct rr *ptr = find(&r, SERVICE, TYPE_PTR, true);
+    CHECK(ptr);
+    check_legacy(ptr);
+    char instance[128];
+    read_name(&r, ptr->rdoff, instance, sizeof(instance));
+    CHECK(!strcmp(instance, INSTANCE));
+    check_srv(&r, find(&r, INSTANCE, TYPE_SRV, false));
+    check_txt(find(&r, INSTANCE, TYPE_TXT, false), false);
+    check_a(find(&r, HOST_NAME, TYPE_A, false));
+
+    host_step("ANY query for the instance answers SRV and TXT");
+    ask_one(INSTANCE, TYPE_ANY, 4, &r);
+    CHECK(r.counts[1] == 2 && r.counts[3] == 1);
+    check_srv(&r, find(&r, INSTANCE, TYPE_SRV, true));
+    check_txt(find(&r, INSTANCE, TYPE_TXT, true), false);
+    check_a(find(&r, HOST_NAME, TYPE_A, false));
+
+    host_step("DNS-SD service type enumeration");
+    ask_one(META, TYPE_PTR, 5, &r);
+    const struct rr *meta = find(&r, META, TYPE_PTR, true);
+    CHECK(meta && r.counts[1] == 1);
+    char type[128];
+    read_name(&r, meta->rdoff, type, sizeof(type));
+    CHECK(!strcmp(type, SERVICE));
+}
+
+static void test_compressed_questions(void)
+{
+    host_step("two questions, the second one compressed against the first");
+    struct query q;
+    query_begin(&q, 6, 0, 2);
+    size_t const service_at = q.len;
+    put_question(&q, SERVICE, TYPE_PTR);
+    put_name(&q, "serial-bridge-a1b2c3", service_at);
+    put16(&q, TYPE_TXT);
+    put16(&q, 1);
+    struct response r;
+    CHECK(ask(&q, &r, 1000));
+    CHECK(r.id == 6);
+    CHECK(find(&r, SERVICE, TYPE_PTR, true));
+    check_txt(find(&r, INSTANCE, TYPE_TXT, true), false);
+}
+
+static void test_session_state(void)
+{
+    host_step("TXT record follows the session state");
+    session_busy = true;
+    struct response r;
+    bool busy = false;
+    // The responder looks at the session state once a second
+    for (int i = 0; i < 30 && !busy; i++) {
+        ask_one(INSTANCE, TYPE_TXT, 7, &r);
+        const struct rr *txt = find(&r, INSTANCE, TYPE_TXT, true);
+        CHECK(txt);
+        busy = txt_has(txt, "session=busy");
+        if (!busy)
+            usleep(100000);
+    }
+    CHECK(busy);
+    check_txt(find(&r, INSTANCE, TYPE_TXT, true), true);
+    session_busy = false;
+
+    host_step("TXT record follows a baud rate changed while running");
+    baud_rate = 115200;
+    bool changed = false;
+    for (int i = 0; i < 30 && !changed; i++) {
+        ask_one(INSTANCE, TYPE_TXT, 15, &r);
+        const struct rr *txt = find(&r, INSTANCE, TYPE_TXT, true);
+        CHECK(txt);
+        changed = txt_has(txt, "baud=115200");
+        if (!changed)
+            usleep(100000);
+    }
+    CHECK(changed);
+    check_txt(find(&r, INSTANCE, TYPE_TXT, true), false);
+    baud_rate = BAUD_RATE;
+}
+
+static void test_not_answered(void)
+{
+    struct query q;
+    struct response r;
+
+    host_step("names of someone else are not answered");
+    query_begin(&q, 8, 0, 1);
+    put_question(&q, "other-host.local", TYPE_A);
+    CHECK(!ask(&q, &r, 300));
+    query_begin(&q, 9, 0, 1);
+    put_question(&q, HOST_NAME, TYPE_TXT);
+    CHECK(!ask(&q, &r, 300));
+
+    host_step("responses are not answered");
+    query_begin(&q, 10, 0x8400, 1);
+    put_question(&q, HOST_NAME, TYPE_A);
+    CHECK(!ask(&q, &r, 300));
+
+    host_step("malformed queries are dropped");
+    query_begin(&q, 11, 0, 1);
+    put_name(&q, "serial-bridge-a1b2c3", 12);   // points to itself
+    put16(&q, TYPE_A);
+    put16(&q, 1);
+    CHECK(!ask(&q, &r, 300));
+    query_begin(&q, 12, 0, 1);
+    put_question(&q, HOST_NAME, TYPE_A);
+    q.len -= 6;                                 // cut in the name
+    CHECK(!ask(&q, &r, 300));
+    query_begin(&q, 13, 0, 3);
+    put_question(&q, HOST_NAME, TYPE_A);        // fewer questions than counted
+    CHECK(!ask(&q, &r, 300));
+
+    host_step("still answering afterwards");
+    ask_one(HOST_NAME, TYPE_A, 14, &r);
+    check_a(find(&r, HOST_NAME, TYPE_A, true));
+}
+
+int main(void)
+{
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    CHECK(sock >= 0);
+
+    settings_t settings = { .uart_baud_rate = BAUD_RATE, .tcp_port = BRIDGE_PORT };
+    mdns_responder_start(&settings);
+    esp_ip4_addr_t const ip = { .addr = htonl(INADDR_LOOPBACK) };
+    mdns_responder_set_ip(&ip);
+
+    test_host_name();
+    test_service();
+    test_compressed_questions();
+    test_session_state();
+    test_not_answered();
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,3 @@
+/* Configuration of the rs485 test: half duplex line with a 200 us turnaround guard */
+#define CONFIG_UART_LINE_RS485              1
+#define CONFIG_UART_RS485_GUARD_US          200
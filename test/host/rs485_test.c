@@ -0,0 +1,160 @@
+/* RS-485 half duplex line
+
+   rs485.c is driven the way the bridge loop drives it, against a frozen clock and
+   the fake UART standing in for the line, 10 us per bit:
+   - starting a transmission does not wait for it, it ends once the estimated time
+     is up and the UART has sent it all
+   - the echo is dropped as it is read, before and after the end, and the response
+     following it is passed on with its turnaround time
+   - a new transmission waits out the turnaround guard
+   - an echo differing from the data sent, or more of it than was sent, is a
+     collision, in long transmissions too while the echo keeps up with the copy
+     of the data kept for comparing
+
+   Firmware sources: rs485.c
+*/
+#include "host.h"
+
+#include "rs485.h"
+
+#define BRIDGE_UART     UART_NUM_1
+#define BAUD_RATE       100000
+#define CHAR_US         100
+#define GUARD_US        CONFIG_UART_RS485_GUARD_US
+
+static rs485_stats_t stats(void)
+{
+    rs485_stats_t s;
+    rs485_get_stats(&s);
+    return s;
+}
+
+static void pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (uint8_t)(i * 7 + seed);
+}
+
+/** Write like the bridge loop does and note the transmission */
+static void send_chunk(const uint8_t *data, size_t len)
+{
+    CHECK(rs485_tx_ready());
+    CHECK(uart_write_bytes(BRIDGE_UART, data, len) == (int)len);
+    rs485_tx_start(data, len);
+}
+
+/** Read all the firmware has buffered through rs485_rx(), returns the bytes passed on */
+static size_t receive(uint8_t *buf, size_t max)
+{
+    int const n = uart_read_bytes(BRIDGE_UART, buf, max, 0);
+    CHECK(n >= 0);
+    return rs485_rx(buf, n);
+}
+
+/** Let the line send all written data, ending the transmission after len bytes of time */
+static void line_done(size_t len)
+{
+    uint8_t buf[1024];
+    while (host_uart_take(BRIDGE_UART, buf, sizeof(buf)))
+        ;
+    host_time_advance(len * CHAR_US);
+}
+
+int main(void)
+{
+    uint8_t data[1024], buf[1024];
+    uart_config_t const config = { .baud_rate = BAUD_RATE };
+    CHECK(uart_param_config(BRIDGE_UART, &config) == ESP_OK);
+    CHECK(uart_driver_install(BRIDGE_UART, 2048, 1024, 0, NULL, 0) == ESP_OK);
+    CHECK(rs485_init(BRIDGE_UART, BAUD_RATE) == ESP_OK);
+    host_time_freeze();
+
+    host_step("the transmission is not waited for, its echo is dropped as it comes");
+    pattern(data, 50, 1);
+    send_chunk(data, 50);
+    CHECK(rs485_tx_busy());
+    CHECK(host_uart_feed(BRIDGE_UART, data, 20) == 20);
+    CHECK(receive(buf, sizeof(buf)) == 0);
+    CHECK(stats().echo_bytes == 20);
+    // The time is up, but the UART has not sent it all yet
+    host_time_advance(50 * CHAR_US);
+    CHECK(rs485_tx_busy());
+    CHECK(rs485_tx_ready());
+
+    host_step("the rest of the echo read after the end is dropped, the response passed on");
+    line_done(1);
+    CHECK(host_uart_feed(BRIDGE_UART, data + 20, 30) == 30);
+    CHECK(!rs485_tx_busy());
+    CHECK(stats().frames == 1);
+    host_time_advance(GUARD_US + 3 * CHAR_US);
+    static const uint8_t resp[] = { 0x11, 0x22, 0x33, 0x44 };
+    CHECK(host_uart_feed(BRIDGE_UART, resp, sizeof(resp)) == sizeof(resp));
+    CHECK(receive(buf, sizeof(buf)) == sizeof(resp));
+    CHECK(!memcmp(buf, resp, sizeof(resp)));
+    rs485_stats_t s = stats();
+    CHECK(s.echo_bytes == 50 && s.collisions == 0 && s.noise_bytes == 0);
+    CHECK_MSG(s.turnarounds == 1 && s.turnaround_us == GUARD_US + 2 * CHAR_US, "turnaround %u", s.turnaround_us);
+
+    host_step("a new transmission waits out the guard after the bus was busy");
+    int64_t const before = esp_timer_get_time();
+    CHECK(rs485_tx_ready());
+    CHECK(esp_timer_get_time() - before == GUARD_US);
+    CHECK(rs485_tx_ready());
+    CHECK(esp_timer_get_time() - before == GUARD_US);
+
+    host_step("bytes right after the own transmission are noise");
+    send_chunk(data, 10);
+    line_done(10);
+    CHECK(!rs485_tx_busy());
+    CHECK(host_uart_feed(BRIDGE_UART, "\xff", 1) == 1);
+    CHECK(receive(buf, sizeof(buf)) == 0);
+    CHECK(stats().noise_bytes == 1 && stats().collisions == 0);
+    host_time_advance(GUARD_US);
+
+    host_step("a long transmission in chunks, echo read in between and at the end");
+    pattern(data, 600, 3);
+    send_chunk(data, 200);
+    CHECK(host_uart_feed(BRIDGE_UART, data, 150) == 150);
+    CHECK(receive(buf, sizeof(buf)) == 0);
+    send_chunk(data + 200, 200);
+    send_chunk(data + 400, 200);
+    CHECK(host_uart_feed(BRIDGE_UART, data + 150, 350) == 350);
+    CHECK(receive(buf, sizeof(buf)) == 0);
+    line_done(600);
+    CHECK(host_uart_feed(BRIDGE_UART, data + 500, 100) == 100);
+    CHECK(!rs485_tx_busy());
+    CHECK(receive(buf, sizeof(buf)) == 0);
+    s = stats();
+    CHECK(s.frames == 3 && s.collisions == 0 && s.echo_bytes == 650);
+    host_time_advance(GUARD_US);
+
+    host_step("a differing byte is a collision, in any chunk and read before or after the end");
+    size_t const pos[] = { 100, 280, 590 };
+    for (int i = 0; i < 3; i++) {
+        uint8_t echo[600];
+        memcpy(echo, data, sizeof(echo));
+        echo[pos[i]] ^= 0x40;
+        send_chunk(data, 300);
+        CHECK(host_uart_feed(BRIDGE_UART, echo, 290) == 290);
+        CHECK(receive(buf, sizeof(buf)) == 0);
+        send_chunk(data + 300, 300);
+        CHECK(host_uart_feed(BRIDGE_UART, echo + 290, 270) == 270);
+        CHECK(receive(buf, sizeof(buf)) == 0);
+        line_done(600);
+        CHECK(host_uart_feed(BRIDGE_UART, echo + 560, 40) == 40);
+        CHECK(!rs485_tx_busy());
+        CHECK(receive(buf, sizeof(buf)) == 0);
+        CHECK_MSG(stats().collisions == i + 1, "byte %zu", pos[i]);
+        host_time_advance(GUARD_US);
+    }
+
+    host_step("more coming back than was sent is a collision");
+    send_chunk(data, 20);
+    CHECK(host_uart_feed(BRIDGE_UART, data, 20) == 20);
+    CHECK(host_uart_feed(BRIDGE_UART, "\x01\x02", 2) == 2);
+    CHECK(receive(buf, sizeof(buf)) == 0);
+    line_done(20);
+    CHECK(!rs485_tx_busy());
+    CHECK(stats().collisions == 4);
+    return 0;
+}
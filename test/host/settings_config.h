@@ -0,0 +1,4 @@
+/* Configuration of the settings test: defaults the settings fall back to */
+#define CONFIG_UART_BITRATE                 921600
+#define CONFIG_BRIDGE_PORT                  3142
+#define CONFIG_WEBSERVER_GPIO               32
@@ -0,0 +1,314 @@
+/* Settings in NVS
+
+   Each boot of the firmware runs in a forked process on the shared NVS stand-in,
+   starting with fresh settings.c state like after a reset:
+   - separate keys of older firmware are converted to the record and kept, saving
+     updates both, until settings_release_legacy() drops the keys
+   - a rollback to older firmware finds the current settings in the keys, and what
+     it changes there is taken over by the next boot of the new firmware
+   - records of newer and older layouts are read up to the fields both know, a
+     damaged record is not used
+
+   Firmware sources: settings.c
+*/
+#include <sys/wait.h>
+#include "host.h"
+#include "nvs.h"
+#include "esp_rom_crc.h"
+
+#include "settings.h"
+
+#define NVS_NAMESPACE   "bridge_cfg"
+#define RECORD_KEY      "settings"
+#define FLAG_LEGACY     0x01
+
+static const char *const LEGACY_KEYS[] = {
+    "baud_rate", "tcp_port", "use_static_ip", "ip_addr", "netmask", "gateway", "dns1", "dns2"
+};
+
+/* Layout version 1 of the record as settings.c writes it */
+struct __attribute__((packed)) record_header {
+    uint16_t magic;
+    uint8_t  version;
+    uint8_t  flags;
+    uint16_t length;
+    uint32_t crc;
+};
+
+struct __attribute__((packed)) record_payload {
+    int32_t  uart_baud_rate;
+    int32_t  tcp_port;
+    uint8_t  use_static_ip;
+    char     ip_addr[16];
+    char     netmask[16];
+    char     gateway[16];
+    char     dns1[16];
+    char     dns2[16];
+};
+
+/* What the next boot expects to load */
+static settings_t expected;
+static settings_source_t expected_source;
+static int save_baud;
+
+static nvs_handle_t nvs_ns(void)
+{
+    nvs_handle_t h;
+    CHECK(nvs_open(NVS_NAMESPACE, NVS_READWRITE, &h) == ESP_OK);
+    return h;
+}
+
+/** Run fn in a child process, one boot of the firmware */
+static void boot(void (*fn)(void))
+{
+    fflush(stdout);
+    pid_t const pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+        fn();
+        exit(0);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void check_settings(const settings_t *s, const settings_t *exp)
+{
+    CHECK_MSG(s->uart_baud_rate == exp->uart_baud_rate, "baud %d", s->uart_baud_rate);
+    CHECK(s->tcp_port == exp->tcp_port);
+    CHECK(s->use_static_ip == exp->use_static_ip);
+    CHECK(!strcmp(s->ip_addr, exp->ip_addr));
+    CHECK(!strcmp(s->netmask, exp->netmask));
+    CHECK(!strcmp(s->gateway, exp->gateway));
+    CHECK(!strcmp(s->dns1, exp->dns1));
+    CHECK(!strcmp(s->dns2, exp->dns2));
+}
+
+static void load_and_check(void)
+{
+    settings_t s;
+    CHECK(load_settings(&s) == ESP_OK);
+    check_settings(&s, &expected);
+    settings_stats_t stats;
+    settings_get_stats(&stats);
+    CHECK_MSG(stats.source == expected_source, "source %d", stats.source);
+}
+
+static void boot_load(void)
+{
+    load_and_check();
+}
+
+static void boot_save(void)
+{
+    load_and_check();
+    settings_t s = expected;
+    s.uart_baud_rate = save_baud;
+    CHECK(save_settings(&s) == ESP_OK);
+    settings_t again;
+    CHECK(load_settings(&again) == ESP_OK);
+    check_settings(&again, &s);
+}
+
+static void boot_release(void)
+{
+    load_and_check();
+    settings_release_legacy();
+}
+
+/** Written the way firmware before the record did, dns2 was never set */
+static void write_legacy(const settings_t *s)
+{
+    nvs_handle_t h = nvs_ns();
+    CHECK(nvs_set_i32(h, "baud_rate", s->uart_baud_rate) == ESP_OK);
+    CHECK(nvs_set_i32(h, "tcp_port", s->tcp_port) == ESP_OK);
+    CHECK(nvs_set_i32(h, "use_static_ip", s->use_static_ip) == ESP_OK);
+    CHECK(nvs_set_str(h, "ip_addr", s->ip_addr) == ESP_OK);
+    CHECK(nvs_set_str(h, "netmask", s->netmask) == ESP_OK);
+    CHECK(nvs_set_str(h, "gateway", s->gateway) == ESP_OK);
+    CHECK(nvs_set_str(h, "dns1", s->dns1) == ESP_OK);
+    nvs_close(h);
+}
+
+/** Baud rate older firmware reads, -1 if there is none */
+static int legacy_baud(void)
+{
+    nvs_handle_t h = nvs_ns();
+    int32_t baud = -1;
+    nvs_get_i32(h, "baud_rate", &baud);
+    nvs_close(h);
+    return baud;
+}
+
+static int legacy_key_cnt(void)
+{
+    nvs_handle_t h = nvs_ns();
+    int cnt = 0;
+    for (int i = 0; i < sizeof(LEGACY_KEYS) / sizeof(LEGACY_KEYS[0]); i++) {
+        int32_t num;
+        size_t len = 0;
+        if (nvs_get_i32(h, LEGACY_KEYS[i], &num) == ESP_OK || nvs_get_str(h, LEGACY_KEYS[i], NULL, &len) == ESP_OK)
+            cnt++;
+    }
+    nvs_close(h);
+    return cnt;
+}
+
+/** Read the record, false if there is none */
+static bool read_record(struct record_header *hdr, struct record_payload *p)
+{
+    uint8_t buf[sizeof(*hdr) + sizeof(*p)];
+    size_t len = sizeof(buf);
+    nvs_handle_t h = nvs_ns();
+    esp_err_t const err = nvs_get_blob(h, RECORD_KEY, buf, &len);
+    nvs_close(h);
+    if (err != ESP_OK)
+        return false;
+    CHECK(len == sizeof(buf));
+    memcpy(hdr, buf, sizeof(*hdr));
+    memcpy(p, buf + sizeof(*hdr), sizeof(*p));
+    CHECK(hdr->magic == 0x5342 && hdr->version == 1 && hdr->length == sizeof(*p));
+    CHECK(hdr->crc == esp_rom_crc32_le(0, (uint8_t *)p, sizeof(*p)));
+    return true;
+}
+
+static void write_record(uint8_t version, const void *payload, uint16_t len, bool damaged)
+{
+    uint8_t buf[256];
+    struct record_header hdr = {
+        .magic = 0x5342,
+        .version = version,
+        .length = len,
+        .crc = esp_rom_crc32_le(0, payload, len) ^ damaged,
+    };
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), payload, len);
+    nvs_handle_t h = nvs_ns();
+    CHECK(nvs_set_blob(h, RECORD_KEY, buf, sizeof(hdr) + len) == ESP_OK);
+    nvs_close(h);
+}
+
+static void payload_from(struct record_payload *p, const settings_t *s)
+{
+    memset(p, 0, sizeof(*p));
+    p->uart_baud_rate = s->uart_baud_rate;
+    p->tcp_port = s->tcp_port;
+    p->use_static_ip = s->use_static_ip;
+    strcpy(p->ip_addr, s->ip_addr);
+    strcpy(p->netmask, s->netmask);
+    strcpy(p->gateway, s->gateway);
+    strcpy(p->dns1, s->dns1);
+    strcpy(p->dns2, s->dns2);
+}
+
+static const settings_t defaults = { .uart_baud_rate = CONFIG_UART_BITRATE, .tcp_port = CONFIG_BRIDGE_PORT };
+
+static const settings_t old_fw = {
+    .uart_baud_rate = 115200,
+    .tcp_port = 4000,
+    .use_static_ip = 1,
+    .ip_addr = "192.168.1.10",
+    .netmask = "255.255.255.0",
+    .gateway = "192.168.1.1",
+    .dns1 = "192.168.1.1",
+};
+
+static void test_migration(void)
+{
+    struct record_header hdr;
+    struct record_payload p;
+
+    host_step("no settings at all, defaults");
+    host_nvs_erase();
+    expected = defaults;
+    expected_source = SETTINGS_SOURCE_DEFAULTS;
+    boot(boot_load);
+    CHECK(!read_record(&hdr, &p));
+
+    host_step("keys of older firmware are converted, and kept");
+    write_legacy(&old_fw);
+    expected = old_fw;
+    expected_source = SETTINGS_SOURCE_LEGACY;
+    boot(boot_load);
+    CHECK(read_record(&hdr, &p));
+    CHECK(hdr.flags == FLAG_LEGACY && p.uart_baud_rate == 115200 && !strcmp(p.ip_addr, "192.168.1.10"));
+    CHECK(legacy_key_cnt() == 7);
+
+    host_step("saving before the new firmware is confirmed updates the keys too");
+    expected_source = SETTINGS_SOURCE_RECORD;
+    save_baud = 57600;
+    boot(boot_save);
+    CHECK(legacy_baud() == 57600);
+    CHECK(legacy_key_cnt() == 8);
+    CHECK(read_record(&hdr, &p));
+    CHECK(hdr.flags == FLAG_LEGACY && p.uart_baud_rate == 57600);
+
+    host_step("rolled back firmware changes the keys, the new firmware takes that over");
+    expected.uart_baud_rate = 38400;
+    write_legacy(&expected);
+    boot(boot_load);
+    CHECK(read_record(&hdr, &p));
+    CHECK(hdr.flags == FLAG_LEGACY && p.uart_baud_rate == 38400);
+
+    host_step("confirmed firmware drops the keys");
+    boot(boot_release);
+    CHECK(legacy_key_cnt() == 0);
+    CHECK(read_record(&hdr, &p));
+    CHECK(hdr.flags == 0 && p.uart_baud_rate == 38400 && !strcmp(p.gateway, "192.168.1.1"));
+
+    host_step("afterwards saving writes the record only");
+    save_baud = 19200;
+    boot(boot_save);
+    CHECK(legacy_key_cnt() == 0);
+    expected.uart_baud_rate = 19200;
+    boot(boot_load);
+    // Nothing left to release
+    boot(boot_release);
+    CHECK(read_record(&hdr, &p));
+    CHECK(hdr.flags == 0 && p.uart_baud_rate == 19200);
+}
+
+static void test_record_versions(void)
+{
+    struct record_payload p;
+    settings_t s = old_fw;
+    strcpy(s.dns2, "8.8.8.8");
+
+    host_step("record of newer firmware with a longer payload");
+    host_nvs_erase();
+    uint8_t longer[sizeof(p) + 12];
+    payload_from(&p, &s);
+    memcpy(longer, &p, sizeof(p));
+    memset(longer + sizeof(p), 0xA5, sizeof(longer) - sizeof(p));
+    write_record(2, longer, sizeof(longer), false);
+    expected = s;
+    expected_source = SETTINGS_SOURCE_RECORD;
+    boot(boot_load);
+
+    host_step("record of older firmware with a shorter payload, the rest is defaults");
+    write_record(0, &p, offsetof(struct record_payload, netmask), false);
+    expected = defaults;
+    expected.uart_baud_rate = s.uart_baud_rate;
+    expected.tcp_port = s.tcp_port;
+    expected.use_static_ip = s.use_static_ip;
+    strcpy(expected.ip_addr, s.ip_addr);
+    boot(boot_load);
+
+    host_step("damaged record is not used");
+    write_record(1, &p, sizeof(p), true);
+    expected = defaults;
+    expected_source = SETTINGS_SOURCE_DEFAULTS;
+    boot(boot_load);
+    write_legacy(&old_fw);
+    expected = old_fw;
+    expected_source = SETTINGS_SOURCE_LEGACY;
+    boot(boot_load);
+}
+
+int main(void)
+{
+    test_migration();
+    test_record_versions();
+    return 0;
+}
@@ -0,0 +1,5 @@
+/* Configuration of the uart_dma test: small DMA buffers so transfers span many */
+#define CONFIG_BRIDGE_MODE_RAW              1
+#define CONFIG_UART_DMA_ENABLE              1
+#define CONFIG_UART_DMA_BUFF_SIZE           256
+#define CONFIG_UART_DMA_BUFF_COUNT          8
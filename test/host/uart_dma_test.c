@@ -0,0 +1,375 @@
+/* UART data path through UHCI DMA
+
+   The buffer ring of dma_ring.c is run on its own first: slot splitting, taking
+   back unused slots at the end of a transfer and counters wrapping around. Then
+   uart_dma.c is run against a fake UHCI driver whose "interrupt" is the test
+   thread feeding the line while a bridge task consumes the data:
+   - a receive transfer spans several buffers and is started again right in the
+     completion callback, so packets never wait for the bridge task
+   - a burst longer than one buffer is received whole while the bridge task stalls
+   - only what does not fit in the buffers is lost, receiving resumes afterwards
+   - transmit buffers are queued in order and held back once all are queued
+
+   Firmware sources: uart_dma.c dma_ring.c
+*/
+#include "host.h"
+#include "freertos/task.h"
+#include "driver/uhci.h"
+
+#include "uart_dma.h"
+#include "dma_ring.h"
+#include "mem_arena.h"
+
+#define SLOT_SZ     CONFIG_UART_DMA_BUFF_SIZE
+#define SLOT_CNT    CONFIG_UART_DMA_BUFF_COUNT
+#define NODE_SZ     600     // DMA descriptor size, not a multiple of the buffer size
+#define STREAM_MAX  (256 * 1024)
+
+static uint8_t dma_rx_mem[SLOT_SZ * SLOT_CNT], dma_tx_mem[SLOT_SZ * SLOT_CNT];
+
+void *mem_arena_get(mem_buf_t buf)
+{
+    return buf == MEM_UART_DMA_RX ? dma_rx_mem : buf == MEM_UART_DMA_TX ? dma_tx_mem : NULL;
+}
+
+/* Fake UHCI driver */
+
+static struct {
+    uhci_event_callbacks_t cbs;
+    uint8_t *rx_buf;
+    size_t   rx_size;
+    size_t   rx_pos;
+    size_t   rx_reported;       // bytes passed to the callback so far
+    bool     rx_active;
+    uint32_t arms_irq;          // uhci_receive() calls from the completion callback
+    uint32_t arms_task;
+    size_t   arm_size_max;
+    size_t   lost;              // bytes on the line without a transfer running
+    struct { uint8_t *buf; size_t len; } tx[SLOT_CNT];
+    uint32_t tx_head, tx_tail;
+} uhci;
+
+static __thread bool in_irq;
+static struct uhci_controller_t { int unused; } controller;
+
+esp_err_t uhci_new_controller(const uhci_controller_config_t *config, uhci_controller_handle_t *ret_uhci)
+{
+    CHECK(config->max_receive_internal_mem >= SLOT_SZ * SLOT_CNT);
+    *ret_uhci = &controller;
+    return ESP_OK;
+}
+
+esp_err_t uhci_register_event_callbacks(uhci_controller_handle_t h, const uhci_event_callbacks_t *cbs, void *ctx)
+{
+    uhci.cbs = *cbs;
+    return ESP_OK;
+}
+
+esp_err_t uhci_receive(uhci_controller_handle_t h, uint8_t *buf, size_t size)
+{
+    if (uhci.rx_active)
+        return ESP_ERR_INVALID_STATE;
+    CHECK(buf >= dma_rx_mem && buf + size <= dma_rx_mem + sizeof(dma_rx_mem));
+    CHECK(size && size % SLOT_SZ == 0);
+    uhci.rx_buf = buf;
+    uhci.rx_size = size;
+    uhci.rx_pos = uhci.rx_reported = 0;
+    uhci.rx_active = true;
+    if (in_irq)
+        uhci.arms_irq++;
+    else
+        uhci.arms_task++;
+    if (size > uhci.arm_size_max)
+        uhci.arm_size_max = size;
+    return ESP_OK;
+}
+
+esp_err_t uhci_transmit(uhci_controller_handle_t h, uint8_t *buf, size_t len)
+{
+    CHECK(uhci.tx_head - uhci.tx_tail < SLOT_CNT);
+    uhci.tx[uhci.tx_head % SLOT_CNT].buf = buf;
+    uhci.tx[uhci.tx_head % SLOT_CNT].len = len;
+    uhci.tx_head++;
+    return ESP_OK;
+}
+
+/** Completion of the bytes received since the last one, the transfer ends with eof */
+static void rx_complete(bool eof)
+{
+    uhci_rx_event_data_t edata = {
+        .data = uhci.rx_buf + uhci.rx_reported,
+        .recv_size = uhci.rx_pos - uhci.rx_reported,
+        .flags.totally_received = eof,
+    };
+    uhci.rx_reported = uhci.rx_pos;
+    // The driver is ready for the next transfer when the callback runs
+    if (eof)
+        uhci.rx_active = false;
+    in_irq = true;
+    uhci.cbs.on_rx_trans_event(&controller, &edata, NULL);
+    in_irq = false;
+}
+
+/** Bytes arriving on the line, idle ends the transfer, returns the bytes received */
+static size_t line_rx(const uint8_t *data, size_t len, bool idle)
+{
+    size_t received = 0;
+    while (len) {
+        if (!uhci.rx_active) {
+            uhci.lost += len;
+            return received;
+        }
+        size_t n = NODE_SZ - (uhci.rx_pos - uhci.rx_reported);
+        if (n > uhci.rx_size - uhci.rx_pos)
+            n = uhci.rx_size - uhci.rx_pos;
+        if (n > len)
+            n = len;
+        memcpy(uhci.rx_buf + uhci.rx_pos, data, n);
+        uhci.rx_pos += n;
+        data += n;
+        len -= n;
+        received += n;
+        if (uhci.rx_pos == uhci.rx_size)
+            rx_complete(true);
+        else if (uhci.rx_pos - uhci.rx_reported == NODE_SZ)
+            rx_complete(false);
+    }
+    if (idle && uhci.rx_active && uhci.rx_pos)
+        rx_complete(true);
+    return received;
+}
+
+/** Send the oldest queued transmit buffer */
+static size_t line_tx(uint8_t *out)
+{
+    if (uhci.tx_tail == uhci.tx_head)
+        return 0;
+    size_t const len = uhci.tx[uhci.tx_tail % SLOT_CNT].len;
+    memcpy(out, uhci.tx[uhci.tx_tail % SLOT_CNT].buf, len);
+    uhci.tx_tail++;
+    uhci_tx_done_event_data_t edata = { .sent_size = len };
+    in_irq = true;
+    uhci.cbs.on_tx_trans_done(&controller, &edata, NULL);
+    in_irq = false;
+    return len;
+}
+
+/* Bridge task consuming the received data */
+
+static uint8_t sent[STREAM_MAX], got[STREAM_MAX];
+static size_t sent_len;
+static volatile size_t got_len;
+static volatile bool stalled;
+
+static void bridge_task(void *arg)
+{
+    uart_dma_set_waiter(xTaskGetCurrentTaskHandle());
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, 1);
+        if (stalled)
+            continue;
+        const uint8_t *data;
+        uint32_t len;
+        while ((len = uart_dma_rx_peek(&data)) != 0) {
+            CHECK(got_len + len <= STREAM_MAX);
+            memcpy(got + got_len, data, len);
+            __atomic_store_n(&got_len, got_len + len, __ATOMIC_RELEASE);
+            uart_dma_rx_consume(len);
+        }
+    }
+}
+
+static uint8_t pattern(size_t i)
+{
+    return (uint8_t)(i * 7 + (i >> 8));
+}
+
+/** Put len bytes of the pattern on the line in chunks, returns the bytes received */
+static size_t send_packet(size_t len, size_t chunk, bool idle)
+{
+    uint8_t buf[4096];
+    CHECK(len <= sizeof(buf));
+    for (size_t i = 0; i < len; i++)
+        buf[i] = pattern(sent_len + uhci.lost + i);
+    size_t received = 0;
+    for (size_t off = 0; off < len; off += chunk) {
+        size_t const n = len - off < chunk ? len - off : chunk;
+        size_t const r = line_rx(buf + off, n, idle && off + n == len);
+        memcpy(sent + sent_len + received, buf + off, r);
+        received += r;
+        if (r < n) {
+            // Lost on the line, the pattern goes on past it
+            uhci.lost += len - off - n;
+            break;
+        }
+    }
+    sent_len += received;
+    return received;
+}
+
+static void wait_received(void)
+{
+    for (int i = 0; i < 2000 && __atomic_load_n(&got_len, __ATOMIC_ACQUIRE) < sent_len; i++)
+        usleep(1000);
+    CHECK_MSG(got_len == sent_len, "%zu of %zu bytes", got_len, sent_len);
+    CHECK(!memcmp(got, sent, sent_len));
+}
+
+static void test_ring(void)
+{
+    static uint8_t mem[6 * 16];
+    dma_ring_t r;
+    const uint8_t *data;
+    uint32_t cnt;
+
+    host_step("ring: slot count rounded down to a power of two");
+    dma_ring_init(&r, mem, 16, 6);
+    CHECK(r.cnt == 4);
+
+    host_step("ring: data split over the slots, unused slots taken back on eof");
+    cnt = 8;
+    CHECK(dma_ring_rx_arm(&r, &cnt) == mem && cnt == 4);
+    CHECK(dma_ring_dma_slots(&r) == 4);
+    dma_ring_rx_data(&r, 40, false);
+    CHECK(dma_ring_dma_slots(&r) == 2);
+    dma_ring_rx_data(&r, 0, true);
+    CHECK(dma_ring_dma_slots(&r) == 0);
+    CHECK(dma_ring_rx_peek(&r, &data) == 16 && data == mem);
+    dma_ring_rx_consume(&r, 16);
+    CHECK(dma_ring_rx_peek(&r, &data) == 16 && data == mem + 16);
+    dma_ring_rx_consume(&r, 16);
+    CHECK(dma_ring_rx_peek(&r, &data) == 8 && data == mem + 32);
+    dma_ring_rx_consume(&r, 8);
+    CHECK(dma_ring_rx_peek(&r, &data) == 0);
+
+    host_step("ring: a transfer does not run past the end of the memory");
+    cnt = 4;
+    CHECK(dma_ring_rx_arm(&r, &cnt) == mem + 48 && cnt == 1);
+    dma_ring_rx_data(&r, 16, true);
+    CHECK(dma_ring_dma_slots(&r) == 0);
+    cnt = 4;
+    CHECK(dma_ring_rx_arm(&r, &cnt) == mem && cnt == 3);
+    dma_ring_rx_data(&r, 5, true);
+
+    host_step("ring: counters wrapping around");
+    dma_ring_init(&r, mem, 16, 4);
+    r.head = r.done = r.tail = UINT32_MAX - 5;
+    size_t in = 0, out = 0;
+    for (int round = 0; round < 12; round++) {
+        cnt = 4;
+        uint8_t *buf = dma_ring_rx_arm(&r, &cnt);
+        CHECK(buf);
+        uint32_t const len = round % 3 == 0 ? cnt * 16 : 10;
+        for (uint32_t i = 0; i < len; i++)
+            buf[i] = pattern(in + i);
+        in += len;
+        dma_ring_rx_data(&r, len, true);
+        uint32_t n;
+        while ((n = dma_ring_rx_peek(&r, &data)) != 0) {
+            for (uint32_t i = 0; i < n; i++)
+                CHECK(data[i] == pattern(out + i));
+            out += n;
+            dma_ring_rx_consume(&r, n);
+        }
+    }
+    CHECK(in == out && r.head < 100);
+}
+
+static void test_receive(void)
+{
+    uart_dma_stats_t stats;
+
+    host_step("a receive transfer spans all buffers");
+    for (int i = 0; i < 1000 && !uhci.rx_active; i++)
+        usleep(1000);
+    CHECK(uhci.rx_active && uhci.arms_task == 1);
+    CHECK(uhci.arm_size_max == SLOT_SZ * SLOT_CNT);
+
+    host_step("packets of any size, the receive is started again in the interrupt");
+    for (int i = 0; i < 300; i++) {
+        size_t const len = (i * 37) % (3 * SLOT_SZ) + 1;
+        CHECK(send_packet(len, 1 + i % 97, true) == len);
+        wait_received();
+    }
+    CHECK(uhci.lost == 0 && uhci.arms_task == 1 && uhci.arms_irq >= 300);
+
+    host_step("a burst of all but one buffer is received whole while the bridge task stalls");
+    stalled = true;
+    CHECK(send_packet((SLOT_CNT - 1) * SLOT_SZ, 64, true) == (SLOT_CNT - 1) * SLOT_SZ);
+    CHECK(uhci.lost == 0 && uhci.rx_active);
+    stalled = false;
+    wait_received();
+
+    host_step("only what does not fit is lost, receiving resumes");
+    stalled = true;
+    size_t const burst = (SLOT_CNT + 2) * SLOT_SZ;
+    size_t const fit = send_packet(burst, 128, true);
+    CHECK_MSG(fit >= (SLOT_CNT - 1) * SLOT_SZ && fit < burst, "%zu", fit);
+    CHECK(uhci.lost == burst - fit);
+    uart_dma_get_stats(&stats);
+    CHECK(stats.rx_starved > 0);
+    stalled = false;
+    wait_received();
+    for (int i = 0; i < 20; i++) {
+        CHECK(send_packet(100 + i, 33, true) == 100 + i);
+        wait_received();
+    }
+    // Started by the task once, after the buffers were all taken
+    CHECK(uhci.arms_task == 2);
+
+    host_step("flush drops what is waiting");
+    stalled = true;
+    usleep(20000);
+    uint8_t junk[300];
+    memset(junk, 0xEE, sizeof(junk));
+    CHECK(line_rx(junk, sizeof(junk), true) == sizeof(junk));
+    CHECK(uart_dma_rx_flush() == sizeof(junk));
+    stalled = false;
+    CHECK(send_packet(50, 50, true) == 50);
+    wait_received();
+
+    uart_dma_get_stats(&stats);
+    CHECK(stats.rx_slots_max > 1 && stats.rx_slots_max <= SLOT_CNT);
+}
+
+static void test_transmit(void)
+{
+    host_step("transmit buffers are sent in order, held back once all are queued");
+    uint8_t out[SLOT_SZ];
+    size_t in = 0, done = 0;
+    for (int round = 0; round < 5; round++) {
+        uint8_t *buf;
+        uint32_t cap;
+        int queued = 0;
+        while ((buf = uart_dma_tx_acquire(&cap)) != NULL) {
+            CHECK(cap == SLOT_SZ);
+            uint32_t const len = 1 + (in * 13) % SLOT_SZ;
+            for (uint32_t i = 0; i < len; i++)
+                buf[i] = pattern(in + i);
+            CHECK(uart_dma_tx_commit(len) == ESP_OK);
+            in += len;
+            queued++;
+        }
+        CHECK(queued == (round ? 3 : SLOT_CNT));
+        size_t n;
+        for (int i = 0; i < 3 && (n = line_tx(out)) != 0; i++) {
+            for (size_t j = 0; j < n; j++)
+                CHECK(out[j] == pattern(done + j));
+            done += n;
+        }
+    }
+    uart_dma_stats_t stats;
+    uart_dma_get_stats(&stats);
+    CHECK(stats.tx_full == 5 && stats.tx_slots_max == SLOT_CNT);
+}
+
+int main(void)
+{
+    test_ring();
+
+    CHECK(uart_dma_init(UART_NUM_1) == ESP_OK);
+    xTaskCreate(bridge_task, "bridge", 4096, NULL, 5, NULL);
+    test_receive();
+    test_transmit();
+    return 0;
+}
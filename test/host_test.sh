@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Builds the host tests in host/ with gcc and runs them. Each <name>_test.c lists
+# the firmware sources it runs on its "Firmware sources:" line and is built with
+# <name>_config.h, if there is one, standing in for sdkconfig.h.
+#
+# Call $0 [name ...] to run only the given tests, HOST_LOG=3 shows the firmware log.
+
+dir=$(dirname "$0")/host
+src=$dir/../../src/main
+out=$dir/bin
+mkdir -p "$out" || exit 2
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$dir" && ls *_test.c | sed 's/_test\.c$//')
+fi
+
+failed=0
+for name in "$@"; do
+    test=$dir/${name}_test.c
+    if [ ! -f "$test" ]; then
+        echo "!!! no test $name !!!"
+        failed=1
+        continue
+    fi
+    sources=$(sed -n 's/^ *Firmware sources: *//p' "$test")
+    config=()
+    [ -f "$dir/${name}_config.h" ] && config=(-include "$dir/${name}_config.h")
+
+    echo "=== $name"
+    if ! gcc -std=gnu17 -g -O1 -Wall -Wextra -Wno-unused-parameter -Wno-sign-compare -pthread \
+            "${config[@]}" -I"$dir/include" -I"$dir" -I"$src" -o "$out/$name" \
+            "$test" "$dir/host_idf.c" $(for s in $sources; do echo "$src/$s"; done); then
+        echo "!!! $name does not build !!!"
+        failed=1
+        continue
+    fi
+    if ! timeout 120 "$out/$name"; then
+        echo "!!! $name failed !!!"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,488 @@
+// Benchmark and integrity test for the serial <-> MQTT mode (CONFIG_BRIDGE_MODE_MQTT).
+//
+// Connects to the broker the bridge uses, publishes numbered messages on the topic
+// the bridge subscribes to and collects them from the topic it publishes on. The
+// UART of the bridge has to be looped back (RX connected to TX) so every message
+// goes out of the UART, is received again, framed, queued and published. Messages
+// are text lines "<seq> <send time us> <padding>\n", so with newline delimiter
+// framing every line is one frame; with idle gap framing send them one at a time
+// (-r 0) or slower than the gap. The lines are put back together from the received
+// payloads (with --batched the payloads carry length prefixed frames), so lost,
+// duplicated (QoS 1 resends after a reconnect) and reordered messages are counted.
+//
+// With -r 0 a message is sent once the previous one came back, which measures the
+// latency through the bridge. With -r N messages go out at N per second and the
+// publish rate the bridge sustains is measured along with the latency.
+//
+// Build: g++ -O2 -std=c++17 -pthread -o mqtt_bench mqtt_bench.cpp
+// Run with --help for options. Any MQTT 3.1.1 broker will do, a local Mosquitto
+// stands in for the production one.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr uint8_t MQTT_CONNECT = 0x10;
+constexpr uint8_t MQTT_CONNACK = 0x20;
+constexpr uint8_t MQTT_PUBLISH = 0x30;
+constexpr uint8_t MQTT_PUBACK = 0x40;
+constexpr uint8_t MQTT_SUBSCRIBE = 0x82;
+constexpr uint8_t MQTT_SUBACK = 0x90;
+constexpr uint8_t MQTT_PINGREQ = 0xC0;
+constexpr uint8_t MQTT_DISCONNECT = 0xE0;
+constexpr int KEEPALIVE_S = 60;
+constexpr size_t LINE_MIN = 24;
+
+struct Options {
+    std::string host;
+    std::string port = "1883";
+    std::string tx_topic = "serial-bridge/tx";  // the bridge writes it to the UART
+    std::string rx_topic = "serial-bridge/rx";  // the bridge publishes the UART frames
+    int count = 1000;
+    double rate = 0;                            // messages per second, 0 waits for every one
+    size_t size = 64;
+    int qos = 1;
+    bool batched = false;
+    double drain = 10;
+    bool json = false;
+};
+
+std::atomic<bool> interrupted{false};
+
+struct Bench {
+    int fd = -1;
+    std::mutex tx_lock;                 // packets are written from both threads
+    uint16_t next_id = 0;
+
+    std::mutex lock;                    // protects everything below
+    std::condition_variable cv;
+    std::string partial;                // line received in part so far
+    std::vector<uint8_t> seen;          // times every message came back
+    std::vector<uint32_t> latency_us;
+    uint64_t publishes = 0;             // publishes received from the bridge
+    uint64_t frames = 0;
+    uint64_t received = 0;
+    uint64_t duplicates = 0;
+    uint64_t reordered = 0;
+    uint64_t garbled = 0;
+    int64_t last_seq = -1;
+    bool closing = false;               // the connection is shut down on purpose
+    std::string error;
+};
+
+int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now().time_since_epoch()).count();
+}
+
+bool write_full(int fd, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t const n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_full(int fd, uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t const n = recv(fd, buf, len, 0);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+void put16(std::vector<uint8_t> &v, uint16_t x)
+{
+    v.push_back(x >> 8);
+    v.push_back(x & 0xFF);
+}
+
+void put_str(std::vector<uint8_t> &v, const std::string &s)
+{
+    put16(v, s.size());
+    v.insert(v.end(), s.begin(), s.end());
+}
+
+bool send_packet(Bench &b, uint8_t type, const std::vector<uint8_t> &body)
+{
+    std::vector<uint8_t> pkt{ type };
+    size_t len = body.size();
+    do {
+        uint8_t byte = len % 128;
+        len /= 128;
+        pkt.push_back(byte | (len ? 0x80 : 0));
+    } while (len);
+    pkt.insert(pkt.end(), body.begin(), body.end());
+    std::lock_guard<std::mutex> lk(b.tx_lock);
+    return write_full(b.fd, pkt.data(), pkt.size());
+}
+
+/** Fixed header type and body of the next packet, false if the connection failed */
+bool read_packet(int fd, uint8_t &type, std::vector<uint8_t> &body)
+{
+    if (!read_full(fd, &type, 1))
+        return false;
+    size_t len = 0, mult = 1;
+    uint8_t byte;
+    do {
+        if (mult > 128 * 128 * 128 || !read_full(fd, &byte, 1))
+            return false;
+        len += (byte & 0x7F) * mult;
+        mult *= 128;
+    } while (byte & 0x80);
+    body.resize(len);
+    return read_full(fd, body.data(), len);
+}
+
+int connect_to(const Options &opt, std::string &error)
+{
+    struct addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int const rc = getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &res);
+    if (rc) {
+        error = gai_strerror(rc);
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        error = std::string("connect: ") + strerror(errno);
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/** Connect with a clean session and subscribe to the topic the bridge publishes on */
+bool mqtt_open(Bench &b, const Options &opt)
+{
+    std::string error;
+    b.fd = connect_to(opt, error);
+    if (b.fd < 0) {
+        b.error = error;
+        return false;
+    }
+    std::vector<uint8_t> body;
+    put_str(body, "MQTT");
+    body.push_back(4);          // protocol level 3.1.1
+    body.push_back(0x02);       // clean session
+    put16(body, KEEPALIVE_S);
+    put_str(body, "mqtt_bench-" + std::to_string(getpid()));
+    uint8_t type;
+    std::vector<uint8_t> resp;
+    if (!send_packet(b, MQTT_CONNECT, body) || !read_packet(b.fd, type, resp) || type != MQTT_CONNACK ||
+        resp.size() < 2 || resp[1]) {
+        b.error = "broker refused the connection";
+        return false;
+    }
+    body.clear();
+    put16(body, ++b.next_id);
+    put_str(body, opt.rx_topic);
+    body.push_back(1);
+    if (!send_packet(b, MQTT_SUBSCRIBE, body) || !read_packet(b.fd, type, resp) || type != MQTT_SUBACK ||
+        resp.size() < 3 || resp[2] > 1) {
+        b.error = "subscribe failed";
+        return false;
+    }
+    return true;
+}
+
+/** Account for one received line, called with the lock held */
+void take_line(Bench &b, const Options &opt, const std::string &line)
+{
+    long long seq, sent;
+    if (sscanf(line.c_str(), "%lld %lld", &seq, &sent) != 2 || seq < 0 || seq >= opt.count) {
+        b.garbled++;
+        return;
+    }
+    if (b.seen[seq]++) {
+        b.duplicates++;
+        return;
+    }
+    if (seq < b.last_seq)
+        b.reordered++;
+    b.last_seq = std::max<int64_t>(b.last_seq, seq);
+    b.received++;
+    b.latency_us.push_back(now_us() - sent);
+    b.cv.notify_all();
+}
+
+/** Payload of a publish from the bridge: frames back to lines */
+void take_payload(Bench &b, const Options &opt, const uint8_t *data, size_t len)
+{
+    std::lock_guard<std::mutex> lk(b.lock);
+    b.publishes++;
+    std::string text;
+    if (opt.batched) {
+        size_t off = 0;
+        while (off + 2 <= len) {
+            size_t const flen = data[off] << 8 | data[off + 1];
+            if (off + 2 + flen > len) {
+                b.garbled++;
+                break;
+            }
+            text.append((const char *)data + off + 2, flen);
+            off += 2 + flen;
+            b.frames++;
+        }
+    } else {
+        text.assign((const char *)data, len);
+        b.frames++;
+    }
+    for (char ch : text) {
+        if (ch == '\n') {
+            take_line(b, opt, b.partial);
+            b.partial.clear();
+        } else if (b.partial.size() < 4 * opt.size) {
+            b.partial += ch;
+        }
+    }
+}
+
+void reader(Bench &b, const Options &opt)
+{
+    uint8_t type;
+    std::vector<uint8_t> body;
+    while (read_packet(b.fd, type, body)) {
+        if ((type & 0xF0) != MQTT_PUBLISH)
+            continue;
+        int const qos = (type >> 1) & 3;
+        if (body.size() < 2)
+            break;
+        size_t off = 2 + (body[0] << 8 | body[1]);
+        if (qos) {
+            if (off + 2 > body.size())
+                break;
+            send_packet(b, MQTT_PUBACK, { body[off], body[off + 1] });
+            off += 2;
+        }
+        if (off <= body.size())
+            take_payload(b, opt, body.data() + off, body.size() - off);
+    }
+    std::lock_guard<std::mutex> lk(b.lock);
+    if (b.error.empty() && !b.closing && !interrupted)
+        b.error = "connection to the broker lost";
+    b.cv.notify_all();
+}
+
+/** One numbered line padded to the message size */
+std::vector<uint8_t> make_message(Bench &b, const Options &opt, int seq)
+{
+    char head[48];
+    int const n = snprintf(head, sizeof(head), "%d %lld ", seq, (long long)now_us());
+    std::vector<uint8_t> body;
+    put_str(body, opt.tx_topic);
+    if (opt.qos) {
+        if (!++b.next_id)
+            b.next_id = 1;
+        put16(body, b.next_id);
+    }
+    body.insert(body.end(), head, head + n);
+    for (size_t i = n; i + 1 < opt.size; i++)
+        body.push_back('a' + (seq + i) % 26);
+    body.push_back('\n');
+    return body;
+}
+
+uint32_t percentile(const std::vector<uint32_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p * sorted.size() + 0.999999);
+    return sorted[std::min(sorted.size(), std::max<size_t>(idx, 1)) - 1];
+}
+
+int run_bench(const Options &opt)
+{
+    Bench b;
+    b.seen.resize(opt.count);
+    if (!mqtt_open(b, opt)) {
+        fprintf(stderr, "%s: %s\n", opt.host.c_str(), b.error.c_str());
+        return 2;
+    }
+    std::thread rx(reader, std::ref(b), std::cref(opt));
+
+    auto const start = Clock::now();
+    auto last_ping = start;
+    int sent = 0;
+    for (; sent < opt.count && !interrupted; sent++) {
+        if (opt.rate > 0)
+            std::this_thread::sleep_until(start + std::chrono::microseconds((int64_t)(sent * 1e6 / opt.rate)));
+        if (!send_packet(b, MQTT_PUBLISH | opt.qos << 1, make_message(b, opt, sent)))
+            break;
+        if (Clock::now() - last_ping > std::chrono::seconds(KEEPALIVE_S / 2)) {
+            send_packet(b, MQTT_PINGREQ, {});
+            last_ping = Clock::now();
+        }
+        if (opt.rate <= 0) {
+            std::unique_lock<std::mutex> lk(b.lock);
+            b.cv.wait_for(lk, std::chrono::milliseconds((int)(opt.drain * 1000)),
+                          [&] { return b.seen[sent] || !b.error.empty() || interrupted; });
+            if (!b.error.empty())
+                break;
+        }
+    }
+    double const send_s = std::chrono::duration<double>(Clock::now() - start).count();
+    {
+        std::unique_lock<std::mutex> lk(b.lock);
+        b.cv.wait_for(lk, std::chrono::milliseconds((int)(opt.drain * 1000)),
+                      [&] { return (int)b.received == sent || !b.error.empty() || interrupted; });
+    }
+    double const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    {
+        std::lock_guard<std::mutex> lk(b.lock);
+        b.closing = true;
+    }
+    send_packet(b, MQTT_DISCONNECT, {});
+    shutdown(b.fd, SHUT_RDWR);
+    rx.join();
+    close(b.fd);
+
+    std::lock_guard<std::mutex> lk(b.lock);
+    std::vector<uint32_t> lat = b.latency_us;
+    std::sort(lat.begin(), lat.end());
+    uint64_t const lost = sent - b.received;
+    static const double pcts[] = { 0.5, 0.9, 0.99 };
+    static const char *const pct_names[] = { "p50", "p90", "p99" };
+    if (opt.json) {
+        printf("{\"broker\":\"%s\",\"port\":%s,\"size\":%zu,\"rate\":%.1f,\"qos\":%d,\"sent\":%d,\"received\":%llu,"
+               "\"lost\":%llu,\"duplicates\":%llu,\"reordered\":%llu,\"garbled\":%llu,\"publishes\":%llu,"
+               "\"frames\":%llu,\"send_s\":%.3f,\"elapsed_s\":%.3f,\"received_per_s\":%.1f,\"latency_us\":{\"min\":%u",
+               opt.host.c_str(), opt.port.c_str(), opt.size, opt.rate, opt.qos, sent,
+               (unsigned long long)b.received, (unsigned long long)lost, (unsigned long long)b.duplicates,
+               (unsigned long long)b.reordered, (unsigned long long)b.garbled, (unsigned long long)b.publishes,
+               (unsigned long long)b.frames, send_s, elapsed, b.received / elapsed, lat.empty() ? 0 : lat.front());
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            printf(",\"%s\":%u", pct_names[i], percentile(lat, pcts[i]));
+        printf(",\"max\":%u},\"error\":\"%s\"}\n", lat.empty() ? 0 : lat.back(), b.error.c_str());
+    } else {
+        printf("%d messages of %zu bytes %s, QoS %d, %.1f s\n", sent, opt.size,
+               opt.rate > 0 ? (std::to_string(opt.rate) + " per second").c_str() : "one at a time", opt.qos, elapsed);
+        printf("received %llu (%.1f per second) in %llu publishes of %llu frames\n", (unsigned long long)b.received,
+               b.received / elapsed, (unsigned long long)b.publishes, (unsigned long long)b.frames);
+        printf("latency us: min %u", lat.empty() ? 0 : lat.front());
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            printf(" %s %u", pct_names[i], percentile(lat, pcts[i]));
+        printf(" max %u\n", lat.empty() ? 0 : lat.back());
+        if (b.duplicates || b.reordered)
+            printf("duplicates %llu, reordered %llu\n", (unsigned long long)b.duplicates,
+                   (unsigned long long)b.reordered);
+        if (!b.error.empty())
+            printf("!!! %s !!!\n", b.error.c_str());
+        if (lost || b.garbled)
+            printf("!!! %llu messages lost, %llu lines garbled !!!\n", (unsigned long long)lost,
+                   (unsigned long long)b.garbled);
+        else
+            printf("integrity ok\n");
+    }
+    return lost || b.garbled ? 1 : 0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] <broker>\n"
+            "  -p, --port PORT        broker port (default 1883)\n"
+            "  -t, --tx-topic TOPIC   topic the bridge writes to the UART (default serial-bridge/tx)\n"
+            "  -T, --rx-topic TOPIC   topic the bridge publishes on (default serial-bridge/rx)\n"
+            "  -n, --count N          messages to send (default 1000)\n"
+            "  -r, --rate N           messages per second, 0 sends the next once one came back (default 0)\n"
+            "  -s, --size BYTES       message size including the newline (default 64, minimum %zu)\n"
+            "  -q, --qos 0|1          QoS of the messages sent (default 1)\n"
+            "  -b, --batched          the bridge sends several length prefixed frames per publish\n"
+            "      --drain S          seconds to wait for outstanding messages (default 10)\n"
+            "  -j, --json             print results as JSON\n"
+            "Exits with 1 if any message was lost or garbled.\n",
+            prog, LINE_MIN);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    static const struct option long_opts[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "tx-topic", required_argument, NULL, 't' },
+        { "rx-topic", required_argument, NULL, 'T' },
+        { "count", required_argument, NULL, 'n' },
+        { "rate", required_argument, NULL, 'r' },
+        { "size", required_argument, NULL, 's' },
+        { "qos", required_argument, NULL, 'q' },
+        { "batched", no_argument, NULL, 'b' },
+        { "drain", required_argument, NULL, 'D' },
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    Options opt;
+    int ch;
+    while ((ch = getopt_long(argc, argv, "p:t:T:n:r:s:q:bjh", long_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'p': opt.port = optarg; break;
+        case 't': opt.tx_topic = optarg; break;
+        case 'T': opt.rx_topic = optarg; break;
+        case 'n': opt.count = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 's': opt.size = strtoul(optarg, NULL, 10); break;
+        case 'q': opt.qos = atoi(optarg); break;
+        case 'b': opt.batched = true; break;
+        case 'D': opt.drain = atof(optarg); break;
+        case 'j': opt.json = true; break;
+        default:
+            usage(argv[0]);
+            return ch == 'h' ? 0 : 2;
+        }
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = [](int) { interrupted = true; };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (optind != argc - 1 || opt.count < 1 || opt.size < LINE_MIN || opt.size > 65535 || opt.qos < 0 ||
+        opt.qos > 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    opt.host = argv[optind];
+    return run_bench(opt);
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# Builds mqtt_bench from mqtt_bench.cpp next to this script when it is missing
+# or outdated and runs it with the given arguments. Requires g++.
+
+dir=$(dirname "$0")
+bin=$dir/mqtt_bench
+
+if [ ! -x "$bin" ] || [ "$dir/mqtt_bench.cpp" -nt "$bin" ]; then
+    g++ -O2 -std=c++17 -pthread -o "$bin" "$dir/mqtt_bench.cpp" || exit 2
+fi
+exec "$bin" "$@"
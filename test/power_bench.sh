@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# Measures what power management costs in latency against what it saves in supply
+# current. Keeps the bridge quiet and then streaming for a while so the current can
+# be read off the meter in both states, and measures the round trip of 64 byte
+# requests sent back to back and after an idle gap longer than the full clock hold
+# time, where the first byte meets the CPU at its lowest clock. The UART should be
+# looped back (RX connected to TX, RTS to CTS) so the data comes back to the network.
+#
+# Requires curl and python3. Run it once with firmware built with Power management
+# and once without, the latency and current differences are what the mode costs
+# and saves.
+
+if [ -z "$1" ]; then
+    echo -e "Call $0 <esp32 IP address> [gap ms] [requests] [port] to run this test"
+    exit 1
+fi
+
+ip=$1
+gap=${2:-1000}
+requests=${3:-20}
+port=${4:-3142}
+bench="$(dirname "$0")/bridge_bench.sh"
+phase=15
+
+# Prints the power counters from /stats: wakeups full_clock_ms, nothing without power management
+power() {
+    curl -s -m 2 http://$ip/stats | python3 -c '
+import json, sys
+p = json.load(sys.stdin).get("power")
+if p:
+    print(p["wakeups"], p["full_clock_ms"])'
+}
+
+# Prints the given fields of the bridge_bench JSON result
+field() {
+    python3 -c '
+import json, sys
+r = json.load(sys.stdin)
+print(*[eval(f, {}, r) for f in sys.argv[1:]])' "$@"
+}
+
+latency='"p50 %d p99 %d max %d" % (latency_us["p50"], latency_us["p99"], latency_us["max"])'
+
+first=($(power))
+if [ ${#first[@]} -eq 0 ]; then
+    echo "Power management is not built in, measuring the baseline"
+fi
+
+echo "Quiet for $phase seconds, read the idle supply current now ..."
+sleep $phase
+quiet=($(power))
+
+echo "Streaming for $phase seconds, read the busy supply current now ..."
+"$bench" -j -p $port -m stream -s 1460 -d $phase $ip > /dev/null || echo "!!! data lost or corrupted !!!"
+
+echo "Back to back requests ..."
+warm=$("$bench" -j -p $port -m req -s 64 -d 5 $ip) || echo "!!! data lost or corrupted !!!"
+
+echo "$requests requests after $gap ms of silence each ..."
+before=($(power))
+idle=$("$bench" -j -p $port -m req -s 64 -g $gap -d $(awk "BEGIN { print ($requests + 0.5) * $gap / 1000 }") $ip) ||
+    echo "!!! data lost or corrupted !!!"
+after=($(power))
+
+echo "back to back latency us:  $(echo "$warm" | field "$latency")"
+echo "after idle latency us:    $(echo "$idle" | field "$latency")"
+echo "first byte penalty us:    $(( $(echo "$idle" | field 'latency_us["p50"]') - $(echo "$warm" | field 'latency_us["p50"]') ))"
+if [ ${#first[@]} -gt 0 ]; then
+    echo "full clock while quiet:   $((quiet[1] - first[1])) ms of $((phase * 1000)) ms"
+    echo "wakeups after idle gaps:  $((after[0] - before[0])) for $(echo "$idle" | field chunks) requests"
+fi
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# Compares the bridge port transports (BSD sockets or lwIP netconn). Streams data
+# through the bridge port for the given number of seconds and reports throughput
+# and the CPU time both cores spent per MB moved, then runs small requests one at a
+# time and reports their round trip latency. The UART should be looped back (RX
+# connected to TX, RTS to CTS) so the data comes back to the network.
+#
+# Requires curl and python3, the CPU time needs CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+# Run it once with firmware built with each Bridge port transport to compare them.
+
+if [ -z "$1" ]; then
+    echo -e "Call $0 <esp32 IP address> [seconds] [port] to run this test"
+    exit 1
+fi
+
+ip=$1
+duration=${2:-30}
+port=${3:-3142}
+bench="$(dirname "$0")/bridge_bench.sh"
+
+# Prints space separated counters from /stats: transport bytes uptime_us idle_us...
+sample() {
+    curl -s -m 2 http://$ip/stats | python3 -c '
+import json, sys
+s = json.load(sys.stdin)
+b = s["bridge"]
+print(b.get("transport", "sockets"), b["uart_to_eth_bytes"] + b["eth_to_uart_bytes"],
+      s["eth"]["uptime_us"], *s["eth"].get("idle_us", []))'
+}
+
+# Prints the given fields of the bridge_bench JSON result
+field() {
+    python3 -c '
+import json, sys
+r = json.load(sys.stdin)
+print(*[eval(f, {}, r) for f in sys.argv[1:]])' "$@"
+}
+
+first=($(sample)) || exit 1
+if [ ${#first[@]} -lt 4 ]; then
+    echo "!!! /stats has no CPU counters, build with CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS !!!"
+    exit 1
+fi
+
+echo "Transport ${first[0]}, streaming through $ip:$port for $duration seconds ..."
+stream=$("$bench" -j -p $port -m stream -s 1460 -d $duration $ip) || echo "!!! data lost or corrupted !!!"
+last=($(sample)) || exit 1
+
+elapsed_us=$((last[2] - first[2]))
+bytes=$((last[1] - first[1]))
+if [ $elapsed_us -le 0 ] || [ $bytes -le 0 ]; then
+    echo "!!! no data went through the bridge !!!"
+    exit 1
+fi
+busy_us=0
+for (( core = 3; core < ${#last[@]}; core++ )); do
+    idle=$((last[core] - first[core]))
+    echo "cpu$((core - 3)) load:       $((100 - idle * 100 / elapsed_us))%"
+    busy_us=$((busy_us + elapsed_us - idle))
+done
+
+echo "Request / response latency, 64 byte requests ..."
+req=$("$bench" -j -p $port -m req -s 64 -d $((duration < 10 ? duration : 10)) $ip) || echo "!!! data lost or corrupted !!!"
+
+echo "transport:       ${first[0]}"
+echo "throughput MB/s: $(echo "$stream" | field 'round(throughput_Bps / 1e6, 3)')"
+echo "cpu ms per MB:   $((busy_us * 1000 / bytes))"
+echo "latency us:      $(echo "$req" | field '"p50 %d p99 %d max %d" % (latency_us["p50"], latency_us["p99"], latency_us["max"])')"
@@ -1,9 +1,9 @@
 #!/bin/bash
 
 if [ -z "$1" ]; then
-    echo -e "Call $0 <esp32 IP address> to run this test"
+    echo -e "Call $0 <esp32 IP address> [seconds] [bridge_bench options] to run this test"
     exit 1
 fi
 
-echo Testing echo server throughput. Type Ctrl-C to stop ...
-dd if=/dev/urandom | nc -N $1 3142 > /dev/null
+echo Testing UART echo throughput ...
+exec "$(dirname "$0")/bridge_bench.sh" -p 3142 -m stream -s 1460 -d ${2:-30} "${@:3}" $1
@@ -0,0 +1,13 @@
+#!/bin/bash
+
+if [ -z "$1" ]; then
+    echo -e "Call $0 <esp32 IP address> [seconds] [bridge_bench options] to run this test"
+    exit 1
+fi
+
+# Same data through the bridge port and the WebSocket endpoint, one after another
+echo Testing UART echo throughput over TCP ...
+"$(dirname "$0")/bridge_bench.sh" -p 3142 -m stream -s 1460 -d ${2:-30} "${@:3}" $1 || exit
+echo
+echo Testing UART echo throughput over WebSocket ...
+exec "$(dirname "$0")/bridge_bench.sh" --ws -p 80 -m stream -s 1460 -d ${2:-30} "${@:3}" $1